@@ -226,4 +226,5 @@
 
 #  define InterlockedIncrement16 _InterlockedIncrement16
 #  define InterlockedDecrement16 _InterlockedDecrement16
+#  define InterlockedCompareExchange16 _InterlockedCompareExchange16
 #pragma endregion
\ No newline at end of file
@@ -141,6 +141,22 @@ typedef struct _KEX_RTL_STRING_MAPPER_HASH_TABLE_ENTRY {
 	UNICODE_STRING					Value;
 } TYPEDEF_TYPE_NAME(KEX_RTL_STRING_MAPPER_HASH_TABLE_ENTRY);
 
+//
+// Flags for KexLdrScanImageImports and related functions.
+//
+
+#define KEX_LDR_IMAGE_MAPPED			1
+
+typedef struct _KEX_LDR_IMPORT_REWRITE {
+	ULONG	NameRva;
+	CHAR	RewrittenName[60];
+} TYPEDEF_TYPE_NAME(KEX_LDR_IMPORT_REWRITE);
+
+typedef NTSTATUS (NTAPI *PKEX_LDR_IMPORT_REWRITE_ROUTINE) (
+	IN		PVOID			Context OPTIONAL,
+	IN		PCANSI_STRING	DllName,
+	IN OUT	PANSI_STRING	RewrittenDllName);
+
 #define VXLL_VERSION 3
 
 typedef enum _VXLLOGINFOCLASS {
@@ -497,6 +513,12 @@ KEXAPI NTSTATUS NTAPI KexLdrMiniGetProcedureAddress(
 	IN	PCSTR	ProcedureName,
 	OUT	PPVOID	ProcedureAddress);
 
+KEXAPI NTSTATUS NTAPI KexLdrMiniGetProcedureAddresses(
+	IN	PVOID	DllBase,
+	IN	ULONG	NumberOfProcedures,
+	IN	PCSTR	*ProcedureNames,
+	OUT	PPVOID	ProcedureAddresses);
+
 KEXAPI NTSTATUS NTAPI KexLdrFindDllInitRoutine(
 	IN	PVOID	DllBase,
 	OUT	PPVOID	InitRoutine);
@@ -509,6 +531,29 @@ KEXAPI NTSTATUS NTAPI KexLdrGetDllFullNameFromAddress(
 	IN	PVOID			Address,
 	OUT	PUNICODE_STRING	DllFullPath);
 
+KEXAPI NTSTATUS NTAPI KexLdrScanImageImports(
+	IN		PVOID							ImageBase,
+	IN		SIZE_T							ImageSize,
+	IN		ULONG							Flags,
+	IN		PKEX_LDR_IMPORT_REWRITE_ROUTINE	RewriteRoutine,
+	IN		PVOID							RewriteContext OPTIONAL,
+	OUT		PKEX_LDR_IMPORT_REWRITE			Rewrites OPTIONAL,
+	IN OUT	PULONG							NumberOfRewrites);
+
+KEXAPI NTSTATUS NTAPI KexLdrInvalidateBoundImports(
+	IN	PVOID						ImageBase,
+	IN	SIZE_T						ImageSize,
+	IN	ULONG						Flags,
+	IN	PCKEX_LDR_IMPORT_REWRITE	Rewrites,
+	IN	ULONG						NumberOfRewrites);
+
+KEXAPI NTSTATUS NTAPI KexLdrApplyImageImportRewrites(
+	IN	PVOID						ImageBase,
+	IN	SIZE_T						ImageSize,
+	IN	ULONG						Flags,
+	IN	PCKEX_LDR_IMPORT_REWRITE	Rewrites,
+	IN	ULONG						NumberOfRewrites);
+
 #pragma endregion
 
 #pragma region KexSrv* functions
@@ -529,6 +574,15 @@ KEXAPI NTSTATUS NTAPI KexSrvNotifyProcessStart(
 	IN	HANDLE				ChannelHandle,
 	IN	PCUNICODE_STRING	ApplicationName);
 
+KEXAPI NTSTATUS NTAPI KexSrvLogEvent(
+	IN	HANDLE				ChannelHandle,
+	IN	VXLSEVERITY			Severity,
+	IN	PCUNICODE_STRING	SourceComponent,
+	IN	PCUNICODE_STRING	SourceFile,
+	IN	ULONG				SourceLine,
+	IN	PCUNICODE_STRING	SourceFunction,
+	IN	PCUNICODE_STRING	Text);
+
 #pragma endregion
 
 #pragma region KexHk* functions
@@ -546,6 +600,25 @@ typedef struct _KEX_BASIC_HOOK_CONTEXT {
 	BYTE OriginalInstructions[BASIC_HOOK_LENGTH];
 } TYPEDEF_TYPE_NAME(KEX_BASIC_HOOK_CONTEXT);
 
+typedef struct _KEX_HOTPATCH_HOOK_CONTEXT {
+	PVOID	ApiAddress;
+	USHORT	OriginalEntry;
+} TYPEDEF_TYPE_NAME(KEX_HOTPATCH_HOOK_CONTEXT);
+
+#define KEX_HOOK_TRANSACTION_MAXIMUM_HOOKS 16
+
+typedef struct _KEX_HOOK_TRANSACTION_ENTRY {
+	PVOID					ApiAddress;
+	PVOID					RedirectedAddress;
+	PKEX_BASIC_HOOK_CONTEXT	HookContext;
+	BYTE					OriginalInstructions[BASIC_HOOK_LENGTH];
+} TYPEDEF_TYPE_NAME(KEX_HOOK_TRANSACTION_ENTRY);
+
+typedef struct _KEX_HOOK_TRANSACTION {
+	ULONG						NumberOfHooks;
+	KEX_HOOK_TRANSACTION_ENTRY	Hooks[KEX_HOOK_TRANSACTION_MAXIMUM_HOOKS];
+} TYPEDEF_TYPE_NAME(KEX_HOOK_TRANSACTION);
+
 KEXAPI NTSTATUS NTAPI KexHkInstallBasicHook(
 	IN		PVOID					ApiAddress,
 	IN		PVOID					RedirectedAddress,
@@ -554,6 +627,40 @@ KEXAPI NTSTATUS NTAPI KexHkInstallBasicHook(
 KEXAPI NTSTATUS NTAPI KexHkRemoveBasicHook(
 	IN		PKEX_BASIC_HOOK_CONTEXT	HookContext);
 
+KEXAPI VOID NTAPI KexHkBeginTransaction(
+	OUT		PKEX_HOOK_TRANSACTION	Transaction);
+
+KEXAPI NTSTATUS NTAPI KexHkAddBasicHookToTransaction(
+	IN OUT	PKEX_HOOK_TRANSACTION	Transaction,
+	IN		PVOID					ApiAddress,
+	IN		PVOID					RedirectedAddress,
+	OUT		PKEX_BASIC_HOOK_CONTEXT	HookContext OPTIONAL);
+
+KEXAPI NTSTATUS NTAPI KexHkCommitTransaction(
+	IN OUT	PKEX_HOOK_TRANSACTION	Transaction);
+
+KEXAPI NTSTATUS NTAPI KexHkAddTrampolineHookToTransaction(
+	IN OUT	PKEX_HOOK_TRANSACTION	Transaction,
+	IN		PVOID					ApiAddress,
+	IN		PVOID					RedirectedAddress,
+	OUT		PPVOID					OriginalRoutine,
+	OUT		PKEX_BASIC_HOOK_CONTEXT	HookContext OPTIONAL);
+
+KEXAPI NTSTATUS NTAPI KexHkInstallTrampolineHook(
+	IN		PVOID					ApiAddress,
+	IN		PVOID					RedirectedAddress,
+	OUT		PPVOID					OriginalRoutine,
+	OUT		PKEX_BASIC_HOOK_CONTEXT	HookContext OPTIONAL);
+
+KEXAPI NTSTATUS NTAPI KexHkInstallHotPatchHook(
+	IN		PVOID						ApiAddress,
+	IN		PVOID						RedirectedAddress,
+	OUT		PPVOID						OriginalRoutine OPTIONAL,
+	OUT		PKEX_HOTPATCH_HOOK_CONTEXT	HookContext OPTIONAL);
+
+KEXAPI NTSTATUS NTAPI KexHkRemoveHotPatchHook(
+	IN		PKEX_HOTPATCH_HOOK_CONTEXT	HookContext);
+
 #pragma endregion
 
 #pragma region KexNt* functions
@@ -603,6 +710,11 @@ KEXAPI NTSTATUS NTAPI KexNtFreeVirtualMemory(
 	IN OUT	PSIZE_T		RegionSize,
 	IN		ULONG		FreeType);
 
+KEXAPI NTSTATUS NTAPI KexNtOpenKey(
+	OUT		PHANDLE						KeyHandle,
+	IN		ACCESS_MASK					DesiredAccess,
+	IN		POBJECT_ATTRIBUTES			ObjectAttributes);
+
 KEXAPI NTSTATUS NTAPI KexNtOpenKeyEx(
 	OUT		PHANDLE						KeyHandle,
 	IN		ACCESS_MASK					DesiredAccess,
@@ -723,6 +835,18 @@ KEXAPI NTSTATUS CDECL VxlWriteLogEx(
 	IN		PCWSTR			Format,
 	IN		...);
 
+KEXAPI NTSTATUS NTAPI VxlWriteLogPreformatted(
+	IN		VXLHANDLE			LogHandle,
+	IN		PCUNICODE_STRING	SourceComponent,
+	IN		PCUNICODE_STRING	SourceFile,
+	IN		ULONG				SourceLine,
+	IN		PCUNICODE_STRING	SourceFunction,
+	IN		VXLSEVERITY			Severity,
+	IN		PCUNICODE_STRING	Text,
+	IN		PLONGLONG			Time OPTIONAL,
+	IN		ULONG				ProcessId OPTIONAL,
+	IN		ULONG				ThreadId OPTIONAL);
+
 //
 // vxlread.c
 //
@@ -32,11 +32,18 @@ typedef enum _KEX_IPC_MESSAGE_ID {
 	KexIpcKexProcessStart,
 	KexIpcHardError,
 	KexIpcLogEvent,
+	KexIpcLogEventBatch,
 	KexIpcMaximumMessageId
 } KEX_IPC_MESSAGE_ID;
 
 typedef struct _KEX_IPC_MESSAGE_DATA_KEX_PROCESS_STARTED {
 	USHORT		ApplicationNameLength;
+
+	// Handle values, in the client process, of the section which contains
+	// the client's log ring and of its doorbell event. Both are zero if the
+	// client has not created a log ring.
+	ULONG		LogRingSectionHandle;
+	ULONG		LogRingDoorbellEventHandle;
 } TYPEDEF_TYPE_NAME(KEX_IPC_MESSAGE_DATA_PROCESS_STARTED);
 
 typedef struct _KEX_IPC_MESSAGE_DATA_HARD_ERROR {
@@ -55,9 +62,29 @@ typedef struct _KEX_IPC_MESSAGE_DATA_LOG_EVENT {
 	USHORT		TextLength;
 } TYPEDEF_TYPE_NAME(KEX_IPC_MESSAGE_DATA_LOG_EVENT);
 
+typedef struct _KEX_IPC_MESSAGE_DATA_LOG_EVENT_BATCH {
+	USHORT		NumberOfEvents;
+} TYPEDEF_TYPE_NAME(KEX_IPC_MESSAGE_DATA_LOG_EVENT_BATCH);
+
+//
+// The auxiliary data block of a KexIpcLogEventBatch message consists of
+// NumberOfEvents of these entries, one after another. Each entry contains
+// the source component, source file, source function and text, in that
+// order, and is padded to a multiple of 4 bytes.
+//
+typedef struct _KEX_IPC_LOG_EVENT_BATCH_ENTRY {
+	KEX_IPC_MESSAGE_DATA_LOG_EVENT	LogEventInformation;
+	WCHAR							Data[];
+} TYPEDEF_TYPE_NAME(KEX_IPC_LOG_EVENT_BATCH_ENTRY);
+
+#define KEX_IPC_LOG_EVENT_BATCH_ENTRY_SIZE(DataCch) \
+	((FIELD_OFFSET(KEX_IPC_LOG_EVENT_BATCH_ENTRY, Data) + ((DataCch) * sizeof(WCHAR)) + 3) & ~3)
+
 //
 // The maximum size of a message is 64KB.
 //
+#define KEX_IPC_MESSAGE_MAXIMUM_SIZE 0xFFFF
+
 typedef struct _KEX_IPC_MESSAGE {
 	KEX_IPC_MESSAGE_ID		MessageId;
 	USHORT					AuxiliaryDataBlockSize;
@@ -67,7 +94,53 @@ typedef struct _KEX_IPC_MESSAGE {
 		KEX_IPC_MESSAGE_DATA_PROCESS_STARTED	ProcessStartedInformation;
 		KEX_IPC_MESSAGE_DATA_HARD_ERROR			HardErrorInformation;
 		KEX_IPC_MESSAGE_DATA_LOG_EVENT			LogEventInformation;
+		KEX_IPC_MESSAGE_DATA_LOG_EVENT_BATCH	LogEventBatchInformation;
 	};
 
 	BYTE					AuxiliaryDataBlock[];
-} TYPEDEF_TYPE_NAME(KEX_IPC_MESSAGE);
\ No newline at end of file
+} TYPEDEF_TYPE_NAME(KEX_IPC_MESSAGE);
+
+//
+// Log events can also be sent to the server through a ring buffer in a
+// section that is shared between the client and the server, instead of
+// through the named pipe. The pipe is still used for all other messages.
+//
+// The data area of the ring contains KexIpcLogEvent messages, each padded
+// to a multiple of KEX_IPC_LOG_RING_ALIGNMENT bytes. A message ID of
+// KEX_IPC_LOG_RING_WRAP means that the rest of the data area is unused and
+// the next message starts at the beginning of the data area.
+//
+// WriteOffset and ReadOffset increase forever and must be taken modulo
+// KEX_IPC_LOG_RING_DATA_SIZE. WriteOffset is only written by the client and
+// ReadOffset is only written by the server. The client only signals the
+// doorbell event when it writes a message into an empty ring, so the server
+// must check the ring once more after updating ReadOffset.
+//
+// The server sets ServerAttached once it is listening to the doorbell. The
+// client does not write anything into the ring before that, and sends its
+// log events through the pipe instead. If the server can't attach to the
+// ring, ServerAttached is never set and the client keeps using the pipe.
+//
+// Since only ULONG and smaller members are used, the layout is the same for
+// 32-bit and 64-bit clients.
+//
+
+#define KEX_IPC_LOG_RING_DATA_SIZE			0x40000
+#define KEX_IPC_LOG_RING_ALIGNMENT			8
+#define KEX_IPC_LOG_RING_WRAP				((KEX_IPC_MESSAGE_ID) 0x7FFFFFFF)
+
+#define KEX_IPC_LOG_RING_RECORD_SIZE(MessageSize) \
+	(((MessageSize) + KEX_IPC_LOG_RING_ALIGNMENT - 1) & ~(KEX_IPC_LOG_RING_ALIGNMENT - 1))
+
+typedef struct _KEX_IPC_LOG_RING {
+	// Only written by the client.
+	VOLATILE ULONG			WriteOffset;
+	BYTE					Padding1[60];
+
+	// Only written by the server.
+	VOLATILE ULONG			ReadOffset;
+	VOLATILE ULONG			ServerAttached;
+	BYTE					Padding2[56];
+
+	BYTE					Data[KEX_IPC_LOG_RING_DATA_SIZE];
+} TYPEDEF_TYPE_NAME(KEX_IPC_LOG_RING);
\ No newline at end of file
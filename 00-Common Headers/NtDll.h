@@ -170,6 +170,10 @@
 #define FSCTL_PIPE_QUERY_CLIENT_PROCESS		CTL_CODE(FILE_DEVICE_NAMED_PIPE, 9, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define FSCTL_PIPE_GET_CONNECTION_ATTRIBUTE	CTL_CODE(FILE_DEVICE_NAMED_PIPE, 12, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
+#define PAGE_SIZE							0x1000
+#define PAGE_ALIGN(Va)						((PVOID) ((ULONG_PTR) (Va) & ~(PAGE_SIZE - 1)))
+#define ROUND_TO_PAGES(Size)				(((ULONG_PTR) (Size) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
 // RTL_USER_PROCESS_PARAMETERS->Flags
 #define RTL_USER_PROCESS_PARAMETERS_NORMALIZED              0x01
 #define RTL_USER_PROCESS_PARAMETERS_PROFILE_USER            0x02
@@ -1772,6 +1776,18 @@ typedef struct _FILE_NAMES_INFORMATION {
 	WCHAR		FileName[];
 } TYPEDEF_TYPE_NAME(FILE_NAMES_INFORMATION);
 
+typedef struct _FILE_RENAME_INFORMATION {
+	BOOLEAN		ReplaceIfExists;
+	HANDLE		RootDirectory;
+	ULONG		FileNameLength;
+	WCHAR		FileName[];
+} TYPEDEF_TYPE_NAME(FILE_RENAME_INFORMATION);
+
+typedef struct _FILE_COMPLETION_INFORMATION {
+	HANDLE		Port;
+	PVOID		Key;
+} TYPEDEF_TYPE_NAME(FILE_COMPLETION_INFORMATION);
+
 typedef struct _SYSTEM_PROCESS_INFORMATION {
 	ULONG			NextEntryOffset;
 	ULONG			NumberOfThreads;
@@ -2288,6 +2304,28 @@ typedef struct _RTL_MEMORY_ZONE {
 	PRTL_MEMORY_ZONE_SEGMENT	FirstSegment;
 } TYPEDEF_TYPE_NAME(RTL_MEMORY_ZONE);
 
+//
+// This is defined in winnt.h in newer SDKs.
+//
+typedef struct _IMAGE_DELAYLOAD_DESCRIPTOR {
+	union {
+		ULONG AllAttributes;
+
+		struct {
+			ULONG RvaBased : 1;
+			ULONG ReservedAttributes : 31;
+		};
+	} Attributes;
+
+	ULONG DllNameRVA;
+	ULONG ModuleHandleRVA;
+	ULONG ImportAddressTableRVA;
+	ULONG ImportNameTableRVA;
+	ULONG BoundImportAddressTableRVA;
+	ULONG UnloadInformationTableRVA;
+	ULONG TimeDateStamp;
+} TYPEDEF_TYPE_NAME(IMAGE_DELAYLOAD_DESCRIPTOR);
+
 #pragma endregion
 
 STATIC PKUSER_SHARED_DATA SharedUserData = (PKUSER_SHARED_DATA) 0x7FFE0000;
@@ -2390,6 +2428,15 @@ NTSYSCALLAPI NTSTATUS NTAPI NtOpenProcess(
 	IN		POBJECT_ATTRIBUTES			ObjectAttributes,
 	IN		PCLIENT_ID					ClientId OPTIONAL);
 
+NTSYSCALLAPI NTSTATUS NTAPI NtDuplicateObject(
+	IN		HANDLE						SourceProcessHandle,
+	IN		HANDLE						SourceHandle,
+	IN		HANDLE						TargetProcessHandle OPTIONAL,
+	OUT		PHANDLE						TargetHandle OPTIONAL,
+	IN		ACCESS_MASK					DesiredAccess,
+	IN		ULONG						HandleAttributes,
+	IN		ULONG						Options);
+
 NTSYSCALLAPI NTSTATUS NTAPI NtTerminateProcess(
 	IN	HANDLE		ProcessHandle OPTIONAL,
 	IN	NTSTATUS	ExitStatus);
@@ -2550,6 +2597,10 @@ NTSYSCALLAPI NTSTATUS NTAPI NtWriteFile(
 	IN		PLONGLONG			ByteOffset OPTIONAL,
 	IN		PULONG				Key OPTIONAL);
 
+NTSYSCALLAPI NTSTATUS NTAPI NtFlushBuffersFile(
+	IN		HANDLE				FileHandle,
+	OUT		PIO_STATUS_BLOCK	IoStatusBlock);
+
 NTSYSCALLAPI NTSTATUS NTAPI NtFsControlFile(
 	IN		HANDLE				FileHandle,
 	IN		HANDLE				Event OPTIONAL,
@@ -2562,6 +2613,26 @@ NTSYSCALLAPI NTSTATUS NTAPI NtFsControlFile(
 	OUT		PVOID				OutputBuffer OPTIONAL,
 	IN		ULONG				OutputBufferLength);
 
+NTSYSCALLAPI NTSTATUS NTAPI NtCreateIoCompletion(
+	OUT		PHANDLE				IoCompletionHandle,
+	IN		ACCESS_MASK			DesiredAccess,
+	IN		POBJECT_ATTRIBUTES	ObjectAttributes OPTIONAL,
+	IN		ULONG				NumberOfConcurrentThreads);
+
+NTSYSCALLAPI NTSTATUS NTAPI NtSetIoCompletion(
+	IN		HANDLE				IoCompletionHandle,
+	IN		PVOID				KeyContext,
+	IN		PVOID				ApcContext OPTIONAL,
+	IN		NTSTATUS			IoStatus,
+	IN		ULONG_PTR			IoStatusInformation);
+
+NTSYSCALLAPI NTSTATUS NTAPI NtRemoveIoCompletion(
+	IN		HANDLE				IoCompletionHandle,
+	OUT		PPVOID				KeyContext,
+	OUT		PPVOID				ApcContext,
+	OUT		PIO_STATUS_BLOCK	IoStatusBlock,
+	IN		PLONGLONG			Timeout OPTIONAL);
+
 NTSYSCALLAPI NTSTATUS NTAPI NtAlpcCreatePort(
     OUT		PHANDLE					PortHandle,
     IN		POBJECT_ATTRIBUTES		ObjectAttributes OPTIONAL,
@@ -2709,6 +2780,14 @@ NTSYSCALLAPI NTSTATUS NTAPI NtDelayExecution(
 	IN		BOOLEAN						Alertable,
 	IN		PLARGE_INTEGER				DelayInterval);
 
+NTSYSCALLAPI NTSTATUS NTAPI NtYieldExecution(
+	VOID);
+
+NTSYSCALLAPI NTSTATUS NTAPI NtSetTimerResolution(
+	IN		ULONG						DesiredResolution,
+	IN		BOOLEAN						SetResolution,
+	OUT		PULONG						CurrentResolution);
+
 NTSYSCALLAPI NTSTATUS NTAPI NtCreateKey(
 	OUT		PHANDLE						KeyHandle,
 	IN		ACCESS_MASK					DesiredAccess,
@@ -3021,6 +3100,35 @@ NTSYSAPI NTSTATUS NTAPI RtlCreateUserThread(
 NTSYSAPI NORETURN VOID NTAPI RtlExitUserThread(
 	IN		NTSTATUS					ExitStatus);
 
+NTSYSAPI NTSTATUS NTAPI RtlRegisterWait(
+	OUT		PHANDLE						WaitHandle,
+	IN		HANDLE						Handle,
+	IN		WAITORTIMERCALLBACKFUNC		Function,
+	IN		PVOID						Context,
+	IN		ULONG						Milliseconds,
+	IN		ULONG						Flags);
+
+NTSYSAPI NTSTATUS NTAPI RtlDeregisterWaitEx(
+	IN		HANDLE						WaitHandle,
+	IN		HANDLE						Event OPTIONAL);
+
+NTSYSAPI NTSTATUS NTAPI RtlCreateTimerQueue(
+	OUT		PHANDLE						TimerQueueHandle);
+
+NTSYSAPI NTSTATUS NTAPI RtlCreateTimer(
+	IN		HANDLE						TimerQueueHandle,
+	OUT		PHANDLE						Handle,
+	IN		WAITORTIMERCALLBACKFUNC		Function,
+	IN		PVOID						Context OPTIONAL,
+	IN		ULONG						DueTime,
+	IN		ULONG						Period,
+	IN		ULONG						Flags);
+
+NTSYSAPI NTSTATUS NTAPI RtlDeleteTimer(
+	IN		HANDLE						TimerQueueHandle,
+	IN		HANDLE						TimerToCancel,
+	IN		HANDLE						Event OPTIONAL);
+
 NTSYSAPI NORETURN VOID NTAPI RtlExitUserProcess(
 	IN		NTSTATUS					ExitStatus);
 
@@ -3241,6 +3349,18 @@ NTSYSAPI BOOLEAN NTAPI RtlTryAcquireSRWLockExclusive(
 NTSYSAPI BOOLEAN NTAPI RtlTryAcquireSRWLockShared(
 	IN OUT	PRTL_SRWLOCK		SRWLock);
 
+NTSYSAPI NTSTATUS NTAPI RtlSleepConditionVariableSRW(
+	IN OUT	PRTL_CONDITION_VARIABLE	ConditionVariable,
+	IN OUT	PRTL_SRWLOCK			SRWLock,
+	IN		PLONGLONG				Timeout OPTIONAL,
+	IN		ULONG					Flags);
+
+NTSYSAPI VOID NTAPI RtlWakeConditionVariable(
+	IN OUT	PRTL_CONDITION_VARIABLE	ConditionVariable);
+
+NTSYSAPI VOID NTAPI RtlWakeAllConditionVariable(
+	IN OUT	PRTL_CONDITION_VARIABLE	ConditionVariable);
+
 NTSYSAPI NTSTATUS NTAPI RtlGetLengthWithoutLastFullDosOrNtPathElement(
 	IN	ULONG				Flags,
 	IN	PCUNICODE_STRING	Path,
@@ -3556,6 +3676,10 @@ BOOLEAN NTAPI LdrpFindLoadedDllByHandle(
 	IN	PVOID					DllHandle,
 	OUT	PPLDR_DATA_TABLE_ENTRY	DataTableEntry);
 
+BOOLEAN NTAPI LdrpFindLoadedDllByName(
+	IN	PCUNICODE_STRING		BaseDllName,
+	OUT	PPLDR_DATA_TABLE_ENTRY	DataTableEntry);
+
 PLDR_DATA_TABLE_ENTRY NTAPI LdrpAllocateDataTableEntry(
 	IN	PVOID	DllBase);
 
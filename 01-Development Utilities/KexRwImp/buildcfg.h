@@ -0,0 +1,5 @@
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#define KEX_COMPONENT L"KexRwImp"
+#define KEX_TARGET_TYPE_EXE
\ No newline at end of file
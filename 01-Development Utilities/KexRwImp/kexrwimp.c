@@ -0,0 +1,613 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     kexrwimp.c
+//
+// Abstract:
+//
+//     Offline DLL import rewriter.
+//
+//     Rewrites the imported DLL names of image files on disk, using the same
+//     DllRewrite configuration and the same code (KexLdrScanImageImports and
+//     KexLdrApplyImageImportRewrites) that KexDll uses at run time. Images
+//     which have been rewritten in this way do not need to be rewritten when
+//     they are loaded.
+//
+//     Usage: KexRwImp [/scan] [/bench:N] file [file ...]
+//
+//       /scan     Only show which imports would be rewritten.
+//                 No files are modified.
+//       /bench:N  Scan each file N times and report the average time taken
+//                 for one scan. Implies /scan.
+//
+//     File names may contain wildcards, so that a whole directory of images
+//     can be processed at once. The exit code is the number of files which
+//     could not be processed, which makes this tool usable for checking the
+//     scanning code against a corpus of image files.
+//
+//     Before a file is modified, a copy of the original is saved with the
+//     .kexbak extension (unless one already exists).
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "buildcfg.h"
+#include <KexComm.h>
+#include <KexDll.h>
+#include <ImageHlp.h>
+
+#pragma comment(lib, "imagehlp.lib")
+
+typedef struct _KEXRWIMP_STATISTICS {
+	ULONG		NumberOfFiles;
+	ULONG		NumberOfRewrittenFiles;
+	ULONG		NumberOfRewrites;
+	ULONG		NumberOfFailures;
+} TYPEDEF_TYPE_NAME(KEXRWIMP_STATISTICS);
+
+PKEX_RTL_STRING_MAPPER DllRewriteStringMapper = NULL;
+BOOLEAN ScanOnly = FALSE;
+ULONG BenchmarkIterations = 0;
+KEXRWIMP_STATISTICS Statistics;
+
+VOID PrintF(
+	IN	PCWSTR	Format,
+	IN	...)
+{
+	HRESULT Result;
+	ARGLIST ArgList;
+	WCHAR Buffer[1024];
+	HANDLE OutputHandle;
+	ULONG CharactersWritten;
+
+	va_start(ArgList, Format);
+	Result = StringCchVPrintf(Buffer, ARRAYSIZE(Buffer), Format, ArgList);
+	va_end(ArgList);
+
+	if (FAILED(Result) && Result != STRSAFE_E_INSUFFICIENT_BUFFER) {
+		return;
+	}
+
+	OutputHandle = GetStdHandle(STD_OUTPUT_HANDLE);
+
+	unless (WriteConsole(OutputHandle, Buffer, (ULONG) wcslen(Buffer), &CharactersWritten, NULL)) {
+		ULONG BytesWritten;
+
+		//
+		// Output is redirected to a file or pipe.
+		//
+
+		WriteFile(OutputHandle, Buffer, (ULONG) wcslen(Buffer) * sizeof(WCHAR), &BytesWritten, NULL);
+	}
+}
+
+//
+// Read the DllRewrite registry key into a string mapper.
+//
+BOOLEAN InitializeDllRewrite(
+	VOID)
+{
+	NTSTATUS Status;
+	ULONG ErrorCode;
+	HKEY DllRewriteKeyHandle;
+	ULONG Index;
+
+	Status = KexRtlCreateStringMapper(
+		&DllRewriteStringMapper,
+		KEX_RTL_STRING_MAPPER_CASE_INSENSITIVE_KEYS);
+
+	if (!NT_SUCCESS(Status)) {
+		PrintF(L"Failed to create string mapper: %s\r\n", KexRtlNtStatusToString(Status));
+		return FALSE;
+	}
+
+	ErrorCode = RegOpenKeyEx(
+		HKEY_LOCAL_MACHINE,
+		L"Software\\VXsoft\\VxKex\\DllRewrite",
+		0,
+		KEY_READ | KEY_WOW64_64KEY,
+		&DllRewriteKeyHandle);
+
+	if (ErrorCode != ERROR_SUCCESS) {
+		PrintF(L"Failed to open the DllRewrite key: %s\r\n", Win32ErrorAsString(ErrorCode));
+		return FALSE;
+	}
+
+	for (Index = 0;; ++Index) {
+		WCHAR ValueName[MAX_PATH];
+		WCHAR ValueData[MAX_PATH];
+		ULONG ValueNameCch;
+		ULONG ValueDataCb;
+		ULONG ValueType;
+		UNICODE_STRING Key;
+		UNICODE_STRING Value;
+
+		ValueNameCch = ARRAYSIZE(ValueName);
+		ValueDataCb = sizeof(ValueData) - sizeof(WCHAR);
+
+		ErrorCode = RegEnumValue(
+			DllRewriteKeyHandle,
+			Index,
+			ValueName,
+			&ValueNameCch,
+			NULL,
+			&ValueType,
+			(PBYTE) ValueData,
+			&ValueDataCb);
+
+		if (ErrorCode == ERROR_NO_MORE_ITEMS) {
+			break;
+		} else if (ErrorCode != ERROR_SUCCESS || ValueType != REG_SZ) {
+			continue;
+		}
+
+		ValueData[ValueDataCb / sizeof(WCHAR)] = '\0';
+
+		//
+		// The string mapper doesn't copy the strings we give it, so they
+		// need to stay around.
+		//
+
+		RtlCreateUnicodeString(&Key, ValueName);
+		RtlCreateUnicodeString(&Value, ValueData);
+
+		KexRtlInsertEntryStringMapper(DllRewriteStringMapper, &Key, &Value);
+	}
+
+	RegCloseKey(DllRewriteKeyHandle);
+	return TRUE;
+}
+
+//
+// Rewrite routine passed to KexLdrScanImageImports. This works the same way
+// as the one in KexDll (see dllrewrt.c).
+//
+NTSTATUS NTAPI RewriteDllName(
+	IN		PVOID			Context OPTIONAL,
+	IN		PCANSI_STRING	AnsiDllName,
+	IN OUT	PANSI_STRING	RewrittenAnsiDllName)
+{
+	NTSTATUS Status;
+	UNICODE_STRING DllName;
+	UNICODE_STRING RewrittenDllName;
+	UNICODE_STRING DotDll;
+
+	Status = RtlAnsiStringToUnicodeString(&DllName, AnsiDllName, TRUE);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	RtlInitConstantUnicodeString(&DotDll, L".dll");
+
+	if (KexRtlUnicodeStringEndsWith(&DllName, &DotDll, TRUE)) {
+		DllName.Length -= DotDll.Length;
+	}
+
+	Status = KexRtlLookupEntryStringMapper(
+		DllRewriteStringMapper,
+		&DllName,
+		&RewrittenDllName);
+
+	if (NT_SUCCESS(Status)) {
+		if (KexRtlUnicodeStringCch(&RewrittenDllName) > KexRtlAnsiStringCch(AnsiDllName)) {
+			Status = STATUS_BUFFER_TOO_SMALL;
+		} else {
+			Status = RtlUnicodeStringToAnsiString(
+				RewrittenAnsiDllName,
+				&RewrittenDllName,
+				FALSE);
+		}
+	}
+
+	RtlFreeUnicodeString(&DllName);
+	return Status;
+}
+
+//
+// Retrieve a data directory entry from an image file of either bitness.
+//
+PIMAGE_DATA_DIRECTORY GetImageDirectory(
+	IN	PIMAGE_NT_HEADERS	NtHeaders,
+	IN	ULONG				DirectoryEntry)
+{
+	if (NtHeaders->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC) {
+		PIMAGE_NT_HEADERS64 NtHeaders64;
+
+		NtHeaders64 = (PIMAGE_NT_HEADERS64) NtHeaders;
+
+		if (NtHeaders64->OptionalHeader.NumberOfRvaAndSizes > DirectoryEntry) {
+			return &NtHeaders64->OptionalHeader.DataDirectory[DirectoryEntry];
+		}
+	} else {
+		PIMAGE_NT_HEADERS32 NtHeaders32;
+
+		NtHeaders32 = (PIMAGE_NT_HEADERS32) NtHeaders;
+
+		if (NtHeaders32->OptionalHeader.NumberOfRvaAndSizes > DirectoryEntry) {
+			return &NtHeaders32->OptionalHeader.DataDirectory[DirectoryEntry];
+		}
+	}
+
+	return NULL;
+}
+
+BOOLEAN ProcessFile(
+	IN	PCWSTR	FilePath)
+{
+	BOOLEAN Success;
+	NTSTATUS Status;
+	HANDLE FileHandle;
+	LARGE_INTEGER FileSize;
+	PBYTE FileBuffer;
+	ULONG BytesTransferred;
+	PKEX_LDR_IMPORT_REWRITE Rewrites;
+	ULONG NumberOfRewrites;
+	ULONG Index;
+
+	Success = FALSE;
+	FileBuffer = NULL;
+	Rewrites = NULL;
+
+	++Statistics.NumberOfFiles;
+
+	FileHandle = CreateFile(
+		FilePath,
+		ScanOnly ? GENERIC_READ : (GENERIC_READ | GENERIC_WRITE),
+		FILE_SHARE_READ,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+
+	if (FileHandle == INVALID_HANDLE_VALUE) {
+		PrintF(L"%s: failed to open file: %s\r\n", FilePath, GetLastErrorAsString());
+		goto Exit;
+	}
+
+	if (!GetFileSizeEx(FileHandle, &FileSize) || FileSize.HighPart != 0) {
+		PrintF(L"%s: file is too large\r\n", FilePath);
+		goto Exit;
+	}
+
+	FileBuffer = SafeAlloc(BYTE, FileSize.LowPart);
+	if (!FileBuffer) {
+		PrintF(L"%s: out of memory\r\n", FilePath);
+		goto Exit;
+	}
+
+	if (!ReadFile(FileHandle, FileBuffer, FileSize.LowPart, &BytesTransferred, NULL) ||
+		BytesTransferred != FileSize.LowPart) {
+
+		PrintF(L"%s: failed to read file: %s\r\n", FilePath, GetLastErrorAsString());
+		goto Exit;
+	}
+
+	//
+	// Find out how many imports need to be rewritten.
+	//
+
+	NumberOfRewrites = 0;
+
+	Status = KexLdrScanImageImports(
+		FileBuffer,
+		FileSize.LowPart,
+		0,
+		RewriteDllName,
+		NULL,
+		NULL,
+		&NumberOfRewrites);
+
+	if (Status == STATUS_IMAGE_NO_IMPORT_DIRECTORY || (NT_SUCCESS(Status) && NumberOfRewrites == 0)) {
+		PrintF(L"%s: nothing to rewrite\r\n", FilePath);
+		Success = TRUE;
+		goto Exit;
+	}
+
+	if (Status != STATUS_BUFFER_TOO_SMALL) {
+		PrintF(L"%s: failed to scan imports: %s\r\n", FilePath, KexRtlNtStatusToString(Status));
+		goto Exit;
+	}
+
+	Rewrites = SafeAlloc(KEX_LDR_IMPORT_REWRITE, NumberOfRewrites);
+	if (!Rewrites) {
+		PrintF(L"%s: out of memory\r\n", FilePath);
+		goto Exit;
+	}
+
+	Status = KexLdrScanImageImports(
+		FileBuffer,
+		FileSize.LowPart,
+		0,
+		RewriteDllName,
+		NULL,
+		Rewrites,
+		&NumberOfRewrites);
+
+	if (!NT_SUCCESS(Status)) {
+		PrintF(L"%s: failed to scan imports: %s\r\n", FilePath, KexRtlNtStatusToString(Status));
+		goto Exit;
+	}
+
+	if (BenchmarkIterations) {
+		LARGE_INTEGER Frequency;
+		LARGE_INTEGER StartTime;
+		LARGE_INTEGER EndTime;
+		ULONG Iteration;
+
+		QueryPerformanceFrequency(&Frequency);
+		QueryPerformanceCounter(&StartTime);
+
+		for (Iteration = 0; Iteration < BenchmarkIterations; ++Iteration) {
+			ULONG Count;
+
+			Count = NumberOfRewrites;
+
+			KexLdrScanImageImports(
+				FileBuffer,
+				FileSize.LowPart,
+				0,
+				RewriteDllName,
+				NULL,
+				Rewrites,
+				&Count);
+		}
+
+		QueryPerformanceCounter(&EndTime);
+
+		PrintF(L"%s: %I64u ns per scan (%lu iterations)\r\n",
+			   FilePath,
+			   ((EndTime.QuadPart - StartTime.QuadPart) * 1000000000) / (Frequency.QuadPart * BenchmarkIterations),
+			   BenchmarkIterations);
+	}
+
+	for (Index = 0; Index < NumberOfRewrites; ++Index) {
+		PrintF(L"%s: name at RVA 0x%08lx -> %hs\r\n",
+			   FilePath,
+			   Rewrites[Index].NameRva,
+			   Rewrites[Index].RewrittenName);
+	}
+
+	++Statistics.NumberOfRewrittenFiles;
+	Statistics.NumberOfRewrites += NumberOfRewrites;
+
+	if (ScanOnly) {
+		Success = TRUE;
+		goto Exit;
+	}
+
+	//
+	// Keep a copy of the original file around. If there is already a backup
+	// then it is from a previous run, and we want to keep that one instead.
+	//
+
+	{
+		PWSTR BackupPath;
+		SIZE_T BackupPathCch;
+		HANDLE BackupHandle;
+
+		BackupPathCch = wcslen(FilePath) + ARRAYSIZE(L".kexbak");
+		BackupPath = StackAlloc(WCHAR, BackupPathCch);
+		StringCchPrintf(BackupPath, BackupPathCch, L"%s.kexbak", FilePath);
+
+		//
+		// We already have the file open for writing, so CopyFile would fail
+		// with a sharing violation. Write out the buffer we read instead.
+		//
+
+		BackupHandle = CreateFile(
+			BackupPath,
+			GENERIC_WRITE,
+			0,
+			NULL,
+			CREATE_NEW,
+			FILE_ATTRIBUTE_NORMAL,
+			NULL);
+
+		if (BackupHandle != INVALID_HANDLE_VALUE) {
+			BOOLEAN BackupWritten;
+
+			BackupWritten = WriteFile(BackupHandle, FileBuffer, FileSize.LowPart, &BytesTransferred, NULL) &&
+							BytesTransferred == FileSize.LowPart;
+
+			CloseHandle(BackupHandle);
+
+			unless (BackupWritten) {
+				PrintF(L"%s: failed to write backup file: %s\r\n", FilePath, GetLastErrorAsString());
+				DeleteFile(BackupPath);
+				goto Exit;
+			}
+		} else if (GetLastError() != ERROR_FILE_EXISTS) {
+			PrintF(L"%s: failed to create backup file: %s\r\n", FilePath, GetLastErrorAsString());
+			goto Exit;
+		}
+	}
+
+	Status = KexLdrApplyImageImportRewrites(
+		FileBuffer,
+		FileSize.LowPart,
+		0,
+		Rewrites,
+		NumberOfRewrites);
+
+	if (!NT_SUCCESS(Status)) {
+		PrintF(L"%s: failed to rewrite imports: %s\r\n", FilePath, KexRtlNtStatusToString(Status));
+		goto Exit;
+	}
+
+	{
+		PIMAGE_NT_HEADERS NtHeaders;
+		PIMAGE_DATA_DIRECTORY SecurityDirectory;
+
+		NtHeaders = ImageNtHeader(FileBuffer);
+
+		SecurityDirectory = GetImageDirectory(NtHeaders, IMAGE_DIRECTORY_ENTRY_SECURITY);
+		if (SecurityDirectory && SecurityDirectory->VirtualAddress != 0) {
+			PrintF(L"%s: warning: the digital signature of this file is no longer valid\r\n", FilePath);
+		}
+
+		//
+		// CheckSum is at the same offset in both PE32 and PE32+ headers.
+		//
+
+		if (NtHeaders->OptionalHeader.CheckSum != 0) {
+			ULONG HeaderSum;
+
+			CheckSumMappedFile(
+				FileBuffer,
+				FileSize.LowPart,
+				&HeaderSum,
+				&NtHeaders->OptionalHeader.CheckSum);
+		}
+	}
+
+	SetFilePointer(FileHandle, 0, NULL, FILE_BEGIN);
+
+	if (!WriteFile(FileHandle, FileBuffer, FileSize.LowPart, &BytesTransferred, NULL) ||
+		BytesTransferred != FileSize.LowPart) {
+
+		PrintF(L"%s: failed to write file: %s\r\n", FilePath, GetLastErrorAsString());
+		goto Exit;
+	}
+
+	Success = TRUE;
+
+Exit:
+	if (!Success) {
+		++Statistics.NumberOfFailures;
+	}
+
+	SafeFree(Rewrites);
+	SafeFree(FileBuffer);
+
+	if (FileHandle != INVALID_HANDLE_VALUE) {
+		CloseHandle(FileHandle);
+	}
+
+	return Success;
+}
+
+//
+// Process all files matching a file name which may contain wildcards.
+//
+VOID ProcessFileSpec(
+	IN	PCWSTR	FileSpec)
+{
+	HANDLE FindHandle;
+	WIN32_FIND_DATA FindData;
+	PCWSTR FileName;
+	SIZE_T DirectoryCch;
+
+	if (!wcschr(FileSpec, '*') && !wcschr(FileSpec, '?')) {
+		ProcessFile(FileSpec);
+		return;
+	}
+
+	FileName = PathFindFileName(FileSpec);
+	DirectoryCch = FileName - FileSpec;
+
+	FindHandle = FindFirstFile(FileSpec, &FindData);
+	if (FindHandle == INVALID_HANDLE_VALUE) {
+		PrintF(L"%s: no matching files\r\n", FileSpec);
+		return;
+	}
+
+	do {
+		WCHAR FilePath[MAX_PATH];
+
+		if (FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			continue;
+		}
+
+		StringCchPrintf(
+			FilePath,
+			ARRAYSIZE(FilePath),
+			L"%.*s%s",
+			(INT) DirectoryCch,
+			FileSpec,
+			FindData.cFileName);
+
+		ProcessFile(FilePath);
+	} while (FindNextFile(FindHandle, &FindData));
+
+	FindClose(FindHandle);
+}
+
+VOID EntryPoint(
+	VOID)
+{
+	PWSTR *Arguments;
+	INT NumberOfArguments;
+	INT Index;
+	UNICODE_STRING BenchmarkSwitch;
+
+	unless (AttachConsole(ATTACH_PARENT_PROCESS)) {
+		AllocConsole();
+	}
+
+	Arguments = CommandLineToArgvW(GetCommandLine(), &NumberOfArguments);
+
+	if (!Arguments || NumberOfArguments < 2) {
+		PrintF(L"Usage: KexRwImp [/scan] [/bench:N] file [file ...]\r\n");
+		ExitProcess(0);
+	}
+
+	if (!InitializeDllRewrite()) {
+		ExitProcess(1);
+	}
+
+	RtlInitConstantUnicodeString(&BenchmarkSwitch, L"/bench:");
+
+	//
+	// Switches apply to every file no matter where they appear on the
+	// command line, so they all have to be parsed before any file is
+	// touched. Otherwise "KexRwImp a.dll /scan" would rewrite a.dll.
+	// Each switch is removed from the argument list once it is parsed.
+	//
+
+	for (Index = 1; Index < NumberOfArguments; ++Index) {
+		UNICODE_STRING Argument;
+
+		if (Arguments[Index][0] != '/') {
+			continue;
+		}
+
+		RtlInitUnicodeString(&Argument, Arguments[Index]);
+
+		if (StringEqualI(Arguments[Index], L"/scan")) {
+			ScanOnly = TRUE;
+		} else if (RtlPrefixUnicodeString(&BenchmarkSwitch, &Argument, TRUE)) {
+			NTSTATUS Status;
+
+			KexRtlAdvanceUnicodeString(&Argument, BenchmarkSwitch.Length);
+			Status = RtlUnicodeStringToInteger(&Argument, 10, &BenchmarkIterations);
+
+			if (!NT_SUCCESS(Status) || BenchmarkIterations == 0) {
+				PrintF(L"Invalid number of benchmark iterations: %s\r\n", Arguments[Index]);
+				ExitProcess(1);
+			}
+
+			ScanOnly = TRUE;
+		} else {
+			PrintF(L"Unknown switch: %s\r\n", Arguments[Index]);
+			PrintF(L"Usage: KexRwImp [/scan] [/bench:N] file [file ...]\r\n");
+			ExitProcess(1);
+		}
+
+		Arguments[Index] = NULL;
+	}
+
+	for (Index = 1; Index < NumberOfArguments; ++Index) {
+		if (Arguments[Index]) {
+			ProcessFileSpec(Arguments[Index]);
+		}
+	}
+
+	PrintF(L"\r\n%lu files processed, %lu contain imports to rewrite (%lu in total), %lu failed.\r\n",
+		   Statistics.NumberOfFiles,
+		   Statistics.NumberOfRewrittenFiles,
+		   Statistics.NumberOfRewrites,
+		   Statistics.NumberOfFailures);
+
+	LocalFree(Arguments);
+	ExitProcess(Statistics.NumberOfFailures);
+}
\ No newline at end of file
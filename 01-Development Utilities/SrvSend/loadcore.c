@@ -0,0 +1,733 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     loadcore.c
+//
+// Abstract:
+//
+//     Contains the parts of the load generator which do not depend on the
+//     operating system: command line parsing, message generation, pacing
+//     and latency histograms. See loadgen.h.
+//
+// Environment:
+//
+//     Any. Only uses the LOAD_TRANSPORT it is given.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "buildcfg.h"
+#include <KexComm.h>
+#include "loadgen.h"
+
+STATIC CONST WCHAR LoadSourceComponent[]	= L"SrvSend";
+STATIC CONST WCHAR LoadSourceFile[]			= L"loadcore.c";
+STATIC CONST WCHAR LoadSourceFunction[]		= L"LoadBuildMessage";
+STATIC CONST WCHAR LoadApplicationName[]	= L"SrvSendLoad.exe";
+STATIC CONST WCHAR LoadHardErrorDllName[]	= L"SrvSendLoad.dll";
+
+#define LOAD_CCH(String) (ARRAYSIZE(String) - 1)
+
+//
+// Command line parsing.
+//
+// The load generator is started with a command line like this:
+//
+//   SrvSend.exe /load /clients:8 /threads:4 /rate:1000 /count:10000
+//               /mix:logevent=90,batch=9,harderror=1 /text:64 /batch:16
+//
+// Switches which are not given keep their default values.
+//
+
+PCWSTR LoadSkipSpaces(
+	IN	PCWSTR	String)
+{
+	ASSERT (String != NULL);
+
+	while (*String == ' ' || *String == '\t') {
+		++String;
+	}
+
+	return String;
+}
+
+//
+// If the string at *Cursor starts with SwitchName (ignoring case), advance
+// *Cursor past it and return TRUE.
+//
+BOOLEAN LoadMatchSwitch(
+	IN OUT	PPCWSTR	Cursor,
+	IN		PCWSTR	SwitchName)
+{
+	PCWSTR String;
+
+	ASSERT (Cursor != NULL);
+	ASSERT (*Cursor != NULL);
+	ASSERT (SwitchName != NULL);
+
+	String = *Cursor;
+
+	while (*SwitchName != '\0') {
+		WCHAR Character;
+
+		Character = *String;
+
+		if (Character >= 'A' && Character <= 'Z') {
+			Character += 'a' - 'A';
+		}
+
+		if (Character != *SwitchName) {
+			return FALSE;
+		}
+
+		++String;
+		++SwitchName;
+	}
+
+	*Cursor = String;
+	return TRUE;
+}
+
+BOOLEAN LoadParseUlong(
+	IN OUT	PPCWSTR	Cursor,
+	OUT		PULONG	Value)
+{
+	PCWSTR String;
+	ULONGLONG Accumulator;
+
+	ASSERT (Cursor != NULL);
+	ASSERT (*Cursor != NULL);
+	ASSERT (Value != NULL);
+
+	String = *Cursor;
+	Accumulator = 0;
+
+	unless (*String >= '0' && *String <= '9') {
+		return FALSE;
+	}
+
+	while (*String >= '0' && *String <= '9') {
+		Accumulator = (Accumulator * 10) + (*String - '0');
+
+		if (Accumulator > ULONG_MAX) {
+			return FALSE;
+		}
+
+		++String;
+	}
+
+	*Cursor = String;
+	*Value = (ULONG) Accumulator;
+	return TRUE;
+}
+
+STATIC BOOLEAN LoadpParseMix(
+	IN OUT	PPCWSTR				Cursor,
+	OUT		PLOAD_CONFIGURATION	Configuration)
+{
+	ULONG Index;
+
+	for (Index = 0; Index < KexIpcMaximumMessageId; ++Index) {
+		Configuration->Weight[Index] = 0;
+	}
+
+	while (TRUE) {
+		KEX_IPC_MESSAGE_ID MessageId;
+
+		// "logeventbatch=" must be checked before "logevent=".
+		if (LoadMatchSwitch(Cursor, L"logeventbatch=") || LoadMatchSwitch(Cursor, L"batch=")) {
+			MessageId = KexIpcLogEventBatch;
+		} else if (LoadMatchSwitch(Cursor, L"logevent=")) {
+			MessageId = KexIpcLogEvent;
+		} else if (LoadMatchSwitch(Cursor, L"harderror=")) {
+			MessageId = KexIpcHardError;
+		} else {
+			// This includes processstart, which cannot be part of the mix.
+			return FALSE;
+		}
+
+		unless (LoadParseUlong(Cursor, &Configuration->Weight[MessageId])) {
+			return FALSE;
+		}
+
+		unless (LoadMatchSwitch(Cursor, L",")) {
+			return TRUE;
+		}
+	}
+}
+
+VOID LoadDefaultConfiguration(
+	OUT	PLOAD_CONFIGURATION	Configuration)
+{
+	ASSERT (Configuration != NULL);
+
+	Configuration->NumberOfClients = 4;
+	Configuration->NumberOfThreads = 4;
+	Configuration->MessagesPerSecond = 1000;
+	Configuration->MessagesPerThread = 10000;
+	Configuration->Weight[KexIpcKexProcessStart] = 0;
+	Configuration->Weight[KexIpcHardError] = 1;
+	Configuration->Weight[KexIpcLogEvent] = 90;
+	Configuration->Weight[KexIpcLogEventBatch] = 9;
+	Configuration->TextLength = 64;
+	Configuration->EventsPerBatch = 16;
+}
+
+//
+// Parse the switches which follow "/load" on the command line. Returns
+// STATUS_INVALID_PARAMETER if a switch is unknown or out of range.
+//
+NTSTATUS LoadParseCommandLine(
+	IN	PCWSTR				CommandLine,
+	OUT	PLOAD_CONFIGURATION	Configuration)
+{
+	PCWSTR Cursor;
+	ULONG TotalWeight;
+	ULONG Index;
+
+	ASSERT (CommandLine != NULL);
+	ASSERT (Configuration != NULL);
+
+	LoadDefaultConfiguration(Configuration);
+	Cursor = LoadSkipSpaces(CommandLine);
+
+	until (*Cursor == '\0') {
+		BOOLEAN Success;
+
+		if (LoadMatchSwitch(&Cursor, L"/clients:")) {
+			Success = LoadParseUlong(&Cursor, &Configuration->NumberOfClients);
+		} else if (LoadMatchSwitch(&Cursor, L"/threads:")) {
+			Success = LoadParseUlong(&Cursor, &Configuration->NumberOfThreads);
+		} else if (LoadMatchSwitch(&Cursor, L"/rate:")) {
+			Success = LoadParseUlong(&Cursor, &Configuration->MessagesPerSecond);
+		} else if (LoadMatchSwitch(&Cursor, L"/count:")) {
+			Success = LoadParseUlong(&Cursor, &Configuration->MessagesPerThread);
+		} else if (LoadMatchSwitch(&Cursor, L"/text:")) {
+			Success = LoadParseUlong(&Cursor, &Configuration->TextLength);
+		} else if (LoadMatchSwitch(&Cursor, L"/batch:")) {
+			Success = LoadParseUlong(&Cursor, &Configuration->EventsPerBatch);
+		} else if (LoadMatchSwitch(&Cursor, L"/mix:")) {
+			Success = LoadpParseMix(&Cursor, Configuration);
+		} else {
+			Success = FALSE;
+		}
+
+		// Each switch must be followed by a space or the end of the string.
+		unless (Success && (*Cursor == '\0' || *Cursor == ' ' || *Cursor == '\t')) {
+			return STATUS_INVALID_PARAMETER;
+		}
+
+		Cursor = LoadSkipSpaces(Cursor);
+	}
+
+	if (Configuration->NumberOfClients == 0 ||
+		Configuration->NumberOfClients > LOAD_MAXIMUM_NUMBER_OF_CLIENTS ||
+		Configuration->NumberOfThreads == 0 ||
+		Configuration->NumberOfThreads > LOAD_MAXIMUM_NUMBER_OF_THREADS ||
+		Configuration->MessagesPerThread == 0 ||
+		Configuration->MessagesPerSecond > 1000000 ||
+		Configuration->TextLength > LOAD_MAXIMUM_TEXT_LENGTH ||
+		Configuration->EventsPerBatch == 0 ||
+		Configuration->EventsPerBatch > LOAD_MAXIMUM_EVENTS_PER_BATCH) {
+
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	TotalWeight = 0;
+
+	for (Index = 0; Index < KexIpcMaximumMessageId; ++Index) {
+		if (Configuration->Weight[Index] > 1000000) {
+			return STATUS_INVALID_PARAMETER;
+		}
+
+		TotalWeight += Configuration->Weight[Index];
+	}
+
+	if (TotalWeight == 0) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+//
+// Message generation.
+//
+
+ULONG LoadRandom(
+	IN OUT	PULONG	Seed)
+{
+	ULONG Value;
+
+	ASSERT (Seed != NULL);
+
+	// xorshift32 gets stuck at zero.
+	Value = *Seed ? *Seed : 0x9E3779B9;
+
+	Value ^= Value << 13;
+	Value ^= Value >> 17;
+	Value ^= Value << 5;
+
+	*Seed = Value;
+	return Value;
+}
+
+KEX_IPC_MESSAGE_ID LoadChooseMessageId(
+	IN		PCLOAD_CONFIGURATION	Configuration,
+	IN OUT	PULONG					Seed)
+{
+	ULONG TotalWeight;
+	ULONG Choice;
+	ULONG Index;
+
+	ASSERT (Configuration != NULL);
+
+	TotalWeight = 0;
+
+	for (Index = 0; Index < KexIpcMaximumMessageId; ++Index) {
+		TotalWeight += Configuration->Weight[Index];
+	}
+
+	ASSERT (TotalWeight != 0);
+	Choice = LoadRandom(Seed) % TotalWeight;
+
+	for (Index = 0; Index < KexIpcMaximumMessageId; ++Index) {
+		if (Choice < Configuration->Weight[Index]) {
+			break;
+		}
+
+		Choice -= Configuration->Weight[Index];
+	}
+
+	ASSERT (Index < KexIpcMaximumMessageId);
+	return (KEX_IPC_MESSAGE_ID) Index;
+}
+
+STATIC VOID LoadpFillText(
+	OUT		PWCHAR	Buffer,
+	IN		ULONG	Length,
+	IN OUT	PULONG	Seed)
+{
+	ULONG Index;
+	ULONG Start;
+
+	Start = LoadRandom(Seed);
+
+	for (Index = 0; Index < Length; ++Index) {
+		Buffer[Index] = (WCHAR) ('a' + ((Start + Index) % 26));
+	}
+}
+
+//
+// Write one log event into Data and return the number of characters that
+// were written.
+//
+STATIC ULONG LoadpBuildLogEvent(
+	IN		PCLOAD_CONFIGURATION				Configuration,
+	IN OUT	PULONG								Seed,
+	OUT		PKEX_IPC_MESSAGE_DATA_LOG_EVENT		LogEventInfo,
+	OUT		PWCHAR								Data)
+{
+	LogEventInfo->Severity = LoadRandom(Seed) % LogSeverityMaximumValue;
+	LogEventInfo->SourceLine = LoadRandom(Seed) % 10000;
+	LogEventInfo->SourceComponentLength = LOAD_CCH(LoadSourceComponent);
+	LogEventInfo->SourceFileLength = LOAD_CCH(LoadSourceFile);
+	LogEventInfo->SourceFunctionLength = LOAD_CCH(LoadSourceFunction);
+	LogEventInfo->TextLength = (USHORT) Configuration->TextLength;
+
+	RtlCopyMemory(Data, LoadSourceComponent, LOAD_CCH(LoadSourceComponent) * sizeof(WCHAR));
+	Data += LOAD_CCH(LoadSourceComponent);
+	RtlCopyMemory(Data, LoadSourceFile, LOAD_CCH(LoadSourceFile) * sizeof(WCHAR));
+	Data += LOAD_CCH(LoadSourceFile);
+	RtlCopyMemory(Data, LoadSourceFunction, LOAD_CCH(LoadSourceFunction) * sizeof(WCHAR));
+	Data += LOAD_CCH(LoadSourceFunction);
+	LoadpFillText(Data, Configuration->TextLength, Seed);
+
+	return LOAD_CCH(LoadSourceComponent) + LOAD_CCH(LoadSourceFile) +
+		   LOAD_CCH(LoadSourceFunction) + Configuration->TextLength;
+}
+
+//
+// Build a message of the given type into Message, which must be at least
+// KEX_IPC_MESSAGE_MAXIMUM_SIZE bytes long. Returns the size of the message.
+//
+// A KexIpcLogEventBatch message contains EventsPerBatch log events, or as
+// many as will fit into a message if that is fewer.
+//
+ULONG LoadBuildMessage(
+	IN		PCLOAD_CONFIGURATION	Configuration,
+	IN		KEX_IPC_MESSAGE_ID		MessageId,
+	IN OUT	PULONG					Seed,
+	OUT		PKEX_IPC_MESSAGE		Message)
+{
+	ULONG AuxiliaryDataBlockSize;
+
+	ASSERT (Configuration != NULL);
+	ASSERT (Configuration->TextLength <= LOAD_MAXIMUM_TEXT_LENGTH);
+	ASSERT (Message != NULL);
+
+	Message->MessageId = MessageId;
+
+	switch (MessageId) {
+	case KexIpcKexProcessStart:
+		Message->ProcessStartedInformation.ApplicationNameLength = LOAD_CCH(LoadApplicationName);
+		Message->ProcessStartedInformation.LogRingSectionHandle = 0;
+		Message->ProcessStartedInformation.LogRingDoorbellEventHandle = 0;
+
+		AuxiliaryDataBlockSize = LOAD_CCH(LoadApplicationName) * sizeof(WCHAR);
+		RtlCopyMemory(Message->AuxiliaryDataBlock, LoadApplicationName, AuxiliaryDataBlockSize);
+		break;
+	case KexIpcHardError:
+		Message->HardErrorInformation.Status = STATUS_DLL_NOT_FOUND;
+		Message->HardErrorInformation.UlongParameter = LoadRandom(Seed);
+		Message->HardErrorInformation.StringParameter1Length = LOAD_CCH(LoadHardErrorDllName);
+		Message->HardErrorInformation.StringParameter2Length = (USHORT) Configuration->TextLength;
+
+		RtlCopyMemory(
+			Message->AuxiliaryDataBlock,
+			LoadHardErrorDllName,
+			LOAD_CCH(LoadHardErrorDllName) * sizeof(WCHAR));
+
+		LoadpFillText(
+			((PWCHAR) Message->AuxiliaryDataBlock) + LOAD_CCH(LoadHardErrorDllName),
+			Configuration->TextLength,
+			Seed);
+
+		AuxiliaryDataBlockSize = (LOAD_CCH(LoadHardErrorDllName) + Configuration->TextLength) * sizeof(WCHAR);
+		break;
+	case KexIpcLogEvent:
+		AuxiliaryDataBlockSize = sizeof(WCHAR) * LoadpBuildLogEvent(
+			Configuration,
+			Seed,
+			&Message->LogEventInformation,
+			(PWCHAR) Message->AuxiliaryDataBlock);
+
+		break;
+	case KexIpcLogEventBatch:
+		{
+			PKEX_IPC_LOG_EVENT_BATCH_ENTRY Entry;
+			ULONG EntrySize;
+			ULONG DataCb;
+			ULONG NumberOfEvents;
+
+			EntrySize = KEX_IPC_LOG_EVENT_BATCH_ENTRY_SIZE(
+				LOAD_CCH(LoadSourceComponent) + LOAD_CCH(LoadSourceFile) +
+				LOAD_CCH(LoadSourceFunction) + Configuration->TextLength);
+
+			AuxiliaryDataBlockSize = 0;
+			NumberOfEvents = 0;
+
+			while (NumberOfEvents < Configuration->EventsPerBatch &&
+				   sizeof(KEX_IPC_MESSAGE) + AuxiliaryDataBlockSize + EntrySize <= KEX_IPC_MESSAGE_MAXIMUM_SIZE) {
+
+				Entry = (PKEX_IPC_LOG_EVENT_BATCH_ENTRY) &Message->AuxiliaryDataBlock[AuxiliaryDataBlockSize];
+
+				DataCb = sizeof(WCHAR) * LoadpBuildLogEvent(
+					Configuration,
+					Seed,
+					&Entry->LogEventInformation,
+					Entry->Data);
+
+				// Clear the padding at the end of the entry.
+				RtlZeroMemory(
+					(PBYTE) Entry->Data + DataCb,
+					EntrySize - FIELD_OFFSET(KEX_IPC_LOG_EVENT_BATCH_ENTRY, Data) - DataCb);
+
+				AuxiliaryDataBlockSize += EntrySize;
+				++NumberOfEvents;
+			}
+
+			ASSERT (NumberOfEvents != 0);
+			Message->LogEventBatchInformation.NumberOfEvents = (USHORT) NumberOfEvents;
+		}
+
+		break;
+	default:
+		NOT_REACHED;
+		AuxiliaryDataBlockSize = 0;
+		break;
+	}
+
+	ASSERT (sizeof(KEX_IPC_MESSAGE) + AuxiliaryDataBlockSize <= KEX_IPC_MESSAGE_MAXIMUM_SIZE);
+
+	Message->AuxiliaryDataBlockSize = (USHORT) AuxiliaryDataBlockSize;
+	return sizeof(KEX_IPC_MESSAGE) + AuxiliaryDataBlockSize;
+}
+
+//
+// Latency histograms.
+//
+
+STATIC ULONG LoadpBucketIndex(
+	IN	ULONG	Value)
+{
+	ULONG Shift;
+
+	if (Value < LOAD_HISTOGRAM_SUB_BUCKETS) {
+		return Value;
+	}
+
+	Shift = 1;
+
+	while ((Value >> Shift) >= LOAD_HISTOGRAM_SUB_BUCKETS) {
+		++Shift;
+	}
+
+	// Value >> Shift is now between HALF_SUB_BUCKETS and SUB_BUCKETS - 1.
+	return (Shift * LOAD_HISTOGRAM_HALF_SUB_BUCKETS) + (Value >> Shift);
+}
+
+//
+// Return the largest value which is recorded into the given bucket.
+//
+STATIC ULONG LoadpBucketHighestValue(
+	IN	ULONG	BucketIndex)
+{
+	ULONG Shift;
+	ULONG SubBucket;
+
+	ASSERT (BucketIndex < LOAD_HISTOGRAM_NUMBER_OF_BUCKETS);
+
+	if (BucketIndex < LOAD_HISTOGRAM_SUB_BUCKETS) {
+		return BucketIndex;
+	}
+
+	Shift = (BucketIndex / LOAD_HISTOGRAM_HALF_SUB_BUCKETS) - 1;
+	SubBucket = BucketIndex - (Shift * LOAD_HISTOGRAM_HALF_SUB_BUCKETS);
+
+	return (ULONG) ((((ULONGLONG) SubBucket + 1) << Shift) - 1);
+}
+
+VOID LoadInitializeResult(
+	OUT	PLOAD_RESULT	Result)
+{
+	ULONG Index;
+
+	ASSERT (Result != NULL);
+
+	RtlZeroMemory(Result, sizeof(*Result));
+	Result->StartTime = ~0ULL;
+
+	for (Index = 0; Index < KexIpcMaximumMessageId; ++Index) {
+		Result->Latency[Index].Minimum = ULONG_MAX;
+	}
+}
+
+VOID LoadRecordLatency(
+	IN OUT	PLOAD_HISTOGRAM	Histogram,
+	IN		ULONGLONG		Latency)
+{
+	ULONG Value;
+
+	ASSERT (Histogram != NULL);
+
+	Value = (Latency > ULONG_MAX) ? ULONG_MAX : (ULONG) Latency;
+
+	Histogram->Count += 1;
+	Histogram->Sum += Value;
+	Histogram->Buckets[LoadpBucketIndex(Value)] += 1;
+
+	if (Value < Histogram->Minimum) {
+		Histogram->Minimum = Value;
+	}
+
+	if (Value > Histogram->Maximum) {
+		Histogram->Maximum = Value;
+	}
+}
+
+//
+// Return the latency below which the given fraction of the recorded values
+// lie, e.g. PartsPer10000 = 9990 for the 99.9th percentile. The result is
+// the upper end of the bucket which contains that value, so it may be up to
+// 1/32 too high, but it is never higher than the maximum recorded value.
+//
+ULONG LoadQueryPercentile(
+	IN	PCLOAD_HISTOGRAM	Histogram,
+	IN	ULONG				PartsPer10000)
+{
+	ULONGLONG Rank;
+	ULONGLONG CumulativeCount;
+	ULONG Index;
+	ULONG Value;
+
+	ASSERT (Histogram != NULL);
+	ASSERT (PartsPer10000 <= 10000);
+
+	if (Histogram->Count == 0) {
+		return 0;
+	}
+
+	Rank = ((Histogram->Count * PartsPer10000) + 9999) / 10000;
+
+	if (Rank == 0) {
+		Rank = 1;
+	}
+
+	CumulativeCount = 0;
+
+	for (Index = 0; Index < LOAD_HISTOGRAM_NUMBER_OF_BUCKETS; ++Index) {
+		CumulativeCount += Histogram->Buckets[Index];
+
+		if (CumulativeCount >= Rank) {
+			break;
+		}
+	}
+
+	ASSERT (Index < LOAD_HISTOGRAM_NUMBER_OF_BUCKETS);
+
+	Value = LoadpBucketHighestValue(Index);
+
+	if (Value > Histogram->Maximum) {
+		Value = Histogram->Maximum;
+	}
+
+	return Value;
+}
+
+VOID LoadMergeResult(
+	IN OUT	PLOAD_RESULT	Destination,
+	IN		PCLOAD_RESULT	Source)
+{
+	ULONG MessageId;
+	ULONG Index;
+
+	ASSERT (Destination != NULL);
+	ASSERT (Source != NULL);
+
+	if (Source->StartTime < Destination->StartTime) {
+		Destination->StartTime = Source->StartTime;
+	}
+
+	if (Source->EndTime > Destination->EndTime) {
+		Destination->EndTime = Source->EndTime;
+	}
+
+	if (Source->NumberOfErrors != 0) {
+		Destination->NumberOfErrors += Source->NumberOfErrors;
+		Destination->LastErrorStatus = Source->LastErrorStatus;
+	}
+
+	for (MessageId = 0; MessageId < KexIpcMaximumMessageId; ++MessageId) {
+		PLOAD_HISTOGRAM DestinationHistogram;
+		PCLOAD_HISTOGRAM SourceHistogram;
+
+		DestinationHistogram = &Destination->Latency[MessageId];
+		SourceHistogram = &Source->Latency[MessageId];
+
+		DestinationHistogram->Count += SourceHistogram->Count;
+		DestinationHistogram->Sum += SourceHistogram->Sum;
+
+		if (SourceHistogram->Minimum < DestinationHistogram->Minimum) {
+			DestinationHistogram->Minimum = SourceHistogram->Minimum;
+		}
+
+		if (SourceHistogram->Maximum > DestinationHistogram->Maximum) {
+			DestinationHistogram->Maximum = SourceHistogram->Maximum;
+		}
+
+		for (Index = 0; Index < LOAD_HISTOGRAM_NUMBER_OF_BUCKETS; ++Index) {
+			DestinationHistogram->Buckets[Index] += SourceHistogram->Buckets[Index];
+		}
+	}
+}
+
+//
+// Sending.
+//
+
+//
+// Send a message and record how long it took, counting from ScheduledTime,
+// in the histogram for its message ID.
+//
+NTSTATUS LoadSendTimedMessage(
+	IN		PCLOAD_TRANSPORT	Transport,
+	IN		PCKEX_IPC_MESSAGE	Message,
+	IN		ULONG				MessageSize,
+	IN		ULONGLONG			ScheduledTime,
+	IN OUT	PLOAD_RESULT		Result)
+{
+	NTSTATUS Status;
+	ULONGLONG EndTime;
+
+	ASSERT (Transport != NULL);
+	ASSERT (Message != NULL);
+	ASSERT (Message->MessageId < KexIpcMaximumMessageId);
+	ASSERT (Result != NULL);
+
+	Status = Transport->SendMessage(Transport->Context, Message, MessageSize);
+	EndTime = Transport->QueryTime(Transport->Context);
+
+	if (ScheduledTime < Result->StartTime) {
+		Result->StartTime = ScheduledTime;
+	}
+
+	if (EndTime > Result->EndTime) {
+		Result->EndTime = EndTime;
+	}
+
+	if (!NT_SUCCESS(Status)) {
+		Result->NumberOfErrors += 1;
+		Result->LastErrorStatus = Status;
+		return Status;
+	}
+
+	LoadRecordLatency(
+		&Result->Latency[Message->MessageId],
+		(EndTime > ScheduledTime) ? (EndTime - ScheduledTime) : 0);
+
+	return Status;
+}
+
+//
+// Send MessagesPerThread messages from the configured mix. This is called
+// once by each thread of each client.
+//
+// If a target rate is set, messages are sent on a fixed schedule which does
+// not depend on how long earlier messages took, and latency is measured
+// from the time at which each message should have been sent. This way, a
+// stall in the server shows up in the latency of every message that was
+// held up by it, and not just in the one which was being sent at the time.
+//
+VOID LoadRunThread(
+	IN		PCLOAD_CONFIGURATION	Configuration,
+	IN		PCLOAD_TRANSPORT		Transport,
+	IN		ULONG					Seed,
+	IN		PKEX_IPC_MESSAGE		MessageBuffer,
+	IN OUT	PLOAD_RESULT			Result)
+{
+	NTSTATUS Status;
+	ULONGLONG StartTime;
+	ULONGLONG ScheduledTime;
+	ULONG MessageSize;
+	ULONG Index;
+
+	ASSERT (Configuration != NULL);
+	ASSERT (Transport != NULL);
+	ASSERT (MessageBuffer != NULL);
+	ASSERT (Result != NULL);
+
+	StartTime = Transport->QueryTime(Transport->Context);
+
+	for (Index = 0; Index < Configuration->MessagesPerThread; ++Index) {
+		MessageSize = LoadBuildMessage(
+			Configuration,
+			LoadChooseMessageId(Configuration, &Seed),
+			&Seed,
+			MessageBuffer);
+
+		if (Configuration->MessagesPerSecond != 0) {
+			ScheduledTime = StartTime + (((ULONGLONG) Index * 1000000) / Configuration->MessagesPerSecond);
+			Transport->WaitUntil(Transport->Context, ScheduledTime);
+		} else {
+			ScheduledTime = Transport->QueryTime(Transport->Context);
+		}
+
+		Status = LoadSendTimedMessage(Transport, MessageBuffer, MessageSize, ScheduledTime, Result);
+
+		if (!NT_SUCCESS(Status)) {
+			// Most likely, the server has disconnected us.
+			break;
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,674 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     loadgen.c
+//
+// Abstract:
+//
+//     Win32 driver for the load generator (see loadgen.h).
+//
+//     "SrvSend.exe /load <switches>" starts one child process for each
+//     simulated client. The children share a section with the parent, which
+//     contains the configuration and receives the results. Each child
+//     connects to KexSrv, sends KexIpcKexProcessStart, and waits for the
+//     parent to signal the start event. Then every thread of the child sends
+//     its messages through the child's pipe handle. When all children have
+//     exited, the parent merges their results and displays a report.
+//
+//     The clients don't set up a log ring, so KexSrv never replies to them.
+//     To measure how long the server takes to accept a message, the pipe is
+//     flushed after each write, which waits until the server has read
+//     everything that was written into it.
+//
+//     Note that this measures raw pipe latency only. KexDll sends its log
+//     events through the log ring and batches them (see KexSrv.h), so the
+//     numbers are not the latency that a real client sees.
+//
+// Environment:
+//
+//     win32 with kexsrv running
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "buildcfg.h"
+#include <KexComm.h>
+#include <KexSrv.h>
+#include <KexDll.h>
+#include "loadgen.h"
+
+//
+// NtDelayExecution can oversleep by up to one timer tick, so only waits
+// longer than this are done by sleeping. The rest is spent yielding.
+//
+
+#define LOAD_TIMER_RESOLUTION		10000		// 1ms, in 100ns units
+#define LOAD_SPIN_THRESHOLD			2000		// microseconds
+
+typedef struct _LOAD_SHARED_DATA {
+	LOAD_CONFIGURATION	Configuration;
+	VOLATILE LONG		NumberOfReadyClients;
+	NTSTATUS			ClientStatus[LOAD_MAXIMUM_NUMBER_OF_CLIENTS];
+	LOAD_RESULT			ClientResult[LOAD_MAXIMUM_NUMBER_OF_CLIENTS];
+} TYPEDEF_TYPE_NAME(LOAD_SHARED_DATA);
+
+typedef struct _LOAD_CLIENT_THREAD {
+	PCLOAD_CONFIGURATION	Configuration;
+	PCLOAD_TRANSPORT		Transport;
+	HANDLE					StartEventHandle;
+	ULONG					Seed;
+	LOAD_RESULT				Result;
+	ULONGLONG				MessageBuffer[KEX_IPC_MESSAGE_MAXIMUM_SIZE / sizeof(ULONGLONG) + 1];
+} TYPEDEF_TYPE_NAME(LOAD_CLIENT_THREAD);
+
+STATIC LONGLONG PerformanceFrequency;
+
+//
+// Pipe transport.
+//
+
+STATIC NTSTATUS LoadpPipeSendMessage(
+	IN	PVOID				Context,
+	IN	PCKEX_IPC_MESSAGE	Message,
+	IN	ULONG				MessageSize)
+{
+	NTSTATUS Status;
+	HANDLE ChannelHandle;
+	IO_STATUS_BLOCK IoStatusBlock;
+
+	ChannelHandle = (HANDLE) Context;
+
+	Status = NtWriteFile(
+		ChannelHandle,
+		NULL,
+		NULL,
+		NULL,
+		&IoStatusBlock,
+		(PVOID) Message,
+		MessageSize,
+		NULL,
+		NULL);
+
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	return NtFlushBuffersFile(ChannelHandle, &IoStatusBlock);
+}
+
+STATIC ULONGLONG LoadpQueryTime(
+	IN	PVOID	Context)
+{
+	LARGE_INTEGER Counter;
+
+	QueryPerformanceCounter(&Counter);
+
+	// Split up to avoid overflowing when the counter is large.
+	return ((Counter.QuadPart / PerformanceFrequency) * 1000000) +
+		   (((Counter.QuadPart % PerformanceFrequency) * 1000000) / PerformanceFrequency);
+}
+
+STATIC VOID LoadpWaitUntil(
+	IN	PVOID		Context,
+	IN	ULONGLONG	Time)
+{
+	ULONGLONG Now;
+
+	Now = LoadpQueryTime(Context);
+
+	if (Time > Now + LOAD_SPIN_THRESHOLD) {
+		LARGE_INTEGER Interval;
+
+		// Negative means relative, in 100ns units.
+		Interval.QuadPart = -(LONGLONG) ((Time - Now - LOAD_SPIN_THRESHOLD) * 10);
+		NtDelayExecution(FALSE, &Interval);
+	}
+
+	while (LoadpQueryTime(Context) < Time) {
+		NtYieldExecution();
+	}
+}
+
+STATIC VOID LoadpInitializeClock(
+	VOID)
+{
+	LARGE_INTEGER Frequency;
+	ULONG CurrentResolution;
+
+	QueryPerformanceFrequency(&Frequency);
+	PerformanceFrequency = Frequency.QuadPart;
+
+	// Makes NtDelayExecution accurate enough for pacing. Failure is harmless.
+	NtSetTimerResolution(LOAD_TIMER_RESOLUTION, TRUE, &CurrentResolution);
+}
+
+//
+// Client process.
+//
+
+STATIC NTSTATUS NTAPI LoadpClientThreadProc(
+	IN	PVOID	Parameter)
+{
+	PLOAD_CLIENT_THREAD Thread;
+
+	Thread = (PLOAD_CLIENT_THREAD) Parameter;
+
+	NtWaitForSingleObject(Thread->StartEventHandle, FALSE, NULL);
+
+	LoadRunThread(
+		Thread->Configuration,
+		Thread->Transport,
+		Thread->Seed,
+		(PKEX_IPC_MESSAGE) Thread->MessageBuffer,
+		&Thread->Result);
+
+	return STATUS_SUCCESS;
+}
+
+STATIC NTSTATUS LoadpConnectToKexSrv(
+	OUT	PHANDLE	ChannelHandle)
+{
+	UNICODE_STRING ChannelName;
+	OBJECT_ATTRIBUTES ObjectAttributes;
+	IO_STATUS_BLOCK IoStatusBlock;
+
+	RtlInitConstantUnicodeString(&ChannelName, KEXSRV_IPC_CHANNEL_NAME);
+	InitializeObjectAttributes(&ObjectAttributes, &ChannelName, 0, NULL, NULL);
+
+	return NtOpenFile(
+		ChannelHandle,
+		GENERIC_WRITE | SYNCHRONIZE,
+		&ObjectAttributes,
+		&IoStatusBlock,
+		FILE_SHARE_WRITE,
+		FILE_SYNCHRONOUS_IO_NONALERT);
+}
+
+//
+// Runs in each child process. Connects to KexSrv, runs the client's threads
+// and stores the merged results of all threads in the shared section.
+//
+STATIC NTSTATUS LoadpRunClient(
+	IN	PLOAD_SHARED_DATA	SharedData,
+	IN	ULONG				ClientIndex,
+	IN	HANDLE				StartEventHandle)
+{
+	NTSTATUS Status;
+	PCLOAD_CONFIGURATION Configuration;
+	PLOAD_RESULT Result;
+	LOAD_TRANSPORT Transport;
+	HANDLE ChannelHandle;
+	PLOAD_CLIENT_THREAD Threads[LOAD_MAXIMUM_NUMBER_OF_THREADS];
+	HANDLE ThreadHandles[LOAD_MAXIMUM_NUMBER_OF_THREADS];
+	ULONG NumberOfThreads;
+	ULONG Index;
+
+	Configuration = &SharedData->Configuration;
+	Result = &SharedData->ClientResult[ClientIndex];
+	ChannelHandle = NULL;
+	NumberOfThreads = 0;
+
+	LoadInitializeResult(Result);
+
+	Status = LoadpConnectToKexSrv(&ChannelHandle);
+	if (!NT_SUCCESS(Status)) {
+		goto Exit;
+	}
+
+	Transport.Context = ChannelHandle;
+	Transport.SendMessage = LoadpPipeSendMessage;
+	Transport.QueryTime = LoadpQueryTime;
+	Transport.WaitUntil = LoadpWaitUntil;
+
+	//
+	// Each thread result is merged into the client result at the end, so
+	// that the time it took to connect is not counted towards throughput.
+	//
+
+	for (Index = 0; Index < Configuration->NumberOfThreads; ++Index) {
+		Threads[Index] = SafeAlloc(LOAD_CLIENT_THREAD, 1);
+
+		if (!Threads[Index]) {
+			Status = STATUS_NO_MEMORY;
+			goto Exit;
+		}
+
+		Threads[Index]->Configuration = Configuration;
+		Threads[Index]->Transport = &Transport;
+		Threads[Index]->StartEventHandle = StartEventHandle;
+		Threads[Index]->Seed = (ClientIndex << 16) ^ (Index + 1) ^ (ULONG) LoadpQueryTime(NULL);
+		LoadInitializeResult(&Threads[Index]->Result);
+
+		Status = RtlCreateUserThread(
+			NtCurrentProcess(),
+			NULL,
+			FALSE,
+			0,
+			0,
+			0,
+			LoadpClientThreadProc,
+			Threads[Index],
+			&ThreadHandles[Index],
+			NULL);
+
+		if (!NT_SUCCESS(Status)) {
+			SafeFree(Threads[Index]);
+			goto Exit;
+		}
+
+		++NumberOfThreads;
+	}
+
+	//
+	// KexSrv disconnects clients which send KexIpcKexProcessStart more than
+	// once, so it is sent here, once per client, and not as part of the mix.
+	// The first thread's message buffer is free until the test starts.
+	//
+
+	{
+		LOAD_RESULT ProcessStartResult;
+		PKEX_IPC_MESSAGE Message;
+		ULONG MessageSize;
+
+		Message = (PKEX_IPC_MESSAGE) Threads[0]->MessageBuffer;
+		MessageSize = LoadBuildMessage(Configuration, KexIpcKexProcessStart, &Threads[0]->Seed, Message);
+
+		LoadInitializeResult(&ProcessStartResult);
+
+		Status = LoadSendTimedMessage(
+			&Transport,
+			Message,
+			MessageSize,
+			LoadpQueryTime(NULL),
+			&ProcessStartResult);
+
+		RtlCopyMemory(
+			&Result->Latency[KexIpcKexProcessStart],
+			&ProcessStartResult.Latency[KexIpcKexProcessStart],
+			sizeof(LOAD_HISTOGRAM));
+	}
+
+Exit:
+	SharedData->ClientStatus[ClientIndex] = Status;
+	InterlockedIncrement(&SharedData->NumberOfReadyClients);
+
+	if (!NT_SUCCESS(Status)) {
+		// Any threads which were already started will fail on their first
+		// send once the test starts, and exit.
+		SafeClose(ChannelHandle);
+	}
+
+	if (NumberOfThreads != 0) {
+		NtWaitForMultipleObjects(NumberOfThreads, ThreadHandles, WaitAllObject, FALSE, NULL);
+
+		for (Index = 0; Index < NumberOfThreads; ++Index) {
+			LoadMergeResult(Result, &Threads[Index]->Result);
+			NtClose(ThreadHandles[Index]);
+			SafeFree(Threads[Index]);
+		}
+	}
+
+	return Status;
+}
+
+//
+// Entry point of a child process. The arguments are the client index and
+// the handle values of the shared section and the start event, which the
+// child has inherited from the parent.
+//
+VOID LoadClientMain(
+	IN	PCWSTR	Arguments)
+{
+	NTSTATUS Status;
+	ULONG ClientIndex;
+	ULONG SectionHandle;
+	ULONG StartEventHandle;
+	PVOID BaseAddress;
+	SIZE_T ViewSize;
+
+	Arguments = LoadSkipSpaces(Arguments);
+	unless (LoadParseUlong(&Arguments, &ClientIndex)) {
+		NtTerminateProcess(NtCurrentProcess(), STATUS_INVALID_PARAMETER);
+	}
+
+	Arguments = LoadSkipSpaces(Arguments);
+	unless (LoadParseUlong(&Arguments, &SectionHandle)) {
+		NtTerminateProcess(NtCurrentProcess(), STATUS_INVALID_PARAMETER);
+	}
+
+	Arguments = LoadSkipSpaces(Arguments);
+	unless (LoadParseUlong(&Arguments, &StartEventHandle)) {
+		NtTerminateProcess(NtCurrentProcess(), STATUS_INVALID_PARAMETER);
+	}
+
+	if (ClientIndex >= LOAD_MAXIMUM_NUMBER_OF_CLIENTS) {
+		NtTerminateProcess(NtCurrentProcess(), STATUS_INVALID_PARAMETER);
+	}
+
+	BaseAddress = NULL;
+	ViewSize = sizeof(LOAD_SHARED_DATA);
+
+	Status = NtMapViewOfSection(
+		UlongToHandle(SectionHandle),
+		NtCurrentProcess(),
+		&BaseAddress,
+		0,
+		0,
+		NULL,
+		&ViewSize,
+		ViewUnmap,
+		0,
+		PAGE_READWRITE);
+
+	if (!NT_SUCCESS(Status)) {
+		NtTerminateProcess(NtCurrentProcess(), Status);
+	}
+
+	LoadpInitializeClock();
+	Status = LoadpRunClient((PLOAD_SHARED_DATA) BaseAddress, ClientIndex, UlongToHandle(StartEventHandle));
+	NtTerminateProcess(NtCurrentProcess(), Status);
+}
+
+//
+// Parent process.
+//
+
+STATIC NTSTATUS LoadpStartClient(
+	IN	ULONG	ClientIndex,
+	IN	HANDLE	SectionHandle,
+	IN	HANDLE	StartEventHandle,
+	OUT	PHANDLE	ProcessHandle)
+{
+	HRESULT Result;
+	BOOL Success;
+	WCHAR CommandLine[MAX_PATH + 64];
+	STARTUPINFO StartupInfo;
+	PROCESS_INFORMATION ProcessInformation;
+
+	Result = StringCchPrintf(
+		CommandLine,
+		ARRAYSIZE(CommandLine),
+		L"\"%.*s\" /loadclient %lu %lu %lu",
+		NtCurrentPeb()->ProcessParameters->ImagePathName.Length / sizeof(WCHAR),
+		NtCurrentPeb()->ProcessParameters->ImagePathName.Buffer,
+		ClientIndex,
+		HandleToUlong(SectionHandle),
+		HandleToUlong(StartEventHandle));
+
+	if (FAILED(Result)) {
+		return STATUS_NAME_TOO_LONG;
+	}
+
+	GetStartupInfo(&StartupInfo);
+
+	Success = CreateProcess(
+		NULL,
+		CommandLine,
+		NULL,
+		NULL,
+		TRUE,
+		0,
+		NULL,
+		NULL,
+		&StartupInfo,
+		&ProcessInformation);
+
+	unless (Success) {
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	NtClose(ProcessInformation.hThread);
+	*ProcessHandle = ProcessInformation.hProcess;
+	return STATUS_SUCCESS;
+}
+
+STATIC VOID LoadpAppendReport(
+	IN OUT	PWSTR	Report,
+	IN		SIZE_T	ReportCch,
+	IN		PCWSTR	Format,
+	IN		...)
+{
+	ARGLIST ArgList;
+	SIZE_T Length;
+
+	StringCchLength(Report, ReportCch, &Length);
+
+	va_start(ArgList, Format);
+	StringCchVPrintf(Report + Length, ReportCch - Length, Format, ArgList);
+	va_end(ArgList);
+}
+
+STATIC VOID LoadpDisplayReport(
+	IN	PCLOAD_SHARED_DATA	SharedData,
+	IN	ULONG				NumberOfClients)
+{
+	STATIC PCWSTR MessageIdNames[] = {
+		L"KexIpcKexProcessStart",
+		L"KexIpcHardError",
+		L"KexIpcLogEvent",
+		L"KexIpcLogEventBatch",
+	};
+
+	STATIC LOAD_RESULT Total;
+	PCLOAD_CONFIGURATION Configuration;
+	WCHAR Report[4096];
+	ULONGLONG NumberOfMessages;
+	ULONGLONG Duration;
+	ULONG MessageId;
+	ULONG Index;
+
+	ASSERT (ARRAYSIZE(MessageIdNames) == KexIpcMaximumMessageId);
+
+	Configuration = &SharedData->Configuration;
+	LoadInitializeResult(&Total);
+
+	for (Index = 0; Index < NumberOfClients; ++Index) {
+		LoadMergeResult(&Total, &SharedData->ClientResult[Index]);
+	}
+
+	NumberOfMessages = 0;
+
+	for (MessageId = 0; MessageId < KexIpcMaximumMessageId; ++MessageId) {
+		if (MessageId != KexIpcKexProcessStart) {
+			NumberOfMessages += Total.Latency[MessageId].Count;
+		}
+	}
+
+	Duration = (Total.EndTime > Total.StartTime) ? (Total.EndTime - Total.StartTime) : 1;
+
+	Report[0] = '\0';
+
+	LoadpAppendReport(
+		Report, ARRAYSIZE(Report),
+		L"Raw pipe latency: messages were written straight to the pipe, not through KexDll's log ring and batching.\r\n\r\n"
+		L"%lu clients, %lu threads per client, %lu messages per thread at %lu messages/s per thread.\r\n"
+		L"Sent %I64u messages in %I64u ms (%I64u messages/s).\r\n\r\n",
+		Configuration->NumberOfClients,
+		Configuration->NumberOfThreads,
+		Configuration->MessagesPerThread,
+		Configuration->MessagesPerSecond,
+		NumberOfMessages,
+		Duration / 1000,
+		(NumberOfMessages * 1000000) / Duration);
+
+	for (MessageId = 0; MessageId < KexIpcMaximumMessageId; ++MessageId) {
+		PCLOAD_HISTOGRAM Histogram;
+
+		Histogram = &Total.Latency[MessageId];
+
+		if (Histogram->Count == 0) {
+			continue;
+		}
+
+		LoadpAppendReport(
+			Report, ARRAYSIZE(Report),
+			L"%s: %I64u sent, latency (us): mean %I64u, p50 %lu, p99 %lu, p99.9 %lu, max %lu\r\n",
+			MessageIdNames[MessageId],
+			Histogram->Count,
+			Histogram->Sum / Histogram->Count,
+			LoadQueryPercentile(Histogram, 5000),
+			LoadQueryPercentile(Histogram, 9900),
+			LoadQueryPercentile(Histogram, 9990),
+			Histogram->Maximum);
+	}
+
+	if (Total.NumberOfErrors != 0) {
+		LoadpAppendReport(
+			Report, ARRAYSIZE(Report),
+			L"\r\n%lu send(s) failed. Last error: %s\r\n",
+			Total.NumberOfErrors,
+			NtStatusAsString(Total.LastErrorStatus));
+	}
+
+	for (Index = 0; Index < NumberOfClients; ++Index) {
+		if (!NT_SUCCESS(SharedData->ClientStatus[Index])) {
+			LoadpAppendReport(
+				Report, ARRAYSIZE(Report),
+				L"Client %lu failed to start: %s\r\n",
+				Index,
+				NtStatusAsString(SharedData->ClientStatus[Index]));
+		}
+	}
+
+	InfoBoxF(L"%s", Report);
+}
+
+//
+// Entry point of "SrvSend.exe /load". Arguments are the switches which
+// follow /load.
+//
+VOID LoadGeneratorMain(
+	IN	PCWSTR	Arguments)
+{
+	NTSTATUS Status;
+	OBJECT_ATTRIBUTES ObjectAttributes;
+	HANDLE SectionHandle;
+	HANDLE StartEventHandle;
+	HANDLE ProcessHandles[LOAD_MAXIMUM_NUMBER_OF_CLIENTS];
+	PLOAD_SHARED_DATA SharedData;
+	LONGLONG MaximumSize;
+	SIZE_T ViewSize;
+	ULONG NumberOfClients;
+	ULONG Index;
+
+	SectionHandle = NULL;
+	StartEventHandle = NULL;
+	SharedData = NULL;
+	NumberOfClients = 0;
+
+	ASSERT (ARRAYSIZE(ProcessHandles) <= MAXIMUM_WAIT_OBJECTS);
+
+	//
+	// The shared section and start event are inherited by the children.
+	//
+
+	InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_INHERIT, NULL, NULL);
+	MaximumSize = sizeof(LOAD_SHARED_DATA);
+
+	Status = NtCreateSection(
+		&SectionHandle,
+		SECTION_MAP_READ | SECTION_MAP_WRITE | SECTION_QUERY,
+		&ObjectAttributes,
+		&MaximumSize,
+		PAGE_READWRITE,
+		SEC_COMMIT,
+		NULL);
+
+	if (!NT_SUCCESS(Status)) {
+		ErrorBoxF(L"Failed to create the shared section: %s", NtStatusAsString(Status));
+		goto Exit;
+	}
+
+	Status = NtCreateEvent(
+		&StartEventHandle,
+		EVENT_MODIFY_STATE | SYNCHRONIZE,
+		&ObjectAttributes,
+		NotificationEvent,
+		FALSE);
+
+	if (!NT_SUCCESS(Status)) {
+		ErrorBoxF(L"Failed to create the start event: %s", NtStatusAsString(Status));
+		goto Exit;
+	}
+
+	ViewSize = sizeof(LOAD_SHARED_DATA);
+
+	Status = NtMapViewOfSection(
+		SectionHandle,
+		NtCurrentProcess(),
+		(PPVOID) &SharedData,
+		0,
+		0,
+		NULL,
+		&ViewSize,
+		ViewUnmap,
+		0,
+		PAGE_READWRITE);
+
+	if (!NT_SUCCESS(Status)) {
+		ErrorBoxF(L"Failed to map the shared section: %s", NtStatusAsString(Status));
+		goto Exit;
+	}
+
+	Status = LoadParseCommandLine(Arguments, &SharedData->Configuration);
+
+	if (!NT_SUCCESS(Status)) {
+		ErrorBoxF(
+			L"Invalid load generator command line.\r\n\r\n"
+			L"Usage: SrvSend /load [/clients:N] [/threads:N] [/rate:N] [/count:N] "
+			L"[/mix:logevent=W,batch=W,harderror=W] [/text:N] [/batch:N]\r\n\r\n"
+			L"Measures raw pipe latency: messages are written straight to the KexSrv pipe, "
+			L"not through the log ring and batching that KexDll uses.\r\n\r\n"
+			L"/clients and /threads may be at most %d. /rate is per thread; 0 sends as fast as possible. "
+			L"KexIpcKexProcessStart is always sent once by each client and cannot be part of the mix.",
+			LOAD_MAXIMUM_NUMBER_OF_CLIENTS);
+		goto Exit;
+	}
+
+	//
+	// Start the clients and wait until all of them have connected.
+	//
+
+	for (Index = 0; Index < SharedData->Configuration.NumberOfClients; ++Index) {
+		Status = LoadpStartClient(Index, SectionHandle, StartEventHandle, &ProcessHandles[Index]);
+
+		if (!NT_SUCCESS(Status)) {
+			ErrorBoxF(L"Failed to start client %lu: %s", Index, NtStatusAsString(Status));
+			break;
+		}
+
+		++NumberOfClients;
+	}
+
+	while ((ULONG) SharedData->NumberOfReadyClients < NumberOfClients) {
+		LARGE_INTEGER Interval;
+
+		// A client which crashed before it became ready would hang us.
+		if (WaitForMultipleObjects(NumberOfClients, ProcessHandles, FALSE, 0) != WAIT_TIMEOUT) {
+			ErrorBoxF(L"A client exited before the test started.");
+			break;
+		}
+
+		Interval.QuadPart = -10 * 10000;
+		NtDelayExecution(FALSE, &Interval);
+	}
+
+	NtSetEvent(StartEventHandle, NULL);
+
+	if (NumberOfClients != 0) {
+		NtWaitForMultipleObjects(NumberOfClients, ProcessHandles, WaitAllObject, FALSE, NULL);
+		LoadpDisplayReport(SharedData, NumberOfClients);
+	}
+
+Exit:
+	for (Index = 0; Index < NumberOfClients; ++Index) {
+		NtClose(ProcessHandles[Index]);
+	}
+
+	if (SharedData) {
+		NtUnmapViewOfSection(NtCurrentProcess(), SharedData);
+	}
+
+	SafeClose(StartEventHandle);
+	SafeClose(SectionHandle);
+}
\ No newline at end of file
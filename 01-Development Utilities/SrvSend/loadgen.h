@@ -0,0 +1,178 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     loadgen.h
+//
+// Abstract:
+//
+//     Definitions for the SrvSend load generator, which simulates many
+//     clients sending a mix of messages to KexSrv and measures how long the
+//     server takes to accept them.
+//
+//     The load generator is split in two parts. loadcore.c contains the
+//     command line parser, message generation, pacing and latency
+//     histograms, and does not call any system functions - everything it
+//     needs from the outside goes through a LOAD_TRANSPORT. loadgen.c
+//     contains the Win32 driver which starts the client processes and
+//     provides the named pipe transport.
+//
+// Environment:
+//
+//     Any.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+//
+// KexSrv keys its clients by process ID, so every simulated client is a
+// separate process. A client process sends from several threads through a
+// single pipe handle, like a real VxKex process does.
+//
+
+#define LOAD_MAXIMUM_NUMBER_OF_CLIENTS			64
+#define LOAD_MAXIMUM_NUMBER_OF_THREADS			64
+#define LOAD_MAXIMUM_TEXT_LENGTH				4096
+#define LOAD_MAXIMUM_EVENTS_PER_BATCH			64
+
+//
+// Latencies are recorded in microseconds, into a histogram with
+// logarithmically spaced buckets. Values below LOAD_HISTOGRAM_SUB_BUCKETS
+// are exact. Above that, each power of two is split into half as many
+// buckets, so that a recorded value is never off by more than 1/32.
+//
+
+#define LOAD_HISTOGRAM_SUB_BUCKET_BITS			6
+#define LOAD_HISTOGRAM_SUB_BUCKETS				(1 << LOAD_HISTOGRAM_SUB_BUCKET_BITS)
+#define LOAD_HISTOGRAM_HALF_SUB_BUCKETS			(LOAD_HISTOGRAM_SUB_BUCKETS / 2)
+#define LOAD_HISTOGRAM_NUMBER_OF_BUCKETS \
+	(LOAD_HISTOGRAM_SUB_BUCKETS + ((32 - LOAD_HISTOGRAM_SUB_BUCKET_BITS) * LOAD_HISTOGRAM_HALF_SUB_BUCKETS))
+
+typedef struct _LOAD_CONFIGURATION {
+	ULONG		NumberOfClients;
+	ULONG		NumberOfThreads;		// per client
+
+	// Target rate of each thread. Zero means to send as fast as possible.
+	ULONG		MessagesPerSecond;
+	ULONG		MessagesPerThread;
+
+	// Relative frequency of each message ID. KexIpcKexProcessStart is sent
+	// exactly once by each client before the test starts (the server
+	// disconnects clients which send it twice), so its weight must be zero.
+	ULONG		Weight[KexIpcMaximumMessageId];
+
+	ULONG		TextLength;				// in characters
+	ULONG		EventsPerBatch;
+} TYPEDEF_TYPE_NAME(LOAD_CONFIGURATION);
+
+typedef struct _LOAD_HISTOGRAM {
+	ULONGLONG	Count;
+	ULONGLONG	Sum;
+	ULONG		Minimum;
+	ULONG		Maximum;
+	ULONG		Buckets[LOAD_HISTOGRAM_NUMBER_OF_BUCKETS];
+} TYPEDEF_TYPE_NAME(LOAD_HISTOGRAM);
+
+typedef struct _LOAD_RESULT {
+	ULONGLONG		StartTime;
+	ULONGLONG		EndTime;
+	ULONG			NumberOfErrors;
+	NTSTATUS		LastErrorStatus;
+	LOAD_HISTOGRAM	Latency[KexIpcMaximumMessageId];
+} TYPEDEF_TYPE_NAME(LOAD_RESULT);
+
+//
+// SendMessage must not return until the server has accepted the message.
+// Times are in microseconds, and must come from a clock which is shared
+// between all threads and clients.
+//
+typedef struct _LOAD_TRANSPORT {
+	PVOID		Context;
+
+	NTSTATUS	(*SendMessage) (
+		IN	PVOID				Context,
+		IN	PCKEX_IPC_MESSAGE	Message,
+		IN	ULONG				MessageSize);
+
+	ULONGLONG	(*QueryTime) (
+		IN	PVOID				Context);
+
+	VOID		(*WaitUntil) (
+		IN	PVOID				Context,
+		IN	ULONGLONG			Time);
+} TYPEDEF_TYPE_NAME(LOAD_TRANSPORT);
+
+//
+// loadcore.c
+//
+
+PCWSTR LoadSkipSpaces(
+	IN	PCWSTR	String);
+
+BOOLEAN LoadMatchSwitch(
+	IN OUT	PPCWSTR	Cursor,
+	IN		PCWSTR	SwitchName);
+
+BOOLEAN LoadParseUlong(
+	IN OUT	PPCWSTR	Cursor,
+	OUT		PULONG	Value);
+
+VOID LoadDefaultConfiguration(
+	OUT	PLOAD_CONFIGURATION	Configuration);
+
+NTSTATUS LoadParseCommandLine(
+	IN	PCWSTR				CommandLine,
+	OUT	PLOAD_CONFIGURATION	Configuration);
+
+ULONG LoadRandom(
+	IN OUT	PULONG	Seed);
+
+KEX_IPC_MESSAGE_ID LoadChooseMessageId(
+	IN		PCLOAD_CONFIGURATION	Configuration,
+	IN OUT	PULONG					Seed);
+
+ULONG LoadBuildMessage(
+	IN		PCLOAD_CONFIGURATION	Configuration,
+	IN		KEX_IPC_MESSAGE_ID		MessageId,
+	IN OUT	PULONG					Seed,
+	OUT		PKEX_IPC_MESSAGE		Message);
+
+VOID LoadInitializeResult(
+	OUT	PLOAD_RESULT	Result);
+
+VOID LoadRecordLatency(
+	IN OUT	PLOAD_HISTOGRAM	Histogram,
+	IN		ULONGLONG		Latency);
+
+ULONG LoadQueryPercentile(
+	IN	PCLOAD_HISTOGRAM	Histogram,
+	IN	ULONG				PartsPer10000);
+
+VOID LoadMergeResult(
+	IN OUT	PLOAD_RESULT	Destination,
+	IN		PCLOAD_RESULT	Source);
+
+NTSTATUS LoadSendTimedMessage(
+	IN		PCLOAD_TRANSPORT	Transport,
+	IN		PCKEX_IPC_MESSAGE	Message,
+	IN		ULONG				MessageSize,
+	IN		ULONGLONG			ScheduledTime,
+	IN OUT	PLOAD_RESULT		Result);
+
+VOID LoadRunThread(
+	IN		PCLOAD_CONFIGURATION	Configuration,
+	IN		PCLOAD_TRANSPORT		Transport,
+	IN		ULONG					Seed,
+	IN		PKEX_IPC_MESSAGE		MessageBuffer,
+	IN OUT	PLOAD_RESULT			Result);
+
+//
+// loadgen.c
+//
+
+VOID LoadClientMain(
+	IN	PCWSTR	Arguments);
+
+VOID LoadGeneratorMain(
+	IN	PCWSTR	Arguments);
\ No newline at end of file
@@ -27,6 +27,7 @@
 #include <KexSrv.h>
 #include <KexDll.h>
 #include "resource.h"
+#include "loadgen.h"
 
 HANDLE ChannelHandle = NULL;
 
@@ -34,6 +35,7 @@ PCWSTR MessageIdToTextLookup[] = {
 	L"KexIpcKexProcessStart",
 	L"KexIpcHardError",
 	L"KexIpcLogEvent",
+	L"KexIpcLogEventBatch",
 };
 
 VOID AddMessageIdsToComboBox(
@@ -96,6 +98,7 @@ VOID SetScene(
 		VisibleEndId = IDC_STRPARAM2;
 		break;
 	case KexIpcLogEvent:
+	case KexIpcLogEventBatch:
 		VisibleStartId = IDC_SEVERITY_DESC;
 		VisibleEndId = IDC_LOGTEXT;
 		break;
@@ -281,6 +284,56 @@ VOID SrvSendDispatchMessage(
 				Message->LogEventInformation.TextLength + 1);
 		}
 
+		break;
+	case KexIpcLogEventBatch:
+		{
+			PKEX_IPC_LOG_EVENT_BATCH_ENTRY Entry;
+			PKEX_IPC_MESSAGE_DATA_LOG_EVENT LogEventInfo;
+			PWSTR Data;
+			HWND SourceComponentWindow;
+			HWND SourceFileWindow;
+			HWND SourceFunctionWindow;
+			HWND TextWindow;
+
+			//
+			// Send a batch which contains a single log event, built from the
+			// same fields as KexIpcLogEvent.
+			//
+
+			SourceComponentWindow = GetDlgItem(MainWindow, IDC_SOURCECOMPONENT);
+			SourceFileWindow = GetDlgItem(MainWindow, IDC_SOURCEFILE);
+			SourceFunctionWindow = GetDlgItem(MainWindow, IDC_SOURCEFUNCTION);
+			TextWindow = GetDlgItem(MainWindow, IDC_LOGTEXT);
+
+			Entry = (PKEX_IPC_LOG_EVENT_BATCH_ENTRY) Message->AuxiliaryDataBlock;
+			LogEventInfo = &Entry->LogEventInformation;
+			Message->LogEventBatchInformation.NumberOfEvents = 1;
+
+			LogEventInfo->Severity = ComboBox_GetCurSel(GetDlgItem(MainWindow, IDC_SEVERITY));
+			LogEventInfo->SourceLine = GetDlgItemInt(MainWindow, IDC_SOURCELINE, NULL, TRUE);
+			LogEventInfo->SourceComponentLength = GetWindowTextLength(SourceComponentWindow);
+			LogEventInfo->SourceFileLength = GetWindowTextLength(SourceFileWindow);
+			LogEventInfo->SourceFunctionLength = GetWindowTextLength(SourceFunctionWindow);
+			LogEventInfo->TextLength = GetWindowTextLength(TextWindow);
+
+			ASSERT (sizeof(KEX_IPC_MESSAGE) +
+					KEX_IPC_LOG_EVENT_BATCH_ENTRY_SIZE(
+						LogEventInfo->SourceComponentLength +
+						LogEventInfo->SourceFileLength +
+						LogEventInfo->SourceFunctionLength +
+						LogEventInfo->TextLength)
+					<= 0xFFFF);
+
+			Data = Entry->Data;
+			GetWindowText(SourceComponentWindow, Data, LogEventInfo->SourceComponentLength + 1);
+			Data += LogEventInfo->SourceComponentLength;
+			GetWindowText(SourceFileWindow, Data, LogEventInfo->SourceFileLength + 1);
+			Data += LogEventInfo->SourceFileLength;
+			GetWindowText(SourceFunctionWindow, Data, LogEventInfo->SourceFunctionLength + 1);
+			Data += LogEventInfo->SourceFunctionLength;
+			GetWindowText(TextWindow, Data, LogEventInfo->TextLength + 1);
+		}
+
 		break;
 	default:
 		NOT_REACHED;
@@ -370,8 +423,28 @@ INT_PTR CALLBACK DlgProc(
 VOID EntryPoint(
 	VOID)
 {
-	InitCommonControls();
+	PCWSTR CommandLine;
+
 	KexgApplicationFriendlyName = L"KexSrv Test Utility";
+	CommandLine = GetCommandLineWithoutImageName();
+
+	//
+	// "/load" runs the load generator instead of showing the dialog, and
+	// "/loadclient" is used by the load generator to start its clients.
+	// See loadgen.c.
+	//
+
+	if (LoadMatchSwitch(&CommandLine, L"/loadclient ")) {
+		LoadClientMain(CommandLine);
+		ExitProcess(0);
+	}
+
+	if (LoadMatchSwitch(&CommandLine, L"/load") && (*CommandLine == '\0' || *CommandLine == ' ')) {
+		LoadGeneratorMain(CommandLine);
+		ExitProcess(0);
+	}
+
+	InitCommonControls();
 	DialogBox(NULL, MAKEINTRESOURCE(IDD_DIALOG1), NULL, DlgProc);
 	ExitProcess(0);
 }
\ No newline at end of file
@@ -0,0 +1,5 @@
+#pragma once
+
+#define KEXAPI
+#define KEX_COMPONENT L"ImgRewrtTest"
+#define KEX_TARGET_TYPE_EXE
\ No newline at end of file
@@ -0,0 +1,421 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     kexdllp.h
+//
+// Abstract:
+//
+//     Stand-in for KexDll's private header, used when KexDll\imgrewrt.c is
+//     compiled on a non-Windows system for testing. Only the types, macros,
+//     status codes and runtime functions which imgrewrt.c uses are defined
+//     here. The PE structures match the ones in winnt.h.
+//
+//     The Makefile copies imgrewrt.c into the build directory before
+//     compiling it, so that its #include "kexdllp.h" finds this file rather
+//     than the real one next to it.
+//
+// Environment:
+//
+//     Any system with a C11 compiler.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define IN
+#define OUT
+#define OPTIONAL
+#define CONST const
+#define VOID void
+#define TRUE 1
+#define FALSE 0
+#define NTAPI
+#define __cdecl
+#define __inline inline
+#define __declspec(x)
+
+typedef unsigned char BYTE, *PBYTE, BOOLEAN, *PBOOLEAN;
+typedef char CHAR, *PCHAR;
+typedef unsigned short USHORT, *PUSHORT;
+typedef unsigned int ULONG, *PULONG;
+typedef int LONG, *PLONG, NTSTATUS, HRESULT;
+typedef unsigned long long ULONGLONG, *PULONGLONG;
+typedef uintptr_t ULONG_PTR;
+typedef size_t SIZE_T, *PSIZE_T;
+typedef unsigned short WCHAR;
+typedef char *PSTR;
+typedef const char *PCSTR;
+typedef WCHAR *PWSTR;
+typedef const WCHAR *PCWSTR;
+
+#include <KexTypes.h>
+
+#define ARRAYSIZE(Array) (sizeof(Array) / sizeof((Array)[0]))
+#define FIELD_OFFSET(Type, Field) ((LONG) offsetof(Type, Field))
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#define KexRtlCopyMemory(Destination, Source, Length) memmove((Destination), (Source), (Length))
+
+#define ASSERT(Condition) do { if (!(Condition)) { \
+	fprintf(stderr, "Assertion failure: %s (%s:%d in %s)\n", #Condition, __FILE__, __LINE__, __func__); \
+	abort(); } } while (0)
+
+#define until(Condition) while (!(Condition))
+#define unless(Condition) if (!(Condition))
+
+#define NT_SUCCESS(Status) (((NTSTATUS) (Status)) >= 0)
+#define FAILED(Result) (((HRESULT) (Result)) < 0)
+
+#define STATUS_SUCCESS						((NTSTATUS) 0x00000000L)
+#define STATUS_INVALID_PARAMETER			((NTSTATUS) 0xC000000DL)
+#define STATUS_INVALID_PARAMETER_3			((NTSTATUS) 0xC00000F1L)
+#define STATUS_BUFFER_TOO_SMALL				((NTSTATUS) 0xC0000023L)
+#define STATUS_INVALID_IMAGE_FORMAT			((NTSTATUS) 0xC000007BL)
+#define STATUS_IMAGE_NO_IMPORT_DIRECTORY	((NTSTATUS) 0xE0000000L)
+
+#define S_OK								((HRESULT) 0x00000000L)
+#define STRSAFE_E_INVALID_PARAMETER			((HRESULT) 0x80070057L)
+
+//
+// Nothing in imgrewrt.c is supposed to fault, so there is no stand-in for
+// SEH. If it does fault, the test crashes, which is what we want.
+//
+
+#define PROTECTED_FUNCTION
+#define PROTECTED_FUNCTION_END_NOLOG
+
+#define KEX_LDR_IMAGE_MAPPED			1
+
+#pragma region PE structures
+
+#define IMAGE_DOS_SIGNATURE					0x5A4D
+#define IMAGE_NT_SIGNATURE					0x00004550
+#define IMAGE_NT_OPTIONAL_HDR32_MAGIC		0x10B
+#define IMAGE_NT_OPTIONAL_HDR64_MAGIC		0x20B
+#define IMAGE_NUMBEROF_DIRECTORY_ENTRIES	16
+#define IMAGE_SIZEOF_SHORT_NAME				8
+
+#define IMAGE_DIRECTORY_ENTRY_IMPORT		1
+#define IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT	11
+#define IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT	13
+
+#pragma pack(push, 4)
+
+typedef struct _IMAGE_DOS_HEADER {
+	USHORT	e_magic;
+	USHORT	e_cblp;
+	USHORT	e_cp;
+	USHORT	e_crlc;
+	USHORT	e_cparhdr;
+	USHORT	e_minalloc;
+	USHORT	e_maxalloc;
+	USHORT	e_ss;
+	USHORT	e_sp;
+	USHORT	e_csum;
+	USHORT	e_ip;
+	USHORT	e_cs;
+	USHORT	e_lfarlc;
+	USHORT	e_ovno;
+	USHORT	e_res[4];
+	USHORT	e_oemid;
+	USHORT	e_oeminfo;
+	USHORT	e_res2[10];
+	LONG	e_lfanew;
+} TYPEDEF_TYPE_NAME(IMAGE_DOS_HEADER);
+
+typedef struct _IMAGE_FILE_HEADER {
+	USHORT	Machine;
+	USHORT	NumberOfSections;
+	ULONG	TimeDateStamp;
+	ULONG	PointerToSymbolTable;
+	ULONG	NumberOfSymbols;
+	USHORT	SizeOfOptionalHeader;
+	USHORT	Characteristics;
+} TYPEDEF_TYPE_NAME(IMAGE_FILE_HEADER);
+
+typedef struct _IMAGE_DATA_DIRECTORY {
+	ULONG	VirtualAddress;
+	ULONG	Size;
+} TYPEDEF_TYPE_NAME(IMAGE_DATA_DIRECTORY);
+
+typedef struct _IMAGE_OPTIONAL_HEADER32 {
+	USHORT					Magic;
+	BYTE					MajorLinkerVersion;
+	BYTE					MinorLinkerVersion;
+	ULONG					SizeOfCode;
+	ULONG					SizeOfInitializedData;
+	ULONG					SizeOfUninitializedData;
+	ULONG					AddressOfEntryPoint;
+	ULONG					BaseOfCode;
+	ULONG					BaseOfData;
+	ULONG					ImageBase;
+	ULONG					SectionAlignment;
+	ULONG					FileAlignment;
+	USHORT					MajorOperatingSystemVersion;
+	USHORT					MinorOperatingSystemVersion;
+	USHORT					MajorImageVersion;
+	USHORT					MinorImageVersion;
+	USHORT					MajorSubsystemVersion;
+	USHORT					MinorSubsystemVersion;
+	ULONG					Win32VersionValue;
+	ULONG					SizeOfImage;
+	ULONG					SizeOfHeaders;
+	ULONG					CheckSum;
+	USHORT					Subsystem;
+	USHORT					DllCharacteristics;
+	ULONG					SizeOfStackReserve;
+	ULONG					SizeOfStackCommit;
+	ULONG					SizeOfHeapReserve;
+	ULONG					SizeOfHeapCommit;
+	ULONG					LoaderFlags;
+	ULONG					NumberOfRvaAndSizes;
+	IMAGE_DATA_DIRECTORY	DataDirectory[IMAGE_NUMBEROF_DIRECTORY_ENTRIES];
+} TYPEDEF_TYPE_NAME(IMAGE_OPTIONAL_HEADER32);
+
+typedef struct _IMAGE_OPTIONAL_HEADER64 {
+	USHORT					Magic;
+	BYTE					MajorLinkerVersion;
+	BYTE					MinorLinkerVersion;
+	ULONG					SizeOfCode;
+	ULONG					SizeOfInitializedData;
+	ULONG					SizeOfUninitializedData;
+	ULONG					AddressOfEntryPoint;
+	ULONG					BaseOfCode;
+	ULONGLONG				ImageBase;
+	ULONG					SectionAlignment;
+	ULONG					FileAlignment;
+	USHORT					MajorOperatingSystemVersion;
+	USHORT					MinorOperatingSystemVersion;
+	USHORT					MajorImageVersion;
+	USHORT					MinorImageVersion;
+	USHORT					MajorSubsystemVersion;
+	USHORT					MinorSubsystemVersion;
+	ULONG					Win32VersionValue;
+	ULONG					SizeOfImage;
+	ULONG					SizeOfHeaders;
+	ULONG					CheckSum;
+	USHORT					Subsystem;
+	USHORT					DllCharacteristics;
+	ULONGLONG				SizeOfStackReserve;
+	ULONGLONG				SizeOfStackCommit;
+	ULONGLONG				SizeOfHeapReserve;
+	ULONGLONG				SizeOfHeapCommit;
+	ULONG					LoaderFlags;
+	ULONG					NumberOfRvaAndSizes;
+	IMAGE_DATA_DIRECTORY	DataDirectory[IMAGE_NUMBEROF_DIRECTORY_ENTRIES];
+} TYPEDEF_TYPE_NAME(IMAGE_OPTIONAL_HEADER64);
+
+typedef struct _IMAGE_NT_HEADERS32 {
+	ULONG					Signature;
+	IMAGE_FILE_HEADER		FileHeader;
+	IMAGE_OPTIONAL_HEADER32	OptionalHeader;
+} TYPEDEF_TYPE_NAME(IMAGE_NT_HEADERS32);
+
+typedef struct _IMAGE_NT_HEADERS64 {
+	ULONG					Signature;
+	IMAGE_FILE_HEADER		FileHeader;
+	IMAGE_OPTIONAL_HEADER64	OptionalHeader;
+} TYPEDEF_TYPE_NAME(IMAGE_NT_HEADERS64);
+
+#if UINTPTR_MAX == 0xFFFFFFFFu
+typedef IMAGE_NT_HEADERS32 IMAGE_NT_HEADERS, *PIMAGE_NT_HEADERS;
+#else
+typedef IMAGE_NT_HEADERS64 IMAGE_NT_HEADERS, *PIMAGE_NT_HEADERS;
+#endif
+
+typedef struct _IMAGE_SECTION_HEADER {
+	BYTE	Name[IMAGE_SIZEOF_SHORT_NAME];
+
+	union {
+		ULONG	PhysicalAddress;
+		ULONG	VirtualSize;
+	} Misc;
+
+	ULONG	VirtualAddress;
+	ULONG	SizeOfRawData;
+	ULONG	PointerToRawData;
+	ULONG	PointerToRelocations;
+	ULONG	PointerToLinenumbers;
+	USHORT	NumberOfRelocations;
+	USHORT	NumberOfLinenumbers;
+	ULONG	Characteristics;
+} TYPEDEF_TYPE_NAME(IMAGE_SECTION_HEADER);
+
+#define IMAGE_FIRST_SECTION(NtHeaders) ((PIMAGE_SECTION_HEADER) \
+	((ULONG_PTR) (NtHeaders) + FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader) + \
+	 (NtHeaders)->FileHeader.SizeOfOptionalHeader))
+
+typedef struct _IMAGE_IMPORT_DESCRIPTOR {
+	union {
+		ULONG	Characteristics;
+		ULONG	OriginalFirstThunk;
+	};
+
+	ULONG	TimeDateStamp;
+	ULONG	ForwarderChain;
+	ULONG	Name;
+	ULONG	FirstThunk;
+} TYPEDEF_TYPE_NAME(IMAGE_IMPORT_DESCRIPTOR);
+
+typedef struct _IMAGE_BOUND_IMPORT_DESCRIPTOR {
+	ULONG	TimeDateStamp;
+	USHORT	OffsetModuleName;
+	USHORT	NumberOfModuleForwarderRefs;
+} TYPEDEF_TYPE_NAME(IMAGE_BOUND_IMPORT_DESCRIPTOR);
+
+typedef struct _IMAGE_BOUND_FORWARDER_REF {
+	ULONG	TimeDateStamp;
+	USHORT	OffsetModuleName;
+	USHORT	Reserved;
+} TYPEDEF_TYPE_NAME(IMAGE_BOUND_FORWARDER_REF);
+
+typedef struct _IMAGE_DELAYLOAD_DESCRIPTOR {
+	union {
+		ULONG AllAttributes;
+
+		struct {
+			ULONG RvaBased : 1;
+			ULONG ReservedAttributes : 31;
+		};
+	} Attributes;
+
+	ULONG DllNameRVA;
+	ULONG ModuleHandleRVA;
+	ULONG ImportAddressTableRVA;
+	ULONG ImportNameTableRVA;
+	ULONG BoundImportAddressTableRVA;
+	ULONG UnloadInformationTableRVA;
+	ULONG TimeDateStamp;
+} TYPEDEF_TYPE_NAME(IMAGE_DELAYLOAD_DESCRIPTOR);
+
+#pragma pack(pop)
+
+#pragma endregion
+
+#pragma region Run-time library
+
+typedef struct _ANSI_STRING {
+	USHORT	Length;
+	USHORT	MaximumLength;
+	PCHAR	Buffer;
+} TYPEDEF_TYPE_NAME(ANSI_STRING);
+
+STATIC INLINE VOID RtlInitEmptyAnsiString(
+	OUT	PANSI_STRING	String,
+	IN	PCHAR			Buffer,
+	IN	USHORT			BufferCb)
+{
+	String->Length = 0;
+	String->MaximumLength = BufferCb;
+	String->Buffer = Buffer;
+}
+
+STATIC INLINE HRESULT StringCchLengthA(
+	IN	PCSTR	String,
+	IN	SIZE_T	MaximumCch,
+	OUT	PSIZE_T	Cch)
+{
+	SIZE_T Index;
+
+	for (Index = 0; Index < MaximumCch; ++Index) {
+		if (String[Index] == '\0') {
+			*Cch = Index;
+			return S_OK;
+		}
+	}
+
+	*Cch = 0;
+	return STRSAFE_E_INVALID_PARAMETER;
+}
+
+//
+// Same checks as the real RtlImageNtHeaderEx makes when it is given a size:
+// the DOS header and the NT signature and file header must lie inside the
+// buffer, and both signatures must be correct.
+//
+STATIC INLINE NTSTATUS RtlImageNtHeaderEx(
+	IN	ULONG				Flags,
+	IN	PVOID				Base,
+	IN	ULONGLONG			Size,
+	OUT	PIMAGE_NT_HEADERS	*OutHeaders)
+{
+	PIMAGE_DOS_HEADER DosHeader;
+	PIMAGE_NT_HEADERS NtHeaders;
+
+	if (!Base || !OutHeaders || Flags != 0) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	*OutHeaders = NULL;
+
+	if (Size < sizeof(IMAGE_DOS_HEADER)) {
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	DosHeader = (PIMAGE_DOS_HEADER) Base;
+
+	if (DosHeader->e_magic != IMAGE_DOS_SIGNATURE || DosHeader->e_lfanew < 0) {
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	if ((ULONGLONG) DosHeader->e_lfanew >= Size ||
+		Size - DosHeader->e_lfanew < sizeof(ULONG) + sizeof(IMAGE_FILE_HEADER)) {
+
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	NtHeaders = (PIMAGE_NT_HEADERS) ((PBYTE) Base + DosHeader->e_lfanew);
+
+	if (NtHeaders->Signature != IMAGE_NT_SIGNATURE) {
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	*OutHeaders = NtHeaders;
+	return STATUS_SUCCESS;
+}
+
+#pragma endregion
+
+#pragma region KexLdr* definitions (from KexDll.h)
+
+typedef struct _KEX_LDR_IMPORT_REWRITE {
+	ULONG	NameRva;
+	CHAR	RewrittenName[60];
+} TYPEDEF_TYPE_NAME(KEX_LDR_IMPORT_REWRITE);
+
+typedef NTSTATUS (NTAPI *PKEX_LDR_IMPORT_REWRITE_ROUTINE) (
+	IN		PVOID			Context OPTIONAL,
+	IN		PCANSI_STRING	DllName,
+	IN OUT	PANSI_STRING	RewrittenDllName);
+
+NTSTATUS NTAPI KexLdrScanImageImports(
+	IN		PVOID							ImageBase,
+	IN		SIZE_T							ImageSize,
+	IN		ULONG							Flags,
+	IN		PKEX_LDR_IMPORT_REWRITE_ROUTINE	RewriteRoutine,
+	IN		PVOID							RewriteContext OPTIONAL,
+	OUT		PKEX_LDR_IMPORT_REWRITE			Rewrites OPTIONAL,
+	IN OUT	PULONG							NumberOfRewrites);
+
+NTSTATUS NTAPI KexLdrInvalidateBoundImports(
+	IN	PVOID						ImageBase,
+	IN	SIZE_T						ImageSize,
+	IN	ULONG						Flags,
+	IN	PCKEX_LDR_IMPORT_REWRITE	Rewrites,
+	IN	ULONG						NumberOfRewrites);
+
+NTSTATUS NTAPI KexLdrApplyImageImportRewrites(
+	IN	PVOID						ImageBase,
+	IN	SIZE_T						ImageSize,
+	IN	ULONG						Flags,
+	IN	PCKEX_LDR_IMPORT_REWRITE	Rewrites,
+	IN	ULONG						NumberOfRewrites);
+
+#pragma endregion
\ No newline at end of file
@@ -0,0 +1,813 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     test.c
+//
+// Abstract:
+//
+//     Tests and benchmark for the image import rewriting routines in
+//     KexDll\imgrewrt.c, which are what KexRwImp and the DLL rewrite code in
+//     KexDll use to find and rewrite imported DLL names.
+//
+//     With no arguments, a set of small synthetic images (PE32 and PE32+, in
+//     both file and mapped layout) is built in memory and checked, including
+//     malformed and truncated ones. Run "make check".
+//
+//     With arguments, each argument is the path of a PE file, which is
+//     scanned and rewritten in memory, and optionally timed. Every name
+//     starting with api-ms-win- or ext-ms-win- is rewritten, so that the
+//     whole rewrite path is exercised no matter how the DllRewrite registry
+//     key is set up. Run "make corpus CORPUS=<directory>".
+//
+// Environment:
+//
+//     Any system with a C11 compiler.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "buildcfg.h"
+#include "kexdllp.h"
+#include <ctype.h>
+#include <time.h>
+
+STATIC ULONG NumberOfFailures = 0;
+
+#define TEST_CHECK(Condition) do { \
+	if (!(Condition)) { \
+		printf("FAILED: %s (%s:%d)\n", #Condition, __FILE__, __LINE__); \
+		++NumberOfFailures; \
+	} } while (0)
+
+#define TEST_MAX_REWRITES 8
+
+//
+// Layout of the synthetic test image. Both the file and mapped layouts use
+// the same RVAs, and there is a single section which holds the import and
+// delay import directories and the DLL names they point to. The bound
+// import directory is in the headers, where linkers put it.
+//
+
+#define TEST_SIZE_OF_HEADERS		0x200
+#define TEST_SECTION_RVA			0x1000
+#define TEST_SECTION_SIZE			0x200
+#define TEST_FILE_SIZE				(TEST_SIZE_OF_HEADERS + TEST_SECTION_SIZE)
+#define TEST_MAPPED_SIZE			0x2000
+
+#define TEST_IMPORT_RVA				0x1000
+#define TEST_DELAY_IMPORT_RVA		0x1060
+#define TEST_BOUND_IMPORT_RVA		0x180
+#define TEST_BOUND_IMPORT_SIZE		0x60
+
+#define TEST_KERNEL32_RVA			0x1100
+#define TEST_SYNCH_RVA				0x1110
+#define TEST_USER32_RVA				0x1140
+#define TEST_PATH_RVA				0x1150
+#define TEST_VA_BASED_RVA			0x1170
+
+#define TEST_BOUND_KERNEL32_OFFSET	32
+#define TEST_BOUND_USER32_OFFSET	45
+#define TEST_BOUND_SYNCH_OFFSET		56
+
+#define TEST_SYNCH_NAME				"api-ms-win-core-synch-l1-2-0.dll"
+#define TEST_PATH_NAME				"api-ms-win-core-path-l1-1-0.dll"
+
+STATIC BYTE ImageBuffer[TEST_MAPPED_SIZE];
+
+typedef struct _TEST_REWRITE_CONTEXT {
+	ULONG	NumberOfCalls;
+} TYPEDEF_TYPE_NAME(TEST_REWRITE_CONTEXT);
+
+STATIC CONST struct {
+	PCSTR	DllName;
+	PCSTR	RewrittenDllName;
+} TestRewriteTable[] = {
+	{TEST_SYNCH_NAME,	"kernelbase.dll"},
+	{TEST_PATH_NAME,	"kxbase.dll"},
+
+	// Longer than the original, so it must be ignored.
+	{"user32.dll",		"user32-but-far-too-long.dll"},
+};
+
+STATIC NTSTATUS NTAPI TestRewriteDllName(
+	IN		PVOID			Context OPTIONAL,
+	IN		PCANSI_STRING	DllName,
+	IN OUT	PANSI_STRING	RewrittenDllName)
+{
+	ULONG Index;
+
+	if (Context) {
+		((PTEST_REWRITE_CONTEXT) Context)->NumberOfCalls += 1;
+	}
+
+	for (Index = 0; Index < ARRAYSIZE(TestRewriteTable); ++Index) {
+		SIZE_T Length;
+
+		if (strlen(TestRewriteTable[Index].DllName) != DllName->Length ||
+			memcmp(TestRewriteTable[Index].DllName, DllName->Buffer, DllName->Length) != 0) {
+
+			continue;
+		}
+
+		Length = strlen(TestRewriteTable[Index].RewrittenDllName);
+		ASSERT (Length < RewrittenDllName->MaximumLength);
+
+		memcpy(RewrittenDllName->Buffer, TestRewriteTable[Index].RewrittenDllName, Length);
+		RewrittenDllName->Length = (USHORT) Length;
+		return STATUS_SUCCESS;
+	}
+
+	return STATUS_INVALID_PARAMETER;
+}
+
+STATIC ULONG TestRvaToOffset(
+	IN	ULONG	Rva,
+	IN	ULONG	Flags)
+{
+	if ((Flags & KEX_LDR_IMAGE_MAPPED) || Rva < TEST_SIZE_OF_HEADERS) {
+		return Rva;
+	}
+
+	return Rva - TEST_SECTION_RVA + TEST_SIZE_OF_HEADERS;
+}
+
+STATIC PVOID TestRvaToPointer(
+	IN	PBYTE	Image,
+	IN	ULONG	Rva,
+	IN	ULONG	Flags)
+{
+	return Image + TestRvaToOffset(Rva, Flags);
+}
+
+STATIC VOID TestPutString(
+	IN	PBYTE	Image,
+	IN	ULONG	Rva,
+	IN	ULONG	Flags,
+	IN	PCSTR	String)
+{
+	memcpy(TestRvaToPointer(Image, Rva, Flags), String, strlen(String) + 1);
+}
+
+//
+// Build the synthetic image into ImageBuffer and return its size.
+//
+STATIC SIZE_T TestBuildImage(
+	IN	BOOLEAN	Is64Bit,
+	IN	ULONG	Flags)
+{
+	PIMAGE_DOS_HEADER DosHeader;
+	PIMAGE_FILE_HEADER FileHeader;
+	PIMAGE_DATA_DIRECTORY DataDirectory;
+	PIMAGE_SECTION_HEADER SectionHeader;
+	PIMAGE_IMPORT_DESCRIPTOR ImportDescriptor;
+	PIMAGE_DELAYLOAD_DESCRIPTOR DelayImportDescriptor;
+	PIMAGE_BOUND_IMPORT_DESCRIPTOR BoundImportDescriptor;
+	PIMAGE_BOUND_FORWARDER_REF ForwarderRef;
+	PBYTE BoundImport;
+
+	memset(ImageBuffer, 0, sizeof(ImageBuffer));
+
+	DosHeader = (PIMAGE_DOS_HEADER) ImageBuffer;
+	DosHeader->e_magic = IMAGE_DOS_SIGNATURE;
+	DosHeader->e_lfanew = 0x40;
+
+	*(PULONG) (ImageBuffer + DosHeader->e_lfanew) = IMAGE_NT_SIGNATURE;
+	FileHeader = (PIMAGE_FILE_HEADER) (ImageBuffer + DosHeader->e_lfanew + sizeof(ULONG));
+	FileHeader->NumberOfSections = 1;
+
+	if (Is64Bit) {
+		PIMAGE_OPTIONAL_HEADER64 OptionalHeader;
+
+		OptionalHeader = (PIMAGE_OPTIONAL_HEADER64) (FileHeader + 1);
+		FileHeader->Machine = 0x8664;
+		FileHeader->SizeOfOptionalHeader = sizeof(*OptionalHeader);
+		OptionalHeader->Magic = IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+		OptionalHeader->SizeOfHeaders = TEST_SIZE_OF_HEADERS;
+		OptionalHeader->SizeOfImage = TEST_MAPPED_SIZE;
+		OptionalHeader->NumberOfRvaAndSizes = IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
+		DataDirectory = OptionalHeader->DataDirectory;
+		SectionHeader = (PIMAGE_SECTION_HEADER) (OptionalHeader + 1);
+	} else {
+		PIMAGE_OPTIONAL_HEADER32 OptionalHeader;
+
+		OptionalHeader = (PIMAGE_OPTIONAL_HEADER32) (FileHeader + 1);
+		FileHeader->Machine = 0x014C;
+		FileHeader->SizeOfOptionalHeader = sizeof(*OptionalHeader);
+		OptionalHeader->Magic = IMAGE_NT_OPTIONAL_HDR32_MAGIC;
+		OptionalHeader->SizeOfHeaders = TEST_SIZE_OF_HEADERS;
+		OptionalHeader->SizeOfImage = TEST_MAPPED_SIZE;
+		OptionalHeader->NumberOfRvaAndSizes = IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
+		DataDirectory = OptionalHeader->DataDirectory;
+		SectionHeader = (PIMAGE_SECTION_HEADER) (OptionalHeader + 1);
+	}
+
+	ASSERT ((PBYTE) (SectionHeader + 1) <= ImageBuffer + TEST_BOUND_IMPORT_RVA);
+
+	memcpy(SectionHeader->Name, ".idata", 6);
+	SectionHeader->Misc.VirtualSize = TEST_SECTION_SIZE;
+	SectionHeader->VirtualAddress = TEST_SECTION_RVA;
+	SectionHeader->SizeOfRawData = TEST_SECTION_SIZE;
+	SectionHeader->PointerToRawData = TEST_SIZE_OF_HEADERS;
+
+	//
+	// Import directory.
+	//
+
+	DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].VirtualAddress = TEST_IMPORT_RVA;
+	DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].Size = 4 * sizeof(IMAGE_IMPORT_DESCRIPTOR);
+
+	ImportDescriptor = (PIMAGE_IMPORT_DESCRIPTOR) TestRvaToPointer(ImageBuffer, TEST_IMPORT_RVA, Flags);
+	ImportDescriptor[0].Name = TEST_KERNEL32_RVA;
+	ImportDescriptor[1].Name = TEST_SYNCH_RVA;
+	ImportDescriptor[2].Name = TEST_USER32_RVA;
+
+	//
+	// Delay import directory. The second descriptor uses VAs, so it must be
+	// skipped even though its name would otherwise be rewritten.
+	//
+
+	DataDirectory[IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT].VirtualAddress = TEST_DELAY_IMPORT_RVA;
+	DataDirectory[IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT].Size = 3 * sizeof(IMAGE_DELAYLOAD_DESCRIPTOR);
+
+	DelayImportDescriptor = (PIMAGE_DELAYLOAD_DESCRIPTOR) TestRvaToPointer(ImageBuffer, TEST_DELAY_IMPORT_RVA, Flags);
+	DelayImportDescriptor[0].Attributes.RvaBased = 1;
+	DelayImportDescriptor[0].DllNameRVA = TEST_PATH_RVA;
+	DelayImportDescriptor[1].Attributes.RvaBased = 0;
+	DelayImportDescriptor[1].DllNameRVA = TEST_VA_BASED_RVA;
+
+	TestPutString(ImageBuffer, TEST_KERNEL32_RVA, Flags, "kernel32.dll");
+	TestPutString(ImageBuffer, TEST_SYNCH_RVA, Flags, TEST_SYNCH_NAME);
+	TestPutString(ImageBuffer, TEST_USER32_RVA, Flags, "user32.dll");
+	TestPutString(ImageBuffer, TEST_PATH_RVA, Flags, TEST_PATH_NAME);
+	TestPutString(ImageBuffer, TEST_VA_BASED_RVA, Flags, TEST_SYNCH_NAME);
+
+	//
+	// Bound import directory: kernel32.dll, and user32.dll which forwards
+	// to the API set which gets rewritten.
+	//
+
+	DataDirectory[IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT].VirtualAddress = TEST_BOUND_IMPORT_RVA;
+	DataDirectory[IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT].Size = TEST_BOUND_IMPORT_SIZE;
+
+	BoundImport = (PBYTE) TestRvaToPointer(ImageBuffer, TEST_BOUND_IMPORT_RVA, Flags);
+
+	BoundImportDescriptor = (PIMAGE_BOUND_IMPORT_DESCRIPTOR) BoundImport;
+	BoundImportDescriptor[0].TimeDateStamp = 0x1111;
+	BoundImportDescriptor[0].OffsetModuleName = TEST_BOUND_KERNEL32_OFFSET;
+	BoundImportDescriptor[1].TimeDateStamp = 0x2222;
+	BoundImportDescriptor[1].OffsetModuleName = TEST_BOUND_USER32_OFFSET;
+	BoundImportDescriptor[1].NumberOfModuleForwarderRefs = 1;
+
+	ForwarderRef = (PIMAGE_BOUND_FORWARDER_REF) &BoundImportDescriptor[2];
+	ForwarderRef->TimeDateStamp = 0x3333;
+	ForwarderRef->OffsetModuleName = TEST_BOUND_SYNCH_OFFSET;
+
+	TestPutString(ImageBuffer, TEST_BOUND_IMPORT_RVA + TEST_BOUND_KERNEL32_OFFSET, Flags, "kernel32.dll");
+	TestPutString(ImageBuffer, TEST_BOUND_IMPORT_RVA + TEST_BOUND_USER32_OFFSET, Flags, "user32.dll");
+	TestPutString(ImageBuffer, TEST_BOUND_IMPORT_RVA + TEST_BOUND_SYNCH_OFFSET, Flags, TEST_SYNCH_NAME);
+
+	return (Flags & KEX_LDR_IMAGE_MAPPED) ? TEST_MAPPED_SIZE : TEST_FILE_SIZE;
+}
+
+STATIC PIMAGE_DATA_DIRECTORY TestImageDirectory(
+	IN	ULONG	DirectoryEntry)
+{
+	PIMAGE_DOS_HEADER DosHeader;
+	PIMAGE_NT_HEADERS32 NtHeaders32;
+
+	DosHeader = (PIMAGE_DOS_HEADER) ImageBuffer;
+	NtHeaders32 = (PIMAGE_NT_HEADERS32) (ImageBuffer + DosHeader->e_lfanew);
+
+	if (NtHeaders32->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC) {
+		return &((PIMAGE_NT_HEADERS64) NtHeaders32)->OptionalHeader.DataDirectory[DirectoryEntry];
+	} else {
+		return &NtHeaders32->OptionalHeader.DataDirectory[DirectoryEntry];
+	}
+}
+
+STATIC PULONG TestNumberOfRvaAndSizes(
+	VOID)
+{
+	PIMAGE_DOS_HEADER DosHeader;
+	PIMAGE_NT_HEADERS32 NtHeaders32;
+
+	DosHeader = (PIMAGE_DOS_HEADER) ImageBuffer;
+	NtHeaders32 = (PIMAGE_NT_HEADERS32) (ImageBuffer + DosHeader->e_lfanew);
+
+	if (NtHeaders32->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC) {
+		return &((PIMAGE_NT_HEADERS64) NtHeaders32)->OptionalHeader.NumberOfRvaAndSizes;
+	} else {
+		return &NtHeaders32->OptionalHeader.NumberOfRvaAndSizes;
+	}
+}
+
+STATIC NTSTATUS TestScan(
+	IN		PVOID					Image,
+	IN		SIZE_T					ImageSize,
+	IN		ULONG					Flags,
+	OUT		PKEX_LDR_IMPORT_REWRITE	Rewrites,
+	IN OUT	PULONG					NumberOfRewrites)
+{
+	return KexLdrScanImageImports(
+		Image,
+		ImageSize,
+		Flags,
+		TestRewriteDllName,
+		NULL,
+		Rewrites,
+		NumberOfRewrites);
+}
+
+STATIC VOID TestScanAndApply(
+	IN	BOOLEAN	Is64Bit,
+	IN	ULONG	Flags)
+{
+	NTSTATUS Status;
+	SIZE_T ImageSize;
+	KEX_LDR_IMPORT_REWRITE Rewrites[TEST_MAX_REWRITES];
+	ULONG NumberOfRewrites;
+	TEST_REWRITE_CONTEXT Context;
+	PIMAGE_BOUND_IMPORT_DESCRIPTOR BoundImportDescriptor;
+	PIMAGE_BOUND_FORWARDER_REF ForwarderRef;
+
+	ImageSize = TestBuildImage(Is64Bit, Flags);
+
+	//
+	// Ask for the number of rewrites first, like KexRwImp does.
+	//
+
+	NumberOfRewrites = 0;
+	Status = TestScan(ImageBuffer, ImageSize, Flags, NULL, &NumberOfRewrites);
+	TEST_CHECK (Status == STATUS_BUFFER_TOO_SMALL);
+	TEST_CHECK (NumberOfRewrites == 3);
+
+	NumberOfRewrites = 1;
+	Status = TestScan(ImageBuffer, ImageSize, Flags, Rewrites, &NumberOfRewrites);
+	TEST_CHECK (Status == STATUS_BUFFER_TOO_SMALL);
+	TEST_CHECK (NumberOfRewrites == 3);
+
+	//
+	// Three names are rewritten: one import, one delay import and one bound
+	// forwarder. The rewrite routine sees every name except the one in the
+	// VA-based delay import descriptor. The result is sorted by NameRva.
+	//
+
+	Context.NumberOfCalls = 0;
+	NumberOfRewrites = ARRAYSIZE(Rewrites);
+
+	Status = KexLdrScanImageImports(
+		ImageBuffer,
+		ImageSize,
+		Flags,
+		TestRewriteDllName,
+		&Context,
+		Rewrites,
+		&NumberOfRewrites);
+
+	TEST_CHECK (Status == STATUS_SUCCESS);
+	TEST_CHECK (Context.NumberOfCalls == 7);
+	TEST_CHECK (NumberOfRewrites == 3);
+
+	if (NumberOfRewrites != 3) {
+		return;
+	}
+
+	TEST_CHECK (Rewrites[0].NameRva == TEST_BOUND_IMPORT_RVA + TEST_BOUND_SYNCH_OFFSET);
+	TEST_CHECK (strcmp(Rewrites[0].RewrittenName, "kernelbase.dll") == 0);
+	TEST_CHECK (Rewrites[1].NameRva == TEST_SYNCH_RVA);
+	TEST_CHECK (strcmp(Rewrites[1].RewrittenName, "kernelbase.dll") == 0);
+	TEST_CHECK (Rewrites[2].NameRva == TEST_PATH_RVA);
+	TEST_CHECK (strcmp(Rewrites[2].RewrittenName, "kxbase.dll") == 0);
+
+	Status = KexLdrApplyImageImportRewrites(ImageBuffer, ImageSize, Flags, Rewrites, NumberOfRewrites);
+	TEST_CHECK (Status == STATUS_SUCCESS);
+
+	TEST_CHECK (strcmp(TestRvaToPointer(ImageBuffer, TEST_SYNCH_RVA, Flags), "kernelbase.dll") == 0);
+	TEST_CHECK (strcmp(TestRvaToPointer(ImageBuffer, TEST_PATH_RVA, Flags), "kxbase.dll") == 0);
+	TEST_CHECK (strcmp(TestRvaToPointer(ImageBuffer, TEST_VA_BASED_RVA, Flags), TEST_SYNCH_NAME) == 0);
+	TEST_CHECK (strcmp(TestRvaToPointer(ImageBuffer, TEST_USER32_RVA, Flags), "user32.dll") == 0);
+	TEST_CHECK (strcmp(TestRvaToPointer(ImageBuffer, TEST_BOUND_IMPORT_RVA + TEST_BOUND_SYNCH_OFFSET, Flags),
+					   "kernelbase.dll") == 0);
+
+	//
+	// Only the bound entries which involve a rewritten name are invalidated.
+	//
+
+	BoundImportDescriptor = (PIMAGE_BOUND_IMPORT_DESCRIPTOR) TestRvaToPointer(
+		ImageBuffer,
+		TEST_BOUND_IMPORT_RVA,
+		Flags);
+
+	ForwarderRef = (PIMAGE_BOUND_FORWARDER_REF) &BoundImportDescriptor[2];
+
+	TEST_CHECK (BoundImportDescriptor[0].TimeDateStamp == 0x1111);
+	TEST_CHECK (BoundImportDescriptor[1].TimeDateStamp == 0);
+	TEST_CHECK (ForwarderRef->TimeDateStamp == 0);
+
+	//
+	// Once rewritten, there is nothing left to rewrite.
+	//
+
+	NumberOfRewrites = ARRAYSIZE(Rewrites);
+	Status = TestScan(ImageBuffer, ImageSize, Flags, Rewrites, &NumberOfRewrites);
+	TEST_CHECK (Status == STATUS_SUCCESS);
+	TEST_CHECK (NumberOfRewrites == 0);
+}
+
+STATIC VOID TestMalformedImages(
+	IN	BOOLEAN	Is64Bit,
+	IN	ULONG	Flags)
+{
+	NTSTATUS Status;
+	SIZE_T ImageSize;
+	KEX_LDR_IMPORT_REWRITE Rewrites[TEST_MAX_REWRITES];
+	ULONG NumberOfRewrites;
+	PIMAGE_IMPORT_DESCRIPTOR ImportDescriptor;
+	STATIC BYTE OriginalImage[TEST_MAPPED_SIZE];
+
+	//
+	// Invalid flags.
+	//
+
+	ImageSize = TestBuildImage(Is64Bit, Flags);
+	NumberOfRewrites = ARRAYSIZE(Rewrites);
+	Status = KexLdrScanImageImports(ImageBuffer, ImageSize, 2, TestRewriteDllName, NULL, Rewrites, &NumberOfRewrites);
+	TEST_CHECK (Status == STATUS_INVALID_PARAMETER_3);
+
+	//
+	// Import name outside the image.
+	//
+
+	ImageSize = TestBuildImage(Is64Bit, Flags);
+	ImportDescriptor = (PIMAGE_IMPORT_DESCRIPTOR) TestRvaToPointer(ImageBuffer, TEST_IMPORT_RVA, Flags);
+	ImportDescriptor[1].Name = 0x10000;
+	NumberOfRewrites = ARRAYSIZE(Rewrites);
+	Status = TestScan(ImageBuffer, ImageSize, Flags, Rewrites, &NumberOfRewrites);
+	TEST_CHECK (Status == STATUS_INVALID_IMAGE_FORMAT);
+
+	//
+	// Import directory which runs off the end of the image.
+	//
+
+	ImageSize = TestBuildImage(Is64Bit, Flags);
+	TestImageDirectory(IMAGE_DIRECTORY_ENTRY_IMPORT)->VirtualAddress = TEST_SECTION_RVA + TEST_SECTION_SIZE - 8;
+	NumberOfRewrites = ARRAYSIZE(Rewrites);
+	Status = TestScan(ImageBuffer, ImageSize, Flags, Rewrites, &NumberOfRewrites);
+	TEST_CHECK (Status == STATUS_INVALID_IMAGE_FORMAT);
+
+	//
+	// Data directory array which runs off the end of the image.
+	//
+
+	ImageSize = TestBuildImage(Is64Bit, Flags);
+	*TestNumberOfRvaAndSizes() = 0x10000;
+	NumberOfRewrites = ARRAYSIZE(Rewrites);
+	Status = TestScan(ImageBuffer, ImageSize, Flags, Rewrites, &NumberOfRewrites);
+	TEST_CHECK (Status == STATUS_INVALID_IMAGE_FORMAT);
+
+	//
+	// No import or delay import directory.
+	//
+
+	ImageSize = TestBuildImage(Is64Bit, Flags);
+	TestImageDirectory(IMAGE_DIRECTORY_ENTRY_IMPORT)->VirtualAddress = 0;
+	TestImageDirectory(IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT)->VirtualAddress = 0;
+	NumberOfRewrites = ARRAYSIZE(Rewrites);
+	Status = TestScan(ImageBuffer, ImageSize, Flags, Rewrites, &NumberOfRewrites);
+	TEST_CHECK (Status == STATUS_IMAGE_NO_IMPORT_DIRECTORY);
+
+	//
+	// Bound import directory which runs off the end of the headers into
+	// nothing. This is only looked at once a rewrite has been found.
+	//
+
+	ImageSize = TestBuildImage(Is64Bit, Flags);
+	TestImageDirectory(IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT)->VirtualAddress = (ULONG) ImageSize - 4;
+	NumberOfRewrites = ARRAYSIZE(Rewrites);
+	Status = TestScan(ImageBuffer, ImageSize, Flags, Rewrites, &NumberOfRewrites);
+	TEST_CHECK (Status == STATUS_INVALID_IMAGE_FORMAT);
+
+	//
+	// Unterminated DLL name at the very end of a file.
+	//
+
+	unless (Flags & KEX_LDR_IMAGE_MAPPED) {
+		ULONG NameRva;
+
+		ImageSize = TestBuildImage(Is64Bit, Flags);
+		NameRva = TEST_SECTION_RVA + TEST_SECTION_SIZE - 16;
+		memset(TestRvaToPointer(ImageBuffer, NameRva, Flags), 'a', 16);
+		ImportDescriptor = (PIMAGE_IMPORT_DESCRIPTOR) TestRvaToPointer(ImageBuffer, TEST_IMPORT_RVA, Flags);
+		ImportDescriptor[0].Name = NameRva;
+		NumberOfRewrites = ARRAYSIZE(Rewrites);
+		Status = TestScan(ImageBuffer, ImageSize, Flags, Rewrites, &NumberOfRewrites);
+		TEST_CHECK (Status == STATUS_INVALID_IMAGE_FORMAT);
+	}
+
+	//
+	// Rewrites which can't be applied must leave the image alone.
+	//
+
+	ImageSize = TestBuildImage(Is64Bit, Flags);
+	NumberOfRewrites = ARRAYSIZE(Rewrites);
+	Status = TestScan(ImageBuffer, ImageSize, Flags, Rewrites, &NumberOfRewrites);
+	TEST_CHECK (Status == STATUS_SUCCESS);
+	TEST_CHECK (NumberOfRewrites == 3);
+	memcpy(OriginalImage, ImageBuffer, ImageSize);
+
+	if (NumberOfRewrites == 3) {
+		strcpy(Rewrites[2].RewrittenName, "api-ms-win-core-path-l1-1-0.dll.x");
+		Status = KexLdrApplyImageImportRewrites(ImageBuffer, ImageSize, Flags, Rewrites, NumberOfRewrites);
+		TEST_CHECK (Status == STATUS_BUFFER_TOO_SMALL);
+		TEST_CHECK (memcmp(OriginalImage, ImageBuffer, ImageSize) == 0);
+
+		strcpy(Rewrites[2].RewrittenName, "kxbase.dll");
+		Rewrites[2].NameRva = 0x10000;
+		Status = KexLdrApplyImageImportRewrites(ImageBuffer, ImageSize, Flags, Rewrites, NumberOfRewrites);
+		TEST_CHECK (Status == STATUS_INVALID_IMAGE_FORMAT);
+		TEST_CHECK (memcmp(OriginalImage, ImageBuffer, ImageSize) == 0);
+	}
+}
+
+//
+// Scan every prefix of the image. Each one is copied into a heap block of
+// exactly that size, so that reads past the end are caught when the test is
+// built with -fsanitize=address.
+//
+STATIC VOID TestTruncatedImages(
+	IN	BOOLEAN	Is64Bit,
+	IN	ULONG	Flags)
+{
+	SIZE_T FullSize;
+	SIZE_T ImageSize;
+
+	FullSize = TestBuildImage(Is64Bit, Flags);
+
+	for (ImageSize = 0; ImageSize < FullSize; ++ImageSize) {
+		NTSTATUS Status;
+		PBYTE Image;
+		KEX_LDR_IMPORT_REWRITE Rewrites[TEST_MAX_REWRITES];
+		ULONG NumberOfRewrites;
+
+		Image = (PBYTE) malloc(ImageSize ? ImageSize : 1);
+		ASSERT (Image != NULL);
+		memcpy(Image, ImageBuffer, ImageSize);
+
+		NumberOfRewrites = ARRAYSIZE(Rewrites);
+		Status = TestScan(Image, ImageSize, Flags, Rewrites, &NumberOfRewrites);
+
+		if (NT_SUCCESS(Status)) {
+			TEST_CHECK (NumberOfRewrites <= 3);
+			Status = KexLdrApplyImageImportRewrites(Image, ImageSize, Flags, Rewrites, NumberOfRewrites);
+			TEST_CHECK (Status == STATUS_SUCCESS);
+		}
+
+		free(Image);
+	}
+}
+
+//
+// Corpus mode.
+//
+
+STATIC NTSTATUS NTAPI CorpusRewriteDllName(
+	IN		PVOID			Context OPTIONAL,
+	IN		PCANSI_STRING	DllName,
+	IN OUT	PANSI_STRING	RewrittenDllName)
+{
+	STATIC CONST CHAR *Prefixes[] = {"api-ms-win-", "ext-ms-win-"};
+	STATIC CONST CHAR Replacement[] = "kernel32.dll";
+	ULONG Index;
+
+	for (Index = 0; Index < ARRAYSIZE(Prefixes); ++Index) {
+		SIZE_T PrefixCch;
+		SIZE_T Position;
+
+		PrefixCch = strlen(Prefixes[Index]);
+
+		if (DllName->Length < PrefixCch) {
+			continue;
+		}
+
+		for (Position = 0; Position < PrefixCch; ++Position) {
+			if (tolower((unsigned char) DllName->Buffer[Position]) != Prefixes[Index][Position]) {
+				break;
+			}
+		}
+
+		if (Position == PrefixCch) {
+			ASSERT (sizeof(Replacement) <= RewrittenDllName->MaximumLength);
+			memcpy(RewrittenDllName->Buffer, Replacement, sizeof(Replacement) - 1);
+			RewrittenDllName->Length = sizeof(Replacement) - 1;
+			return STATUS_SUCCESS;
+		}
+	}
+
+	return STATUS_INVALID_PARAMETER;
+}
+
+STATIC ULONGLONG CorpusQueryTime(
+	VOID)
+{
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return (ULONGLONG) Now.tv_sec * 1000000000 + Now.tv_nsec;
+}
+
+typedef struct _CORPUS_STATISTICS {
+	ULONG		NumberOfFiles;
+	ULONG		NumberOfRewrittenFiles;
+	ULONG		NumberOfRewrites;
+	ULONG		NumberOfSkippedFiles;
+	ULONGLONG	TotalScanTime;
+	ULONGLONG	TotalScans;
+} TYPEDEF_TYPE_NAME(CORPUS_STATISTICS);
+
+STATIC VOID CorpusProcessFile(
+	IN		PCSTR				FilePath,
+	IN		ULONG				Iterations,
+	IN OUT	PCORPUS_STATISTICS	Statistics)
+{
+	NTSTATUS Status;
+	FILE *File;
+	PBYTE Image;
+	long FileSize;
+	ULONG NumberOfRewrites;
+	PKEX_LDR_IMPORT_REWRITE Rewrites;
+
+	File = fopen(FilePath, "rb");
+	if (!File) {
+		printf("%s: failed to open file\n", FilePath);
+		++NumberOfFailures;
+		return;
+	}
+
+	fseek(File, 0, SEEK_END);
+	FileSize = ftell(File);
+	fseek(File, 0, SEEK_SET);
+
+	Image = (PBYTE) malloc(FileSize > 0 ? FileSize : 1);
+	ASSERT (Image != NULL);
+
+	if (FileSize < 0 || fread(Image, 1, FileSize, File) != (SIZE_T) FileSize) {
+		printf("%s: failed to read file\n", FilePath);
+		++NumberOfFailures;
+		fclose(File);
+		free(Image);
+		return;
+	}
+
+	fclose(File);
+	++Statistics->NumberOfFiles;
+
+	NumberOfRewrites = 0;
+	Status = KexLdrScanImageImports(Image, FileSize, 0, CorpusRewriteDllName, NULL, NULL, &NumberOfRewrites);
+
+	if (Status == STATUS_INVALID_IMAGE_FORMAT || Status == STATUS_IMAGE_NO_IMPORT_DIRECTORY) {
+		// Not an image, or nothing to rewrite in it.
+		printf("%s: skipped (0x%08lx)\n", FilePath, (unsigned long) (ULONG) Status);
+		++Statistics->NumberOfSkippedFiles;
+		free(Image);
+		return;
+	}
+
+	if (Status != STATUS_SUCCESS && Status != STATUS_BUFFER_TOO_SMALL) {
+		printf("%s: FAILED: scan returned 0x%08lx\n", FilePath, (unsigned long) (ULONG) Status);
+		++NumberOfFailures;
+		free(Image);
+		return;
+	}
+
+	Rewrites = (PKEX_LDR_IMPORT_REWRITE) calloc(NumberOfRewrites + 1, sizeof(KEX_LDR_IMPORT_REWRITE));
+	ASSERT (Rewrites != NULL);
+
+	if (Iterations != 0) {
+		ULONGLONG StartTime;
+		ULONGLONG EndTime;
+		ULONG Iteration;
+
+		StartTime = CorpusQueryTime();
+
+		for (Iteration = 0; Iteration < Iterations; ++Iteration) {
+			ULONG Count;
+
+			Count = NumberOfRewrites;
+			KexLdrScanImageImports(Image, FileSize, 0, CorpusRewriteDllName, NULL, Rewrites, &Count);
+		}
+
+		EndTime = CorpusQueryTime();
+		Statistics->TotalScanTime += EndTime - StartTime;
+		Statistics->TotalScans += Iterations;
+
+		printf("%s: %lu rewrite(s), %llu ns per scan\n",
+			   FilePath,
+			   (unsigned long) NumberOfRewrites,
+			   (EndTime - StartTime) / Iterations);
+	} else {
+		printf("%s: %lu rewrite(s)\n", FilePath, (unsigned long) NumberOfRewrites);
+	}
+
+	Status = KexLdrScanImageImports(Image, FileSize, 0, CorpusRewriteDllName, NULL, Rewrites, &NumberOfRewrites);
+
+	if (Status != STATUS_SUCCESS) {
+		printf("%s: FAILED: second scan returned 0x%08lx\n", FilePath, (unsigned long) (ULONG) Status);
+		++NumberOfFailures;
+	} else if (NumberOfRewrites != 0) {
+		ULONG Count;
+
+		++Statistics->NumberOfRewrittenFiles;
+		Statistics->NumberOfRewrites += NumberOfRewrites;
+
+		Status = KexLdrApplyImageImportRewrites(Image, FileSize, 0, Rewrites, NumberOfRewrites);
+
+		if (Status != STATUS_SUCCESS) {
+			printf("%s: FAILED: apply returned 0x%08lx\n", FilePath, (unsigned long) (ULONG) Status);
+			++NumberOfFailures;
+		} else {
+			Count = 0;
+			Status = KexLdrScanImageImports(Image, FileSize, 0, CorpusRewriteDllName, NULL, NULL, &Count);
+
+			if (Status != STATUS_SUCCESS || Count != 0) {
+				printf("%s: FAILED: %lu name(s) left to rewrite after rewriting\n",
+					   FilePath, (unsigned long) Count);
+				++NumberOfFailures;
+			}
+		}
+	}
+
+	free(Rewrites);
+	free(Image);
+}
+
+STATIC VOID CorpusMain(
+	IN	int		NumberOfArguments,
+	IN	char	**Arguments)
+{
+	CORPUS_STATISTICS Statistics;
+	ULONG Iterations;
+	int Index;
+
+	memset(&Statistics, 0, sizeof(Statistics));
+	Iterations = 0;
+	Index = 1;
+
+	if (strcmp(Arguments[Index], "-b") == 0) {
+		if (Index + 1 >= NumberOfArguments) {
+			printf("Usage: %s [-b iterations] file [file ...]\n", Arguments[0]);
+			exit(2);
+		}
+
+		Iterations = (ULONG) strtoul(Arguments[Index + 1], NULL, 10);
+		Index += 2;
+	}
+
+	for (; Index < NumberOfArguments; ++Index) {
+		CorpusProcessFile(Arguments[Index], Iterations, &Statistics);
+	}
+
+	printf("\n%lu files processed, %lu skipped, %lu contain imports to rewrite (%lu in total)\n",
+		   (unsigned long) Statistics.NumberOfFiles,
+		   (unsigned long) Statistics.NumberOfSkippedFiles,
+		   (unsigned long) Statistics.NumberOfRewrittenFiles,
+		   (unsigned long) Statistics.NumberOfRewrites);
+
+	if (Statistics.TotalScans != 0) {
+		printf("Average scan time: %llu ns\n", Statistics.TotalScanTime / Statistics.TotalScans);
+	}
+}
+
+int main(
+	int		NumberOfArguments,
+	char	**Arguments)
+{
+	ULONG Index;
+
+	STATIC CONST struct {
+		BOOLEAN	Is64Bit;
+		ULONG	Flags;
+	} Layouts[] = {
+		{FALSE,	0},
+		{FALSE,	KEX_LDR_IMAGE_MAPPED},
+		{TRUE,	0},
+		{TRUE,	KEX_LDR_IMAGE_MAPPED},
+	};
+
+	if (NumberOfArguments > 1) {
+		CorpusMain(NumberOfArguments, Arguments);
+	} else {
+		for (Index = 0; Index < ARRAYSIZE(Layouts); ++Index) {
+			TestScanAndApply(Layouts[Index].Is64Bit, Layouts[Index].Flags);
+			TestMalformedImages(Layouts[Index].Is64Bit, Layouts[Index].Flags);
+			TestTruncatedImages(Layouts[Index].Is64Bit, Layouts[Index].Flags);
+		}
+	}
+
+	if (NumberOfFailures != 0) {
+		printf("%lu check(s) failed\n", (unsigned long) NumberOfFailures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
\ No newline at end of file
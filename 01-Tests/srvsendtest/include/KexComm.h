@@ -0,0 +1,86 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     KexComm.h
+//
+// Abstract:
+//
+//     Stand-in for the real KexComm.h, used when the portable parts of
+//     SrvSend and KexSrv are compiled on a non-Windows system for testing.
+//     Only the types, macros and status codes which those files use are
+//     defined here. The message definitions come from the real KexTypes.h
+//     and KexSrv.h.
+//
+//     Must be compiled with -fshort-wchar, so that L"" strings are made up
+//     of 16-bit characters like on Windows.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <wchar.h>
+
+#define IN
+#define OUT
+#define OPTIONAL
+#define CONST const
+#define VOID void
+#define TRUE 1
+#define FALSE 0
+#define __cdecl
+#define __declspec(x)
+
+typedef unsigned char BYTE, *PBYTE, BOOLEAN, *PBOOLEAN;
+typedef char CHAR;
+typedef unsigned short USHORT, *PUSHORT;
+typedef unsigned int ULONG, *PULONG;
+typedef int LONG, *PLONG, NTSTATUS;
+typedef unsigned long long ULONGLONG, *PULONGLONG;
+typedef long long LONGLONG, *PLONGLONG;
+typedef wchar_t WCHAR, *PWCHAR;
+typedef char *PSTR;
+typedef const char *PCSTR;
+typedef WCHAR *PWSTR;
+typedef const WCHAR *PCWSTR;
+typedef WCHAR *PNZWCH;
+typedef const WCHAR *PCNZWCH;
+
+#define ARRAYSIZE(Array) (sizeof(Array) / sizeof((Array)[0]))
+#define FIELD_OFFSET(Type, Field) ((LONG) offsetof(Type, Field))
+#define RtlCopyMemory(Destination, Source, Length) memcpy((Destination), (Source), (Length))
+#define RtlZeroMemory(Destination, Length) memset((Destination), 0, (Length))
+
+#define NT_SUCCESS(Status) (((NTSTATUS) (Status)) >= 0)
+#define STATUS_SUCCESS				((NTSTATUS) 0x00000000L)
+#define STATUS_INVALID_PARAMETER	((NTSTATUS) 0xC000000DL)
+#define STATUS_PIPE_BROKEN			((NTSTATUS) 0xC000014BL)
+#define STATUS_DLL_NOT_FOUND		((NTSTATUS) 0xC0000135L)
+
+#define ASSERT(Condition) do { if (!(Condition)) { \
+	fprintf(stderr, "Assertion failure: %s (%s:%d in %s)\n", #Condition, __FILE__, __LINE__, __func__); \
+	abort(); } } while (0)
+#define ASSUME ASSERT
+#define NOT_REACHED ASSUME(FALSE)
+
+#define until(Condition) while (!(Condition))
+#define unless(Condition) if (!(Condition))
+
+typedef enum _VXLSEVERITY {
+	LogSeverityInvalidValue = -1,
+	LogSeverityCritical,
+	LogSeverityError,
+	LogSeverityWarning,
+	LogSeverityInformation,
+	LogSeverityDetail,
+	LogSeverityDebug,
+	LogSeverityMaximumValue
+} VXLSEVERITY;
+
+#include <KexTypes.h>
+#include <KexSrv.h>
\ No newline at end of file
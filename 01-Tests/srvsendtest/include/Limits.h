@@ -0,0 +1,10 @@
+//
+// KexTypes.h includes <Limits.h>, which is spelled <limits.h> here. ULONG
+// is 32 bits wide, like on Windows, so ULONG_MAX must match it.
+//
+
+#pragma once
+#include <limits.h>
+
+#undef ULONG_MAX
+#define ULONG_MAX 0xFFFFFFFFUL
\ No newline at end of file
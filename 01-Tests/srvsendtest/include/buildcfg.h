@@ -0,0 +1,4 @@
+#pragma once
+
+#define KEX_COMPONENT L"SrvSendTest"
+#define KEX_TARGET_TYPE_EXE
\ No newline at end of file
@@ -0,0 +1,483 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     test.c
+//
+// Abstract:
+//
+//     Tests for the SrvSend load generator. The portable parts of the load
+//     generator (loadcore.c) are run against a stand-in transport, which
+//     passes every message through the same checks that KexSrv performs
+//     before dispatching it (msgcheck.c) and keeps a simulated clock.
+//
+//     This builds on any system with a C11 compiler which supports
+//     -fshort-wchar. Run "make check".
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "buildcfg.h"
+#include <KexComm.h>
+#include "loadgen.h"
+
+//
+// From KexSrv\msgcheck.c.
+//
+
+NTSTATUS GetLogEventBatchEntry(
+	IN		PCKEX_IPC_MESSAGE					Message,
+	IN OUT	PULONG								Offset,
+	OUT		PPCKEX_IPC_LOG_EVENT_BATCH_ENTRY	Entry,
+	OUT		PUSHORT								EntryDataCb);
+
+NTSTATUS ValidateMessage(
+	IN	PCKEX_IPC_MESSAGE	Message);
+
+STATIC ULONG NumberOfFailures = 0;
+
+#define TEST_CHECK(Condition) do { \
+	if (!(Condition)) { \
+		printf("FAILED: %s (%s:%d)\n", #Condition, __FILE__, __LINE__); \
+		++NumberOfFailures; \
+	} } while (0)
+
+STATIC ULONGLONG MessageBuffer[KEX_IPC_MESSAGE_MAXIMUM_SIZE / sizeof(ULONGLONG) + 1];
+
+//
+// Check a message the same way KexSrv does - ValidateMessage first, and
+// then, for a batch, each of its entries in turn as DispatchLogEventBatch
+// walks through them.
+//
+STATIC NTSTATUS TestCheckMessage(
+	IN	PCKEX_IPC_MESSAGE	Message)
+{
+	NTSTATUS Status;
+	PCKEX_IPC_LOG_EVENT_BATCH_ENTRY Entry;
+	USHORT EntryDataCb;
+	ULONG Offset;
+	ULONG Index;
+
+	Status = ValidateMessage(Message);
+
+	if (!NT_SUCCESS(Status) || Message->MessageId != KexIpcLogEventBatch) {
+		return Status;
+	}
+
+	Offset = 0;
+
+	for (Index = 0; Index < Message->LogEventBatchInformation.NumberOfEvents; ++Index) {
+		Status = GetLogEventBatchEntry(Message, &Offset, &Entry, &EntryDataCb);
+
+		if (!NT_SUCCESS(Status)) {
+			return Status;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+//
+// Stand-in transport. Each message takes ServiceTime microseconds of
+// simulated time to be accepted, and waiting just moves the clock forward.
+//
+
+typedef struct _TEST_TRANSPORT_CONTEXT {
+	ULONGLONG	Now;
+	ULONG		ServiceTime;
+	ULONG		FailAfter;			// zero means never fail
+	ULONG		NumberOfMessages;
+	ULONG		NumberOfInvalidMessages;
+	ULONG		NumberOfEvents;
+	ULONG		Count[KexIpcMaximumMessageId];
+} TYPEDEF_TYPE_NAME(TEST_TRANSPORT_CONTEXT);
+
+STATIC NTSTATUS TestSendMessage(
+	IN	PVOID				Context,
+	IN	PCKEX_IPC_MESSAGE	Message,
+	IN	ULONG				MessageSize)
+{
+	PTEST_TRANSPORT_CONTEXT TestContext;
+
+	TestContext = (PTEST_TRANSPORT_CONTEXT) Context;
+
+	if (TestContext->FailAfter != 0 && TestContext->NumberOfMessages >= TestContext->FailAfter) {
+		return STATUS_PIPE_BROKEN;
+	}
+
+	TestContext->Now += TestContext->ServiceTime;
+	TestContext->NumberOfMessages += 1;
+
+	// Same check as KexSrv performs when the read completes.
+	if (MessageSize > KEX_IPC_MESSAGE_MAXIMUM_SIZE ||
+		MessageSize != sizeof(KEX_IPC_MESSAGE) + Message->AuxiliaryDataBlockSize ||
+		!NT_SUCCESS(TestCheckMessage(Message))) {
+
+		TestContext->NumberOfInvalidMessages += 1;
+		return STATUS_SUCCESS;
+	}
+
+	TestContext->Count[Message->MessageId] += 1;
+
+	if (Message->MessageId == KexIpcLogEvent) {
+		TestContext->NumberOfEvents += 1;
+	} else if (Message->MessageId == KexIpcLogEventBatch) {
+		TestContext->NumberOfEvents += Message->LogEventBatchInformation.NumberOfEvents;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+STATIC ULONGLONG TestQueryTime(
+	IN	PVOID	Context)
+{
+	return ((PTEST_TRANSPORT_CONTEXT) Context)->Now;
+}
+
+STATIC VOID TestWaitUntil(
+	IN	PVOID		Context,
+	IN	ULONGLONG	Time)
+{
+	PTEST_TRANSPORT_CONTEXT TestContext;
+
+	TestContext = (PTEST_TRANSPORT_CONTEXT) Context;
+
+	if (TestContext->Now < Time) {
+		TestContext->Now = Time;
+	}
+}
+
+STATIC VOID TestInitializeTransport(
+	OUT	PLOAD_TRANSPORT			Transport,
+	OUT	PTEST_TRANSPORT_CONTEXT	Context,
+	IN	ULONG					ServiceTime)
+{
+	memset(Context, 0, sizeof(*Context));
+	Context->Now = 1000000;
+	Context->ServiceTime = ServiceTime;
+
+	Transport->Context = Context;
+	Transport->SendMessage = TestSendMessage;
+	Transport->QueryTime = TestQueryTime;
+	Transport->WaitUntil = TestWaitUntil;
+}
+
+STATIC VOID TestParseCommandLine(
+	VOID)
+{
+	NTSTATUS Status;
+	LOAD_CONFIGURATION Configuration;
+
+	Status = LoadParseCommandLine(L"", &Configuration);
+	TEST_CHECK (NT_SUCCESS(Status));
+	TEST_CHECK (Configuration.Weight[KexIpcKexProcessStart] == 0);
+
+	Status = LoadParseCommandLine(
+		L"  /clients:8 /THREADS:4\t/rate:0 /count:250 "
+		L"/mix:logevent=90,batch=5,harderror=5 /text:100 /batch:8  ",
+		&Configuration);
+
+	TEST_CHECK (NT_SUCCESS(Status));
+	TEST_CHECK (Configuration.NumberOfClients == 8);
+	TEST_CHECK (Configuration.NumberOfThreads == 4);
+	TEST_CHECK (Configuration.MessagesPerSecond == 0);
+	TEST_CHECK (Configuration.MessagesPerThread == 250);
+	TEST_CHECK (Configuration.Weight[KexIpcKexProcessStart] == 0);
+	TEST_CHECK (Configuration.Weight[KexIpcHardError] == 5);
+	TEST_CHECK (Configuration.Weight[KexIpcLogEvent] == 90);
+	TEST_CHECK (Configuration.Weight[KexIpcLogEventBatch] == 5);
+	TEST_CHECK (Configuration.TextLength == 100);
+	TEST_CHECK (Configuration.EventsPerBatch == 8);
+
+	Status = LoadParseCommandLine(L"/mix:logeventbatch=1", &Configuration);
+	TEST_CHECK (NT_SUCCESS(Status));
+	TEST_CHECK (Configuration.Weight[KexIpcLogEventBatch] == 1);
+	TEST_CHECK (Configuration.Weight[KexIpcLogEvent] == 0);
+
+	TEST_CHECK (!NT_SUCCESS(LoadParseCommandLine(L"/bogus:1", &Configuration)));
+	TEST_CHECK (!NT_SUCCESS(LoadParseCommandLine(L"/clients:", &Configuration)));
+	TEST_CHECK (!NT_SUCCESS(LoadParseCommandLine(L"/clients:0", &Configuration)));
+	TEST_CHECK (!NT_SUCCESS(LoadParseCommandLine(L"/clients:65", &Configuration)));
+	TEST_CHECK (!NT_SUCCESS(LoadParseCommandLine(L"/clients:4x", &Configuration)));
+	TEST_CHECK (!NT_SUCCESS(LoadParseCommandLine(L"/threads:99999999999", &Configuration)));
+	TEST_CHECK (!NT_SUCCESS(LoadParseCommandLine(L"/text:4097", &Configuration)));
+	TEST_CHECK (!NT_SUCCESS(LoadParseCommandLine(L"/batch:0", &Configuration)));
+	TEST_CHECK (!NT_SUCCESS(LoadParseCommandLine(L"/mix:logevent=0", &Configuration)));
+	TEST_CHECK (!NT_SUCCESS(LoadParseCommandLine(L"/mix:processstart=1", &Configuration)));
+	TEST_CHECK (!NT_SUCCESS(LoadParseCommandLine(L"/mix:logevent=1,", &Configuration)));
+}
+
+STATIC VOID TestHistogram(
+	VOID)
+{
+	STATIC LOAD_RESULT Result;
+	STATIC LOAD_RESULT Merged;
+	PLOAD_HISTOGRAM Histogram;
+	ULONG Value;
+	ULONG Percentile;
+
+	LoadInitializeResult(&Result);
+	Histogram = &Result.Latency[KexIpcLogEvent];
+
+	TEST_CHECK (LoadQueryPercentile(Histogram, 5000) == 0);
+
+	// Small values are recorded exactly.
+	for (Value = 1; Value <= 50; ++Value) {
+		LoadRecordLatency(Histogram, Value);
+	}
+
+	TEST_CHECK (Histogram->Count == 50);
+	TEST_CHECK (Histogram->Minimum == 1);
+	TEST_CHECK (Histogram->Maximum == 50);
+	TEST_CHECK (LoadQueryPercentile(Histogram, 5000) == 25);
+	TEST_CHECK (LoadQueryPercentile(Histogram, 9900) == 50);
+	TEST_CHECK (LoadQueryPercentile(Histogram, 0) == 1);
+
+	// Large values are within 1/32 of the real value, and never above the
+	// maximum.
+	LoadInitializeResult(&Result);
+
+	for (Value = 1; Value <= 100000; ++Value) {
+		LoadRecordLatency(Histogram, Value * 37ULL);
+	}
+
+	Percentile = LoadQueryPercentile(Histogram, 5000);
+	TEST_CHECK (Percentile >= 50000 * 37 && Percentile <= 50000 * 37 + (50000 * 37) / 32);
+	Percentile = LoadQueryPercentile(Histogram, 9990);
+	TEST_CHECK (Percentile >= 99900 * 37 && Percentile <= 99900 * 37 + (99900 * 37) / 32);
+	TEST_CHECK (LoadQueryPercentile(Histogram, 10000) == 100000 * 37);
+
+	LoadRecordLatency(Histogram, 1ULL << 40);
+	TEST_CHECK (Histogram->Maximum == ULONG_MAX);
+	TEST_CHECK (LoadQueryPercentile(Histogram, 10000) == ULONG_MAX);
+
+	// Merging adds counts and keeps the extremes.
+	LoadInitializeResult(&Merged);
+	Result.StartTime = 10;
+	Result.EndTime = 20;
+	LoadMergeResult(&Merged, &Result);
+	Result.StartTime = 5;
+	Result.EndTime = 15;
+	LoadMergeResult(&Merged, &Result);
+
+	TEST_CHECK (Merged.StartTime == 5);
+	TEST_CHECK (Merged.EndTime == 20);
+	TEST_CHECK (Merged.Latency[KexIpcLogEvent].Count == 2 * Histogram->Count);
+	TEST_CHECK (Merged.Latency[KexIpcLogEvent].Minimum == 37);
+	TEST_CHECK (Merged.Latency[KexIpcLogEvent].Maximum == ULONG_MAX);
+	TEST_CHECK (Merged.Latency[KexIpcHardError].Count == 0);
+	TEST_CHECK (LoadQueryPercentile(&Merged.Latency[KexIpcLogEvent], 5000) ==
+				LoadQueryPercentile(Histogram, 5000));
+}
+
+STATIC VOID TestBuildMessages(
+	VOID)
+{
+	STATIC CONST ULONG TextLengths[] = {0, 1, 63, 64, 1000, LOAD_MAXIMUM_TEXT_LENGTH};
+	LOAD_CONFIGURATION Configuration;
+	PKEX_IPC_MESSAGE Message;
+	ULONG Seed;
+	ULONG Index;
+	ULONG MessageId;
+	ULONG MessageSize;
+
+	Message = (PKEX_IPC_MESSAGE) MessageBuffer;
+	LoadDefaultConfiguration(&Configuration);
+	Seed = 1;
+
+	for (Index = 0; Index < ARRAYSIZE(TextLengths); ++Index) {
+		Configuration.TextLength = TextLengths[Index];
+		Configuration.EventsPerBatch = LOAD_MAXIMUM_EVENTS_PER_BATCH;
+
+		for (MessageId = 0; MessageId < KexIpcMaximumMessageId; ++MessageId) {
+			MessageSize = LoadBuildMessage(&Configuration, (KEX_IPC_MESSAGE_ID) MessageId, &Seed, Message);
+
+			TEST_CHECK (Message->MessageId == MessageId);
+			TEST_CHECK (MessageSize <= KEX_IPC_MESSAGE_MAXIMUM_SIZE);
+			TEST_CHECK (MessageSize == sizeof(KEX_IPC_MESSAGE) + Message->AuxiliaryDataBlockSize);
+			TEST_CHECK (NT_SUCCESS(TestCheckMessage(Message)));
+
+			if (MessageId == KexIpcLogEventBatch) {
+				TEST_CHECK (Message->LogEventBatchInformation.NumberOfEvents >= 1);
+				TEST_CHECK (Message->LogEventBatchInformation.NumberOfEvents <= LOAD_MAXIMUM_EVENTS_PER_BATCH);
+			}
+		}
+	}
+
+	// A batch of small events contains exactly EventsPerBatch events.
+	Configuration.TextLength = 64;
+	Configuration.EventsPerBatch = 16;
+	LoadBuildMessage(&Configuration, KexIpcLogEventBatch, &Seed, Message);
+	TEST_CHECK (Message->LogEventBatchInformation.NumberOfEvents == 16);
+
+	// Large events are cut off when the message is full.
+	Configuration.TextLength = LOAD_MAXIMUM_TEXT_LENGTH;
+	LoadBuildMessage(&Configuration, KexIpcLogEventBatch, &Seed, Message);
+	TEST_CHECK (Message->LogEventBatchInformation.NumberOfEvents == 7);
+}
+
+STATIC VOID TestValidateMessage(
+	VOID)
+{
+	LOAD_CONFIGURATION Configuration;
+	PKEX_IPC_MESSAGE Message;
+	ULONG Seed;
+
+	Message = (PKEX_IPC_MESSAGE) MessageBuffer;
+	LoadDefaultConfiguration(&Configuration);
+	Seed = 1;
+
+	LoadBuildMessage(&Configuration, KexIpcKexProcessStart, &Seed, Message);
+	Message->ProcessStartedInformation.ApplicationNameLength += 1;
+	TEST_CHECK (!NT_SUCCESS(TestCheckMessage(Message)));
+
+	LoadBuildMessage(&Configuration, KexIpcHardError, &Seed, Message);
+	Message->HardErrorInformation.StringParameter2Length += 1;
+	TEST_CHECK (!NT_SUCCESS(TestCheckMessage(Message)));
+
+	LoadBuildMessage(&Configuration, KexIpcLogEvent, &Seed, Message);
+	Message->AuxiliaryDataBlockSize -= sizeof(WCHAR);
+	TEST_CHECK (!NT_SUCCESS(TestCheckMessage(Message)));
+
+	// Lengths which overflow a USHORT when added together.
+	LoadBuildMessage(&Configuration, KexIpcLogEvent, &Seed, Message);
+	Message->LogEventInformation.SourceFileLength = 0xFFFF;
+	Message->LogEventInformation.TextLength = 0xFFFF;
+	TEST_CHECK (!NT_SUCCESS(TestCheckMessage(Message)));
+
+	// Bad batch entries are only found while the batch is being walked.
+	LoadBuildMessage(&Configuration, KexIpcLogEventBatch, &Seed, Message);
+	Message->LogEventBatchInformation.NumberOfEvents += 1;
+	TEST_CHECK (NT_SUCCESS(ValidateMessage(Message)));
+	TEST_CHECK (!NT_SUCCESS(TestCheckMessage(Message)));
+
+	LoadBuildMessage(&Configuration, KexIpcLogEventBatch, &Seed, Message);
+	((PKEX_IPC_LOG_EVENT_BATCH_ENTRY) Message->AuxiliaryDataBlock)->LogEventInformation.TextLength = 0x8000;
+	TEST_CHECK (NT_SUCCESS(ValidateMessage(Message)));
+	TEST_CHECK (!NT_SUCCESS(TestCheckMessage(Message)));
+
+	LoadBuildMessage(&Configuration, KexIpcLogEvent, &Seed, Message);
+	Message->MessageId = KexIpcMaximumMessageId;
+	TEST_CHECK (!NT_SUCCESS(TestCheckMessage(Message)));
+
+	Message->MessageId = (KEX_IPC_MESSAGE_ID) -1;
+	TEST_CHECK (!NT_SUCCESS(TestCheckMessage(Message)));
+}
+
+STATIC VOID TestRunThread(
+	VOID)
+{
+	STATIC LOAD_RESULT Result;
+	LOAD_CONFIGURATION Configuration;
+	LOAD_TRANSPORT Transport;
+	TEST_TRANSPORT_CONTEXT Context;
+	PCLOAD_HISTOGRAM Histogram;
+	ULONG MessageId;
+	ULONGLONG TotalCount;
+
+	LoadParseCommandLine(
+		L"/rate:1000 /count:10000 /mix:logevent=80,batch=10,harderror=10 /text:32 /batch:4",
+		&Configuration);
+
+	//
+	// The server keeps up: every message is accepted within the service
+	// time, and the messages are spread out over the expected time.
+	//
+
+	TestInitializeTransport(&Transport, &Context, 100);
+	LoadInitializeResult(&Result);
+	LoadRunThread(&Configuration, &Transport, 1, (PKEX_IPC_MESSAGE) MessageBuffer, &Result);
+
+	TEST_CHECK (Context.NumberOfMessages == 10000);
+	TEST_CHECK (Context.NumberOfInvalidMessages == 0);
+	TEST_CHECK (Context.Count[KexIpcKexProcessStart] == 0);
+	TEST_CHECK (Context.Count[KexIpcLogEvent] > 7500 && Context.Count[KexIpcLogEvent] < 8500);
+	TEST_CHECK (Context.Count[KexIpcHardError] > 700 && Context.Count[KexIpcHardError] < 1300);
+	TEST_CHECK (Context.NumberOfEvents == Context.Count[KexIpcLogEvent] + 4 * Context.Count[KexIpcLogEventBatch]);
+	TEST_CHECK (Result.NumberOfErrors == 0);
+	TEST_CHECK (Result.EndTime - Result.StartTime == 9999 * 1000 + 100);
+
+	TotalCount = 0;
+
+	for (MessageId = 0; MessageId < KexIpcMaximumMessageId; ++MessageId) {
+		Histogram = &Result.Latency[MessageId];
+		TotalCount += Histogram->Count;
+		TEST_CHECK (Histogram->Count == Context.Count[MessageId]);
+
+		if (Histogram->Count != 0) {
+			TEST_CHECK (Histogram->Minimum == 100);
+			TEST_CHECK (Histogram->Maximum == 100);
+			TEST_CHECK (LoadQueryPercentile(Histogram, 9990) == 100);
+		}
+	}
+
+	TEST_CHECK (TotalCount == 10000);
+
+	//
+	// The server is twice as slow as the target rate. Since messages are
+	// sent on a fixed schedule, latency keeps growing instead of staying
+	// at the service time.
+	//
+
+	Configuration.MessagesPerThread = 1000;
+	TestInitializeTransport(&Transport, &Context, 2000);
+	LoadInitializeResult(&Result);
+	LoadRunThread(&Configuration, &Transport, 1, (PKEX_IPC_MESSAGE) MessageBuffer, &Result);
+
+	Histogram = &Result.Latency[KexIpcLogEvent];
+	TEST_CHECK (Result.Latency[KexIpcLogEvent].Minimum <= 2000 * 10);
+	TEST_CHECK (Result.Latency[KexIpcLogEvent].Maximum >= 990 * 1000);
+	TEST_CHECK (LoadQueryPercentile(Histogram, 5000) >= 400 * 1000);
+	TEST_CHECK (Result.EndTime - Result.StartTime == 1000 * 2000);
+
+	//
+	// Without a target rate, messages are sent back to back and latency is
+	// just the service time.
+	//
+
+	Configuration.MessagesPerSecond = 0;
+	TestInitializeTransport(&Transport, &Context, 2000);
+	LoadInitializeResult(&Result);
+	LoadRunThread(&Configuration, &Transport, 1, (PKEX_IPC_MESSAGE) MessageBuffer, &Result);
+
+	TEST_CHECK (Result.Latency[KexIpcLogEvent].Maximum == 2000);
+	TEST_CHECK (Result.EndTime - Result.StartTime == 1000 * 2000);
+
+	//
+	// The thread stops at the first failure.
+	//
+
+	TestInitializeTransport(&Transport, &Context, 10);
+	Context.FailAfter = 10;
+	LoadInitializeResult(&Result);
+	LoadRunThread(&Configuration, &Transport, 1, (PKEX_IPC_MESSAGE) MessageBuffer, &Result);
+
+	TEST_CHECK (Context.NumberOfMessages == 10);
+	TEST_CHECK (Result.NumberOfErrors == 1);
+	TEST_CHECK (Result.LastErrorStatus == STATUS_PIPE_BROKEN);
+
+	TotalCount = 0;
+
+	for (MessageId = 0; MessageId < KexIpcMaximumMessageId; ++MessageId) {
+		TotalCount += Result.Latency[MessageId].Count;
+	}
+
+	TEST_CHECK (TotalCount == 10);
+}
+
+int main(
+	VOID)
+{
+	TestParseCommandLine();
+	TestHistogram();
+	TestBuildMessages();
+	TestValidateMessage();
+	TestRunThread();
+
+	if (NumberOfFailures != 0) {
+		printf("%lu check(s) failed\n", (unsigned long) NumberOfFailures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
\ No newline at end of file
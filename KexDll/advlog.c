@@ -59,11 +59,24 @@ NTSTATUS KexInitializeAdvancedLogging(
 		return Status;
 	}
 
-	Status = KexHkInstallBasicHook(
-		vDbgPrintExWithPrefixInternal, 
-		KexpvDbgPrintExWithPrefixInternalHook, 
+	//
+	// DbgPrint can be called by any thread at any time, so use a hot-patch
+	// hook if the function allows for it.
+	//
+
+	Status = KexHkInstallHotPatchHook(
+		vDbgPrintExWithPrefixInternal,
+		KexpvDbgPrintExWithPrefixInternalHook,
+		NULL,
 		NULL);
 
+	if (!NT_SUCCESS(Status)) {
+		Status = KexHkInstallBasicHook(
+			vDbgPrintExWithPrefixInternal, 
+			KexpvDbgPrintExWithPrefixInternalHook, 
+			NULL);
+	}
+
 	if (!NT_SUCCESS(Status)) {
 		return Status;
 	}
@@ -90,6 +90,13 @@ BOOL WINAPI DllMain(
 
 		KexDataInitialize(&KexData);
 		KexData->KexDllBase = DllBase;
+
+		//
+		// Find out the system call numbers for our unhooked system call
+		// stubs before anything uses them.
+		//
+
+		KexInitializeSyscallTable();
 	}
 	
 	if (Reason == DLL_PROCESS_VERIFIER) {
@@ -111,6 +111,9 @@ NTSTATUS KexpAddKex3264ToDllPath(
 
 	Status = KexpShrinkDllPathLength(DllPath, DllPath->Length - Prepend.Length);
 	if (!NT_SUCCESS(Status)) {
+		// Duplicate entries may already have been removed, but the loader
+		// still expects the original length.
+		KexpPadDllPathToOriginalLength(DllPath, DllPathOriginalLength);
 		return Status;
 	}
 
@@ -145,96 +148,149 @@ NTSTATUS KexpAddKex3264ToDllPath(
 	return KexpPadDllPathToOriginalLength(DllPath, DllPathOriginalLength);
 } PROTECTED_FUNCTION_END
 
+//
+// One slot in the hash set used by KexpShrinkDllPathLength. Entry.Buffer is
+// NULL for unused slots, otherwise it points into the already compacted part
+// of DllPath, which is never written to again.
+//
+typedef struct _KEX_DLL_PATH_HASH_SLOT {
+	ULONG			Hash;
+	UNICODE_STRING	Entry;
+} TYPEDEF_TYPE_NAME(KEX_DLL_PATH_HASH_SLOT);
+
 //
 // Try to shrink the DllPath length to equal or less than "Length" by
 // removing duplicate entries.
 //
+// This is done in a single pass over DllPath. Each entry is looked up
+// (case-insensitively) in a hash set of the entries we have already kept.
+// Entries which are not already in the set are copied down to the write
+// position and added to the set, and duplicate entries are skipped. This
+// keeps the first occurrence of every entry in its original order.
+//
+// Empty entries are never removed.
+//
 STATIC NTSTATUS KexpShrinkDllPathLength(
 	IN	PUNICODE_STRING	DllPath,
 	IN	USHORT			TargetLength) PROTECTED_FUNCTION
 {
-	NTSTATUS Status;
-	UNICODE_STRING DllPathAfterCurrentEntry;
-	UNICODE_STRING CurrentPathEntry;
-	UNICODE_STRING DuplicatePathEntry;
-	UNICODE_STRING Semicolon;
+	PKEX_DLL_PATH_HASH_SLOT HashSet;
+	ULONG HashSetMask;
+	ULONG NumberOfEntries;
+	PWCHAR Read;
+	PWCHAR Write;
+	PWCHAR End;
+
+	if (DllPath->Length <= TargetLength) {
+		return STATUS_SUCCESS;
+	}
+
+	End = KexRtlEndOfUnicodeString(DllPath);
+
+	//
+	// Size the hash set to at least twice the number of entries in DllPath,
+	// rounded up to a power of two, so that probe sequences stay short.
+	//
+
+	NumberOfEntries = 1;
+
+	for (Read = DllPath->Buffer; Read < End; ++Read) {
+		if (*Read == ';') {
+			++NumberOfEntries;
+		}
+	}
+
+	HashSetMask = 15;
+
+	while (HashSetMask < NumberOfEntries * 2) {
+		HashSetMask = (HashSetMask << 1) | 1;
+	}
+
+	HashSet = SafeAllocEx(RtlProcessHeap(), HEAP_ZERO_MEMORY, KEX_DLL_PATH_HASH_SLOT, HashSetMask + 1);
+	if (!HashSet) {
+		return STATUS_NO_MEMORY;
+	}
 
-	RtlInitConstantUnicodeString(&Semicolon, L";");
-	DllPathAfterCurrentEntry = *DllPath;
+	Read = DllPath->Buffer;
+	Write = DllPath->Buffer;
 
-	until (DllPath->Length <= TargetLength) {
+	while (Read < End) {
+		UNICODE_STRING CurrentPathEntry;
+		PWCHAR EntryStart;
+		BOOLEAN IsDuplicate;
 
 		//
-		// Fetch a path entry
+		// Fetch a path entry. Read is left pointing after the semicolon, if
+		// there is one.
 		//
 
-		Status = RtlFindCharInUnicodeString(
-			0,
-			&DllPathAfterCurrentEntry,
-			&Semicolon,
-			&CurrentPathEntry.Length);
-
-		if (!NT_SUCCESS(Status)) {
-			KexLogErrorEvent(
-				L"RtlFindCharInUnicodeString returned an error\r\n\r\n"
-				L"NTSTATUS error code: %s",
-				KexRtlNtStatusToString(Status));
-			return Status;
+		EntryStart = Read;
+
+		while (Read < End && *Read != ';') {
+			++Read;
 		}
 
-		CurrentPathEntry.Length -= sizeof(WCHAR); // it includes the semicolon - get rid of it
-		CurrentPathEntry.Buffer = DllPathAfterCurrentEntry.Buffer;
+		CurrentPathEntry.Buffer = EntryStart;
+		CurrentPathEntry.Length = (USHORT) ((Read - EntryStart) * sizeof(WCHAR));
 		CurrentPathEntry.MaximumLength = CurrentPathEntry.Length;
-		KexRtlAdvanceUnicodeString(&DllPathAfterCurrentEntry, CurrentPathEntry.Length + sizeof(WCHAR));
 
-		//
-		// Look for one or more duplicate entries later in the path.
-		//
+		if (Read < End) {
+			++Read;
+		}
 
-		do {
-			DuplicatePathEntry.Buffer = KexRtlFindUnicodeSubstring(
-				&DllPathAfterCurrentEntry,
-				&CurrentPathEntry,
-				TRUE);
+		IsDuplicate = FALSE;
 
-			if (DuplicatePathEntry.Buffer) {
-				UNICODE_STRING AfterDuplicate;
+		if (CurrentPathEntry.Length != 0) {
+			ULONG Hash;
+			ULONG Index;
 
-				DuplicatePathEntry.Length = CurrentPathEntry.Length;
-				DuplicatePathEntry.MaximumLength = (USHORT)
-					((KexRtlEndOfUnicodeString(DllPath) - DuplicatePathEntry.Buffer) * sizeof(WCHAR));
+			// No need to check RtlHashUnicodeString return value because it can't
+			// fail when given valid parameters.
+			RtlHashUnicodeString(&CurrentPathEntry, TRUE, HASH_STRING_ALGORITHM_DEFAULT, &Hash);
 
-				//
-				// We want only full path entries, i.e. surrounded by semicolons, or at
-				// the end of the string.
-				//
+			for (Index = Hash & HashSetMask; HashSet[Index].Entry.Buffer; Index = (Index + 1) & HashSetMask) {
+				if (HashSet[Index].Hash == Hash &&
+					RtlEqualUnicodeString(&HashSet[Index].Entry, &CurrentPathEntry, TRUE)) {
 
-				// the -1 is safe because we know DuplicatePathEntry is always ahead of DllPath
-				if (DuplicatePathEntry.Buffer[-1] != ';') {
+					IsDuplicate = TRUE;
 					break;
 				}
+			}
 
-				if (KexRtlEndOfUnicodeString(&DuplicatePathEntry) != KexRtlEndOfUnicodeString(DllPath)) {
-					if (*(KexRtlEndOfUnicodeString(&DuplicatePathEntry)) != L';') {
-						break;
-					}
-				}
-
-				//
-				// We need to cut this path entry out of the original DllPath and update the
-				// length field accordingly. To do this, we will copy all characters from
-				// the end of the duplicate path entry over top of the beginning of the
-				// duplicate entry.
-				//
+			unless (IsDuplicate) {
+				HashSet[Index].Hash = Hash;
+				HashSet[Index].Entry.Buffer = Write;
+				HashSet[Index].Entry.Length = CurrentPathEntry.Length;
+				HashSet[Index].Entry.MaximumLength = CurrentPathEntry.Length;
+			}
+		}
 
-				AfterDuplicate.Buffer = KexRtlEndOfUnicodeString(&DuplicatePathEntry);
-				AfterDuplicate.Length = (USHORT) ((KexRtlEndOfUnicodeString(DllPath) - AfterDuplicate.Buffer) * sizeof(WCHAR));
-				AfterDuplicate.MaximumLength = AfterDuplicate.Length;
+		//
+		// Copy the entry (together with its semicolon) down to the write
+		// position. The source and destination may overlap.
+		//
 
-				DllPath->Length -= DuplicatePathEntry.Length;
-				RtlCopyUnicodeString(&DuplicatePathEntry, &AfterDuplicate);
+		unless (IsDuplicate) {
+			if (Write != EntryStart) {
+				RtlMoveMemory(Write, EntryStart, (Read - EntryStart) * sizeof(WCHAR));
 			}
-		} while (DuplicatePathEntry.Buffer);
+
+			Write += Read - EntryStart;
+		}
+	}
+
+	SafeFree(HashSet);
+
+	DllPath->Length = (USHORT) ((Write - DllPath->Buffer) * sizeof(WCHAR));
+
+	if (DllPath->Length > TargetLength) {
+		KexLogErrorEvent(
+			L"Could not shrink DllPath enough to add the Kex3264 directory\r\n\r\n"
+			L"DllPath is %hu bytes long, but needs to be at most %hu bytes long.",
+			DllPath->Length,
+			TargetLength);
+
+		return STATUS_BUFFER_TOO_SMALL;
 	}
 
 	return STATUS_SUCCESS;
@@ -7,8 +7,8 @@
 // Abstract:
 //
 //     Contains routines related to DLL rewriting - more precisely, rewriting
-//     the names of DLLs imported from a PE image (which itself may be an EXE
-//     or a DLL).
+//     the names of DLLs imported (or delay-loaded) from a PE image (which
+//     itself may be an EXE or a DLL).
 //
 // Author:
 //
@@ -40,6 +40,9 @@ NTSTATUS KexInitializeDllRewrite(
 	UNICODE_STRING DllRewriteKeyName;
 	OBJECT_ATTRIBUTES ObjectAttributes;
 	ULONG Index;
+	ULONG ConfigurationSignature;
+
+	ConfigurationSignature = 0;
 
 	Status = KexRtlCreateStringMapper(
 		&DllRewriteStringMapper, 
@@ -177,6 +180,22 @@ NTSTATUS KexInitializeDllRewrite(
 			&StringMapperKey,
 			&StringMapperValue);
 
+		//
+		// Fold this entry into the configuration signature, which is used to
+		// invalidate the DLL rewrite cache whenever the DllRewrite key changes.
+		// The combination is order-independent because the enumeration order of
+		// registry values is not something we want to rely on.
+		//
+
+		{
+			ULONG KeyHash;
+			ULONG ValueHash;
+
+			RtlHashUnicodeString(&StringMapperKey, TRUE, HASH_STRING_ALGORITHM_DEFAULT, &KeyHash);
+			RtlHashUnicodeString(&StringMapperValue, TRUE, HASH_STRING_ALGORITHM_DEFAULT, &ValueHash);
+			ConfigurationSignature += (KeyHash * 33) ^ ValueHash;
+		}
+
 		Status = KexRtlInsertEntryStringMapper(
 			DllRewriteStringMapper,
 			&StringMapperKey,
@@ -188,6 +207,19 @@ NTSTATUS KexInitializeDllRewrite(
 	}
 
 	NtClose(DllRewriteKeyHandle);
+
+	//
+	// Open the DLL rewrite cache. Failure here is not a big deal, it just
+	// means that every image will have its imports looked up from scratch.
+	//
+
+	Status = KexInitializeDllRewriteCache(ConfigurationSignature);
+	if (!NT_SUCCESS(Status)) {
+		KexLogWarningEvent(
+			L"Failed to open the DLL rewrite cache.\r\n\r\n"
+			L"NTSTATUS error code: %s",
+			KexRtlNtStatusToString(Status));
+	}
 	
 	Status = KexpAddKex3264ToDllPath();
 	if (!NT_SUCCESS(Status)) {
@@ -205,10 +237,16 @@ NTSTATUS KexInitializeDllRewrite(
 } PROTECTED_FUNCTION_END
 
 //
-// Rewrite a DLL name based on the string mapper entries.
+// Look up the rewritten name of a DLL based on the string mapper entries.
+// The original DLL name is not modified - the rewritten name is placed in
+// RewrittenAnsiDllName, whose buffer must be supplied by the caller.
+//
+// This is the rewrite routine passed to KexLdrScanImageImports.
 //
-STATIC NTSTATUS KexpRewriteDllName(
-	IN OUT	PANSI_STRING	AnsiDllName) PROTECTED_FUNCTION
+STATIC NTSTATUS NTAPI KexpRewriteDllName(
+	IN		PVOID			Context OPTIONAL,
+	IN		PCANSI_STRING	AnsiDllName,
+	IN OUT	PANSI_STRING	RewrittenAnsiDllName) PROTECTED_FUNCTION
 {
 	NTSTATUS Status;
 	UNICODE_STRING DllName;
@@ -258,19 +296,285 @@ STATIC NTSTATUS KexpRewriteDllName(
 	}
 
 	Status = RtlUnicodeStringToAnsiString(
-		AnsiDllName,
+		RewrittenAnsiDllName,
 		&RewrittenDllName,
 		FALSE);
 
 Exit:
 	if (NT_SUCCESS(Status)) {
 		KexLogDetailEvent(L"Rewrote DLL import: %wZ -> %wZ", &DllName, &RewrittenDllName);
+	} else if (Status != STATUS_STRING_MAPPER_ENTRY_NOT_FOUND) {
+		KexLogWarningEvent(
+			L"Failed to rewrite DLL import %wZ\r\n\r\n"
+			L"NTSTATUS error code: %s",
+			&DllName,
+			KexRtlNtStatusToString(Status));
 	}
 
 	RtlFreeUnicodeString(&DllName);
 	return Status;
 } PROTECTED_FUNCTION_END
 
+//
+// Write rewritten DLL names into a mapped image.
+// The entries must be sorted by NameRva.
+//
+// Page protection is only changed on the pages which actually contain names
+// that need to be rewritten. Entries that lie on the same or adjacent pages
+// are grouped together, so that each group only costs a single pair of
+// NtProtectVirtualMemory calls.
+//
+STATIC NTSTATUS KexpApplyDllRewrites(
+	IN	PVOID						ImageBase,
+	IN	PCKEX_LDR_IMPORT_REWRITE	Rewrites,
+	IN	ULONG						NumberOfRewrites) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+	NTSTATUS FailureStatus;
+	ULONG FirstIndex;
+	ULONG LastIndex;
+
+	FailureStatus = STATUS_SUCCESS;
+	FirstIndex = 0;
+
+	while (FirstIndex < NumberOfRewrites) {
+		ULONG_PTR RegionStart;
+		ULONG_PTR RegionEnd;
+		PVOID RegionPtr;
+		SIZE_T RegionSize;
+		ULONG OldProtect;
+		ULONG Index;
+
+		//
+		// Find the extent of this group of entries.
+		//
+
+		RegionStart = (ULONG_PTR) PAGE_ALIGN(RVA_TO_VA(ImageBase, Rewrites[FirstIndex].NameRva));
+		RegionEnd = RegionStart;
+
+		for (LastIndex = FirstIndex; LastIndex < NumberOfRewrites; ++LastIndex) {
+			PCKEX_LDR_IMPORT_REWRITE Entry;
+			ULONG_PTR EntryStart;
+			ULONG_PTR EntryEnd;
+
+			Entry = &Rewrites[LastIndex];
+			EntryStart = (ULONG_PTR) RVA_TO_VA(ImageBase, Entry->NameRva);
+			EntryEnd = EntryStart + strlen(Entry->RewrittenName) + 1;
+
+			if ((ULONG_PTR) PAGE_ALIGN(EntryStart) > ROUND_TO_PAGES(RegionEnd)) {
+				break;
+			}
+
+			RegionEnd = max(RegionEnd, EntryEnd);
+		}
+
+		RegionPtr = (PVOID) RegionStart;
+		RegionSize = RegionEnd - RegionStart;
+
+		Status = NtProtectVirtualMemory(
+			NtCurrentProcess(),
+			&RegionPtr,
+			&RegionSize,
+			PAGE_READWRITE,
+			&OldProtect);
+
+		if (NT_SUCCESS(Status)) {
+			for (Index = FirstIndex; Index < LastIndex; ++Index) {
+				PCKEX_LDR_IMPORT_REWRITE Entry;
+
+				Entry = &Rewrites[Index];
+
+				KexRtlCopyMemory(
+					RVA_TO_VA(ImageBase, Entry->NameRva),
+					Entry->RewrittenName,
+					strlen(Entry->RewrittenName) + 1);
+			}
+
+			NtProtectVirtualMemory(
+				NtCurrentProcess(),
+				&RegionPtr,
+				&RegionSize,
+				OldProtect,
+				&OldProtect);
+		} else {
+			KexLogErrorEvent(
+				L"Failed to change page protection\r\n\r\n"
+				L"on memory at base 0x%p (region size %Iu)\r\n"
+				L"NTSTATUS error code: %s",
+				RegionPtr,
+				RegionSize,
+				KexRtlNtStatusToString(Status));
+
+			FailureStatus = Status;
+		}
+
+		FirstIndex = LastIndex;
+	}
+
+	return FailureStatus;
+} PROTECTED_FUNCTION_END
+
+//
+// Check that the entries of a DLL rewrite cache entry can safely be written
+// into a mapped image. The cache lives in HKCU, so the entries may be stale
+// or may have been tampered with. Each entry must lie inside the image, the
+// entries must be sorted by NameRva (KexpApplyDllRewrites relies on this),
+// and each rewritten name must fit into the original name which it
+// replaces.
+//
+STATIC BOOLEAN KexpCheckCachedDllRewrites(
+	IN	PVOID						ImageBase,
+	IN	ULONG						SizeOfImage,
+	IN	PCKEX_LDR_IMPORT_REWRITE	Rewrites,
+	IN	ULONG						NumberOfRewrites) PROTECTED_FUNCTION
+{
+	ULONG Index;
+	ULONG PreviousNameEnd;
+
+	PreviousNameEnd = 0;
+
+	for (Index = 0; Index < NumberOfRewrites; ++Index) {
+		PCKEX_LDR_IMPORT_REWRITE Entry;
+		PCSTR OriginalName;
+		SIZE_T OriginalNameCch;
+		SIZE_T RewrittenNameCch;
+		SIZE_T MaximumCch;
+
+		Entry = &Rewrites[Index];
+
+		if (Entry->NameRva < PreviousNameEnd || Entry->NameRva >= SizeOfImage) {
+			return FALSE;
+		}
+
+		//
+		// Find the end of the original name without reading past the end
+		// of the image.
+		//
+
+		OriginalName = (PCSTR) RVA_TO_VA(ImageBase, Entry->NameRva);
+		MaximumCch = SizeOfImage - Entry->NameRva;
+
+		for (OriginalNameCch = 0; OriginalNameCch < MaximumCch; ++OriginalNameCch) {
+			if (OriginalName[OriginalNameCch] == '\0') {
+				break;
+			}
+		}
+
+		if (OriginalNameCch == MaximumCch) {
+			return FALSE;
+		}
+
+		RewrittenNameCch = strlen(Entry->RewrittenName);
+
+		if (RewrittenNameCch > OriginalNameCch) {
+			return FALSE;
+		}
+
+		PreviousNameEnd = Entry->NameRva + (ULONG) OriginalNameCch + 1;
+	}
+
+	return TRUE;
+} PROTECTED_FUNCTION_END_BOOLEAN
+
+//
+// Mark the bound import entries of the rewritten DLLs in a mapped image as
+// stale. See KexLdrInvalidateBoundImports for more information.
+//
+STATIC NTSTATUS KexpInvalidateBoundImports(
+	IN	PVOID						ImageBase,
+	IN	PIMAGE_NT_HEADERS			NtHeaders,
+	IN	PIMAGE_DATA_DIRECTORY		BoundImportDirectory,
+	IN	PCKEX_LDR_IMPORT_REWRITE	Rewrites,
+	IN	ULONG						NumberOfRewrites) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+	PVOID BoundImportPtr;
+	SIZE_T BoundImportSize;
+	ULONG OldProtect;
+
+	BoundImportPtr = RVA_TO_VA(ImageBase, BoundImportDirectory->VirtualAddress);
+	BoundImportSize = BoundImportDirectory->Size;
+
+	Status = NtProtectVirtualMemory(
+		NtCurrentProcess(),
+		&BoundImportPtr,
+		&BoundImportSize,
+		PAGE_READWRITE,
+		&OldProtect);
+
+	if (!NT_SUCCESS(Status)) {
+		KexLogErrorEvent(
+			L"Failed to change page protection\r\n\r\n"
+			L"on memory at base 0x%p (region size %Iu)\r\n"
+			L"NTSTATUS error code: %s",
+			BoundImportPtr,
+			BoundImportSize,
+			KexRtlNtStatusToString(Status));
+
+		return Status;
+	}
+
+	Status = KexLdrInvalidateBoundImports(
+		ImageBase,
+		NtHeaders->OptionalHeader.SizeOfImage,
+		KEX_LDR_IMAGE_MAPPED,
+		Rewrites,
+		NumberOfRewrites);
+
+	NtProtectVirtualMemory(
+		NtCurrentProcess(),
+		&BoundImportPtr,
+		&BoundImportSize,
+		OldProtect,
+		&OldProtect);
+
+	return Status;
+} PROTECTED_FUNCTION_END
+
+//
+// Remove the bound import directory from an image entirely. This is only
+// done if we can't tell exactly which bound entries are stale.
+//
+STATIC NTSTATUS KexpEraseBoundImportDirectory(
+	IN	PIMAGE_DATA_DIRECTORY	BoundImportDirectory) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+	PVOID DataDirectoryPtr;
+	SIZE_T DataDirectorySize;
+	ULONG OldProtect;
+
+	DataDirectoryPtr = BoundImportDirectory;
+	DataDirectorySize = sizeof(IMAGE_DATA_DIRECTORY);
+
+	Status = NtProtectVirtualMemory(
+		NtCurrentProcess(),
+		&DataDirectoryPtr,
+		&DataDirectorySize,
+		PAGE_READWRITE,
+		&OldProtect);
+
+	if (NT_SUCCESS(Status)) {
+		RtlZeroMemory(BoundImportDirectory, sizeof(*BoundImportDirectory));
+
+		NtProtectVirtualMemory(
+			NtCurrentProcess(),
+			&DataDirectoryPtr,
+			&DataDirectorySize,
+			OldProtect,
+			&OldProtect);
+	} else {
+		KexLogErrorEvent(
+			L"Failed to change page protection\r\n\r\n"
+			L"on memory at base 0x%p (region size %Iu)\r\n"
+			L"NTSTATUS error code: %s",
+			DataDirectoryPtr,
+			DataDirectorySize,
+			KexRtlNtStatusToString(Status));
+	}
+
+	return Status;
+} PROTECTED_FUNCTION_END
+
 //
 // Determine whether the imports of a particular DLL (identified by name and
 // path) should be rewritten.
@@ -301,14 +605,15 @@ NTSTATUS KexRewriteImageImportDirectory(
 	PIMAGE_NT_HEADERS NtHeaders;
 	PIMAGE_FILE_HEADER CoffHeader;
 	PIMAGE_OPTIONAL_HEADER OptionalHeader;
-	PIMAGE_DATA_DIRECTORY ImportDirectory;
-	PIMAGE_IMPORT_DESCRIPTOR ImportDescriptor;
-	PVOID ImportTablePtr;
-	SIZE_T ImportTableSize;
-	BOOLEAN AtLeastOneImportWasRewritten;
-	ULONG OldProtect;
+	PIMAGE_DATA_DIRECTORY BoundImportDirectory;
+	PKEX_LDR_IMPORT_REWRITE Rewrites;
+	ULONG NumberOfRewrites;
+	BOOLEAN CacheHit;
+	BOOLEAN CacheOverflow;
+	KEX_DLL_REWRITE_CACHE_DATA RewriteData;
 
-	AtLeastOneImportWasRewritten = FALSE;
+	Rewrites = RewriteData.Entries;
+	CacheOverflow = FALSE;
 
 	Status = RtlImageNtHeaderEx(RTL_IMAGE_NT_HEADER_EX_FLAG_NO_RANGE_CHECK, ImageBase, 0, &NtHeaders);
 	if (!NT_SUCCESS(Status)) {
@@ -323,7 +628,6 @@ NTSTATUS KexRewriteImageImportDirectory(
 
 	CoffHeader = &NtHeaders->FileHeader;
 	OptionalHeader = &NtHeaders->OptionalHeader;
-	ImportDirectory = &OptionalHeader->DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
 
 	if ((KexRtlCurrentProcessBitness() == 64) != (CoffHeader->Machine == 0x8664)) {
 		//
@@ -341,130 +645,155 @@ NTSTATUS KexRewriteImageImportDirectory(
 		return STATUS_IMAGE_MACHINE_TYPE_MISMATCH;
 	}
 
-	if (OptionalHeader->NumberOfRvaAndSizes < (IMAGE_DIRECTORY_ENTRY_IMPORT + 1) ||
-		ImportDirectory->VirtualAddress == 0) {
+	//
+	// Check whether we already know what needs to be done to this image from
+	// a previous run. If there is nothing to rewrite, we can avoid touching
+	// the page protections of the image entirely.
+	//
+
+	Status = KexLookupDllRewriteCache(FullImageName, NtHeaders, &RewriteData);
+	CacheHit = NT_SUCCESS(Status);
+
+	if (CacheHit && !KexpCheckCachedDllRewrites(
+			ImageBase,
+			OptionalHeader->SizeOfImage,
+			RewriteData.Entries,
+			RewriteData.NumberOfEntries)) {
+
 		//
-		// There is no import directory in the image.
+		// The scan below will overwrite the bad cache entry.
 		//
 
-		KexLogInformationEvent(
-			L"%wZ contains no import directory",
-			BaseImageName);
-
-		return STATUS_IMAGE_NO_IMPORT_DIRECTORY;
+		KexLogWarningEvent(L"Ignoring an invalid DLL rewrite cache entry for %wZ", BaseImageName);
+		CacheHit = FALSE;
 	}
 
-	ImportDescriptor = (PIMAGE_IMPORT_DESCRIPTOR) RVA_TO_VA(ImageBase, ImportDirectory->VirtualAddress);
+	if (CacheHit) {
+		if (RewriteData.NumberOfEntries == 0) {
+			KexLogDebugEvent(L"DLL rewrite cache: %wZ has no imports to rewrite", BaseImageName);
+			return STATUS_SUCCESS;
+		}
 
-	if (ImportDescriptor->Name == 0) {
+		NumberOfRewrites = RewriteData.NumberOfEntries;
+	} else {
 		//
-		// There shouldn't be an import directory if it has no entries.
+		// Scan pass. Walk through the imports and figure out which ones need
+		// to be rewritten, without modifying the image. Most images don't
+		// need anything rewritten at all, and in that case we never need to
+		// change any page protections (and therefore never cause any of the
+		// image's pages to be copied).
 		//
 
-		KexLogWarningEvent(
-			L"%wZ contains an empty import directory",
-			BaseImageName);
+		NumberOfRewrites = ARRAYSIZE(RewriteData.Entries);
+
+		Status = KexLdrScanImageImports(
+			ImageBase,
+			OptionalHeader->SizeOfImage,
+			KEX_LDR_IMAGE_MAPPED,
+			KexpRewriteDllName,
+			NULL,
+			Rewrites,
+			&NumberOfRewrites);
+
+		if (Status == STATUS_BUFFER_TOO_SMALL) {
+			//
+			// Too many imports need rewriting to fit into RewriteData.
+			// This image will not be cached.
+			//
+
+			CacheOverflow = TRUE;
+			Rewrites = SafeAlloc(KEX_LDR_IMPORT_REWRITE, NumberOfRewrites);
+
+			if (!Rewrites) {
+				return STATUS_NO_MEMORY;
+			}
+
+			Status = KexLdrScanImageImports(
+				ImageBase,
+				OptionalHeader->SizeOfImage,
+				KEX_LDR_IMAGE_MAPPED,
+				KexpRewriteDllName,
+				NULL,
+				Rewrites,
+				&NumberOfRewrites);
+		}
+
+		if (!NT_SUCCESS(Status)) {
+			if (Status == STATUS_IMAGE_NO_IMPORT_DIRECTORY) {
+				KexLogInformationEvent(
+					L"%wZ contains no import directory",
+					BaseImageName);
+			} else {
+				KexLogWarningEvent(
+					L"Failed to scan the import directory of %wZ\r\n\r\n"
+					L"NTSTATUS error code: %s",
+					BaseImageName,
+					KexRtlNtStatusToString(Status));
+			}
+
+			goto Exit;
+		}
 
-		return STATUS_INVALID_IMAGE_FORMAT;
+		RewriteData.NumberOfEntries = min(NumberOfRewrites, ARRAYSIZE(RewriteData.Entries));
+	}
+
+	if (NumberOfRewrites == 0) {
+		goto Exit;
 	}
 
 	//
-	// Set entire import directory to read-write.
+	// Write pass. Only pages containing names that need to be rewritten
+	// are made writable.
 	//
-	
-	ImportTablePtr = ImportDescriptor;
-	ImportTableSize = ImportDirectory->Size;
-	Status = NtProtectVirtualMemory(
-		NtCurrentProcess(),
-		&ImportTablePtr,
-		&ImportTableSize,
-		PAGE_READWRITE,
-		&OldProtect);
 
+	Status = KexpApplyDllRewrites(ImageBase, Rewrites, NumberOfRewrites);
 	if (!NT_SUCCESS(Status)) {
-		KexLogErrorEvent(
-			L"Failed to change page protection\r\n\r\n"
-			L"on memory at base 0x%p (region size %hu)\r\n"
-			L"NTSTATUS error code: %s",
-			ImportTablePtr,
-			ImportTableSize,
-			KexRtlNtStatusToString(Status));
-
-		// Don't bother returning here. If we AV, the
-		// exception handler will deal with it.
+		CacheOverflow = TRUE;
 	}
 
 	//
-	// Walk through imports and rewrite each one if necessary.
+	// The bound import directory can be kept, but the bound entries for
+	// the DLLs we have replaced must be marked as stale. If something went
+	// wrong above, we can't tell which entries are stale, so in that case
+	// the whole directory is erased.
 	//
 
-	do {
-		PSTR DllNameBuffer;
-		ANSI_STRING ImportedDllNameAnsi;
+	if (OptionalHeader->NumberOfRvaAndSizes > IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT) {
+		BoundImportDirectory = &OptionalHeader->DataDirectory[IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT];
 
-		DllNameBuffer = (PSTR) RVA_TO_VA(ImageBase, ImportDescriptor->Name);
-		RtlInitAnsiString(&ImportedDllNameAnsi, DllNameBuffer);
+		if (BoundImportDirectory->VirtualAddress != 0) {
+			if (NT_SUCCESS(Status)) {
+				Status = KexpInvalidateBoundImports(
+					ImageBase,
+					NtHeaders,
+					BoundImportDirectory,
+					Rewrites,
+					NumberOfRewrites);
+			}
 
-		Status = KexpRewriteDllName(&ImportedDllNameAnsi);
-		
-		if (NT_SUCCESS(Status)) {
-			AtLeastOneImportWasRewritten = TRUE;
+			if (!NT_SUCCESS(Status)) {
+				KexpEraseBoundImportDirectory(BoundImportDirectory);
+				CacheOverflow = TRUE;
+			}
 		}
-	} while ((++ImportDescriptor)->Name != 0);
-
-	// restore old permissions
-	NtProtectVirtualMemory(
-		NtCurrentProcess(),
-		&ImportTablePtr,
-		&ImportTableSize,
-		OldProtect,
-		&OldProtect);
-
-	if (AtLeastOneImportWasRewritten) {
-		PIMAGE_DATA_DIRECTORY BoundImportDirectory;
-		PVOID DataDirectoryPtr;
-		SIZE_T DataDirectorySize;
-
-		//
-		// A Bound Import Directory will cause process initialization to fail if we have rewritten
-		// anything. So we simply zero it out.
-		// Bound imports are a performance optimization, but basically we can't use it because
-		// the bound import addresses are dependent on the "real" function addresses within the
-		// imported DLL - and since we have replaced one or more imported DLLs, these pre-calculated
-		// function addresses are no longer valid, so we just have to delete it.
-		//
-
-		BoundImportDirectory = &OptionalHeader->DataDirectory[IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT];
+	}
 
-		DataDirectoryPtr = BoundImportDirectory;
-		DataDirectorySize = sizeof(IMAGE_DATA_DIRECTORY);
+	Status = STATUS_SUCCESS;
 
-		Status = NtProtectVirtualMemory(
-			NtCurrentProcess(),
-			&DataDirectoryPtr,
-			&DataDirectorySize,
-			PAGE_READWRITE,
-			&OldProtect);
+Exit:
+	//
+	// Record the results in the DLL rewrite cache. If there were too many
+	// rewritten imports to fit in a cache entry, or if writing some of them
+	// failed, we just don't cache this image.
+	//
 
-		if (NT_SUCCESS(Status)) {
-			RtlZeroMemory(BoundImportDirectory, sizeof(*BoundImportDirectory));
-		} else {
-			KexLogErrorEvent(
-				L"Failed to change page protection\r\n\r\n"
-				L"on memory at base 0x%p (region size %Iu)\r\n"
-				L"NTSTATUS error code: %s",
-				DataDirectoryPtr,
-				DataDirectorySize,
-				KexRtlNtStatusToString(Status));
-		}
+	if (NT_SUCCESS(Status) && !CacheHit && !CacheOverflow) {
+		KexUpdateDllRewriteCache(FullImageName, NtHeaders, &RewriteData);
+	}
 
-		NtProtectVirtualMemory(
-			NtCurrentProcess(),
-			&DataDirectoryPtr,
-			&DataDirectorySize,
-			OldProtect,
-			&OldProtect);
+	if (Rewrites != RewriteData.Entries) {
+		SafeFree(Rewrites);
 	}
 
-	return STATUS_SUCCESS;
+	return Status;
 } PROTECTED_FUNCTION_END
\ No newline at end of file
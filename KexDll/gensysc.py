@@ -0,0 +1,53 @@
+#
+# Generates syscal64.asm from the list of system calls in syscalls.h.
+#
+# Usage: python gensysc.py
+#
+# The 32-bit stubs and the tables are generated by the C preprocessor, so
+# this script only has to produce the x64 stubs, which MASM cannot build
+# directly from a C header.
+#
+
+import os
+import re
+
+here = os.path.dirname(os.path.abspath(__file__))
+
+with open(os.path.join(here, "syscalls.h"), "r") as f:
+	names = re.findall(r"^KEX_SYSCALL\((\w+),", f.read(), re.MULTILINE)
+
+lines = [
+	"; Generated by gensysc.py from syscalls.h. Do not edit.",
+	"",
+	"IFDEF RAX",
+	"",
+	"EXTERN KexpSyscallNumbers64:DWORD",
+	"",
+	"_TEXT SEGMENT",
+	"",
+	"GENERATE_SYSCALL MACRO SyscallName, SyscallIndex",
+	"PUBLIC SyscallName",
+	"ALIGN 16",
+	"SyscallName PROC",
+	"\tmov\t\t\tr10, rcx",
+	"\tmov\t\t\teax, DWORD PTR KexpSyscallNumbers64[SyscallIndex * 4]",
+	"\tsyscall",
+	"\tret",
+	"SyscallName ENDP",
+	"ENDM",
+	"",
+]
+
+for index, name in enumerate(names):
+	lines.append("GENERATE_SYSCALL Kex%s,%s%d" % (name, "\t" * max(1, (64 - len("GENERATE_SYSCALL Kex%s," % name) + 3) // 4), index))
+
+lines += [
+	"",
+	"_TEXT ENDS",
+	"",
+	"ENDIF",
+	"END",
+]
+
+with open(os.path.join(here, "syscal64.asm"), "w", newline="\r\n") as f:
+	f.write("\n".join(lines))
\ No newline at end of file
@@ -0,0 +1,760 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     imgrewrt.c
+//
+// Abstract:
+//
+//     Contains routines which find and rewrite the names of DLLs imported by
+//     a PE image contained in a memory buffer.
+//
+//     These routines do not depend on any process state (loaded modules,
+//     page protections, the DllRewrite configuration etc.) and do not log
+//     anything. The buffer may contain either a mapped image, as is the case
+//     when called from KexRewriteImageImportDirectory, or the raw contents of
+//     an image file, as is the case when called from an offline tool. Images
+//     of either bitness can be processed no matter the bitness of the caller.
+//
+// Environment:
+//
+//     Anywhere.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "buildcfg.h"
+#include "kexdllp.h"
+
+//
+// Longest DLL name we are willing to look at. This is only used to bound the
+// search for the null terminator of a string inside the image buffer.
+//
+#define KEX_LDR_MAX_IMPORT_NAME_CCH 256
+
+typedef struct _KEX_LDR_IMAGE {
+	PBYTE					Base;
+	SIZE_T					Size;
+	ULONG					Flags;
+	PIMAGE_NT_HEADERS		NtHeaders;
+	ULONG					SizeOfHeaders;
+	ULONG					NumberOfRvaAndSizes;
+	PIMAGE_DATA_DIRECTORY	DataDirectory;
+} TYPEDEF_TYPE_NAME(KEX_LDR_IMAGE);
+
+STATIC NTSTATUS KexpLdrInitializeImage(
+	OUT	PKEX_LDR_IMAGE	Image,
+	IN	PVOID			ImageBase,
+	IN	SIZE_T			ImageSize,
+	IN	ULONG			Flags)
+{
+	NTSTATUS Status;
+	PIMAGE_NT_HEADERS NtHeaders;
+
+	Status = RtlImageNtHeaderEx(0, ImageBase, ImageSize, &NtHeaders);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	Image->Base = (PBYTE) ImageBase;
+	Image->Size = ImageSize;
+	Image->Flags = Flags;
+	Image->NtHeaders = NtHeaders;
+
+	//
+	// The optional header differs between PE32 and PE32+, so we can't just
+	// use the IMAGE_NT_HEADERS type that matches our own bitness.
+	// RtlImageNtHeaderEx only checks that the file header is inside the
+	// buffer, so everything up to the data directory array has to be
+	// checked here before it is read.
+	//
+
+	if ((PBYTE) (&NtHeaders->OptionalHeader.Magic + 1) > Image->Base + Image->Size) {
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	if (NtHeaders->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC) {
+		PIMAGE_NT_HEADERS64 NtHeaders64;
+
+		NtHeaders64 = (PIMAGE_NT_HEADERS64) NtHeaders;
+
+		if ((PBYTE) NtHeaders64->OptionalHeader.DataDirectory > Image->Base + Image->Size) {
+			return STATUS_INVALID_IMAGE_FORMAT;
+		}
+
+		Image->SizeOfHeaders = NtHeaders64->OptionalHeader.SizeOfHeaders;
+		Image->NumberOfRvaAndSizes = NtHeaders64->OptionalHeader.NumberOfRvaAndSizes;
+		Image->DataDirectory = NtHeaders64->OptionalHeader.DataDirectory;
+	} else if (NtHeaders->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR32_MAGIC) {
+		PIMAGE_NT_HEADERS32 NtHeaders32;
+
+		NtHeaders32 = (PIMAGE_NT_HEADERS32) NtHeaders;
+
+		if ((PBYTE) NtHeaders32->OptionalHeader.DataDirectory > Image->Base + Image->Size) {
+			return STATUS_INVALID_IMAGE_FORMAT;
+		}
+
+		Image->SizeOfHeaders = NtHeaders32->OptionalHeader.SizeOfHeaders;
+		Image->NumberOfRvaAndSizes = NtHeaders32->OptionalHeader.NumberOfRvaAndSizes;
+		Image->DataDirectory = NtHeaders32->OptionalHeader.DataDirectory;
+	} else {
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	if (Image->NumberOfRvaAndSizes >
+		(ULONG_PTR) ((Image->Base + Image->Size) - (PBYTE) Image->DataDirectory) / sizeof(IMAGE_DATA_DIRECTORY)) {
+
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+//
+// Convert a RVA to a pointer into the image buffer, making sure that Cb
+// bytes starting at that pointer lie entirely inside the buffer.
+// Returns NULL if the RVA is invalid.
+//
+STATIC PVOID KexpLdrImageRvaToPointer(
+	IN	PCKEX_LDR_IMAGE	Image,
+	IN	ULONG			Rva,
+	IN	ULONG			Cb)
+{
+	ULONG_PTR Offset;
+
+	if ((Image->Flags & KEX_LDR_IMAGE_MAPPED) || Rva < Image->SizeOfHeaders) {
+		Offset = Rva;
+	} else {
+		PIMAGE_SECTION_HEADER SectionHeader;
+		ULONG Index;
+
+		SectionHeader = IMAGE_FIRST_SECTION(Image->NtHeaders);
+
+		for (Index = 0; Index < Image->NtHeaders->FileHeader.NumberOfSections; ++Index, ++SectionHeader) {
+			if ((PBYTE) (SectionHeader + 1) > Image->Base + Image->Size) {
+				return NULL;
+			}
+
+			if (Rva >= SectionHeader->VirtualAddress &&
+				Rva - SectionHeader->VirtualAddress < SectionHeader->SizeOfRawData) {
+
+				break;
+			}
+		}
+
+		if (Index == Image->NtHeaders->FileHeader.NumberOfSections) {
+			return NULL;
+		}
+
+		Offset = SectionHeader->PointerToRawData + (Rva - SectionHeader->VirtualAddress);
+	}
+
+	if (Offset > Image->Size || Cb > Image->Size - Offset) {
+		return NULL;
+	}
+
+	return Image->Base + Offset;
+}
+
+//
+// Retrieve a pointer to a null terminated string inside the image buffer.
+// Returns NULL if the string is not entirely inside the buffer, or if it is
+// unreasonably long.
+//
+STATIC PCHAR KexpLdrImageStringAtRva(
+	IN	PCKEX_LDR_IMAGE	Image,
+	IN	ULONG			Rva,
+	OUT	PUSHORT			Cch)
+{
+	PCHAR String;
+	ULONG_PTR MaximumCch;
+	USHORT Index;
+
+	String = (PCHAR) KexpLdrImageRvaToPointer(Image, Rva, 1);
+	if (!String) {
+		return NULL;
+	}
+
+	MaximumCch = min(KEX_LDR_MAX_IMPORT_NAME_CCH, (ULONG_PTR) ((Image->Base + Image->Size) - (PBYTE) String));
+
+	for (Index = 0; Index < MaximumCch; ++Index) {
+		if (String[Index] == '\0') {
+			*Cch = Index;
+			return String;
+		}
+	}
+
+	return NULL;
+}
+
+STATIC PIMAGE_DATA_DIRECTORY KexpLdrImageDirectory(
+	IN	PCKEX_LDR_IMAGE	Image,
+	IN	ULONG			DirectoryEntry)
+{
+	if (Image->NumberOfRvaAndSizes <= DirectoryEntry) {
+		return NULL;
+	}
+
+	if (Image->DataDirectory[DirectoryEntry].VirtualAddress == 0) {
+		return NULL;
+	}
+
+	return &Image->DataDirectory[DirectoryEntry];
+}
+
+typedef struct _KEX_LDR_SCAN_CONTEXT {
+	PCKEX_LDR_IMAGE					Image;
+	PKEX_LDR_IMPORT_REWRITE_ROUTINE	RewriteRoutine;
+	PVOID							RewriteContext;
+	PKEX_LDR_IMPORT_REWRITE			Rewrites;
+	ULONG							MaximumNumberOfRewrites;
+	ULONG							NumberOfRewrites;
+} TYPEDEF_TYPE_NAME(KEX_LDR_SCAN_CONTEXT);
+
+//
+// Call the rewrite routine for the DLL name at NameRva, and record the
+// result if the name needs to be rewritten. Entries that don't fit into the
+// caller's array are counted but not stored.
+//
+STATIC NTSTATUS KexpLdrScanDllName(
+	IN OUT	PKEX_LDR_SCAN_CONTEXT	ScanContext,
+	IN		ULONG					NameRva)
+{
+	NTSTATUS Status;
+	PKEX_LDR_IMPORT_REWRITE Rewrite;
+	KEX_LDR_IMPORT_REWRITE ScratchRewrite;
+	ANSI_STRING DllName;
+	ANSI_STRING RewrittenDllName;
+
+	DllName.Buffer = KexpLdrImageStringAtRva(ScanContext->Image, NameRva, &DllName.Length);
+	if (!DllName.Buffer) {
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	DllName.MaximumLength = DllName.Length + 1;
+
+	if (ScanContext->NumberOfRewrites < ScanContext->MaximumNumberOfRewrites) {
+		Rewrite = &ScanContext->Rewrites[ScanContext->NumberOfRewrites];
+	} else {
+		Rewrite = &ScratchRewrite;
+	}
+
+	RtlInitEmptyAnsiString(&RewrittenDllName, Rewrite->RewrittenName, sizeof(Rewrite->RewrittenName));
+
+	Status = ScanContext->RewriteRoutine(
+		ScanContext->RewriteContext,
+		&DllName,
+		&RewrittenDllName);
+
+	if (!NT_SUCCESS(Status)) {
+		//
+		// This DLL name doesn't need to be rewritten.
+		//
+
+		return STATUS_SUCCESS;
+	}
+
+	//
+	// Make sure that the rewrite routine gave us something we can actually
+	// write into the image.
+	//
+
+	if (RewrittenDllName.Length > DllName.Length ||
+		RewrittenDllName.Length >= sizeof(Rewrite->RewrittenName)) {
+
+		return STATUS_SUCCESS;
+	}
+
+	Rewrite->RewrittenName[RewrittenDllName.Length] = '\0';
+	Rewrite->NameRva = NameRva;
+	++ScanContext->NumberOfRewrites;
+
+	return STATUS_SUCCESS;
+}
+
+STATIC NTSTATUS KexpLdrScanImportDirectory(
+	IN OUT	PKEX_LDR_SCAN_CONTEXT	ScanContext,
+	IN		PIMAGE_DATA_DIRECTORY	ImportDirectory)
+{
+	NTSTATUS Status;
+	ULONG Rva;
+
+	for (Rva = ImportDirectory->VirtualAddress;; Rva += sizeof(IMAGE_IMPORT_DESCRIPTOR)) {
+		PIMAGE_IMPORT_DESCRIPTOR ImportDescriptor;
+
+		ImportDescriptor = (PIMAGE_IMPORT_DESCRIPTOR) KexpLdrImageRvaToPointer(
+			ScanContext->Image,
+			Rva,
+			sizeof(IMAGE_IMPORT_DESCRIPTOR));
+
+		if (!ImportDescriptor) {
+			return STATUS_INVALID_IMAGE_FORMAT;
+		}
+
+		if (ImportDescriptor->Name == 0) {
+			break;
+		}
+
+		Status = KexpLdrScanDllName(ScanContext, ImportDescriptor->Name);
+		if (!NT_SUCCESS(Status)) {
+			return Status;
+		}
+	}
+
+	if (Rva == ImportDirectory->VirtualAddress) {
+		//
+		// There shouldn't be an import directory if it has no entries.
+		//
+
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+STATIC NTSTATUS KexpLdrScanDelayImportDirectory(
+	IN OUT	PKEX_LDR_SCAN_CONTEXT	ScanContext,
+	IN		PIMAGE_DATA_DIRECTORY	DelayImportDirectory)
+{
+	NTSTATUS Status;
+	ULONG Rva;
+
+	for (Rva = DelayImportDirectory->VirtualAddress;; Rva += sizeof(IMAGE_DELAYLOAD_DESCRIPTOR)) {
+		PIMAGE_DELAYLOAD_DESCRIPTOR DelayImportDescriptor;
+
+		DelayImportDescriptor = (PIMAGE_DELAYLOAD_DESCRIPTOR) KexpLdrImageRvaToPointer(
+			ScanContext->Image,
+			Rva,
+			sizeof(IMAGE_DELAYLOAD_DESCRIPTOR));
+
+		if (!DelayImportDescriptor) {
+			return STATUS_INVALID_IMAGE_FORMAT;
+		}
+
+		if (DelayImportDescriptor->DllNameRVA == 0) {
+			break;
+		}
+
+		if (!DelayImportDescriptor->Attributes.RvaBased) {
+			//
+			// Very old linkers (VC6 and earlier) put VAs instead of
+			// RVAs in the delay import descriptors. Those images
+			// can't depend on any DLL we'd want to rewrite anyway.
+			//
+
+			continue;
+		}
+
+		Status = KexpLdrScanDllName(ScanContext, DelayImportDescriptor->DllNameRVA);
+		if (!NT_SUCCESS(Status)) {
+			return Status;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+//
+// The callback is called for each bound DLL name and each bound forwarder
+// DLL name in the bound import directory, along with a pointer to the time
+// stamp associated with that name and the time stamp of the bound import
+// descriptor which the name belongs to.
+//
+typedef NTSTATUS (*PKEXP_LDR_BOUND_IMPORT_CALLBACK)(
+	IN		PVOID	Context,
+	IN		ULONG	NameRva,
+	IN OUT	PULONG	TimeDateStamp,
+	IN OUT	PULONG	DescriptorTimeDateStamp);
+
+STATIC NTSTATUS KexpLdrWalkBoundImportDirectory(
+	IN	PCKEX_LDR_IMAGE					Image,
+	IN	PIMAGE_DATA_DIRECTORY			BoundImportDirectory,
+	IN	PKEXP_LDR_BOUND_IMPORT_CALLBACK	Callback,
+	IN	PVOID							Context)
+{
+	NTSTATUS Status;
+	PBYTE BoundImport;
+	ULONG Offset;
+
+	BoundImport = (PBYTE) KexpLdrImageRvaToPointer(
+		Image,
+		BoundImportDirectory->VirtualAddress,
+		BoundImportDirectory->Size);
+
+	if (!BoundImport) {
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	Offset = 0;
+
+	while (Offset + sizeof(IMAGE_BOUND_IMPORT_DESCRIPTOR) <= BoundImportDirectory->Size) {
+		PIMAGE_BOUND_IMPORT_DESCRIPTOR BoundImportDescriptor;
+		PIMAGE_BOUND_FORWARDER_REF ForwarderRef;
+		ULONG Index;
+
+		BoundImportDescriptor = (PIMAGE_BOUND_IMPORT_DESCRIPTOR) (BoundImport + Offset);
+
+		if (BoundImportDescriptor->OffsetModuleName == 0) {
+			break;
+		}
+
+		Status = Callback(
+			Context,
+			BoundImportDirectory->VirtualAddress + BoundImportDescriptor->OffsetModuleName,
+			&BoundImportDescriptor->TimeDateStamp,
+			&BoundImportDescriptor->TimeDateStamp);
+
+		if (!NT_SUCCESS(Status)) {
+			return Status;
+		}
+
+		Offset += sizeof(IMAGE_BOUND_IMPORT_DESCRIPTOR);
+
+		for (Index = 0; Index < BoundImportDescriptor->NumberOfModuleForwarderRefs; ++Index) {
+			if (Offset + sizeof(IMAGE_BOUND_FORWARDER_REF) > BoundImportDirectory->Size) {
+				return STATUS_INVALID_IMAGE_FORMAT;
+			}
+
+			ForwarderRef = (PIMAGE_BOUND_FORWARDER_REF) (BoundImport + Offset);
+
+			Status = Callback(
+				Context,
+				BoundImportDirectory->VirtualAddress + ForwarderRef->OffsetModuleName,
+				&ForwarderRef->TimeDateStamp,
+				&BoundImportDescriptor->TimeDateStamp);
+
+			if (!NT_SUCCESS(Status)) {
+				return Status;
+			}
+
+			Offset += sizeof(IMAGE_BOUND_FORWARDER_REF);
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+STATIC NTSTATUS KexpLdrScanBoundImport(
+	IN		PVOID	Context,
+	IN		ULONG	NameRva,
+	IN OUT	PULONG	TimeDateStamp,
+	IN OUT	PULONG	DescriptorTimeDateStamp)
+{
+	return KexpLdrScanDllName((PKEX_LDR_SCAN_CONTEXT) Context, NameRva);
+}
+
+STATIC VOID KexpLdrSortImportRewrites(
+	IN OUT	PKEX_LDR_IMPORT_REWRITE	Rewrites,
+	IN		ULONG					NumberOfRewrites)
+{
+	ULONG Index;
+
+	//
+	// There are only ever a handful of entries, so insertion sort is fine.
+	//
+
+	for (Index = 1; Index < NumberOfRewrites; ++Index) {
+		KEX_LDR_IMPORT_REWRITE Rewrite;
+		ULONG Position;
+
+		Rewrite = Rewrites[Index];
+		Position = Index;
+
+		while (Position > 0 && Rewrites[Position - 1].NameRva > Rewrite.NameRva) {
+			Rewrites[Position] = Rewrites[Position - 1];
+			--Position;
+		}
+
+		Rewrites[Position] = Rewrite;
+	}
+}
+
+STATIC BOOLEAN KexpLdrIsDllNameRewritten(
+	IN	PCKEX_LDR_IMPORT_REWRITE	Rewrites,
+	IN	ULONG						NumberOfRewrites,
+	IN	ULONG						NameRva)
+{
+	ULONG Low;
+	ULONG High;
+
+	Low = 0;
+	High = NumberOfRewrites;
+
+	while (Low < High) {
+		ULONG Middle;
+
+		Middle = Low + (High - Low) / 2;
+
+		if (Rewrites[Middle].NameRva == NameRva) {
+			return TRUE;
+		} else if (Rewrites[Middle].NameRva < NameRva) {
+			Low = Middle + 1;
+		} else {
+			High = Middle;
+		}
+	}
+
+	return FALSE;
+}
+
+//
+// Find the imported DLL names in an image which need to be rewritten.
+//
+//   ImageBase, ImageSize
+//     The buffer containing the image.
+//
+//   Flags
+//     KEX_LDR_IMAGE_MAPPED if the buffer contains a mapped image (i.e. the
+//     sections are laid out at their RVAs). Otherwise, the buffer is treated
+//     as the raw contents of an image file.
+//
+//   RewriteRoutine, RewriteContext
+//     Called for each DLL name found in the image. If the DLL name should be
+//     rewritten, the routine places the new name in its third parameter and
+//     returns a success code. Any failure code means that the name is left
+//     as-is. The new name must not be longer than the original.
+//
+//   Rewrites
+//     Receives the names to be rewritten, sorted by NameRva.
+//
+//   NumberOfRewrites
+//     On entry, the number of elements in the Rewrites array. On exit, the
+//     number of names that need to be rewritten. If this is greater than the
+//     size of the array, STATUS_BUFFER_TOO_SMALL is returned and the caller
+//     may call again with a larger array.
+//
+// The import directory and delay import directory are scanned. If any of
+// those names need to be rewritten, the names in the bound import directory
+// are scanned as well, since the loader loads bound DLLs using those names.
+//
+// Returns STATUS_IMAGE_NO_IMPORT_DIRECTORY if the image has neither an import
+// directory nor a delay import directory.
+//
+NTSTATUS NTAPI KexLdrScanImageImports(
+	IN		PVOID							ImageBase,
+	IN		SIZE_T							ImageSize,
+	IN		ULONG							Flags,
+	IN		PKEX_LDR_IMPORT_REWRITE_ROUTINE	RewriteRoutine,
+	IN		PVOID							RewriteContext OPTIONAL,
+	OUT		PKEX_LDR_IMPORT_REWRITE			Rewrites OPTIONAL,
+	IN OUT	PULONG							NumberOfRewrites) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+	KEX_LDR_IMAGE Image;
+	KEX_LDR_SCAN_CONTEXT ScanContext;
+	PIMAGE_DATA_DIRECTORY ImportDirectory;
+	PIMAGE_DATA_DIRECTORY DelayImportDirectory;
+	PIMAGE_DATA_DIRECTORY BoundImportDirectory;
+
+	if (!ImageBase || !RewriteRoutine || !NumberOfRewrites) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (Flags & ~KEX_LDR_IMAGE_MAPPED) {
+		return STATUS_INVALID_PARAMETER_3;
+	}
+
+	if (!Rewrites && *NumberOfRewrites != 0) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	Status = KexpLdrInitializeImage(&Image, ImageBase, ImageSize, Flags);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	ScanContext.Image = &Image;
+	ScanContext.RewriteRoutine = RewriteRoutine;
+	ScanContext.RewriteContext = RewriteContext;
+	ScanContext.Rewrites = Rewrites;
+	ScanContext.MaximumNumberOfRewrites = *NumberOfRewrites;
+	ScanContext.NumberOfRewrites = 0;
+
+	*NumberOfRewrites = 0;
+
+	ImportDirectory = KexpLdrImageDirectory(&Image, IMAGE_DIRECTORY_ENTRY_IMPORT);
+	DelayImportDirectory = KexpLdrImageDirectory(&Image, IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT);
+	BoundImportDirectory = KexpLdrImageDirectory(&Image, IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT);
+
+	if (!ImportDirectory && !DelayImportDirectory) {
+		return STATUS_IMAGE_NO_IMPORT_DIRECTORY;
+	}
+
+	if (ImportDirectory) {
+		Status = KexpLdrScanImportDirectory(&ScanContext, ImportDirectory);
+		if (!NT_SUCCESS(Status)) {
+			return Status;
+		}
+	}
+
+	if (DelayImportDirectory) {
+		Status = KexpLdrScanDelayImportDirectory(&ScanContext, DelayImportDirectory);
+		if (!NT_SUCCESS(Status)) {
+			return Status;
+		}
+	}
+
+	//
+	// Bound import entries are only looked at if the corresponding imports
+	// were rewritten, since otherwise there is nothing to invalidate.
+	//
+
+	if (BoundImportDirectory && ScanContext.NumberOfRewrites != 0) {
+		Status = KexpLdrWalkBoundImportDirectory(
+			&Image,
+			BoundImportDirectory,
+			KexpLdrScanBoundImport,
+			&ScanContext);
+
+		if (!NT_SUCCESS(Status)) {
+			return Status;
+		}
+	}
+
+	*NumberOfRewrites = ScanContext.NumberOfRewrites;
+
+	if (ScanContext.NumberOfRewrites > ScanContext.MaximumNumberOfRewrites) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	KexpLdrSortImportRewrites(Rewrites, ScanContext.NumberOfRewrites);
+	return STATUS_SUCCESS;
+} PROTECTED_FUNCTION_END_NOLOG
+
+typedef struct _KEX_LDR_INVALIDATE_CONTEXT {
+	PCKEX_LDR_IMPORT_REWRITE	Rewrites;
+	ULONG						NumberOfRewrites;
+} TYPEDEF_TYPE_NAME(KEX_LDR_INVALIDATE_CONTEXT);
+
+STATIC NTSTATUS KexpLdrInvalidateBoundImport(
+	IN		PVOID	Context,
+	IN		ULONG	NameRva,
+	IN OUT	PULONG	TimeDateStamp,
+	IN OUT	PULONG	DescriptorTimeDateStamp)
+{
+	PKEX_LDR_INVALIDATE_CONTEXT InvalidateContext;
+
+	InvalidateContext = (PKEX_LDR_INVALIDATE_CONTEXT) Context;
+
+	if (KexpLdrIsDllNameRewritten(InvalidateContext->Rewrites, InvalidateContext->NumberOfRewrites, NameRva)) {
+		//
+		// If a forwarder is stale, the whole entry is stale.
+		//
+
+		*TimeDateStamp = 0;
+		*DescriptorTimeDateStamp = 0;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+//
+// Mark the bound import entries of all DLLs that are rewritten as stale, by
+// zeroing their time stamps.
+//
+// The IAT entries for a rewritten DLL were pre-calculated against the
+// original DLL, so they are no longer valid. A stale entry makes the loader
+// snap the IAT for that DLL only, while bound entries for DLLs that were not
+// rewritten continue to be used as normal.
+//
+// The bound import directory must be writable. Rewrites must be sorted by
+// NameRva, as returned by KexLdrScanImageImports.
+//
+NTSTATUS NTAPI KexLdrInvalidateBoundImports(
+	IN	PVOID						ImageBase,
+	IN	SIZE_T						ImageSize,
+	IN	ULONG						Flags,
+	IN	PCKEX_LDR_IMPORT_REWRITE	Rewrites,
+	IN	ULONG						NumberOfRewrites) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+	KEX_LDR_IMAGE Image;
+	KEX_LDR_INVALIDATE_CONTEXT InvalidateContext;
+	PIMAGE_DATA_DIRECTORY BoundImportDirectory;
+
+	if (!ImageBase || (!Rewrites && NumberOfRewrites != 0)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	Status = KexpLdrInitializeImage(&Image, ImageBase, ImageSize, Flags);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	BoundImportDirectory = KexpLdrImageDirectory(&Image, IMAGE_DIRECTORY_ENTRY_BOUND_IMPORT);
+	if (!BoundImportDirectory || NumberOfRewrites == 0) {
+		return STATUS_SUCCESS;
+	}
+
+	InvalidateContext.Rewrites = Rewrites;
+	InvalidateContext.NumberOfRewrites = NumberOfRewrites;
+
+	return KexpLdrWalkBoundImportDirectory(
+		&Image,
+		BoundImportDirectory,
+		KexpLdrInvalidateBoundImport,
+		&InvalidateContext);
+} PROTECTED_FUNCTION_END_NOLOG
+
+//
+// Write the rewritten DLL names into an image and invalidate the bound
+// import entries for those DLLs. The whole buffer must be writable.
+// Rewrites must be sorted by NameRva, as returned by KexLdrScanImageImports.
+//
+NTSTATUS NTAPI KexLdrApplyImageImportRewrites(
+	IN	PVOID						ImageBase,
+	IN	SIZE_T						ImageSize,
+	IN	ULONG						Flags,
+	IN	PCKEX_LDR_IMPORT_REWRITE	Rewrites,
+	IN	ULONG						NumberOfRewrites) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+	KEX_LDR_IMAGE Image;
+	ULONG Index;
+
+	if (!ImageBase || (!Rewrites && NumberOfRewrites != 0)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	Status = KexpLdrInitializeImage(&Image, ImageBase, ImageSize, Flags);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	//
+	// Validate everything before writing anything, so that we don't leave
+	// a half-rewritten image behind.
+	//
+
+	for (Index = 0; Index < NumberOfRewrites; ++Index) {
+		HRESULT Result;
+		USHORT OriginalCch;
+		SIZE_T RewrittenCch;
+
+		if (!KexpLdrImageStringAtRva(&Image, Rewrites[Index].NameRva, &OriginalCch)) {
+			return STATUS_INVALID_IMAGE_FORMAT;
+		}
+
+		Result = StringCchLengthA(
+			Rewrites[Index].RewrittenName,
+			ARRAYSIZE(Rewrites[Index].RewrittenName),
+			&RewrittenCch);
+
+		if (FAILED(Result) || RewrittenCch > OriginalCch) {
+			return STATUS_BUFFER_TOO_SMALL;
+		}
+	}
+
+	for (Index = 0; Index < NumberOfRewrites; ++Index) {
+		PCHAR DllName;
+		USHORT OriginalCch;
+
+		DllName = KexpLdrImageStringAtRva(&Image, Rewrites[Index].NameRva, &OriginalCch);
+
+		KexRtlCopyMemory(
+			DllName,
+			Rewrites[Index].RewrittenName,
+			strlen(Rewrites[Index].RewrittenName) + 1);
+	}
+
+	return KexLdrInvalidateBoundImports(ImageBase, ImageSize, Flags, Rewrites, NumberOfRewrites);
+} PROTECTED_FUNCTION_END_NOLOG
\ No newline at end of file
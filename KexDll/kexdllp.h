@@ -72,6 +72,71 @@ ULONG KexDllProtectedFunctionExceptionFilter(
 
 extern PKEX_PROCESS_DATA KexData;
 
+//
+// DLL rewrite cache (see rwcache.c)
+//
+
+#define KEX_DLL_REWRITE_CACHE_VERSION		3
+#define KEX_DLL_REWRITE_CACHE_MAX_ENTRIES	64
+
+typedef struct _KEX_DLL_REWRITE_CACHE_DATA {
+	ULONG		Version;								// KEX_DLL_REWRITE_CACHE_VERSION
+	ULONG		ConfigurationSignature;					// identifies DllRewrite key contents
+	ULONG		SizeOfImage;
+	ULONG		TimeDateStamp;
+	ULONG		CheckSum;
+	ULONG		NumberOfEntries;						// 0 = nothing to rewrite
+	KEX_LDR_IMPORT_REWRITE	Entries[KEX_DLL_REWRITE_CACHE_MAX_ENTRIES];	// sorted by NameRva
+} TYPEDEF_TYPE_NAME(KEX_DLL_REWRITE_CACHE_DATA);
+
+//
+// Unhooked system call stubs (see syscalls.h and sysctab.c)
+//
+
+typedef enum _KEX_SYSCALL_INDEX {
+#define KEX_SYSCALL(Name, ...) KexSyscall##Name,
+#include "syscalls.h"
+#undef KEX_SYSCALL
+	KexSyscallMaximum
+} TYPEDEF_TYPE_NAME(KEX_SYSCALL_INDEX);
+
+extern ULONG KexpSyscallNumbers64[KexSyscallMaximum];
+
+#ifdef KEX_ARCH_X86
+extern ULONG KexpSyscallNumbers32[KexSyscallMaximum];
+extern ULONG KexpSyscallWow64EcxValues[KexSyscallMaximum];
+#endif
+
+extern CONST USHORT KexpSyscallParameterBytes[KexSyscallMaximum];
+
+NTSTATUS KexInitializeSyscallTable(
+	VOID);
+
+PULONG KexpGetNativeSyscallNumbers(
+	VOID);
+
+//
+// Length disassembler (see ldasm.c)
+//
+
+#define KEX_LDASM_MAXIMUM_INSTRUCTION_LENGTH	15
+
+#define KEX_LDASM_RELATIVE						1	// has an IP-relative branch displacement
+#define KEX_LDASM_RIP_RELATIVE					2	// has a RIP-relative memory operand (x64)
+#define KEX_LDASM_TERMINATOR					4	// unconditional JMP or RET
+
+typedef struct _KEX_LDASM_INSTRUCTION {
+	UCHAR		Length;
+	UCHAR		Flags;
+	UCHAR		OpcodeOffset;
+	UCHAR		DisplacementOffset;						// valid if KEX_LDASM_(RIP_)RELATIVE
+	UCHAR		DisplacementSize;						// 1 or 4
+} TYPEDEF_TYPE_NAME(KEX_LDASM_INSTRUCTION);
+
+NTSTATUS KexpLdasmDecodeInstruction(
+	IN	PCVOID					Code,
+	OUT	PKEX_LDASM_INSTRUCTION	Instruction);
+
 VOID NTAPI KexDllNotificationCallback(
 	IN	LDR_DLL_NOTIFICATION_REASON	Reason,
 	IN	PCLDR_DLL_NOTIFICATION_DATA	NotificationData,
@@ -89,6 +154,19 @@ NTSTATUS KexRewriteImageImportDirectory(
 	IN	PCUNICODE_STRING	BaseImageName,
 	IN	PCUNICODE_STRING	FullImageName);
 
+NTSTATUS KexInitializeDllRewriteCache(
+	IN	ULONG	ConfigurationSignature);
+
+NTSTATUS KexLookupDllRewriteCache(
+	IN	PCUNICODE_STRING				FullImageName,
+	IN	PIMAGE_NT_HEADERS				NtHeaders,
+	OUT	PKEX_DLL_REWRITE_CACHE_DATA		CacheData);
+
+NTSTATUS KexUpdateDllRewriteCache(
+	IN		PCUNICODE_STRING				FullImageName,
+	IN		PIMAGE_NT_HEADERS				NtHeaders,
+	IN OUT	PKEX_DLL_REWRITE_CACHE_DATA		CacheData);
+
 NTSTATUS KexHeInstallHandler(
 	VOID);
 
@@ -141,17 +219,17 @@ ULONG VxlpGetTotalLogEntryCount(
 
 NTSTATUS VxlpFindOrCreateSourceComponentIndex(
 	IN	VXLHANDLE			LogHandle,
-	IN	PCWSTR				SourceComponent,
+	IN	PCUNICODE_STRING	SourceComponent,
 	OUT	PUCHAR				SourceComponentIndex);
 
 NTSTATUS VxlpFindOrCreateSourceFileIndex(
 	IN	VXLHANDLE			LogHandle,
-	IN	PCWSTR				SourceFile,
+	IN	PCUNICODE_STRING	SourceFile,
 	OUT	PUCHAR				SourceFileIndex);
 
 NTSTATUS VxlpFindOrCreateSourceFunctionIndex(
 	IN	VXLHANDLE			LogHandle,
-	IN	PCWSTR				SourceFunction,
+	IN	PCUNICODE_STRING	SourceFunction,
 	OUT	PUCHAR				SourceFunctionIndex);
 
 NTSTATUS VxlpBuildIndex(
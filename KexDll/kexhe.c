@@ -31,6 +31,18 @@
 #include "buildcfg.h"
 #include "kexdllp.h"
 
+//
+// Points to a trampoline for the original NtRaiseHardError if we could
+// build one, otherwise to our own syscall stub.
+//
+STATIC NTSTATUS (NTAPI *OriginalNtRaiseHardError) (
+	IN	NTSTATUS	ErrorStatus,
+	IN	ULONG		NumberOfParameters,
+	IN	ULONG		UnicodeStringParameterMask,
+	IN	PULONG_PTR	Parameters,
+	IN	ULONG		ValidResponseOptions,
+	OUT	PULONG		Response) = KexNtRaiseHardError;
+
 //
 // Send a message to KexSrv that contains the error and its parameters.
 // If not connected to KexSrv, fall back to original API.
@@ -137,7 +149,7 @@ BailOut:
 	// call original NtRaiseHardError
 	//
 
-	Status = KexNtRaiseHardError(
+	Status = OriginalNtRaiseHardError(
 		ErrorStatus,
 		NumberOfParameters,
 		UnicodeStringParameterMask,
@@ -157,7 +169,16 @@ NTSTATUS KexHeInstallHandler(
 		return STATUS_PORT_DISCONNECTED;
 	}
 
-	Status = KexHkInstallBasicHook(NtRaiseHardError, KexpNtRaiseHardErrorHook, NULL);
+	Status = KexHkInstallTrampolineHook(
+		NtRaiseHardError,
+		KexpNtRaiseHardErrorHook,
+		(PPVOID) &OriginalNtRaiseHardError,
+		NULL);
+
+	if (!NT_SUCCESS(Status)) {
+		KexLogDebugEvent(L"Could not build a trampoline for NtRaiseHardError.");
+		Status = KexHkInstallBasicHook(NtRaiseHardError, KexpNtRaiseHardErrorHook, NULL);
+	}
 
 	if (NT_SUCCESS(Status)) {
 		KexLogInformationEvent(L"Successfully installed hard error handler.");
@@ -202,7 +223,7 @@ NORETURN VOID KexHeErrorBox(
 		Parameters[2] = 16;							// MB_ICONERROR
 		Parameters[3] = INFINITE;					// Timeout in milliseconds
 
-		KexNtRaiseHardError(
+		OriginalNtRaiseHardError(
 			STATUS_SERVICE_NOTIFICATION | HARDERROR_OVERRIDE_ERRORMODE,
 			ARRAYSIZE(Parameters),
 			3,
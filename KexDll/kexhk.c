@@ -17,6 +17,19 @@
 //     else. In other terms, only if you have a complete re-implementation of
 //     the function you are hooking (which is easy for Nt* syscall stubs).
 //
+//     Trampoline hooks are basic hooks which additionally copy the overwritten
+//     instructions into an executable trampoline, followed by a jump back to
+//     the rest of the original function. The trampoline can then be called in
+//     order to call the original function. Instructions are found with the
+//     length disassembler in ldasm.c, and IP-relative instructions are
+//     relocated as they are copied.
+//
+//     Hot-patch hooks can be installed and removed while other threads are
+//     running. They make use of the padding which the compiler places before
+//     hot-patchable functions: a near JMP is written into the padding, and
+//     then the first two bytes of the function (on x86, always MOV EDI, EDI)
+//     are atomically replaced with a short JMP to the near JMP.
+//
 // Author:
 //
 //     vxiiduu (23-Oct-2022)
@@ -24,26 +37,831 @@
 // Environment:
 //
 //   Early process creation ONLY. For reasons of simplicity these functions
-//   are not thread safe at all.
+//   (other than the hot-patch hook functions) are not thread safe at all.
+//   Each hook transaction is owned by its caller, but two threads which
+//   commit transactions that touch the same pages at the same time will
+//   still interfere with each other's page protections.
 //
 // Revision History:
 //
 //     vxiiduu              23-Oct-2022  Initial creation.
 //
-///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#include "buildcfg.h"
+#include "kexdllp.h"
+
+STATIC CONST BYTE BasicHookTemplate[BASIC_HOOK_LENGTH] = {
+#ifdef KEX_ARCH_X64
+	0xFF, 0x25, 0x00, 0x00, 0x00, 0x00,				// JMP [FuncPtr]
+	0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC	// FuncPtr: DQ 0xCCCCCCCCCCCCCCCC
+#else
+	0x68, 0xCC, 0xCC, 0xCC, 0xCC,					// PUSH 0xCCCCCCCC
+	0xC3											// RET
+#endif
+};
+
+//
+// Trampolines are carved out of 64KB regions of executable memory. On x64,
+// we try to place the regions within 2GB of the hooked function so that
+// RIP-relative instructions can be relocated. Trampolines are never freed.
+//
+
+#define KEX_TRAMPOLINE_SLOT_SIZE			64
+#define KEX_TRAMPOLINE_REGION_SIZE			0x10000
+#define KEX_TRAMPOLINE_MAXIMUM_REGIONS		8
+
+typedef struct _KEX_TRAMPOLINE_REGION {
+	PBYTE	Base;
+	ULONG	NumberOfUsedSlots;
+} TYPEDEF_TYPE_NAME(KEX_TRAMPOLINE_REGION);
+
+STATIC KEX_TRAMPOLINE_REGION TrampolineRegions[KEX_TRAMPOLINE_MAXIMUM_REGIONS];
+STATIC ULONG NumberOfTrampolineRegions = 0;
+
+//
+// A hot-patchable function is preceded by at least 5 bytes of padding, which
+// is enough for a near JMP. The first two bytes of the function are replaced
+// with a short JMP back into the padding.
+//
+
+#define HOTPATCH_PADDING_LENGTH		5
+#define HOTPATCH_SHORT_JUMP			0xF9EB			// JMP $-5 (EB F9)
+#define HOTPATCH_MOV_EDI_EDI		0xFF8B			// MOV EDI, EDI (8B FF)
+#define HOTPATCH_XCHG_AX_AX			0x9066			// XCHG AX, AX (66 90)
+
+//
+// Write a basic hook which jumps to Destination into Buffer, which must be
+// at least BASIC_HOOK_LENGTH bytes long.
+//
+STATIC VOID KexpHkBuildBasicHook(
+	OUT	PBYTE	Buffer,
+	IN	PVOID	Destination)
+{
+	KexRtlCopyMemory(Buffer, BasicHookTemplate, BASIC_HOOK_LENGTH);
+	*(PPVOID) (&Buffer[BASIC_HOOK_DESTINATION_OFFSET]) = Destination;
+}
+
+//
+// Change the protection of the pages spanned by hooks [FirstIndex, LastIndex]
+// of a sorted transaction to read-write, write either the hooks or the
+// original instructions, and then restore the old page protection.
+//
+// The caller guarantees that those hooks are on one contiguous run of pages.
+// All pages in the run are assumed to have the same protection, which is
+// always the case for code inside a single image section.
+//
+STATIC NTSTATUS KexpHkWriteHookGroup(
+	IN	PKEX_HOOK_TRANSACTION	Transaction,
+	IN	ULONG					FirstIndex,
+	IN	ULONG					LastIndex,
+	IN	BOOLEAN					RestoreOriginal)
+{
+	NTSTATUS Status;
+	PVOID RegionAddress;
+	SIZE_T RegionSize;
+	ULONG_PTR RegionEnd;
+	ULONG OldProtect;
+	ULONG Index;
+
+	RegionAddress = PAGE_ALIGN(Transaction->Hooks[FirstIndex].ApiAddress);
+	RegionEnd = ROUND_TO_PAGES((ULONG_PTR) Transaction->Hooks[LastIndex].ApiAddress + BASIC_HOOK_LENGTH);
+	RegionSize = RegionEnd - (ULONG_PTR) RegionAddress;
+
+	//
+	// We use the KexNt* private syscall stub because otherwise we risk changing
+	// memory protection on the NtProtectVirtualMemory stub itself, and therefore
+	// causing recursive access violation exceptions upon return from the system
+	// call. (This actually happened, not just theoretical.)
+	//
+
+	Status = KexNtProtectVirtualMemory(
+		NtCurrentProcess(),
+		&RegionAddress,
+		&RegionSize,
+		PAGE_READWRITE,
+		&OldProtect);
+
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	for (Index = FirstIndex; Index <= LastIndex; ++Index) {
+		PKEX_HOOK_TRANSACTION_ENTRY Hook;
+
+		Hook = &Transaction->Hooks[Index];
+
+		if (RestoreOriginal) {
+			KexRtlCopyMemory(Hook->ApiAddress, Hook->OriginalInstructions, BASIC_HOOK_LENGTH);
+		} else {
+			BYTE HookInstructions[BASIC_HOOK_LENGTH];
+
+			KexpHkBuildBasicHook(HookInstructions, Hook->RedirectedAddress);
+			KexRtlCopyMemory(Hook->ApiAddress, HookInstructions, BASIC_HOOK_LENGTH);
+		}
+	}
+
+	KexNtProtectVirtualMemory(
+		NtCurrentProcess(),
+		&RegionAddress,
+		&RegionSize,
+		OldProtect,
+		&OldProtect);
+
+	return STATUS_SUCCESS;
+}
+
+//
+// Find the last hook, starting from FirstIndex, which shares a contiguous
+// run of pages with the hooks before it.
+//
+STATIC ULONG KexpHkFindEndOfHookGroup(
+	IN	PCKEX_HOOK_TRANSACTION	Transaction,
+	IN	ULONG					FirstIndex)
+{
+	ULONG_PTR RegionEnd;
+	ULONG Index;
+
+	RegionEnd = ROUND_TO_PAGES((ULONG_PTR) Transaction->Hooks[FirstIndex].ApiAddress + BASIC_HOOK_LENGTH);
+
+	for (Index = FirstIndex + 1; Index < Transaction->NumberOfHooks; ++Index) {
+		PVOID ApiAddress;
+
+		ApiAddress = Transaction->Hooks[Index].ApiAddress;
+
+		if ((ULONG_PTR) PAGE_ALIGN(ApiAddress) > RegionEnd) {
+			break;
+		}
+
+		RegionEnd = ROUND_TO_PAGES((ULONG_PTR) ApiAddress + BASIC_HOOK_LENGTH);
+	}
+
+	return Index - 1;
+}
+
+//
+// Returns TRUE if Target can be reached with a 32-bit displacement from
+// NextInstruction. This is always the case on x86.
+//
+STATIC BOOLEAN KexpHkIsWithinRel32(
+	IN	PVOID	NextInstruction,
+	IN	PVOID	Target)
+{
+#ifdef KEX_ARCH_X64
+	LONGLONG Difference;
+
+	Difference = (LONGLONG) Target - (LONGLONG) NextInstruction;
+	return (Difference >= MINLONG && Difference <= MAXLONG);
+#else
+	UNREFERENCED_PARAMETER(NextInstruction);
+	UNREFERENCED_PARAMETER(Target);
+	return TRUE;
+#endif
+}
+
+STATIC NTSTATUS KexpHkAllocateTrampolineRegionAt(
+	IN	PVOID	Address,
+	OUT	PBYTE *	RegionBase)
+{
+	NTSTATUS Status;
+	PVOID BaseAddress;
+	SIZE_T RegionSize;
+
+	BaseAddress = Address;
+	RegionSize = KEX_TRAMPOLINE_REGION_SIZE;
+
+	Status = KexNtAllocateVirtualMemory(
+		NtCurrentProcess(),
+		&BaseAddress,
+		0,
+		&RegionSize,
+		MEM_RESERVE | MEM_COMMIT,
+		PAGE_EXECUTE_READ);
+
+	if (NT_SUCCESS(Status)) {
+		*RegionBase = (PBYTE) BaseAddress;
+	}
+
+	return Status;
+}
+
+#ifdef KEX_ARCH_X64
+//
+// Find a free 64KB-aligned block of address space within 2GB of NearAddress
+// and allocate a trampoline region there. We search downwards first, since
+// system DLLs are loaded at the top of the address space.
+//
+STATIC NTSTATUS KexpHkAllocateTrampolineRegionNear(
+	IN	PVOID	NearAddress,
+	OUT	PBYTE *	RegionBase)
+{
+	NTSTATUS Status;
+	MEMORY_BASIC_INFORMATION BasicInformation;
+	ULONG_PTR Address;
+	ULONG_PTR Lowest;
+	ULONG_PTR Highest;
+
+	Lowest = (ULONG_PTR) NearAddress - min((ULONG_PTR) NearAddress, 0x7FFF0000);
+	Lowest = max(Lowest, KEX_TRAMPOLINE_REGION_SIZE);
+	Highest = (ULONG_PTR) NearAddress + 0x7FFF0000 - KEX_TRAMPOLINE_REGION_SIZE;
+
+	Address = ((ULONG_PTR) NearAddress & ~(KEX_TRAMPOLINE_REGION_SIZE - 1)) - KEX_TRAMPOLINE_REGION_SIZE;
+
+	while (Address >= Lowest) {
+		Status = KexNtQueryVirtualMemory(
+			NtCurrentProcess(),
+			(PVOID) Address,
+			MemoryBasicInformation,
+			&BasicInformation,
+			sizeof(BasicInformation),
+			NULL);
+
+		if (!NT_SUCCESS(Status)) {
+			break;
+		}
+
+		if (BasicInformation.State == MEM_FREE &&
+			(ULONG_PTR) BasicInformation.BaseAddress + BasicInformation.RegionSize >=
+			Address + KEX_TRAMPOLINE_REGION_SIZE) {
+
+			Status = KexpHkAllocateTrampolineRegionAt((PVOID) Address, RegionBase);
+
+			if (NT_SUCCESS(Status)) {
+				return Status;
+			}
+		}
+
+		if (BasicInformation.State != MEM_FREE &&
+			(ULONG_PTR) BasicInformation.AllocationBase < Address) {
+
+			// skip to below the start of this allocation
+			Address = (ULONG_PTR) BasicInformation.AllocationBase & ~(KEX_TRAMPOLINE_REGION_SIZE - 1);
+		}
+
+		if (Address < KEX_TRAMPOLINE_REGION_SIZE) {
+			break;
+		}
+
+		Address -= KEX_TRAMPOLINE_REGION_SIZE;
+	}
+
+	Address = ((ULONG_PTR) NearAddress + KEX_TRAMPOLINE_REGION_SIZE) & ~(KEX_TRAMPOLINE_REGION_SIZE - 1);
+
+	while (Address <= Highest) {
+		Status = KexNtQueryVirtualMemory(
+			NtCurrentProcess(),
+			(PVOID) Address,
+			MemoryBasicInformation,
+			&BasicInformation,
+			sizeof(BasicInformation),
+			NULL);
+
+		if (!NT_SUCCESS(Status)) {
+			break;
+		}
+
+		if (BasicInformation.State == MEM_FREE &&
+			(ULONG_PTR) BasicInformation.BaseAddress + BasicInformation.RegionSize >=
+			Address + KEX_TRAMPOLINE_REGION_SIZE) {
+
+			Status = KexpHkAllocateTrampolineRegionAt((PVOID) Address, RegionBase);
+
+			if (NT_SUCCESS(Status)) {
+				return Status;
+			}
+		}
+
+		// skip to the end of this region
+		Address = (ULONG_PTR) BasicInformation.BaseAddress + BasicInformation.RegionSize;
+		Address = (Address + KEX_TRAMPOLINE_REGION_SIZE - 1) & ~(KEX_TRAMPOLINE_REGION_SIZE - 1);
+	}
+
+	return STATUS_NO_MEMORY;
+}
+#endif
+
+//
+// Find a trampoline region with at least one free slot, preferably one that
+// is close to NearAddress. A new region is allocated if necessary.
+//
+STATIC NTSTATUS KexpHkFindTrampolineRegion(
+	IN	PVOID					NearAddress,
+	OUT	PPKEX_TRAMPOLINE_REGION	Region)
+{
+	NTSTATUS Status;
+	PKEX_TRAMPOLINE_REGION FarRegion;
+	PBYTE RegionBase;
+	ULONG Index;
+
+	FarRegion = NULL;
+
+	for (Index = 0; Index < NumberOfTrampolineRegions; ++Index) {
+		PKEX_TRAMPOLINE_REGION Candidate;
+
+		Candidate = &TrampolineRegions[Index];
+
+		if (Candidate->NumberOfUsedSlots >= KEX_TRAMPOLINE_REGION_SIZE / KEX_TRAMPOLINE_SLOT_SIZE) {
+			continue;
+		}
+
+		if (KexpHkIsWithinRel32(NearAddress, Candidate->Base) &&
+			KexpHkIsWithinRel32(NearAddress, Candidate->Base + KEX_TRAMPOLINE_REGION_SIZE)) {
+
+			*Region = Candidate;
+			return STATUS_SUCCESS;
+		}
+
+		if (!FarRegion) {
+			FarRegion = Candidate;
+		}
+	}
+
+	if (NumberOfTrampolineRegions >= ARRAYSIZE(TrampolineRegions)) {
+		if (FarRegion) {
+			*Region = FarRegion;
+			return STATUS_SUCCESS;
+		}
+
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+#ifdef KEX_ARCH_X64
+	Status = KexpHkAllocateTrampolineRegionNear(NearAddress, &RegionBase);
+
+	if (!NT_SUCCESS(Status))
+#endif
+	{
+		//
+		// Fall back to a region anywhere in the address space. This works
+		// fine as long as the instructions we need to relocate don't have
+		// any 32-bit displacements.
+		//
+
+		Status = KexpHkAllocateTrampolineRegionAt(NULL, &RegionBase);
+	}
+
+	if (!NT_SUCCESS(Status)) {
+		if (FarRegion) {
+			*Region = FarRegion;
+			return STATUS_SUCCESS;
+		}
+
+		return Status;
+	}
+
+	*Region = &TrampolineRegions[NumberOfTrampolineRegions++];
+	(*Region)->Base = RegionBase;
+	(*Region)->NumberOfUsedSlots = 0;
+
+	return STATUS_SUCCESS;
+}
+
+//
+// Copy KEX_TRAMPOLINE_SLOT_SIZE bytes of code from Buffer into the next free
+// slot of a trampoline region.
+//
+STATIC NTSTATUS KexpHkWriteTrampoline(
+	IN	PKEX_TRAMPOLINE_REGION	Region,
+	IN	PCVOID					Buffer)
+{
+	NTSTATUS Status;
+	PBYTE Destination;
+	PVOID ProtectAddress;
+	SIZE_T ProtectSize;
+	ULONG OldProtect;
+
+	Destination = Region->Base + (Region->NumberOfUsedSlots * KEX_TRAMPOLINE_SLOT_SIZE);
+	ProtectAddress = Destination;
+	ProtectSize = KEX_TRAMPOLINE_SLOT_SIZE;
+
+	//
+	// Other threads may be running code from other trampolines on the
+	// same page, so the page must stay executable.
+	//
+
+	Status = KexNtProtectVirtualMemory(
+		NtCurrentProcess(),
+		&ProtectAddress,
+		&ProtectSize,
+		PAGE_EXECUTE_READWRITE,
+		&OldProtect);
+
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	KexRtlCopyMemory(Destination, Buffer, KEX_TRAMPOLINE_SLOT_SIZE);
+
+	KexNtProtectVirtualMemory(
+		NtCurrentProcess(),
+		&ProtectAddress,
+		&ProtectSize,
+		PAGE_EXECUTE_READ,
+		&OldProtect);
+
+	++Region->NumberOfUsedSlots;
+	return STATUS_SUCCESS;
+}
+
+//
+// Returns TRUE if the instruction is padding that is never executed, such as
+// the INT3 or NOP instructions between functions.
+//
+STATIC BOOLEAN KexpHkIsPaddingInstruction(
+	IN	PBYTE					Code,
+	IN	PCKEX_LDASM_INSTRUCTION	Instruction)
+{
+	PBYTE Opcode;
+
+	Opcode = Code + Instruction->OpcodeOffset;
+
+	if (Opcode[0] == 0xCC || Opcode[0] == 0x90) {
+		return TRUE;
+	}
+
+	if (Opcode[0] == 0x0F && Opcode[1] == 0x1F) {
+		// multi-byte NOP
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+//
+// Copy the instructions which will be overwritten by a hook of HookLength
+// bytes at ApiAddress into a new trampoline, followed by a jump to the first
+// instruction that is not overwritten.
+//
+// Branches with 8-bit displacements are converted into branches with 32-bit
+// displacements, and all IP-relative displacements are adjusted to point to
+// the same target from the trampoline.
+//
+// We refuse (with STATUS_NOT_SUPPORTED) to handle instructions we cannot
+// decode, branches into the overwritten instructions, LOOP and JCXZ which
+// have no 32-bit form, and functions shorter than the hook unless they are
+// followed only by padding.
+//
+STATIC NTSTATUS KexpHkBuildTrampoline(
+	IN	PVOID	ApiAddress,
+	IN	ULONG	HookLength,
+	OUT	PPVOID	Trampoline)
+{
+	NTSTATUS Status;
+	PKEX_TRAMPOLINE_REGION Region;
+	PBYTE Source;
+	PBYTE Destination;
+	BYTE Buffer[KEX_TRAMPOLINE_SLOT_SIZE];
+	ULONG SourceOffset;
+	ULONG BufferOffset;
+	BOOLEAN ReachedEndOfFunction;
+
+	Status = KexpHkFindTrampolineRegion(ApiAddress, &Region);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	Source = (PBYTE) ApiAddress;
+	Destination = Region->Base + (Region->NumberOfUsedSlots * KEX_TRAMPOLINE_SLOT_SIZE);
+	SourceOffset = 0;
+	BufferOffset = 0;
+	ReachedEndOfFunction = FALSE;
+
+	RtlFillMemory(Buffer, sizeof(Buffer), 0xCC);
+
+	while (SourceOffset < HookLength) {
+		KEX_LDASM_INSTRUCTION Instruction;
+		PBYTE Code;
+		PBYTE Target;
+		ULONG NewLength;
+
+		Code = Source + SourceOffset;
+		Target = NULL;
+
+		Status = KexpLdasmDecodeInstruction(Code, &Instruction);
+		if (!NT_SUCCESS(Status)) {
+			return Status;
+		}
+
+		if (ReachedEndOfFunction) {
+			unless (KexpHkIsPaddingInstruction(Code, &Instruction)) {
+				return STATUS_NOT_SUPPORTED;
+			}
+
+			SourceOffset += Instruction.Length;
+			continue;
+		}
+
+		if (Instruction.Flags & KEX_LDASM_TERMINATOR) {
+			ReachedEndOfFunction = TRUE;
+		}
+
+		NewLength = Instruction.Length;
+
+		if (Instruction.Flags & (KEX_LDASM_RELATIVE | KEX_LDASM_RIP_RELATIVE)) {
+			LONG Displacement;
+
+			if (Instruction.DisplacementSize == 1) {
+				Displacement = *(PCHAR) (Code + Instruction.DisplacementOffset);
+			} else {
+				Displacement = *(PLONG) (Code + Instruction.DisplacementOffset);
+			}
+
+			Target = Code + Instruction.Length + Displacement;
+
+			if ((Instruction.Flags & KEX_LDASM_RELATIVE) &&
+				Target >= Source && Target < Source + HookLength) {
+
+				return STATUS_NOT_SUPPORTED;
+			}
+		}
+
+		if ((Instruction.Flags & KEX_LDASM_RELATIVE) && Instruction.DisplacementSize == 1) {
+			UCHAR Opcode;
+
+			Opcode = Code[Instruction.OpcodeOffset];
+
+			//
+			// Keep any prefixes, and convert the branch to its rel32 form.
+			//
+
+			if (Opcode == 0xEB) {
+				NewLength = Instruction.OpcodeOffset + 1 + sizeof(LONG);
+			} else if (Opcode >= 0x70 && Opcode <= 0x7F) {
+				NewLength = Instruction.OpcodeOffset + 2 + sizeof(LONG);
+			} else {
+				// LOOP, LOOPcc and JCXZ
+				return STATUS_NOT_SUPPORTED;
+			}
+
+			if (BufferOffset + NewLength + BASIC_HOOK_LENGTH > sizeof(Buffer)) {
+				return STATUS_BUFFER_TOO_SMALL;
+			}
+
+			KexRtlCopyMemory(&Buffer[BufferOffset], Code, Instruction.OpcodeOffset);
+
+			if (Opcode == 0xEB) {
+				Buffer[BufferOffset + Instruction.OpcodeOffset] = 0xE9;
+			} else {
+				Buffer[BufferOffset + Instruction.OpcodeOffset] = 0x0F;
+				Buffer[BufferOffset + Instruction.OpcodeOffset + 1] = 0x80 | (Opcode & 0x0F);
+			}
+
+			Instruction.DisplacementOffset = (UCHAR) (NewLength - sizeof(LONG));
+		} else {
+			if (BufferOffset + NewLength + BASIC_HOOK_LENGTH > sizeof(Buffer)) {
+				return STATUS_BUFFER_TOO_SMALL;
+			}
+
+			KexRtlCopyMemory(&Buffer[BufferOffset], Code, Instruction.Length);
+		}
+
+		if (Instruction.Flags & (KEX_LDASM_RELATIVE | KEX_LDASM_RIP_RELATIVE)) {
+			PBYTE NextInstruction;
+
+			NextInstruction = Destination + BufferOffset + NewLength;
+
+			unless (KexpHkIsWithinRel32(NextInstruction, Target)) {
+				return STATUS_NOT_SUPPORTED;
+			}
+
+			*(PLONG) (&Buffer[BufferOffset + Instruction.DisplacementOffset]) =
+				(LONG) (Target - NextInstruction);
+		}
+
+		SourceOffset += Instruction.Length;
+		BufferOffset += NewLength;
+	}
+
+	unless (ReachedEndOfFunction) {
+		KexpHkBuildBasicHook(&Buffer[BufferOffset], Source + SourceOffset);
+	}
+
+	Status = KexpHkWriteTrampoline(Region, Buffer);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	*Trampoline = Destination;
+	return STATUS_SUCCESS;
+}
+
+//
+// Prepare a hook transaction. A hook transaction collects a number of hooks
+// and then installs all of them at once with KexHkCommitTransaction, which
+// changes page protections only once per group of adjacent pages instead
+// of twice per hook.
+//
+VOID NTAPI KexHkBeginTransaction(
+	OUT		PKEX_HOOK_TRANSACTION	Transaction)
+{
+	Transaction->NumberOfHooks = 0;
+}
+
+//
+// Add a hook to a transaction. See KexHkInstallBasicHook for a description
+// of the parameters. Nothing is written until the transaction is committed,
+// but HookContext (if present) must remain valid until then.
+//
+NTSTATUS NTAPI KexHkAddBasicHookToTransaction(
+	IN OUT	PKEX_HOOK_TRANSACTION	Transaction,
+	IN		PVOID					ApiAddress,
+	IN		PVOID					RedirectedAddress,
+	OUT		PKEX_BASIC_HOOK_CONTEXT	HookContext OPTIONAL)
+{
+	PKEX_HOOK_TRANSACTION_ENTRY Hook;
+
+	if (!Transaction) {
+		return STATUS_INVALID_PARAMETER_1;
+	}
+
+	if (!ApiAddress) {
+		return STATUS_INVALID_PARAMETER_2;
+	}
+
+	if (!RedirectedAddress) {
+		return STATUS_INVALID_PARAMETER_3;
+	}
+
+	if (Transaction->NumberOfHooks >= ARRAYSIZE(Transaction->Hooks)) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	Hook = &Transaction->Hooks[Transaction->NumberOfHooks++];
+	Hook->ApiAddress = ApiAddress;
+	Hook->RedirectedAddress = RedirectedAddress;
+	Hook->HookContext = HookContext;
+
+	return STATUS_SUCCESS;
+}
+
+//
+// Add a trampoline hook to a transaction. This is the same as a basic hook,
+// except that OriginalRoutine receives the address of a trampoline which can
+// be called to run the original function. The trampoline is built
+// immediately, so OriginalRoutine is valid even before the transaction is
+// committed.
+//
+// If this function fails (typically with STATUS_NOT_SUPPORTED, which means
+// that the start of the function at ApiAddress could not be relocated),
+// callers should fall back to a basic hook.
+//
+NTSTATUS NTAPI KexHkAddTrampolineHookToTransaction(
+	IN OUT	PKEX_HOOK_TRANSACTION	Transaction,
+	IN		PVOID					ApiAddress,
+	IN		PVOID					RedirectedAddress,
+	OUT		PPVOID					OriginalRoutine,
+	OUT		PKEX_BASIC_HOOK_CONTEXT	HookContext OPTIONAL) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+	PVOID Trampoline;
+
+	if (!Transaction) {
+		return STATUS_INVALID_PARAMETER_1;
+	}
+
+	if (!ApiAddress) {
+		return STATUS_INVALID_PARAMETER_2;
+	}
+
+	if (!RedirectedAddress) {
+		return STATUS_INVALID_PARAMETER_3;
+	}
+
+	if (!OriginalRoutine) {
+		return STATUS_INVALID_PARAMETER_4;
+	}
+
+	if (Transaction->NumberOfHooks >= ARRAYSIZE(Transaction->Hooks)) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	Status = KexpHkBuildTrampoline(ApiAddress, BASIC_HOOK_LENGTH, &Trampoline);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	Status = KexHkAddBasicHookToTransaction(
+		Transaction,
+		ApiAddress,
+		RedirectedAddress,
+		HookContext);
+
+	if (NT_SUCCESS(Status)) {
+		*OriginalRoutine = Trampoline;
+	}
+
+	return Status;
+} PROTECTED_FUNCTION_END
+
+//
+// Install all hooks in a transaction.
+//
+// Either all hooks are installed, or (if this function returns an error
+// code) none of them are.
+//
+// Only KexNt* system call stubs are used, so this function can be called
+// within KexDllInitializeThunk, where we can't call any NTDLL exports.
+//
+NTSTATUS NTAPI KexHkCommitTransaction(
+	IN OUT	PKEX_HOOK_TRANSACTION	Transaction) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+	ULONG Index;
+	ULONG FirstIndex;
+	ULONG LastIndex;
 
-#include "buildcfg.h"
-#include "kexdllp.h"
+	if (!Transaction) {
+		return STATUS_INVALID_PARAMETER;
+	}
 
-STATIC BYTE BasicHookTemplate[BASIC_HOOK_LENGTH] = {
-#ifdef KEX_ARCH_X64
-	0xFF, 0x25, 0x00, 0x00, 0x00, 0x00,				// JMP [FuncPtr]
-	0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC	// FuncPtr: DQ 0xCCCCCCCCCCCCCCCC
-#else
-	0x68, 0xCC, 0xCC, 0xCC, 0xCC,					// PUSH 0xCCCCCCCC
-	0xC3											// RET
-#endif
-};
+	if (Transaction->NumberOfHooks == 0) {
+		return STATUS_SUCCESS;
+	}
+
+	//
+	// Sort the hooks by address (there are never many of them, so insertion
+	// sort is fine) and make sure none of them overlap.
+	//
+
+	for (Index = 1; Index < Transaction->NumberOfHooks; ++Index) {
+		KEX_HOOK_TRANSACTION_ENTRY Hook;
+		ULONG Position;
+
+		Hook = Transaction->Hooks[Index];
+
+		for (Position = Index; Position > 0; --Position) {
+			if (Transaction->Hooks[Position - 1].ApiAddress <= Hook.ApiAddress) {
+				break;
+			}
+
+			Transaction->Hooks[Position] = Transaction->Hooks[Position - 1];
+		}
+
+		Transaction->Hooks[Position] = Hook;
+	}
+
+	for (Index = 1; Index < Transaction->NumberOfHooks; ++Index) {
+		if ((PBYTE) Transaction->Hooks[Index].ApiAddress <
+			(PBYTE) Transaction->Hooks[Index - 1].ApiAddress + BASIC_HOOK_LENGTH) {
+
+			return STATUS_CONFLICTING_ADDRESSES;
+		}
+	}
+
+	//
+	// Save the original instructions, so that we can roll back if something
+	// fails and so that the caller can undo the hooks later.
+	//
+
+	for (Index = 0; Index < Transaction->NumberOfHooks; ++Index) {
+		PKEX_HOOK_TRANSACTION_ENTRY Hook;
+
+		Hook = &Transaction->Hooks[Index];
+
+		KexRtlCopyMemory(
+			Hook->OriginalInstructions,
+			Hook->ApiAddress,
+			BASIC_HOOK_LENGTH);
+
+		if (Hook->HookContext) {
+			Hook->HookContext->OriginalApiAddress = Hook->ApiAddress;
+
+			KexRtlCopyMemory(
+				Hook->HookContext->OriginalInstructions,
+				Hook->ApiAddress,
+				BASIC_HOOK_LENGTH);
+		}
+	}
+
+	//
+	// Write the hooks, one group of adjacent pages at a time.
+	//
+
+	for (FirstIndex = 0; FirstIndex < Transaction->NumberOfHooks; FirstIndex = LastIndex + 1) {
+		LastIndex = KexpHkFindEndOfHookGroup(Transaction, FirstIndex);
+
+		Status = KexpHkWriteHookGroup(Transaction, FirstIndex, LastIndex, FALSE);
+
+		if (!NT_SUCCESS(Status)) {
+			ULONG RollbackIndex;
+
+			//
+			// Undo the groups that we have already written.
+			//
+
+			for (RollbackIndex = 0; RollbackIndex < FirstIndex; RollbackIndex = LastIndex + 1) {
+				LastIndex = KexpHkFindEndOfHookGroup(Transaction, RollbackIndex);
+				KexpHkWriteHookGroup(Transaction, RollbackIndex, LastIndex, TRUE);
+			}
+
+			return Status;
+		}
+	}
+
+	KexNtFlushInstructionCache(NtCurrentProcess(), NULL, 0);
+
+	return STATUS_SUCCESS;
+} PROTECTED_FUNCTION_END
 
 //
 // Install a hook on a given API routine.
@@ -60,61 +878,378 @@ STATIC BYTE BasicHookTemplate[BASIC_HOOK_LENGTH] = {
 //     you want to uninstall the hook or if you want to call the original API.
 //     If this parameter is NULL, the hook is permanent.
 //
+// If you are installing more than one hook at a time, use a hook transaction
+// instead (see KexHkBeginTransaction).
+//
+// This function can be called within KexDllInitializeThunk, so it must not
+// call any NTDLL exports. Only the KexNt* system call stubs may be used.
+//
 NTSTATUS NTAPI KexHkInstallBasicHook(
 	IN		PVOID					ApiAddress,
 	IN		PVOID					RedirectedAddress,
 	OUT		PKEX_BASIC_HOOK_CONTEXT	HookContext OPTIONAL) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+	KEX_HOOK_TRANSACTION Transaction;
+
+	if (!ApiAddress) {
+		return STATUS_INVALID_PARAMETER_1;
+	}
+	
+	if (!RedirectedAddress) {
+		return STATUS_INVALID_PARAMETER_2;
+	}
+
+	KexHkBeginTransaction(&Transaction);
+
+	Status = KexHkAddBasicHookToTransaction(
+		&Transaction,
+		ApiAddress,
+		RedirectedAddress,
+		HookContext);
+
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	return KexHkCommitTransaction(&Transaction);
+} PROTECTED_FUNCTION_END
+
+//
+// Install a trampoline hook on a given API routine. See
+// KexHkAddTrampolineHookToTransaction for a description of OriginalRoutine.
+// The hook can be removed with KexHkRemoveBasicHook, but the trampoline
+// remains valid.
+//
+NTSTATUS NTAPI KexHkInstallTrampolineHook(
+	IN		PVOID					ApiAddress,
+	IN		PVOID					RedirectedAddress,
+	OUT		PPVOID					OriginalRoutine,
+	OUT		PKEX_BASIC_HOOK_CONTEXT	HookContext OPTIONAL) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+	KEX_HOOK_TRANSACTION Transaction;
+
+	KexHkBeginTransaction(&Transaction);
+
+	Status = KexHkAddTrampolineHookToTransaction(
+		&Transaction,
+		ApiAddress,
+		RedirectedAddress,
+		OriginalRoutine,
+		HookContext);
+
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	return KexHkCommitTransaction(&Transaction);
+} PROTECTED_FUNCTION_END
+
+NTSTATUS NTAPI KexHkRemoveBasicHook(
+	IN		PKEX_BASIC_HOOK_CONTEXT	HookContext) PROTECTED_FUNCTION
 {
 	NTSTATUS Status;
 	PVOID ApiPageAddress;
 	SIZE_T HookLength;
 	ULONG OldProtect;
 
+	if (!HookContext) {
+		return STATUS_INVALID_PARAMETER_1;
+	}
+
+	ApiPageAddress = HookContext->OriginalApiAddress;
+	HookLength = sizeof(BasicHookTemplate);
+
+	Status = NtProtectVirtualMemory(
+		NtCurrentProcess(),
+		&ApiPageAddress,
+		&HookLength,
+		PAGE_READWRITE,
+		&OldProtect);
+
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	RtlCopyMemory(
+		HookContext->OriginalApiAddress,
+		HookContext->OriginalInstructions,
+		sizeof(BasicHookTemplate));
+
+	NtProtectVirtualMemory(
+		NtCurrentProcess(),
+		&ApiPageAddress,
+		&HookLength,
+		OldProtect,
+		&OldProtect);
+
+	return STATUS_SUCCESS;
+} PROTECTED_FUNCTION_END
+
+//
+// Returns TRUE if Address is the start of a trampoline slot that has been
+// handed out.
+//
+STATIC BOOLEAN KexpHkIsTrampolineSlot(
+	IN	PVOID	Address)
+{
+	ULONG Index;
+
+	for (Index = 0; Index < NumberOfTrampolineRegions; ++Index) {
+		PCKEX_TRAMPOLINE_REGION Region;
+		ULONG_PTR Offset;
+
+		Region = &TrampolineRegions[Index];
+
+		if ((PBYTE) Address < Region->Base) {
+			continue;
+		}
+
+		Offset = (PBYTE) Address - Region->Base;
+
+		if (Offset < Region->NumberOfUsedSlots * KEX_TRAMPOLINE_SLOT_SIZE &&
+			Offset % KEX_TRAMPOLINE_SLOT_SIZE == 0) {
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+//
+// Returns TRUE if the bytes before a function can hold a hot-patch jump.
+// That is the case for unused padding (five INT3s or five NOPs), and for a
+// near JMP left behind by a hot-patch hook that was removed. *NearJumpTarget
+// receives the destination of such a near JMP, or NULL if there is none.
+//
+// A near JMP is only ours if it leads to RedirectedAddress or to one of our
+// trampoline slots. Anything else was put there by someone else.
+//
+STATIC BOOLEAN KexpHkIsHotPatchPadding(
+	IN	PBYTE	Padding,
+	IN	PVOID	RedirectedAddress,
+	OUT	PBYTE *	NearJumpTarget)
+{
+	ULONG Index;
+
+	*NearJumpTarget = NULL;
+
+	if (Padding[0] == 0xE9) {
+		PBYTE Target;
+
+		Target = Padding + HOTPATCH_PADDING_LENGTH + *(PLONG) &Padding[1];
+
+		unless (Target == RedirectedAddress || KexpHkIsTrampolineSlot(Target)) {
+			return FALSE;
+		}
+
+		*NearJumpTarget = Target;
+		return TRUE;
+	}
+
+	if (Padding[0] != 0xCC && Padding[0] != 0x90) {
+		return FALSE;
+	}
+
+	for (Index = 1; Index < HOTPATCH_PADDING_LENGTH; ++Index) {
+		if (Padding[Index] != Padding[0]) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+//
+// Install a hot-patch hook on a given API routine. Unlike the other kinds of
+// hooks, hot-patch hooks can be installed and removed while other threads
+// are running (and possibly executing the hooked function), since the
+// function entry is changed with a single interlocked operation. Calls to
+// KexHkInstallHotPatchHook and KexHkRemoveHotPatchHook must still be
+// serialized by the caller.
+//
+//   ApiAddress
+//     Address of a hot-patchable function that you want to hook. The first
+//     instruction must be at least two bytes long, and the function must be
+//     preceded by at least five bytes of padding.
+//
+//   RedirectedAddress
+//     Address of your function with an identical call signature that you
+//     want to get called instead of the hooked function.
+//
+//   OriginalRoutine
+//     Optional parameter that receives an address which can be called to
+//     run the original function. This remains valid after the hook has been
+//     removed.
+//
+//   HookContext
+//     Optional parameter that allows you to remove the hook later with
+//     KexHkRemoveHotPatchHook.
+//
+// Returns STATUS_NOT_SUPPORTED if the function is not hot-patchable. In
+// that case, the caller should fall back to a basic or trampoline hook.
+//
+// If the function was hot-patched before and the hook was removed, the
+// near JMP left in the padding is reused if it already leads to
+// RedirectedAddress, and retargeted otherwise. Retargeting is done with a
+// single interlocked write of the 4-byte displacement, so it is refused
+// with STATUS_NOT_SUPPORTED if that displacement is not 4-byte aligned.
+//
+NTSTATUS NTAPI KexHkInstallHotPatchHook(
+	IN		PVOID						ApiAddress,
+	IN		PVOID						RedirectedAddress,
+	OUT		PPVOID						OriginalRoutine OPTIONAL,
+	OUT		PKEX_HOTPATCH_HOOK_CONTEXT	HookContext OPTIONAL) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+	PBYTE Entry;
+	PBYTE Padding;
+	USHORT OriginalEntry;
+	PVOID Original;
+	PVOID JumpTarget;
+	PBYTE NearJumpTarget;
+	BOOLEAN ReuseNearJump;
+	LONG Displacement;
+	KEX_LDASM_INSTRUCTION Instruction;
+	BYTE NearJump[HOTPATCH_PADDING_LENGTH];
+	PVOID ProtectAddress;
+	SIZE_T ProtectSize;
+	ULONG OldProtect;
+
 	if (!ApiAddress) {
 		return STATUS_INVALID_PARAMETER_1;
 	}
-	
+
 	if (!RedirectedAddress) {
 		return STATUS_INVALID_PARAMETER_2;
 	}
 
-	ApiPageAddress = ApiAddress;
-	HookLength = sizeof(BasicHookTemplate);
-	
+	Entry = (PBYTE) ApiAddress;
+	Padding = Entry - HOTPATCH_PADDING_LENGTH;
+	OriginalEntry = *(PUSHORT) Entry;
+	Original = NULL;
+
+	if (OriginalEntry == HOTPATCH_SHORT_JUMP) {
+		// already hot-patched
+		return STATUS_CONFLICTING_ADDRESSES;
+	}
+
+	unless (KexpHkIsHotPatchPadding(Padding, RedirectedAddress, &NearJumpTarget)) {
+		return STATUS_NOT_SUPPORTED;
+	}
+
 	//
-	// Fill out hook context fields, copy the original bytes (so
-	// we can undo the hook later), and prepare the hook template for
-	// writing.
+	// A near JMP left behind by an earlier hook may still be executed by a
+	// thread which went through the short JMP just before that hook was
+	// removed. It can be reused as-is if it already ends up at
+	// RedirectedAddress (directly, or through a trampoline slot containing
+	// a basic hook). Otherwise its displacement must be changed with one
+	// aligned interlocked write, which rules out unaligned displacements.
 	//
 
-	if (HookContext) {
-		HookContext->OriginalApiAddress = ApiAddress;
-		
-		KexRtlCopyMemory(
-			HookContext->OriginalInstructions,
-			ApiAddress,
-			sizeof(BasicHookTemplate));
+	ReuseNearJump = FALSE;
+
+	if (NearJumpTarget) {
+		BYTE ExpectedSlot[BASIC_HOOK_LENGTH];
+
+		KexpHkBuildBasicHook(ExpectedSlot, RedirectedAddress);
+
+		if (NearJumpTarget == RedirectedAddress ||
+			RtlEqualMemory(NearJumpTarget, ExpectedSlot, BASIC_HOOK_LENGTH)) {
+
+			ReuseNearJump = TRUE;
+		} else if ((ULONG_PTR) &Padding[1] & (sizeof(LONG) - 1)) {
+			return STATUS_NOT_SUPPORTED;
+		}
 	}
 
-	*(PPVOID) (&BasicHookTemplate[BASIC_HOOK_DESTINATION_OFFSET]) = RedirectedAddress;
-	
 	//
-	// Let us write to the address of the hooked API.
-	// We use the KexNt* private syscall stub because otherwise we risk changing
-	// memory protection on the NtProtectVirtualMemory stub itself, and therefore
-	// causing recursive access violation exceptions upon return from the system
-	// call. (This actually happened, not just theoretical.)
+	// The short JMP must not overwrite more than one instruction, otherwise
+	// another thread could be executing the second one while we write it.
+	//
+
+	Status = KexpLdasmDecodeInstruction(Entry, &Instruction);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	if (Instruction.Length < 2) {
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	if (OriginalRoutine) {
+#ifdef KEX_ARCH_X86
+		if (OriginalEntry == HOTPATCH_MOV_EDI_EDI) {
+			Original = Entry + 2;
+		} else
+#endif
+		if (OriginalEntry == HOTPATCH_XCHG_AX_AX) {
+			Original = Entry + 2;
+		} else {
+			//
+			// The first instruction does something, so it has to be run
+			// from a trampoline.
+			//
+
+			Status = KexpHkBuildTrampoline(ApiAddress, 2, &Original);
+			if (!NT_SUCCESS(Status)) {
+				return Status;
+			}
+		}
+	}
+
+	if (ReuseNearJump) {
+		JumpTarget = NearJumpTarget;
+	} else {
+#ifdef KEX_ARCH_X64
+		PKEX_TRAMPOLINE_REGION Region;
+		BYTE Buffer[KEX_TRAMPOLINE_SLOT_SIZE];
+
+		//
+		// A near JMP can only reach 2GB in either direction, so jump to
+		// an absolute JMP in a nearby trampoline slot instead.
+		//
+
+		Status = KexpHkFindTrampolineRegion(Entry, &Region);
+		if (!NT_SUCCESS(Status)) {
+			return Status;
+		}
+
+		JumpTarget = Region->Base + (Region->NumberOfUsedSlots * KEX_TRAMPOLINE_SLOT_SIZE);
+
+		unless (KexpHkIsWithinRel32(Entry, JumpTarget)) {
+			return STATUS_NOT_SUPPORTED;
+		}
+
+		RtlFillMemory(Buffer, sizeof(Buffer), 0xCC);
+		KexpHkBuildBasicHook(Buffer, RedirectedAddress);
+
+		Status = KexpHkWriteTrampoline(Region, Buffer);
+		if (!NT_SUCCESS(Status)) {
+			return Status;
+		}
+#else
+		JumpTarget = RedirectedAddress;
+#endif
+	}
+
+	Displacement = (LONG) ((PBYTE) JumpTarget - Entry);
+
 	//
-	// A second reason for using the KexNt* stub is because KexHkInstallBasicHook
-	// can be called within KexDllInitializeThunk, and we can't call any NTDLL
-	// exports.
+	// Other threads may be running code on the same pages, so they must
+	// stay executable while we write to them.
 	//
 
+	ProtectAddress = Padding;
+	ProtectSize = HOTPATCH_PADDING_LENGTH + 2;
+
 	Status = KexNtProtectVirtualMemory(
 		NtCurrentProcess(),
-		&ApiPageAddress,
-		&HookLength,
-		PAGE_READWRITE,
+		&ProtectAddress,
+		&ProtectSize,
+		PAGE_EXECUTE_READWRITE,
 		&OldProtect);
 
 	if (!NT_SUCCESS(Status)) {
@@ -122,58 +1257,106 @@ NTSTATUS NTAPI KexHkInstallBasicHook(
 	}
 
 	//
-	// Hook the function and restore old page protections.
+	// Unused padding is not reachable until the short JMP below is written,
+	// so it can be written normally. A near JMP which is already there may
+	// be running on another thread, so only its displacement is changed,
+	// in one piece. Either way, the interlocked operation on the entry acts
+	// as a full barrier, so the near JMP is visible before the short JMP
+	// that leads to it.
 	//
 
-	KexRtlCopyMemory(ApiAddress, BasicHookTemplate, sizeof(BasicHookTemplate));
+	if (!NearJumpTarget) {
+		NearJump[0] = 0xE9;
+		*(PLONG) (&NearJump[1]) = Displacement;
+		KexRtlCopyMemory(Padding, NearJump, HOTPATCH_PADDING_LENGTH);
+	} else if (!ReuseNearJump) {
+		InterlockedExchange((PLONG) &Padding[1], Displacement);
+	}
+
+	if (InterlockedCompareExchange16(
+		(PSHORT) Entry,
+		(SHORT) HOTPATCH_SHORT_JUMP,
+		(SHORT) OriginalEntry) != (SHORT) OriginalEntry) {
+
+		// someone else changed the function entry in the meantime
+		Status = STATUS_CONFLICTING_ADDRESSES;
+	}
 
 	KexNtProtectVirtualMemory(
 		NtCurrentProcess(),
-		&ApiPageAddress,
-		&HookLength,
+		&ProtectAddress,
+		&ProtectSize,
 		OldProtect,
 		&OldProtect);
 
+	NtFlushInstructionCache(NtCurrentProcess(), Padding, HOTPATCH_PADDING_LENGTH + 2);
+
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	if (HookContext) {
+		HookContext->ApiAddress = ApiAddress;
+		HookContext->OriginalEntry = OriginalEntry;
+	}
+
+	if (OriginalRoutine) {
+		*OriginalRoutine = Original;
+	}
+
 	return STATUS_SUCCESS;
 } PROTECTED_FUNCTION_END
 
-NTSTATUS NTAPI KexHkRemoveBasicHook(
-	IN		PKEX_BASIC_HOOK_CONTEXT	HookContext) PROTECTED_FUNCTION
+//
+// Remove a hot-patch hook. Only the function entry is restored - the near
+// JMP in the padding is left alone, since another thread might be just
+// about to execute it. If the function is hooked again later,
+// KexHkInstallHotPatchHook reuses or retargets that near JMP.
+//
+NTSTATUS NTAPI KexHkRemoveHotPatchHook(
+	IN		PKEX_HOTPATCH_HOOK_CONTEXT	HookContext) PROTECTED_FUNCTION
 {
 	NTSTATUS Status;
-	PVOID ApiPageAddress;
-	SIZE_T HookLength;
+	PVOID ProtectAddress;
+	SIZE_T ProtectSize;
 	ULONG OldProtect;
+	SHORT PreviousEntry;
 
 	if (!HookContext) {
 		return STATUS_INVALID_PARAMETER_1;
 	}
 
-	ApiPageAddress = HookContext->OriginalApiAddress;
-	HookLength = sizeof(BasicHookTemplate);
+	ProtectAddress = HookContext->ApiAddress;
+	ProtectSize = 2;
 
-	Status = NtProtectVirtualMemory(
+	Status = KexNtProtectVirtualMemory(
 		NtCurrentProcess(),
-		&ApiPageAddress,
-		&HookLength,
-		PAGE_READWRITE,
+		&ProtectAddress,
+		&ProtectSize,
+		PAGE_EXECUTE_READWRITE,
 		&OldProtect);
 
 	if (!NT_SUCCESS(Status)) {
 		return Status;
 	}
 
-	RtlCopyMemory(
-		HookContext->OriginalApiAddress,
-		HookContext->OriginalInstructions,
-		sizeof(BasicHookTemplate));
+	PreviousEntry = InterlockedCompareExchange16(
+		(PSHORT) HookContext->ApiAddress,
+		(SHORT) HookContext->OriginalEntry,
+		(SHORT) HOTPATCH_SHORT_JUMP);
 
-	NtProtectVirtualMemory(
+	KexNtProtectVirtualMemory(
 		NtCurrentProcess(),
-		&ApiPageAddress,
-		&HookLength,
+		&ProtectAddress,
+		&ProtectSize,
 		OldProtect,
 		&OldProtect);
 
+	NtFlushInstructionCache(NtCurrentProcess(), HookContext->ApiAddress, 2);
+
+	if (PreviousEntry != (SHORT) HOTPATCH_SHORT_JUMP) {
+		return STATUS_NOT_FOUND;
+	}
+
 	return STATUS_SUCCESS;
 } PROTECTED_FUNCTION_END
\ No newline at end of file
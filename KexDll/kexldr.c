@@ -121,58 +121,433 @@ NTSTATUS NTAPI KexLdrFindDllInitRoutine(
 	return STATUS_SUCCESS;
 } PROTECTED_FUNCTION_END
 
+//
+// Contains all the information we need about an export directory to look up
+// and resolve exports.
+//
+typedef struct _KEX_LDR_EXPORTS {
+	PVOID						DllBase;
+	PIMAGE_EXPORT_DIRECTORY		ExportDirectory;
+	ULONG						ExportDirectorySize;
+	PULONG						NameRvas;
+	PULONG						FunctionRvas;
+	PUSHORT						NameOrdinals;
+} TYPEDEF_TYPE_NAME(KEX_LDR_EXPORTS);
+
+//
+// Maximum length of a forwarder chain (e.g. kernel32 -> kernelbase -> ntdll
+// has length 2) before we decide that it must be circular.
+//
+#define KEX_LDR_MAX_FORWARDER_DEPTH 8
+
+//
+// Same convention as GetProcAddress: if the high word of a procedure name
+// pointer is zero, the low word is an ordinal.
+//
+#define KEX_LDR_IS_ORDINAL(ProcedureName) (((ULONG_PTR) (ProcedureName) >> 16) == 0)
+
+STATIC NTSTATUS KexpLdrMiniGetProcedureAddress(
+	IN	PVOID	DllBase,
+	IN	PCSTR	ProcedureName,
+	IN	ULONG	ForwarderDepth,
+	OUT	PPVOID	ProcedureAddress);
+
+STATIC NTSTATUS KexpLdrMiniGetExports(
+	IN	PVOID			DllBase,
+	OUT	PKEX_LDR_EXPORTS	Exports)
+{
+	Exports->DllBase = DllBase;
+	Exports->ExportDirectory = (PIMAGE_EXPORT_DIRECTORY) RtlImageDirectoryEntryToData(
+		DllBase,
+		TRUE,
+		IMAGE_DIRECTORY_ENTRY_EXPORT,
+		&Exports->ExportDirectorySize);
+
+	if (!Exports->ExportDirectory) {
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	Exports->NameRvas = (PULONG) RVA_TO_VA(DllBase, Exports->ExportDirectory->AddressOfNames);
+	Exports->FunctionRvas = (PULONG) RVA_TO_VA(DllBase, Exports->ExportDirectory->AddressOfFunctions);
+	Exports->NameOrdinals = (PUSHORT) RVA_TO_VA(DllBase, Exports->ExportDirectory->AddressOfNameOrdinals);
+
+	return STATUS_SUCCESS;
+}
+
+//
+// Compare two export names the same way the linker sorts them, i.e. by
+// unsigned byte value.
+//
+STATIC LONG KexpLdrMiniCompareExportName(
+	IN	PCSTR	Name1,
+	IN	PCSTR	Name2)
+{
+	while (*Name1 && *Name1 == *Name2) {
+		++Name1;
+		++Name2;
+	}
+
+	return (LONG) (UCHAR) *Name1 - (LONG) (UCHAR) *Name2;
+}
+
+//
+// Binary search the export name table in the range [Low, High).
+// Returns the index of the name, or -1 if it was not found.
+//
+STATIC LONG KexpLdrMiniFindExportName(
+	IN	PCKEX_LDR_EXPORTS	Exports,
+	IN	PCSTR				ProcedureName,
+	IN	ULONG				Low,
+	IN	ULONG				High)
+{
+	while (Low < High) {
+		ULONG Middle;
+		LONG Comparison;
+
+		Middle = Low + (High - Low) / 2;
+
+		Comparison = KexpLdrMiniCompareExportName(
+			ProcedureName,
+			(PCSTR) RVA_TO_VA(Exports->DllBase, Exports->NameRvas[Middle]));
+
+		if (Comparison == 0) {
+			return Middle;
+		} else if (Comparison < 0) {
+			High = Middle;
+		} else {
+			Low = Middle + 1;
+		}
+	}
+
+	return -1;
+}
+
+//
+// Resolve a forwarder string such as "NTDLL.RtlAllocateHeap" or
+// "NTDLL.#123". The target DLL is looked up in the loaded module table of
+// the current process. It is never loaded by this function, and the loader
+// lock is not taken.
+//
+STATIC NTSTATUS KexpLdrMiniResolveForwarder(
+	IN	PCSTR	Forwarder,
+	IN	ULONG	ForwarderDepth,
+	OUT	PPVOID	ProcedureAddress)
+{
+	NTSTATUS Status;
+	PCSTR Separator;
+	PCSTR ProcedureName;
+	ANSI_STRING ForwarderDllNameAnsi;
+	UNICODE_STRING ForwarderDllName;
+	WCHAR ForwarderDllNameBuffer[MAX_PATH];
+	PLDR_DATA_TABLE_ENTRY Entry;
+
+	if (ForwarderDepth >= KEX_LDR_MAX_FORWARDER_DEPTH) {
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	for (Separator = Forwarder; *Separator != '.'; ++Separator) {
+		if (*Separator == '\0') {
+			return STATUS_INVALID_IMAGE_FORMAT;
+		}
+	}
+
+	ForwarderDllNameAnsi.Buffer = (PCHAR) Forwarder;
+	ForwarderDllNameAnsi.Length = (USHORT) (Separator - Forwarder);
+	ForwarderDllNameAnsi.MaximumLength = ForwarderDllNameAnsi.Length;
+
+	RtlInitEmptyUnicodeString(&ForwarderDllName, ForwarderDllNameBuffer, sizeof(ForwarderDllNameBuffer));
+
+	Status = RtlAnsiStringToUnicodeString(&ForwarderDllName, &ForwarderDllNameAnsi, FALSE);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	Status = RtlAppendUnicodeToString(&ForwarderDllName, L".dll");
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	unless (LdrpFindLoadedDllByName(&ForwarderDllName, &Entry)) {
+		return STATUS_DLL_NOT_FOUND;
+	}
+
+	ProcedureName = Separator + 1;
+
+	if (*ProcedureName == '#') {
+		ULONG Ordinal;
+
+		//
+		// Forward by ordinal.
+		//
+
+		Ordinal = 0;
+
+		for (++ProcedureName; *ProcedureName; ++ProcedureName) {
+			if (*ProcedureName < '0' || *ProcedureName > '9' || Ordinal > 0xFFFF) {
+				return STATUS_INVALID_IMAGE_FORMAT;
+			}
+
+			Ordinal = (Ordinal * 10) + (*ProcedureName - '0');
+		}
+
+		if (Ordinal == 0 || Ordinal > 0xFFFF) {
+			return STATUS_INVALID_IMAGE_FORMAT;
+		}
+
+		ProcedureName = (PCSTR) (ULONG_PTR) Ordinal;
+	}
+
+	return KexpLdrMiniGetProcedureAddress(
+		Entry->DllBase,
+		ProcedureName,
+		ForwarderDepth + 1,
+		ProcedureAddress);
+}
+
+//
+// Get the address of an export given its index into AddressOfFunctions,
+// following forwarders if necessary.
+//
+STATIC NTSTATUS KexpLdrMiniGetExportAddress(
+	IN	PCKEX_LDR_EXPORTS	Exports,
+	IN	ULONG				FunctionIndex,
+	IN	ULONG				ForwarderDepth,
+	OUT	PPVOID				ProcedureAddress)
+{
+	ULONG FunctionRva;
+	ULONG ExportDirectoryRva;
+
+	if (FunctionIndex >= Exports->ExportDirectory->NumberOfFunctions) {
+		return STATUS_ENTRYPOINT_NOT_FOUND;
+	}
+
+	FunctionRva = Exports->FunctionRvas[FunctionIndex];
+
+	if (FunctionRva == 0) {
+		// gap in the ordinal range
+		return STATUS_ENTRYPOINT_NOT_FOUND;
+	}
+
+	//
+	// If the RVA points inside the export directory, this export is a
+	// forwarder.
+	//
+
+	ExportDirectoryRva = (ULONG) VA_TO_RVA(Exports->DllBase, Exports->ExportDirectory);
+
+	if (FunctionRva >= ExportDirectoryRva &&
+		FunctionRva < ExportDirectoryRva + Exports->ExportDirectorySize) {
+
+		return KexpLdrMiniResolveForwarder(
+			(PCSTR) RVA_TO_VA(Exports->DllBase, FunctionRva),
+			ForwarderDepth,
+			ProcedureAddress);
+	}
+
+	*ProcedureAddress = RVA_TO_VA(Exports->DllBase, FunctionRva);
+	return STATUS_SUCCESS;
+}
+
+STATIC NTSTATUS KexpLdrMiniGetProcedureAddress(
+	IN	PVOID	DllBase,
+	IN	PCSTR	ProcedureName,
+	IN	ULONG	ForwarderDepth,
+	OUT	PPVOID	ProcedureAddress)
+{
+	NTSTATUS Status;
+	KEX_LDR_EXPORTS Exports;
+	LONG NameIndex;
+
+	Status = KexpLdrMiniGetExports(DllBase, &Exports);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	if (KEX_LDR_IS_ORDINAL(ProcedureName)) {
+		return KexpLdrMiniGetExportAddress(
+			&Exports,
+			(USHORT) (ULONG_PTR) ProcedureName - Exports.ExportDirectory->Base,
+			ForwarderDepth,
+			ProcedureAddress);
+	}
+
+	NameIndex = KexpLdrMiniFindExportName(
+		&Exports,
+		ProcedureName,
+		0,
+		Exports.ExportDirectory->NumberOfNames);
+
+	if (NameIndex == -1) {
+		return STATUS_ENTRYPOINT_NOT_FOUND;
+	}
+
+	return KexpLdrMiniGetExportAddress(
+		&Exports,
+		Exports.NameOrdinals[NameIndex],
+		ForwarderDepth,
+		ProcedureAddress);
+}
+
 //
 // Main reason for using this is to:
 //   - get proc address in DLLs mapped but not registered with loader
 //   - get proc address in "wrong" bitness dlls (e.g. native ntdll.dll from wow64 process)
+//   - get proc address without taking the loader lock
+//
+// The export name table of a PE image is sorted, so we can binary search
+// it. If you need to look up a large number of names in the same DLL, use
+// KexLdrMiniGetProcedureAddresses instead.
 //
-// However, for DLLs registered with loader, this function is not useful
-// as it is far slower than LdrGetProcedureAddress.
+// ProcedureName can also be an ordinal, in the same way as GetProcAddress.
+//
+// Forwarders are followed, but only to DLLs which are already loaded in the
+// current process. This means that forwarders in "wrong" bitness DLLs can't
+// be resolved. If the forwarder target is not loaded, STATUS_DLL_NOT_FOUND
+// is returned.
 //
 NTSTATUS NTAPI KexLdrMiniGetProcedureAddress(
 	IN	PVOID	DllBase,
 	IN	PCSTR	ProcedureName,
 	OUT	PPVOID	ProcedureAddress) PROTECTED_FUNCTION
 {
-	PIMAGE_EXPORT_DIRECTORY ExportDirectory;
-	ULONG ExportDirectorySize;
-	PULONG NameRvas;
-	PULONG FunctionRvas;
-	PUSHORT NameOrdinals;
-	ULONG Index;
-
 	if (!DllBase || !ProcedureName || !ProcedureAddress) {
 		return STATUS_INVALID_PARAMETER;
 	}
 
 	*ProcedureAddress = NULL;
 
-	ExportDirectory = (PIMAGE_EXPORT_DIRECTORY) RtlImageDirectoryEntryToData(
-		DllBase, 
-		TRUE, 
-		IMAGE_DIRECTORY_ENTRY_EXPORT, 
-		&ExportDirectorySize);
+	return KexpLdrMiniGetProcedureAddress(DllBase, ProcedureName, 0, ProcedureAddress);
+} PROTECTED_FUNCTION_END
 
-	if (!ExportDirectory) {
-		return STATUS_INVALID_IMAGE_FORMAT;
+//
+// Resolve many procedure names (or ordinals) in one DLL at once.
+//
+// The requested names are sorted first, and then each one is searched for
+// only in the part of the export name table that comes after the previous
+// match, so the export directory is traversed in a single forward pass.
+//
+// If all procedures were found, STATUS_SUCCESS is returned. Otherwise, the
+// status code of the first failed lookup (in the order given by the caller)
+// is returned, and the addresses of procedures that could not be found are
+// set to NULL. Procedures that could be found are always filled out.
+//
+NTSTATUS NTAPI KexLdrMiniGetProcedureAddresses(
+	IN	PVOID	DllBase,
+	IN	ULONG	NumberOfProcedures,
+	IN	PCSTR	*ProcedureNames,
+	OUT	PPVOID	ProcedureAddresses) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+	NTSTATUS FailureStatus;
+	ULONG FailureIndex;
+	KEX_LDR_EXPORTS Exports;
+	PULONG SortedIndices;
+	ULONG NumberOfSortedIndices;
+	ULONG NameTableLow;
+	ULONG Index;
+
+	if (!DllBase || !ProcedureNames || !ProcedureAddresses) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (NumberOfProcedures == 0) {
+		return STATUS_SUCCESS;
+	}
+
+	RtlZeroMemory(ProcedureAddresses, NumberOfProcedures * sizeof(PVOID));
+
+	Status = KexpLdrMiniGetExports(DllBase, &Exports);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	SortedIndices = SafeAlloc(ULONG, NumberOfProcedures);
+	if (!SortedIndices) {
+		return STATUS_NO_MEMORY;
 	}
 
-	NameRvas = (PULONG) RVA_TO_VA(DllBase, ExportDirectory->AddressOfNames);
-	FunctionRvas = (PULONG) RVA_TO_VA(DllBase, ExportDirectory->AddressOfFunctions);
-	NameOrdinals = (PUSHORT) RVA_TO_VA(DllBase, ExportDirectory->AddressOfNameOrdinals);
+	FailureStatus = STATUS_SUCCESS;
+	FailureIndex = NumberOfProcedures;
+	NumberOfSortedIndices = 0;
 
-	for (Index = 0; Index < ExportDirectory->NumberOfNames; ++Index) {
-		PCSTR CurrentProcedureName;
+	//
+	// Resolve ordinals directly, and insertion sort the indices of the
+	// named procedures. NumberOfProcedures is normally small, so this is
+	// fine.
+	//
+
+	for (Index = 0; Index < NumberOfProcedures; ++Index) {
+		PCSTR ProcedureName;
+		ULONG Position;
 
-		CurrentProcedureName = (PCSTR) RVA_TO_VA(DllBase, NameRvas[Index]);
+		ProcedureName = ProcedureNames[Index];
 
-		if (StringEqualA(ProcedureName, CurrentProcedureName)) {
-			*ProcedureAddress = RVA_TO_VA(DllBase, FunctionRvas[NameOrdinals[Index]]);
-			return STATUS_SUCCESS;
+		if (KEX_LDR_IS_ORDINAL(ProcedureName)) {
+			Status = KexpLdrMiniGetExportAddress(
+				&Exports,
+				(USHORT) (ULONG_PTR) ProcedureName - Exports.ExportDirectory->Base,
+				0,
+				&ProcedureAddresses[Index]);
+
+			if (!NT_SUCCESS(Status) && Index < FailureIndex) {
+				FailureStatus = Status;
+				FailureIndex = Index;
+			}
+
+			continue;
+		}
+
+		for (Position = NumberOfSortedIndices; Position > 0; --Position) {
+			if (KexpLdrMiniCompareExportName(ProcedureNames[SortedIndices[Position - 1]], ProcedureName) <= 0) {
+				break;
+			}
+
+			SortedIndices[Position] = SortedIndices[Position - 1];
+		}
+
+		SortedIndices[Position] = Index;
+		++NumberOfSortedIndices;
+	}
+
+	//
+	// Now look up the names in ascending order. Each search can start where
+	// the previous one ended.
+	//
+
+	NameTableLow = 0;
+
+	for (Index = 0; Index < NumberOfSortedIndices; ++Index) {
+		ULONG ProcedureIndex;
+		LONG NameIndex;
+
+		ProcedureIndex = SortedIndices[Index];
+
+		NameIndex = KexpLdrMiniFindExportName(
+			&Exports,
+			ProcedureNames[ProcedureIndex],
+			NameTableLow,
+			Exports.ExportDirectory->NumberOfNames);
+
+		if (NameIndex == -1) {
+			Status = STATUS_ENTRYPOINT_NOT_FOUND;
+		} else {
+			NameTableLow = NameIndex;
+
+			Status = KexpLdrMiniGetExportAddress(
+				&Exports,
+				Exports.NameOrdinals[NameIndex],
+				0,
+				&ProcedureAddresses[ProcedureIndex]);
+		}
+
+		if (!NT_SUCCESS(Status) && ProcedureIndex < FailureIndex) {
+			FailureStatus = Status;
+			FailureIndex = ProcedureIndex;
 		}
 	}
 
-	return STATUS_ENTRYPOINT_NOT_FOUND;
+	SafeFree(SortedIndices);
+	return FailureStatus;
 } PROTECTED_FUNCTION_END
 
 //
@@ -180,6 +555,9 @@ NTSTATUS NTAPI KexLdrMiniGetProcedureAddress(
 // if this is a 32-bit process running on a 64-bit operating
 // system, get the 64-bit NTDLL, and so on.
 //
+// The result is cached in KexData->SystemDllBase, so after
+// KexDataInitialize has run, this function is very cheap.
+//
 PVOID NTAPI KexLdrGetNativeSystemDllBase(
 	VOID) PROTECTED_FUNCTION
 {
@@ -187,16 +565,18 @@ PVOID NTAPI KexLdrGetNativeSystemDllBase(
 	UNICODE_STRING NtdllPathFragment;
 	UNICODE_STRING NtdllBaseName;
 	ULONG_PTR NtdllBaseAddress;
+	ULONG_PTR SearchAddress;
 	PUNICODE_STRING MappedFileNameInformation;
 	ULONG MappedFileNameLength;
 
+	if (_KexData.SystemDllBase) {
+		return _KexData.SystemDllBase;
+	}
+
 	RtlInitConstantUnicodeString(&NtdllBaseName, L"ntdll.dll");
 
 	//
-	// NTDLL is mapped between 0x7F000000 and 0x7FFF0000 on
-	// boundaries of 0x10000 (due to ASLR). This gives us 256
-	// possibilities we need to search for. To avoid this penalty,
-	// we will avoid performing the search if we could just get
+	// If this process is the same bitness as the OS, we can just get
 	// NTDLL's base address from the loader subsystem.
 	//
 
@@ -210,52 +590,57 @@ PVOID NTAPI KexLdrGetNativeSystemDllBase(
 
 	//
 	// Either the loader call failed or this is a 32-bit process running
-	// on a 64-bit operating system. We must search for NTDLL as described.
+	// on a 64-bit operating system. The native NTDLL is mapped somewhere
+	// between 0x70000000 and 0x7FFF0000.
+	//
+	// Instead of probing every 64K-aligned address in that range, walk
+	// the address space one region at a time. Free and private regions
+	// are skipped with a single query each, and we only ask for the
+	// mapped file name at the base of an image mapping.
 	//
 
 	MappedFileNameLength = 512;
 	MappedFileNameInformation = (PUNICODE_STRING) StackAlloc(BYTE, 512);
 	RtlInitConstantUnicodeString(&NtdllPathFragment, L"Windows\\system32\\ntdll.dll");
 
-	for (NtdllBaseAddress = 0x7FFD0000; NtdllBaseAddress > 0x70000000; NtdllBaseAddress -= 0x10000) {
+	SearchAddress = 0x70000000;
+
+	while (SearchAddress < 0x7FFF0000) {
 		MEMORY_BASIC_INFORMATION BasicInformation;
 
 		Status = NtQueryVirtualMemory(
 			NtCurrentProcess(),
-			(PVOID) NtdllBaseAddress,
-			MemoryMappedFilenameInformation,
-			MappedFileNameInformation,
-			MappedFileNameLength,
+			(PVOID) SearchAddress,
+			MemoryBasicInformation,
+			&BasicInformation,
+			sizeof(BasicInformation),
 			NULL);
 
-		if (!NT_SUCCESS(Status)) {
-			continue;
+		if (!NT_SUCCESS(Status) || BasicInformation.RegionSize == 0) {
+			break;
 		}
 
-		//
-		// We now have a pointer to a memory mapped file.
-		// We will now determine whether this file is an image, and also
-		// the base address of this image file.
-		//
+		NtdllBaseAddress = (ULONG_PTR) BasicInformation.BaseAddress;
+		SearchAddress = NtdllBaseAddress + BasicInformation.RegionSize;
+
+		if (BasicInformation.Type != MEM_IMAGE ||
+			BasicInformation.AllocationBase != BasicInformation.BaseAddress) {
+
+			continue;
+		}
 
 		Status = NtQueryVirtualMemory(
 			NtCurrentProcess(),
 			(PVOID) NtdllBaseAddress,
-			MemoryBasicInformation,
-			&BasicInformation,
-			sizeof(BasicInformation),
+			MemoryMappedFilenameInformation,
+			MappedFileNameInformation,
+			MappedFileNameLength,
 			NULL);
 
 		if (!NT_SUCCESS(Status)) {
 			continue;
 		}
 
-		NtdllBaseAddress = (ULONG_PTR) BasicInformation.AllocationBase;
-
-		if (BasicInformation.Type != MEM_IMAGE) {
-			continue;
-		}
-
 		//
 		// Confirm that this memory-mapped image is in fact the native
 		// NTDLL inside the system32 directory.
@@ -22,6 +22,661 @@
 #include "buildcfg.h"
 #include "kexdllp.h"
 
+//
+// Log ring shared with KexSrv. See KexSrv.h for a description of the ring.
+// These are set up by KexSrvNotifyProcessStart and stay valid for the
+// lifetime of the process. Nothing is written into the ring until the server
+// has set LogRing->ServerAttached - until then, and for good if the server
+// can't attach to the ring, log events go through the pipe.
+//
+
+STATIC HANDLE LogRingSectionHandle = NULL;
+STATIC HANDLE LogRingDoorbellEventHandle = NULL;
+STATIC PKEX_IPC_LOG_RING LogRing = NULL;
+STATIC RTL_SRWLOCK LogRingLock = RTL_SRWLOCK_INIT;
+
+//
+// Log events which are sent through the pipe are collected into a single
+// KexIpcLogEventBatch message. The batch is sent when it is full, when the
+// batch timer expires, or before any other message is sent to the server.
+//
+
+#define KEX_LOG_BATCH_DELAY 20 // milliseconds
+
+STATIC RTL_SRWLOCK LogBatchLock = RTL_SRWLOCK_INIT;
+STATIC HANDLE LogBatchChannelHandle = NULL;
+STATIC HANDLE LogBatchTimerQueueHandle = NULL;
+STATIC HANDLE LogBatchTimerHandle = NULL;
+STATIC ULONG_PTR LogBatchBuffers[2][KEX_IPC_MESSAGE_MAXIMUM_SIZE / sizeof(ULONG_PTR)];
+STATIC PKEX_IPC_MESSAGE LogBatch = (PKEX_IPC_MESSAGE) LogBatchBuffers[0];
+
+//
+// KexpSrvSendBlocking swaps the pending batch with this one, so that it can
+// write the batch to the pipe without holding LogBatchLock. Only accessed
+// while holding SendLock.
+//
+
+STATIC PKEX_IPC_MESSAGE SpareLogBatch = (PKEX_IPC_MESSAGE) LogBatchBuffers[1];
+
+//
+// Most messages are not written to the pipe by the thread that sends them.
+// They are copied into a bounded queue instead, which is emptied by a
+// dedicated sender thread, so that a busy or hung server can't stall the
+// application. What happens to a message when the queue is full depends on
+// its class - see KexpSrvSendPolicy.
+//
+// SendLock serializes all writes to the pipe. It is held by the sender thread
+// while it empties the queue, and by threads which send KexSrvSendBlock class
+// messages themselves. The lock order is SendLock, LogBatchLock, SendQueueLock.
+//
+
+#define KEX_SRV_SEND_QUEUE_LENGTH 32
+
+typedef enum _KEX_SRV_SEND_POLICY {
+	KexSrvSendBlock,		// written by the calling thread, which waits for the server
+	KexSrvSendDrop,			// queued, or discarded if the queue is full
+	KexSrvSendCoalesce		// queued, or handed back to the caller if the queue is full
+} TYPEDEF_TYPE_NAME(KEX_SRV_SEND_POLICY);
+
+typedef struct _KEX_SRV_SEND_QUEUE_ENTRY {
+	HANDLE				ChannelHandle;
+	PKEX_IPC_MESSAGE	Message;
+} TYPEDEF_TYPE_NAME(KEX_SRV_SEND_QUEUE_ENTRY);
+
+//
+// Indexed by KEX_IPC_MESSAGE_ID. Message IDs that are not in this table are
+// treated as KexSrvSendBlock.
+//
+STATIC CONST KEX_SRV_SEND_POLICY KexpSrvSendPolicy[] = {
+	KexSrvSendBlock,		// KexIpcKexProcessStart
+	KexSrvSendBlock,		// KexIpcHardError
+	KexSrvSendDrop,			// KexIpcLogEvent
+	KexSrvSendCoalesce		// KexIpcLogEventBatch
+};
+
+STATIC RTL_SRWLOCK SendLock = RTL_SRWLOCK_INIT;
+STATIC RTL_SRWLOCK SendQueueLock = RTL_SRWLOCK_INIT;
+STATIC HANDLE SendQueueEventHandle = NULL;
+STATIC BOOLEAN SenderThreadStartAttempted = FALSE;
+STATIC KEX_SRV_SEND_QUEUE_ENTRY SendQueue[KEX_SRV_SEND_QUEUE_LENGTH];
+STATIC ULONG SendQueueHead = 0;
+STATIC ULONG SendQueueCount = 0;
+STATIC VOLATILE LONG NumberOfDroppedMessages = 0;
+
+//
+// Create the log ring section and its doorbell event, and map the ring into
+// our address space. The handles are sent to the server as part of the
+// KexIpcKexProcessStart message.
+//
+STATIC NTSTATUS KexpSrvCreateLogRing(
+	OUT	PPKEX_IPC_LOG_RING	NewLogRing)
+{
+	NTSTATUS Status;
+	LONGLONG MaximumSize;
+	SIZE_T ViewSize;
+	PVOID BaseAddress;
+
+	ASSERT (LogRing == NULL);
+	ASSERT (NewLogRing != NULL);
+
+	MaximumSize = sizeof(KEX_IPC_LOG_RING);
+
+	Status = NtCreateSection(
+		&LogRingSectionHandle,
+		SECTION_MAP_READ | SECTION_MAP_WRITE | SECTION_QUERY,
+		NULL,
+		&MaximumSize,
+		PAGE_READWRITE,
+		SEC_COMMIT,
+		NULL);
+
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	Status = NtCreateEvent(
+		&LogRingDoorbellEventHandle,
+		EVENT_MODIFY_STATE | SYNCHRONIZE,
+		NULL,
+		SynchronizationEvent,
+		FALSE);
+
+	if (!NT_SUCCESS(Status)) {
+		SafeClose(LogRingSectionHandle);
+		return Status;
+	}
+
+	BaseAddress = NULL;
+	ViewSize = sizeof(KEX_IPC_LOG_RING);
+
+	Status = NtMapViewOfSection(
+		LogRingSectionHandle,
+		NtCurrentProcess(),
+		&BaseAddress,
+		0,
+		0,
+		NULL,
+		&ViewSize,
+		ViewUnmap,
+		0,
+		PAGE_READWRITE);
+
+	if (!NT_SUCCESS(Status)) {
+		SafeClose(LogRingDoorbellEventHandle);
+		SafeClose(LogRingSectionHandle);
+		return Status;
+	}
+
+	// The section is zero-initialized, so both offsets start out at zero.
+	*NewLogRing = (PKEX_IPC_LOG_RING) BaseAddress;
+	return STATUS_SUCCESS;
+}
+
+//
+// Undo KexpSrvCreateLogRing. This is used when the ring's handles could not
+// be sent to the server, so nothing has been written into it yet.
+//
+STATIC VOID KexpSrvDeleteLogRing(
+	IN	PKEX_IPC_LOG_RING	OldLogRing)
+{
+	ASSERT (LogRing == NULL);
+	ASSERT (OldLogRing != NULL);
+
+	NtUnmapViewOfSection(NtCurrentProcess(), OldLogRing);
+	SafeClose(LogRingDoorbellEventHandle);
+	SafeClose(LogRingSectionHandle);
+}
+
+//
+// Copy a message into the log ring. Returns STATUS_BUFFER_TOO_SMALL if the
+// ring does not currently have enough free space, in which case the caller
+// should send the message through the pipe instead.
+//
+STATIC NTSTATUS KexpSrvWriteLogRing(
+	IN	PKEX_IPC_MESSAGE	Message)
+{
+	ULONG MessageSize;
+	ULONG RecordSize;
+	ULONG RequiredSize;
+	ULONG OriginalWriteOffset;
+	ULONG WriteOffset;
+	ULONG ReadOffset;
+	ULONG Position;
+	ULONG Contiguous;
+
+	ASSERT (LogRing != NULL);
+	ASSERT (Message != NULL);
+
+	MessageSize = sizeof(KEX_IPC_MESSAGE) + Message->AuxiliaryDataBlockSize;
+	RecordSize = KEX_IPC_LOG_RING_RECORD_SIZE(MessageSize);
+
+	RtlAcquireSRWLockExclusive(&LogRingLock);
+
+	OriginalWriteOffset = LogRing->WriteOffset;
+	WriteOffset = OriginalWriteOffset;
+	ReadOffset = LogRing->ReadOffset;
+	Position = WriteOffset % KEX_IPC_LOG_RING_DATA_SIZE;
+	Contiguous = KEX_IPC_LOG_RING_DATA_SIZE - Position;
+
+	//
+	// Messages are never split across the end of the data area. If there is
+	// not enough room left before the end, the remaining space is skipped.
+	//
+
+	RequiredSize = RecordSize;
+
+	if (Contiguous < RecordSize) {
+		RequiredSize += Contiguous;
+	}
+
+	if (WriteOffset - ReadOffset > KEX_IPC_LOG_RING_DATA_SIZE ||
+		RequiredSize > KEX_IPC_LOG_RING_DATA_SIZE - (WriteOffset - ReadOffset)) {
+
+		RtlReleaseSRWLockExclusive(&LogRingLock);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	if (Contiguous < RecordSize) {
+		*(KEX_IPC_MESSAGE_ID *) &LogRing->Data[Position] = KEX_IPC_LOG_RING_WRAP;
+		WriteOffset += Contiguous;
+		Position = 0;
+	}
+
+	RtlCopyMemory(&LogRing->Data[Position], Message, MessageSize);
+
+	//
+	// Publish the message, and then find out whether the server had already
+	// consumed everything before it. If so, the server may be asleep and we
+	// have to ring the doorbell.
+	//
+
+	LogRing->WriteOffset = WriteOffset + RecordSize;
+	MemoryBarrier();
+	ReadOffset = LogRing->ReadOffset;
+
+	RtlReleaseSRWLockExclusive(&LogRingLock);
+
+	if (ReadOffset == OriginalWriteOffset) {
+		NtSetEvent(LogRingDoorbellEventHandle, NULL);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+STATIC NTSTATUS KexpSrvWriteMessage(
+	IN	HANDLE				ChannelHandle,
+	IN	PKEX_IPC_MESSAGE	Message)
+{
+	IO_STATUS_BLOCK IoStatusBlock;
+
+	return KexNtWriteFile(
+		ChannelHandle,
+		NULL,
+		NULL,
+		NULL,
+		&IoStatusBlock,
+		Message,
+		sizeof(KEX_IPC_MESSAGE) + Message->AuxiliaryDataBlockSize,
+		NULL,
+		NULL);
+}
+
+//
+// Write out everything in the send queue, oldest first. The caller must hold
+// SendLock exclusively.
+//
+STATIC VOID KexpSrvDrainSendQueueLocked(
+	VOID)
+{
+	KEX_SRV_SEND_QUEUE_ENTRY Entry;
+	LONG DroppedMessages;
+
+	while (TRUE) {
+		RtlAcquireSRWLockExclusive(&SendQueueLock);
+
+		if (SendQueueCount == 0) {
+			RtlReleaseSRWLockExclusive(&SendQueueLock);
+			break;
+		}
+
+		Entry = SendQueue[SendQueueHead];
+		SendQueueHead = (SendQueueHead + 1) % KEX_SRV_SEND_QUEUE_LENGTH;
+		--SendQueueCount;
+
+		RtlReleaseSRWLockExclusive(&SendQueueLock);
+
+		KexpSrvWriteMessage(Entry.ChannelHandle, Entry.Message);
+		SafeFree(Entry.Message);
+	}
+
+	DroppedMessages = InterlockedExchange(&NumberOfDroppedMessages, 0);
+
+	if (DroppedMessages != 0) {
+		KexLogWarningEvent(
+			L"%ld messages to KexSrv were dropped because the send queue was full.",
+			DroppedMessages);
+	}
+}
+
+STATIC NTSTATUS NTAPI KexpSrvSenderThreadProc(
+	IN	PVOID	Parameter)
+{
+	NTSTATUS Status;
+
+	while (TRUE) {
+		Status = NtWaitForSingleObject(SendQueueEventHandle, FALSE, NULL);
+
+		if (!NT_SUCCESS(Status)) {
+			break;
+		}
+
+		RtlAcquireSRWLockExclusive(&SendLock);
+		KexpSrvDrainSendQueueLocked();
+		RtlReleaseSRWLockExclusive(&SendLock);
+	}
+
+	return Status;
+}
+
+//
+// Create the sender thread. The caller must hold SendQueueLock exclusively.
+//
+// If this is called during process initialization, the new thread will not
+// run until the loader has finished initializing the process. Messages that
+// are queued in the meantime simply wait in the queue.
+//
+STATIC NTSTATUS KexpSrvStartSenderThread(
+	VOID)
+{
+	NTSTATUS Status;
+	HANDLE ThreadHandle;
+
+	ASSERT (SendQueueEventHandle == NULL);
+
+	Status = NtCreateEvent(
+		&SendQueueEventHandle,
+		EVENT_ALL_ACCESS,
+		NULL,
+		SynchronizationEvent,
+		FALSE);
+
+	if (!NT_SUCCESS(Status)) {
+		SendQueueEventHandle = NULL;
+		return Status;
+	}
+
+	Status = RtlCreateUserThread(
+		NtCurrentProcess(),
+		NULL,
+		FALSE,
+		0,
+		0,
+		0,
+		KexpSrvSenderThreadProc,
+		NULL,
+		&ThreadHandle,
+		NULL);
+
+	if (!NT_SUCCESS(Status)) {
+		SafeClose(SendQueueEventHandle);
+		return Status;
+	}
+
+	NtClose(ThreadHandle);
+	return STATUS_SUCCESS;
+}
+
+//
+// Put a copy of a message into the send queue. If the queue is full, the
+// message is not sent and STATUS_DEVICE_BUSY is returned. For KexSrvSendDrop
+// class messages, this is counted and reported in the log once the sender
+// thread catches up. For KexSrvSendCoalesce class messages, the caller is
+// expected to hold on to the contents of the message and try again later.
+//
+STATIC NTSTATUS KexpSrvQueueMessage(
+	IN	HANDLE				ChannelHandle,
+	IN	PKEX_IPC_MESSAGE	Message,
+	IN	KEX_SRV_SEND_POLICY	Policy)
+{
+	ULONG MessageSize;
+	ULONG Index;
+	BOOLEAN QueueWasEmpty;
+	PKEX_IPC_MESSAGE QueuedMessage;
+
+	ASSERT (Policy != KexSrvSendBlock);
+
+	MessageSize = sizeof(KEX_IPC_MESSAGE) + Message->AuxiliaryDataBlockSize;
+	QueuedMessage = (PKEX_IPC_MESSAGE) SafeAlloc(BYTE, MessageSize);
+
+	if (!QueuedMessage) {
+		if (Policy == KexSrvSendDrop) {
+			InterlockedIncrement(&NumberOfDroppedMessages);
+		}
+
+		return STATUS_NO_MEMORY;
+	}
+
+	RtlCopyMemory(QueuedMessage, Message, MessageSize);
+
+	RtlAcquireSRWLockExclusive(&SendQueueLock);
+
+	if (!SenderThreadStartAttempted) {
+		SenderThreadStartAttempted = TRUE;
+		KexpSrvStartSenderThread();
+	}
+
+	if (!SendQueueEventHandle) {
+		//
+		// There is no sender thread, so nothing is ever queued and the
+		// message can be written right away.
+		//
+
+		RtlReleaseSRWLockExclusive(&SendQueueLock);
+		SafeFree(QueuedMessage);
+		return KexpSrvWriteMessage(ChannelHandle, Message);
+	}
+
+	if (SendQueueCount == KEX_SRV_SEND_QUEUE_LENGTH) {
+		RtlReleaseSRWLockExclusive(&SendQueueLock);
+		SafeFree(QueuedMessage);
+
+		if (Policy == KexSrvSendDrop) {
+			InterlockedIncrement(&NumberOfDroppedMessages);
+		}
+
+		return STATUS_DEVICE_BUSY;
+	}
+
+	Index = (SendQueueHead + SendQueueCount) % KEX_SRV_SEND_QUEUE_LENGTH;
+	SendQueue[Index].ChannelHandle = ChannelHandle;
+	SendQueue[Index].Message = QueuedMessage;
+	QueueWasEmpty = (SendQueueCount == 0);
+	++SendQueueCount;
+
+	RtlReleaseSRWLockExclusive(&SendQueueLock);
+
+	//
+	// The sender thread only goes back to sleep once it has seen an empty
+	// queue, so it only needs to be woken up for the first message.
+	//
+
+	if (QueueWasEmpty) {
+		NtSetEvent(SendQueueEventHandle, NULL);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+//
+// Hand the pending log event batch to the send queue, if there is one. If
+// the queue is full (or the batch can't be copied), the batch is kept so that
+// further log events can be coalesced into it, and an error is returned.
+//
+// The caller must hold LogBatchLock exclusively.
+//
+STATIC NTSTATUS KexpSrvFlushLogBatchLocked(
+	VOID)
+{
+	NTSTATUS Status;
+
+	if (LogBatch->LogEventBatchInformation.NumberOfEvents == 0) {
+		return STATUS_SUCCESS;
+	}
+
+	Status = KexpSrvQueueMessage(
+		LogBatchChannelHandle,
+		LogBatch,
+		KexpSrvSendPolicy[KexIpcLogEventBatch]);
+
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	LogBatch->AuxiliaryDataBlockSize = 0;
+	LogBatch->LogEventBatchInformation.NumberOfEvents = 0;
+
+	return Status;
+}
+
+//
+// Write a message to the pipe from the calling thread, after everything that
+// was sent before it. This is used for KexSrvSendBlock class messages, which
+// must have reached the server by the time the caller continues.
+//
+STATIC NTSTATUS KexpSrvSendBlocking(
+	IN	HANDLE				ChannelHandle,
+	IN	PKEX_IPC_MESSAGE	Message)
+{
+	NTSTATUS Status;
+	PKEX_IPC_MESSAGE PendingLogBatch;
+	HANDLE PendingLogBatchChannelHandle;
+
+	RtlAcquireSRWLockExclusive(&SendLock);
+
+	KexpSrvDrainSendQueueLocked();
+
+	//
+	// Take the pending log batch and put an empty one in its place. The
+	// batch is written after LogBatchLock has been released, so that other
+	// threads can keep adding log events while we wait for the server.
+	//
+
+	PendingLogBatch = NULL;
+	PendingLogBatchChannelHandle = NULL;
+
+	RtlAcquireSRWLockExclusive(&LogBatchLock);
+
+	if (LogBatch->LogEventBatchInformation.NumberOfEvents != 0) {
+		PendingLogBatch = LogBatch;
+		PendingLogBatchChannelHandle = LogBatchChannelHandle;
+
+		LogBatch = SpareLogBatch;
+		LogBatch->AuxiliaryDataBlockSize = 0;
+		LogBatch->LogEventBatchInformation.NumberOfEvents = 0;
+	}
+
+	RtlReleaseSRWLockExclusive(&LogBatchLock);
+
+	if (PendingLogBatch) {
+		KexpSrvWriteMessage(PendingLogBatchChannelHandle, PendingLogBatch);
+		SpareLogBatch = PendingLogBatch;
+	}
+
+	Status = KexpSrvWriteMessage(ChannelHandle, Message);
+
+	RtlReleaseSRWLockExclusive(&SendLock);
+
+	return Status;
+}
+
+STATIC VOID NTAPI KexpSrvLogBatchTimerCallback(
+	IN	PVOID	Context,
+	IN	BOOLEAN	TimerOrWaitFired)
+{
+	RtlAcquireSRWLockExclusive(&LogBatchLock);
+
+	KexpSrvFlushLogBatchLocked();
+
+	//
+	// The timer keeps firing until the batch has been handed to the send
+	// queue. A new one is created when the next log event is added to an
+	// empty batch.
+	//
+
+	if (LogBatch->LogEventBatchInformation.NumberOfEvents == 0) {
+		RtlDeleteTimer(LogBatchTimerQueueHandle, LogBatchTimerHandle, NULL);
+		LogBatchTimerHandle = NULL;
+	}
+
+	RtlReleaseSRWLockExclusive(&LogBatchLock);
+}
+
+//
+// Add a log event to the pending batch. If the batch timer can't be started,
+// the batch is sent right away so that the event is not held back forever.
+//
+// If the batch is full and the send queue has no room for it, the event is
+// dropped and an error is returned.
+//
+STATIC NTSTATUS KexpSrvAddToLogBatch(
+	IN	HANDLE				ChannelHandle,
+	IN	VXLSEVERITY			Severity,
+	IN	PCUNICODE_STRING	SourceComponent,
+	IN	PCUNICODE_STRING	SourceFile,
+	IN	ULONG				SourceLine,
+	IN	PCUNICODE_STRING	SourceFunction,
+	IN	PCUNICODE_STRING	Text)
+{
+	NTSTATUS Status;
+	ULONG EntrySize;
+	PKEX_IPC_LOG_EVENT_BATCH_ENTRY Entry;
+	PBYTE EntryData;
+
+	EntrySize = KEX_IPC_LOG_EVENT_BATCH_ENTRY_SIZE(
+		KexRtlUnicodeStringCch(SourceComponent) + KexRtlUnicodeStringCch(SourceFile) +
+		KexRtlUnicodeStringCch(SourceFunction) + KexRtlUnicodeStringCch(Text));
+
+	if (sizeof(KEX_IPC_MESSAGE) + EntrySize > KEX_IPC_MESSAGE_MAXIMUM_SIZE) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	Status = STATUS_SUCCESS;
+
+	RtlAcquireSRWLockExclusive(&LogBatchLock);
+
+	if (LogBatchChannelHandle != ChannelHandle ||
+		sizeof(KEX_IPC_MESSAGE) + LogBatch->AuxiliaryDataBlockSize + EntrySize > KEX_IPC_MESSAGE_MAXIMUM_SIZE) {
+
+		Status = KexpSrvFlushLogBatchLocked();
+
+		if (!NT_SUCCESS(Status)) {
+			RtlReleaseSRWLockExclusive(&LogBatchLock);
+			InterlockedIncrement(&NumberOfDroppedMessages);
+			return Status;
+		}
+	}
+
+	LogBatchChannelHandle = ChannelHandle;
+	LogBatch->MessageId = KexIpcLogEventBatch;
+
+	Entry = (PKEX_IPC_LOG_EVENT_BATCH_ENTRY) &LogBatch->AuxiliaryDataBlock[LogBatch->AuxiliaryDataBlockSize];
+	Entry->LogEventInformation.Severity = Severity;
+	Entry->LogEventInformation.SourceLine = SourceLine;
+	Entry->LogEventInformation.SourceComponentLength = KexRtlUnicodeStringCch(SourceComponent);
+	Entry->LogEventInformation.SourceFileLength = KexRtlUnicodeStringCch(SourceFile);
+	Entry->LogEventInformation.SourceFunctionLength = KexRtlUnicodeStringCch(SourceFunction);
+	Entry->LogEventInformation.TextLength = KexRtlUnicodeStringCch(Text);
+
+	EntryData = (PBYTE) Entry->Data;
+	RtlCopyMemory(EntryData, SourceComponent->Buffer, SourceComponent->Length);
+	EntryData += SourceComponent->Length;
+	RtlCopyMemory(EntryData, SourceFile->Buffer, SourceFile->Length);
+	EntryData += SourceFile->Length;
+	RtlCopyMemory(EntryData, SourceFunction->Buffer, SourceFunction->Length);
+	EntryData += SourceFunction->Length;
+	RtlCopyMemory(EntryData, Text->Buffer, Text->Length);
+
+	LogBatch->AuxiliaryDataBlockSize += (USHORT) EntrySize;
+	++LogBatch->LogEventBatchInformation.NumberOfEvents;
+
+	if (!LogBatchTimerHandle) {
+		if (!LogBatchTimerQueueHandle) {
+			Status = RtlCreateTimerQueue(&LogBatchTimerQueueHandle);
+
+			if (!NT_SUCCESS(Status)) {
+				LogBatchTimerQueueHandle = NULL;
+			}
+		}
+
+		if (LogBatchTimerQueueHandle) {
+			Status = RtlCreateTimer(
+				LogBatchTimerQueueHandle,
+				&LogBatchTimerHandle,
+				KexpSrvLogBatchTimerCallback,
+				NULL,
+				KEX_LOG_BATCH_DELAY,
+				KEX_LOG_BATCH_DELAY,
+				WT_EXECUTEINTIMERTHREAD);
+
+			if (!NT_SUCCESS(Status)) {
+				LogBatchTimerHandle = NULL;
+			}
+		}
+
+		if (!LogBatchTimerHandle) {
+			// If the send queue is full, the batch goes out together with
+			// the next log event instead.
+			KexpSrvFlushLogBatchLocked();
+		}
+
+		Status = STATUS_SUCCESS;
+	}
+
+	RtlReleaseSRWLockExclusive(&LogBatchLock);
+
+	return Status;
+}
+
 KEXAPI NTSTATUS NTAPI KexSrvOpenChannel(
 	OUT	PHANDLE	ChannelHandle) PROTECTED_FUNCTION
 {
@@ -52,11 +707,18 @@ KEXAPI NTSTATUS NTAPI KexSrvOpenChannel(
 	return Status;
 } PROTECTED_FUNCTION_END_NOLOG
 
+//
+// Send a message to the server. Depending on the class of the message (see
+// KexpSrvSendPolicy), it is either written to the pipe before this function
+// returns, or queued for the sender thread. A queued message may be
+// discarded, or, for KexIpcLogEventBatch messages, refused with
+// STATUS_DEVICE_BUSY if the server is not keeping up.
+//
 KEXAPI NTSTATUS NTAPI KexSrvSendMessage(
 	IN	HANDLE				ChannelHandle,
 	IN	PKEX_IPC_MESSAGE	Message) PROTECTED_FUNCTION
 {
-	IO_STATUS_BLOCK IoStatusBlock;
+	KEX_SRV_SEND_POLICY Policy;
 
 	if (!ChannelHandle) {
 		return STATUS_PORT_DISCONNECTED;
@@ -66,16 +728,17 @@ KEXAPI NTSTATUS NTAPI KexSrvSendMessage(
 		return STATUS_INVALID_PARAMETER;
 	}
 
-	return KexNtWriteFile(
-		ChannelHandle,
-		NULL,
-		NULL,
-		NULL,
-		&IoStatusBlock,
-		Message,
-		sizeof(KEX_IPC_MESSAGE) + Message->AuxiliaryDataBlockSize,
-		NULL,
-		NULL);
+	Policy = KexSrvSendBlock;
+
+	if ((ULONG) Message->MessageId < ARRAYSIZE(KexpSrvSendPolicy)) {
+		Policy = KexpSrvSendPolicy[Message->MessageId];
+	}
+
+	if (Policy == KexSrvSendBlock) {
+		return KexpSrvSendBlocking(ChannelHandle, Message);
+	}
+
+	return KexpSrvQueueMessage(ChannelHandle, Message, Policy);
 } PROTECTED_FUNCTION_END_NOLOG
 
 KEXAPI NTSTATUS NTAPI KexSrvSendReceiveMessage(
@@ -94,16 +757,7 @@ KEXAPI NTSTATUS NTAPI KexSrvSendReceiveMessage(
 		return STATUS_INVALID_PARAMETER;
 	}
 
-	Status = NtWriteFile(
-		ChannelHandle,
-		NULL,
-		NULL,
-		NULL,
-		&IoStatusBlock,
-		MessageToSend,
-		sizeof(KEX_IPC_MESSAGE) + MessageToSend->AuxiliaryDataBlockSize,
-		NULL,
-		NULL);
+	Status = KexpSrvSendBlocking(ChannelHandle, MessageToSend);
 
 	if (!NT_SUCCESS(Status)) {
 		return Status;
@@ -125,8 +779,10 @@ KEXAPI NTSTATUS NTAPI KexSrvNotifyProcessStart(
 	IN	HANDLE				ChannelHandle,
 	IN	PCUNICODE_STRING	ApplicationName) PROTECTED_FUNCTION
 {
+	NTSTATUS Status;
 	PKEX_IPC_MESSAGE Message;
 	UNICODE_STRING DestinationString;
+	PKEX_IPC_LOG_RING NewLogRing;
 
 	if (!ChannelHandle) {
 		return STATUS_PORT_DISCONNECTED;
@@ -140,6 +796,8 @@ KEXAPI NTSTATUS NTAPI KexSrvNotifyProcessStart(
 	Message->MessageId = KexIpcKexProcessStart;
 	Message->AuxiliaryDataBlockSize = ApplicationName->Length;
 	Message->ProcessStartedInformation.ApplicationNameLength = KexRtlUnicodeStringCch(ApplicationName);
+	Message->ProcessStartedInformation.LogRingSectionHandle = 0;
+	Message->ProcessStartedInformation.LogRingDoorbellEventHandle = 0;
 
 	RtlInitEmptyUnicodeString(
 		&DestinationString,
@@ -148,5 +806,107 @@ KEXAPI NTSTATUS NTAPI KexSrvNotifyProcessStart(
 
 	RtlCopyUnicodeString(&DestinationString, ApplicationName);
 
-	return KexSrvSendMessage(ChannelHandle, Message);
-} PROTECTED_FUNCTION_END
\ No newline at end of file
+	//
+	// Set up the log ring and pass its handles to the server. If this fails,
+	// log events are simply sent through the pipe.
+	//
+
+	NewLogRing = NULL;
+
+	if (LogRing || !NT_SUCCESS(KexpSrvCreateLogRing(&NewLogRing))) {
+		return KexSrvSendMessage(ChannelHandle, Message);
+	}
+
+	Message->ProcessStartedInformation.LogRingSectionHandle = HandleToUlong(LogRingSectionHandle);
+	Message->ProcessStartedInformation.LogRingDoorbellEventHandle = HandleToUlong(LogRingDoorbellEventHandle);
+
+	//
+	// Don't wait for the server to attach to the ring, since a server that
+	// never answers would then hang every process at startup. The server
+	// sets LogRing->ServerAttached once it is listening, and KexSrvLogEvent
+	// only starts to use the ring after that.
+	//
+
+	Status = KexSrvSendMessage(ChannelHandle, Message);
+
+	if (!NT_SUCCESS(Status)) {
+		KexpSrvDeleteLogRing(NewLogRing);
+		return Status;
+	}
+
+	LogRing = NewLogRing;
+	return STATUS_SUCCESS;
+} PROTECTED_FUNCTION_END
+
+//
+// Send a log event to the server. If the log ring has been set up by
+// KexSrvNotifyProcessStart and the server is listening to it, the event is
+// copied into the ring and the server is only notified if it was idle.
+// Otherwise (or if the ring is full) the event is added to a batch which is
+// sent through the pipe a short time later.
+//
+KEXAPI NTSTATUS NTAPI KexSrvLogEvent(
+	IN	HANDLE				ChannelHandle,
+	IN	VXLSEVERITY			Severity,
+	IN	PCUNICODE_STRING	SourceComponent,
+	IN	PCUNICODE_STRING	SourceFile,
+	IN	ULONG				SourceLine,
+	IN	PCUNICODE_STRING	SourceFunction,
+	IN	PCUNICODE_STRING	Text) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+	PKEX_IPC_MESSAGE Message;
+	ULONG AuxiliaryDataBlockSize;
+	PBYTE AuxiliaryData;
+
+	if (!ChannelHandle) {
+		return STATUS_PORT_DISCONNECTED;
+	}
+
+	if (!SourceComponent || !SourceFile || !SourceFunction || !Text) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	AuxiliaryDataBlockSize = SourceComponent->Length + SourceFile->Length +
+							 SourceFunction->Length + Text->Length;
+
+	if (sizeof(KEX_IPC_MESSAGE) + AuxiliaryDataBlockSize > KEX_IPC_MESSAGE_MAXIMUM_SIZE) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (LogRing && LogRing->ServerAttached) {
+		Message = (PKEX_IPC_MESSAGE) StackAlloc(BYTE, sizeof(KEX_IPC_MESSAGE) + AuxiliaryDataBlockSize);
+		Message->MessageId = KexIpcLogEvent;
+		Message->AuxiliaryDataBlockSize = (USHORT) AuxiliaryDataBlockSize;
+		Message->LogEventInformation.Severity = Severity;
+		Message->LogEventInformation.SourceLine = SourceLine;
+		Message->LogEventInformation.SourceComponentLength = KexRtlUnicodeStringCch(SourceComponent);
+		Message->LogEventInformation.SourceFileLength = KexRtlUnicodeStringCch(SourceFile);
+		Message->LogEventInformation.SourceFunctionLength = KexRtlUnicodeStringCch(SourceFunction);
+		Message->LogEventInformation.TextLength = KexRtlUnicodeStringCch(Text);
+
+		AuxiliaryData = Message->AuxiliaryDataBlock;
+		RtlCopyMemory(AuxiliaryData, SourceComponent->Buffer, SourceComponent->Length);
+		AuxiliaryData += SourceComponent->Length;
+		RtlCopyMemory(AuxiliaryData, SourceFile->Buffer, SourceFile->Length);
+		AuxiliaryData += SourceFile->Length;
+		RtlCopyMemory(AuxiliaryData, SourceFunction->Buffer, SourceFunction->Length);
+		AuxiliaryData += SourceFunction->Length;
+		RtlCopyMemory(AuxiliaryData, Text->Buffer, Text->Length);
+
+		Status = KexpSrvWriteLogRing(Message);
+
+		if (NT_SUCCESS(Status)) {
+			return Status;
+		}
+	}
+
+	return KexpSrvAddToLogBatch(
+		ChannelHandle,
+		Severity,
+		SourceComponent,
+		SourceFile,
+		SourceLine,
+		SourceFunction,
+		Text);
+} PROTECTED_FUNCTION_END_NOLOG
\ No newline at end of file
@@ -0,0 +1,333 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     ldasm.c
+//
+// Abstract:
+//
+//     Length disassembler for x86 and x64 code.
+//
+//     This is used to find instruction boundaries in function prologues, so
+//     that the overwritten instructions can be copied into a trampoline (see
+//     kexhk.c). It only decodes as much as is needed for that purpose: the
+//     length of each instruction, and the location of any displacement that
+//     is relative to the instruction pointer.
+//
+//     VEX/EVEX-encoded instructions, 3DNow! instructions and a few other
+//     oddities are not supported. They do not occur in the prologues of the
+//     functions we hook.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "buildcfg.h"
+#include "kexdllp.h"
+
+//
+// Opcode table flags.
+//
+
+#define M		0x01		// ModRM byte follows
+#define I8		0x02		// 8-bit immediate
+#define I16		0x04		// 16-bit immediate
+#define IZ		0x08		// 16 or 32-bit immediate depending on operand size
+#define R8		0x10		// 8-bit relative branch displacement
+#define RZ		0x20		// 32-bit relative branch displacement
+#define MO		0x40		// memory offset, size depends on address size
+#define X		0x80		// not supported
+
+STATIC CONST UCHAR KexpLdasmOneByteOpcodes[256] = {
+	/* 0_ */ M, M, M, M, I8, IZ, 0, 0, M, M, M, M, I8, IZ, 0, 0,
+	/* 1_ */ M, M, M, M, I8, IZ, 0, 0, M, M, M, M, I8, IZ, 0, 0,
+	/* 2_ */ M, M, M, M, I8, IZ, 0, 0, M, M, M, M, I8, IZ, 0, 0,
+	/* 3_ */ M, M, M, M, I8, IZ, 0, 0, M, M, M, M, I8, IZ, 0, 0,
+	/* 4_ */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 5_ */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 6_ */ 0, 0, M, M, 0, 0, 0, 0, IZ, M|IZ, I8, M|I8, 0, 0, 0, 0,
+	/* 7_ */ R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8,
+	/* 8_ */ M|I8, M|IZ, M|I8, M|I8, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 9_ */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, I16|IZ, 0, 0, 0, 0, 0,
+	/* A_ */ MO, MO, MO, MO, 0, 0, 0, 0, I8, IZ, 0, 0, 0, 0, 0, 0,
+	/* B_ */ I8, I8, I8, I8, I8, I8, I8, I8, IZ, IZ, IZ, IZ, IZ, IZ, IZ, IZ,
+	/* C_ */ M|I8, M|I8, I16, 0, M, M, M|I8, M|IZ, I8|I16, 0, I16, 0, 0, I8, 0, 0,
+	/* D_ */ M, M, M, M, I8, I8, 0, 0, M, M, M, M, M, M, M, M,
+	/* E_ */ R8, R8, R8, R8, I8, I8, I8, I8, RZ, RZ, I16|IZ, R8, 0, 0, 0, 0,
+	/* F_ */ 0, 0, 0, 0, 0, 0, M, M, 0, 0, 0, 0, 0, 0, M, M
+};
+
+STATIC CONST UCHAR KexpLdasmTwoByteOpcodes[256] = {
+	/* 0_ */ M, M, M, M, 0, 0, 0, 0, 0, 0, 0, 0, 0, M, 0, X,
+	/* 1_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 2_ */ M, M, M, M, X, X, X, X, M, M, M, M, M, M, M, M,
+	/* 3_ */ 0, 0, 0, 0, 0, 0, X, X, M, X, M|I8, X, X, X, X, X,
+	/* 4_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 5_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 6_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 7_ */ M|I8, M|I8, M|I8, M|I8, M, M, M, 0, M, M, M, M, M, M, M, M,
+	/* 8_ */ RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ, RZ,
+	/* 9_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* A_ */ 0, 0, 0, M, M|I8, M, M, M, 0, 0, 0, M, M|I8, M, M, M,
+	/* B_ */ M, M, M, M, M, M, M, M, M, M, M|I8, M, M, M, M, M,
+	/* C_ */ M, M, M|I8, M, M|I8, M|I8, M|I8, M, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* D_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* E_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* F_ */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, X
+};
+
+//
+// Decode one instruction and return information about it.
+//
+// Returns STATUS_NOT_SUPPORTED if the instruction cannot be decoded by this
+// length disassembler, or STATUS_ILLEGAL_INSTRUCTION if it is longer than
+// the architectural limit of 15 bytes.
+//
+NTSTATUS KexpLdasmDecodeInstruction(
+	IN	PCVOID					Code,
+	OUT	PKEX_LDASM_INSTRUCTION	Instruction)
+{
+	PBYTE Start;
+	PBYTE Pointer;
+	BOOLEAN OperandSizeOverride;
+	BOOLEAN AddressSizeOverride;
+	BOOLEAN RexW;
+	BOOLEAN IsTwoByteOpcode;
+	UCHAR Opcode;
+	UCHAR OpcodeFlags;
+	ULONG ImmediateSize;
+	ULONG Length;
+
+	Start = (PBYTE) Code;
+	Pointer = Start;
+	OperandSizeOverride = FALSE;
+	AddressSizeOverride = FALSE;
+	RexW = FALSE;
+	IsTwoByteOpcode = FALSE;
+	ImmediateSize = 0;
+
+	RtlZeroMemory(Instruction, sizeof(*Instruction));
+
+	//
+	// Legacy prefixes.
+	//
+
+	while (TRUE) {
+		switch (*Pointer) {
+		case 0x66:
+			OperandSizeOverride = TRUE;
+			break;
+		case 0x67:
+			AddressSizeOverride = TRUE;
+			break;
+		case 0x26:
+		case 0x2E:
+		case 0x36:
+		case 0x3E:
+		case 0x64:
+		case 0x65:
+		case 0xF0:
+		case 0xF2:
+		case 0xF3:
+			break;
+		default:
+			goto EndOfPrefixes;
+		}
+
+		++Pointer;
+
+		if (Pointer - Start >= KEX_LDASM_MAXIMUM_INSTRUCTION_LENGTH) {
+			return STATUS_ILLEGAL_INSTRUCTION;
+		}
+	}
+
+EndOfPrefixes:
+
+#ifdef KEX_ARCH_X64
+	//
+	// REX prefix. It must immediately precede the opcode.
+	//
+
+	if ((*Pointer & 0xF0) == 0x40) {
+		RexW = !!(*Pointer & 0x08);
+		++Pointer;
+	}
+#endif
+
+	//
+	// Opcode.
+	//
+
+	Instruction->OpcodeOffset = (UCHAR) (Pointer - Start);
+	Opcode = *Pointer++;
+
+	if (Opcode == 0x0F) {
+		IsTwoByteOpcode = TRUE;
+		Opcode = *Pointer++;
+
+		if (Opcode == 0x38) {
+			// three-byte opcode, 0F 38 xx /r
+			++Pointer;
+			OpcodeFlags = KexpLdasmTwoByteOpcodes[0x38];
+		} else if (Opcode == 0x3A) {
+			// three-byte opcode, 0F 3A xx /r ib
+			++Pointer;
+			OpcodeFlags = KexpLdasmTwoByteOpcodes[0x3A];
+		} else {
+			OpcodeFlags = KexpLdasmTwoByteOpcodes[Opcode];
+		}
+	} else {
+		OpcodeFlags = KexpLdasmOneByteOpcodes[Opcode];
+
+#ifdef KEX_ARCH_X64
+		//
+		// 62, C4 and C5 are EVEX/VEX prefixes in 64-bit mode, and the far
+		// CALL/JMP instructions do not exist.
+		//
+
+		if (Opcode == 0x62 || Opcode == 0xC4 || Opcode == 0xC5 ||
+			Opcode == 0x9A || Opcode == 0xEA) {
+
+			OpcodeFlags = X;
+		}
+#endif
+
+		switch (Opcode) {
+		case 0xC2:
+		case 0xC3:
+		case 0xCA:
+		case 0xCB:
+		case 0xE9:
+		case 0xEA:
+		case 0xEB:
+			Instruction->Flags |= KEX_LDASM_TERMINATOR;
+			break;
+		}
+	}
+
+	if (OpcodeFlags & X) {
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	//
+	// ModRM, SIB and displacement.
+	//
+
+	if (OpcodeFlags & M) {
+		UCHAR ModRm;
+		UCHAR Mod;
+		UCHAR Reg;
+		UCHAR Rm;
+		ULONG DisplacementSize;
+
+		ModRm = *Pointer++;
+		Mod = ModRm >> 6;
+		Reg = (ModRm >> 3) & 7;
+		Rm = ModRm & 7;
+		DisplacementSize = 0;
+
+		if (!IsTwoByteOpcode) {
+			if ((Opcode == 0xF6 || Opcode == 0xF7) && Reg <= 1) {
+				// TEST r/m, imm is the only member of group 3 with an immediate
+				OpcodeFlags |= (Opcode == 0xF6) ? I8 : IZ;
+			} else if (Opcode == 0xFF && (Reg == 4 || Reg == 5)) {
+				// indirect JMP
+				Instruction->Flags |= KEX_LDASM_TERMINATOR;
+			}
+		}
+
+		if (Mod != 3) {
+#ifdef KEX_ARCH_X86
+			if (AddressSizeOverride) {
+				//
+				// 16-bit addressing.
+				//
+
+				if (Mod == 1) {
+					DisplacementSize = 1;
+				} else if (Mod == 2 || Rm == 6) {
+					DisplacementSize = 2;
+				}
+			} else
+#endif
+			{
+				if (Rm == 4) {
+					UCHAR Sib;
+
+					Sib = *Pointer++;
+
+					if (Mod == 0 && (Sib & 7) == 5) {
+						DisplacementSize = 4;
+					}
+				}
+
+				if (Mod == 1) {
+					DisplacementSize = 1;
+				} else if (Mod == 2) {
+					DisplacementSize = 4;
+				} else if (Rm == 5) {
+					DisplacementSize = 4;
+
+#ifdef KEX_ARCH_X64
+					Instruction->Flags |= KEX_LDASM_RIP_RELATIVE;
+					Instruction->DisplacementOffset = (UCHAR) (Pointer - Start);
+					Instruction->DisplacementSize = 4;
+#endif
+				}
+			}
+
+			Pointer += DisplacementSize;
+		}
+	}
+
+	//
+	// Immediates and relative branch displacements.
+	//
+
+	if (OpcodeFlags & I8) {
+		ImmediateSize += 1;
+	}
+
+	if (OpcodeFlags & I16) {
+		ImmediateSize += 2;
+	}
+
+	if (OpcodeFlags & IZ) {
+#ifdef KEX_ARCH_X64
+		if (!IsTwoByteOpcode && Opcode >= 0xB8 && Opcode <= 0xBF && RexW) {
+			// MOV r64, imm64
+			ImmediateSize += 8;
+		} else
+#endif
+		{
+			ImmediateSize += OperandSizeOverride ? 2 : 4;
+		}
+	}
+
+	if (OpcodeFlags & MO) {
+#ifdef KEX_ARCH_X64
+		ImmediateSize += AddressSizeOverride ? 4 : 8;
+#else
+		ImmediateSize += AddressSizeOverride ? 2 : 4;
+#endif
+	}
+
+	if (OpcodeFlags & (R8 | RZ)) {
+		if ((OpcodeFlags & RZ) && OperandSizeOverride) {
+			// 16-bit relative branches truncate EIP - nobody uses these
+			return STATUS_NOT_SUPPORTED;
+		}
+
+		Instruction->Flags |= KEX_LDASM_RELATIVE;
+		Instruction->DisplacementOffset = (UCHAR) (Pointer - Start);
+		Instruction->DisplacementSize = (OpcodeFlags & R8) ? 1 : 4;
+		ImmediateSize += Instruction->DisplacementSize;
+	}
+
+	Length = (ULONG) (Pointer - Start) + ImmediateSize;
+
+	if (Length > KEX_LDASM_MAXIMUM_INSTRUCTION_LENGTH) {
+		return STATUS_ILLEGAL_INSTRUCTION;
+	}
+
+	Instruction->Length = (UCHAR) Length;
+	return STATUS_SUCCESS;
+}
\ No newline at end of file
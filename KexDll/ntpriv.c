@@ -77,6 +77,32 @@ BOOLEAN NTAPI LdrpFindLoadedDllByHandle(
 		}
 	}
 
+	*DataTableEntry = Entry;
+	return TRUE;
+}
+
+BOOLEAN NTAPI LdrpFindLoadedDllByName(
+	IN	PCUNICODE_STRING		BaseDllName,
+	OUT	PPLDR_DATA_TABLE_ENTRY	DataTableEntry)
+{
+	PLDR_DATA_TABLE_ENTRY Entry;
+	PPEB_LDR_DATA PebLdr;
+
+	PebLdr = NtCurrentPeb()->Ldr;
+	Entry = (PLDR_DATA_TABLE_ENTRY) PebLdr->InLoadOrderModuleList.Flink;
+
+	if (IsListEmpty(&PebLdr->InLoadOrderModuleList)) {
+		return FALSE;
+	}
+
+	until (Entry->InMemoryOrderLinks.Flink && RtlEqualUnicodeString(&Entry->BaseDllName, BaseDllName, TRUE)) {
+		Entry = (PLDR_DATA_TABLE_ENTRY) Entry->InLoadOrderLinks.Flink;
+
+		if ((PLIST_ENTRY) Entry == &PebLdr->InLoadOrderModuleList) {
+			return FALSE;
+		}
+	}
+
 	*DataTableEntry = Entry;
 	return TRUE;
 }
\ No newline at end of file
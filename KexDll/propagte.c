@@ -44,9 +44,40 @@ STATIC NTSTATUS NTAPI KexpNtCreateUserProcessHook(
     IN OUT	CONST PPS_CREATE_INFO				CreateInfo,
     IN		CONST PPS_ATTRIBUTE_LIST			AttributeList OPTIONAL);
 
+//
+// Points to a trampoline for the original NtCreateUserProcess if we could
+// build one, otherwise to our own syscall stub.
+//
+STATIC NTSTATUS (NTAPI *OriginalNtCreateUserProcess) (
+	OUT		PHANDLE							ProcessHandle,
+	OUT		PHANDLE							ThreadHandle,
+	IN		ACCESS_MASK						ProcessDesiredAccess,
+	IN		ACCESS_MASK						ThreadDesiredAccess,
+	IN		POBJECT_ATTRIBUTES				ProcessObjectAttributes OPTIONAL,
+	IN		POBJECT_ATTRIBUTES				ThreadObjectAttributes OPTIONAL,
+	IN		ULONG							ProcessFlags,
+	IN		ULONG							ThreadFlags,
+	IN		PRTL_USER_PROCESS_PARAMETERS	ProcessParameters,
+	IN OUT	PPS_CREATE_INFO					CreateInfo,
+	IN		PPS_ATTRIBUTE_LIST				AttributeList OPTIONAL) = KexNtCreateUserProcess;
+
 STATIC PVOID NativeNtOpenKey;
 STATIC PVOID NativeNtOpenKeyEx;
 
+//
+// Image section for the native-bitness KexDll, which is mapped into every
+// child process, together with the RVAs of the things inside it which we
+// need to find in the child.
+//
+typedef struct _KEX_PROPAGATION_SECTION {
+	HANDLE		SectionHandle;
+	ULONG_PTR	NtOpenKeyHookRva;
+	ULONG_PTR	NtOpenKeyExHookRva;
+	ULONG_PTR	SyscallNumbersRva;
+} TYPEDEF_TYPE_NAME(KEX_PROPAGATION_SECTION);
+
+STATIC PKEX_PROPAGATION_SECTION CachedPropagationSection = NULL;
+
 //
 // This function unhooks NtOpenKey/NtOpenKeyEx and unmaps the
 // temporary KexDll from the current process.
@@ -152,9 +183,9 @@ STATIC VOID KexpCleanupPropagationRemains(
 
 				SyscallNumber = (PDWORD) &SyscallTemplate[4];
 				
-				*SyscallNumber = 0x0F; // NtOpenKey
+				*SyscallNumber = KexpGetNativeSyscallNumbers()[KexSyscallNtOpenKey];
 				RtlCopyMemory(NativeNtOpenKey, SyscallTemplate, sizeof(SyscallTemplate));
-				*SyscallNumber = 0xF2; // NtOpenKeyEx
+				*SyscallNumber = KexpGetNativeSyscallNumbers()[KexSyscallNtOpenKeyEx];
 				RtlCopyMemory(NativeNtOpenKeyEx, SyscallTemplate, sizeof(SyscallTemplate));
 			} else {
 				PULONG SyscallNumber;
@@ -169,11 +200,11 @@ STATIC VOID KexpCleanupPropagationRemains(
 				SyscallNumber = (PULONG) &SyscallTemplate[1];
 				ParamBytes = (PUSHORT) &SyscallTemplate[13];
 
-				*SyscallNumber = 0xB6; // NtOpenKey
-				*ParamBytes = 0x0C;
+				*SyscallNumber = KexpGetNativeSyscallNumbers()[KexSyscallNtOpenKey];
+				*ParamBytes = KexpSyscallParameterBytes[KexSyscallNtOpenKey];
 				RtlCopyMemory(NativeNtOpenKey, SyscallTemplate, sizeof(SyscallTemplate));
-				*SyscallNumber = 0xB7; // NtOpenKeyEx
-				*ParamBytes = 0x10;
+				*SyscallNumber = KexpGetNativeSyscallNumbers()[KexSyscallNtOpenKeyEx];
+				*ParamBytes = KexpSyscallParameterBytes[KexSyscallNtOpenKeyEx];
 				RtlCopyMemory(NativeNtOpenKeyEx, SyscallTemplate, sizeof(SyscallTemplate));
 			}
 
@@ -251,10 +282,20 @@ NTSTATUS KexInitializePropagation(
 	}
 
 	//
-	// Install a permanent hook, because our hook function will directly do
-	// a syscall when it wants to call the original function.
+	// Install a permanent hook. Our hook function calls the original function
+	// through a trampoline, or if the trampoline can't be built, by directly
+	// doing a syscall.
 	//
-	Status = KexHkInstallBasicHook(&NtCreateUserProcess, KexpNtCreateUserProcessHook, NULL);
+	Status = KexHkInstallTrampolineHook(
+		&NtCreateUserProcess,
+		KexpNtCreateUserProcessHook,
+		(PPVOID) &OriginalNtCreateUserProcess,
+		NULL);
+
+	if (!NT_SUCCESS(Status)) {
+		KexLogDebugEvent(L"Could not build a trampoline for NtCreateUserProcess.");
+		Status = KexHkInstallBasicHook(&NtCreateUserProcess, KexpNtCreateUserProcessHook, NULL);
+	}
 
 	if (NT_SUCCESS(Status)) {
 		KexLogInformationEvent(L"Successfully initialized propagation system.");
@@ -277,6 +318,11 @@ NTSTATUS KexInitializePropagation(
 // Exception handling also doesn't work, since on x64 that depends on the
 // NTDLL export __C_specific_handler.
 //
+// The hooks are normally removed by the child's own KexDll, but if that
+// never loads they stay in place for the life of the process and can be
+// called on any thread. So KexpNtOpenKeyExHook must not keep any state in
+// static variables.
+//
 
 NTSTATUS NTAPI KexpNtOpenKeyExHook(
 	OUT		PHANDLE						KeyHandle,
@@ -287,6 +333,7 @@ NTSTATUS NTAPI KexpNtOpenKeyExHook(
 	UNICODE_STRING IfeoBaseKeyName;
 	UNICODE_STRING DotExe;
 	PPEB Peb;
+	ULONG_PTR RootDirectoryNameBuffer[0x400 / sizeof(ULONG_PTR)];
 
 	Peb = NtCurrentPeb();
 	Peb->ProcessParameters->Flags &= ~RTL_USER_PROCESS_PARAMETERS_IMAGE_KEY_MISSING;
@@ -306,27 +353,20 @@ NTSTATUS NTAPI KexpNtOpenKeyExHook(
 	if (ObjectAttributes->RootDirectory) {
 		NTSTATUS Status;
 		PUNICODE_STRING RootDirectoryName;
-		SIZE_T RootDirectoryNameLength;
 
-		RootDirectoryName = NULL;
-		RootDirectoryNameLength = 0x1000;
-		Status = KexNtAllocateVirtualMemory(
-			NtCurrentProcess(),
-			(PPVOID) &RootDirectoryName,
-			0,
-			&RootDirectoryNameLength,
-			MEM_COMMIT | MEM_RESERVE,
-			PAGE_READWRITE);
+		//
+		// The name of the root directory is queried into a buffer on the
+		// stack. Any name that doesn't fit is much longer than the name of
+		// the IFEO key, so it doesn't matter that the query fails for it.
+		//
 
-		if (!NT_SUCCESS(Status)) {
-			goto BailOut;
-		}
+		RootDirectoryName = (PUNICODE_STRING) RootDirectoryNameBuffer;
 
 		Status = KexNtQueryObject(
 			ObjectAttributes->RootDirectory,
 			ObjectNameInformation,
 			RootDirectoryName,
-			(ULONG) RootDirectoryNameLength,
+			sizeof(RootDirectoryNameBuffer),
 			NULL);
 
 		if (NT_SUCCESS(Status) && 
@@ -341,12 +381,6 @@ NTSTATUS NTAPI KexpNtOpenKeyExHook(
 			ModifiedObjectAttributes.ObjectName = &KexVirtualIfeoEntryName;
 			ObjectAttributes = &ModifiedObjectAttributes;
 		}
-
-		KexNtFreeVirtualMemory(
-			NtCurrentProcess(),
-			(PPVOID) &RootDirectoryName,
-			&RootDirectoryNameLength,
-			MEM_RELEASE);
 	}
 
 BailOut:
@@ -369,6 +403,189 @@ NTSTATUS NTAPI KexpNtOpenKeyHook(
 		0);
 }
 
+//
+// Create an image section for the native-bitness KexDll, and find the
+// RVAs of the things in it that the parent has to know about.
+//
+STATIC NTSTATUS KexpCreatePropagationSection(
+	OUT	PPKEX_PROPAGATION_SECTION	PropagationSection) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+	UNICODE_STRING DllPath;
+	OBJECT_ATTRIBUTES ObjectAttributes;
+	IO_STATUS_BLOCK IoStatusBlock;
+	HANDLE FileHandle;
+	PKEX_PROPAGATION_SECTION Section;
+
+	*PropagationSection = NULL;
+
+	Section = SafeAlloc(KEX_PROPAGATION_SECTION, 1);
+	if (!Section) {
+		return STATUS_NO_MEMORY;
+	}
+
+	RtlZeroMemory(Section, sizeof(*Section));
+
+	RtlInitConstantUnicodeString(&DllPath, L"\\SystemRoot\\system32\\KexDll.dll");
+	InitializeObjectAttributes(&ObjectAttributes, &DllPath, OBJ_CASE_INSENSITIVE, NULL, NULL);
+
+	Status = NtOpenFile(
+		&FileHandle,
+		GENERIC_READ | GENERIC_EXECUTE,
+		&ObjectAttributes,
+		&IoStatusBlock,
+		FILE_SHARE_READ,
+		0);
+
+	if (!NT_SUCCESS(Status)) {
+		KexLogWarningEvent(
+			L"Failed to open KexDll.\r\n\r\n"
+			L"Path to the missing or inaccessible DLL: \"%wZ\"\r\n"
+			L"NTSTATUS error code: %s",
+			&DllPath,
+			KexRtlNtStatusToString(Status));
+		goto Exit;
+	}
+
+	Status = NtCreateSection(
+		&Section->SectionHandle,
+		SECTION_ALL_ACCESS,
+		NULL,
+		NULL,
+		PAGE_EXECUTE_WRITECOPY,
+		SEC_IMAGE,
+		FileHandle);
+
+	NtClose(FileHandle);
+
+	if (!NT_SUCCESS(Status)) {
+		KexLogWarningEvent(
+			L"Failed to create an image section backed by KexDll.\r\n\r\n"
+			L"NTSTATUS error code: %s",
+			KexRtlNtStatusToString(Status));
+		Section->SectionHandle = NULL;
+		goto Exit;
+	}
+
+	//
+	// Find the RVAs of the native-bitness hook procedures and system call
+	// number table.
+	//
+
+	if (KexRtlCurrentProcessBitness() == KexRtlOperatingSystemBitness()) {
+		Section->NtOpenKeyHookRva = (ULONG_PTR) VA_TO_RVA(KexData->KexDllBase, KexpNtOpenKeyHook);
+		Section->NtOpenKeyExHookRva = (ULONG_PTR) VA_TO_RVA(KexData->KexDllBase, KexpNtOpenKeyExHook);
+		Section->SyscallNumbersRva = (ULONG_PTR) VA_TO_RVA(KexData->KexDllBase, KexpGetNativeSyscallNumbers());
+	} else {
+		PVOID TemporaryMapping;
+		SIZE_T TemporaryMappingSize;
+		PVOID Addresses[3];
+		PCSTR Names[3];
+
+		TemporaryMapping = NULL;
+		TemporaryMappingSize = 0;
+
+		Status = NtMapViewOfSection(
+			Section->SectionHandle,
+			NtCurrentProcess(),
+			&TemporaryMapping,
+			0,
+			0,
+			NULL,
+			&TemporaryMappingSize,
+			ViewUnmap,
+			0,
+			PAGE_READWRITE);
+
+		if (!NT_SUCCESS(Status)) {
+			KexLogWarningEvent(
+				L"Failed to map temporary KexDll section into current process.\r\n\r\n"
+				L"NTSTATUS error code: %s",
+				KexRtlNtStatusToString(Status));
+			goto Exit;
+		}
+
+		Names[0] = "KexpNtOpenKeyHook";
+		Names[1] = "KexpNtOpenKeyExHook";
+		Names[2] = "KexpSyscallNumbers64";
+
+		Status = KexLdrMiniGetProcedureAddresses(
+			TemporaryMapping,
+			ARRAYSIZE(Names),
+			Names,
+			Addresses);
+
+		NtUnmapViewOfSection(NtCurrentProcess(), TemporaryMapping);
+
+		if (!NT_SUCCESS(Status)) {
+			KexLogWarningEvent(
+				L"Failed to find the required exports of the native KexDll.\r\n\r\n"
+				L"NTSTATUS error code: %s",
+				KexRtlNtStatusToString(Status));
+			goto Exit;
+		}
+
+		Section->NtOpenKeyHookRva = (ULONG_PTR) VA_TO_RVA(TemporaryMapping, Addresses[0]);
+		Section->NtOpenKeyExHookRva = (ULONG_PTR) VA_TO_RVA(TemporaryMapping, Addresses[1]);
+		Section->SyscallNumbersRva = (ULONG_PTR) VA_TO_RVA(TemporaryMapping, Addresses[2]);
+	}
+
+	*PropagationSection = Section;
+	Section = NULL;
+
+Exit:
+	if (Section) {
+		SafeClose(Section->SectionHandle);
+		SafeFree(Section);
+	}
+
+	return Status;
+} PROTECTED_FUNCTION_END
+
+//
+// Get the cached KexDll image section, creating it if this is the first
+// child process. The section stays open until the process exits, which
+// saves opening the file and creating a new section for every child.
+//
+STATIC NTSTATUS KexpGetPropagationSection(
+	OUT	PPKEX_PROPAGATION_SECTION	PropagationSection)
+{
+	NTSTATUS Status;
+	PKEX_PROPAGATION_SECTION Section;
+	PKEX_PROPAGATION_SECTION ExistingSection;
+
+	Section = CachedPropagationSection;
+
+	if (Section) {
+		*PropagationSection = Section;
+		return STATUS_SUCCESS;
+	}
+
+	Status = KexpCreatePropagationSection(&Section);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	//
+	// Another thread might have created a child process at the same time.
+	// If it beat us to it, use its section and throw ours away.
+	//
+
+	ExistingSection = (PKEX_PROPAGATION_SECTION) InterlockedCompareExchangePointer(
+		(PPVOID) &CachedPropagationSection,
+		Section,
+		NULL);
+
+	if (ExistingSection) {
+		NtClose(Section->SectionHandle);
+		SafeFree(Section);
+		Section = ExistingSection;
+	}
+
+	*PropagationSection = Section;
+	return STATUS_SUCCESS;
+}
+
 STATIC NTSTATUS NTAPI KexpNtCreateUserProcessHook(
     OUT		CONST PHANDLE						ProcessHandle,
     OUT		CONST PHANDLE						ThreadHandle,
@@ -387,19 +604,14 @@ STATIC NTSTATUS NTAPI KexpNtCreateUserProcessHook(
 	ULONG ModifiedThreadDesiredAccess;
 
 	NTSTATUS Status;
-	UNICODE_STRING DllPath;
-	OBJECT_ATTRIBUTES ObjectAttributes;
-	IO_STATUS_BLOCK IoStatusBlock;
+	PKEX_PROPAGATION_SECTION PropagationSection;
 	PVOID RemoteDllBase;
 	SIZE_T RemoteDllSize;
-	HANDLE FileHandle;
-	HANDLE SectionHandle;
 	ULONG_PTR RemoteNtOpenKeyHook;
 	ULONG_PTR RemoteNtOpenKeyExHook;
+	ULONG_PTR RemoteSyscallNumbers;
 	PBYTE HookTemplate;
 
-	SectionHandle = NULL;
-
 	ModifiedProcessDesiredAccess = ProcessDesiredAccess;
 	ModifiedThreadDesiredAccess = ThreadDesiredAccess;
 	ModifiedThreadFlags = ThreadFlags;
@@ -420,7 +632,7 @@ STATIC NTSTATUS NTAPI KexpNtCreateUserProcessHook(
 	ModifiedThreadDesiredAccess |= THREAD_SUSPEND_RESUME;
 	ModifiedThreadFlags |= THREAD_CREATE_FLAGS_CREATE_SUSPENDED;
 	
-	Status = KexNtCreateUserProcess(
+	Status = OriginalNtCreateUserProcess(
 		ProcessHandle,
 		ThreadHandle,
 		ModifiedProcessDesiredAccess,
@@ -446,7 +658,7 @@ STATIC NTSTATUS NTAPI KexpNtCreateUserProcessHook(
 		// the caller. Of course, this means that VxKex will not be
 		// enabled for the child process.
 		//
-		return KexNtCreateUserProcess(
+		return OriginalNtCreateUserProcess(
 			ProcessHandle,
 			ThreadHandle,
 			ProcessDesiredAccess,
@@ -460,50 +672,15 @@ STATIC NTSTATUS NTAPI KexpNtCreateUserProcessHook(
 			AttributeList);
 	}
 	
-	RtlInitConstantUnicodeString(&DllPath, L"\\SystemRoot\\system32\\KexDll.dll");
-	InitializeObjectAttributes(&ObjectAttributes, &DllPath, OBJ_CASE_INSENSITIVE, NULL, NULL);
-
-	Status = NtOpenFile(
-		&FileHandle,
-		GENERIC_READ | GENERIC_EXECUTE,
-		&ObjectAttributes,
-		&IoStatusBlock,
-		FILE_SHARE_READ,
-		0);
-
+	Status = KexpGetPropagationSection(&PropagationSection);
 	if (!NT_SUCCESS(Status)) {
-		KexLogWarningEvent(
-			L"Failed to open KexDll.\r\n\r\n"
-			L"Path to the missing or inaccessible DLL: \"%wZ\"\r\n"
-			L"NTSTATUS error code: %s",
-			&DllPath,
-			KexRtlNtStatusToString(Status));
-		goto BailOut;
-	}
-
-	Status = NtCreateSection(
-		&SectionHandle,
-		SECTION_ALL_ACCESS,
-		NULL,
-		NULL,
-		PAGE_EXECUTE_WRITECOPY,
-		SEC_IMAGE,
-		FileHandle);
-
-	NtClose(FileHandle);
-
-	if (!NT_SUCCESS(Status)) {
-		KexLogWarningEvent(
-			L"Failed to create an image section backed by KexDll.\r\n\r\n"
-			L"NTSTATUS error code: %s",
-			KexRtlNtStatusToString(Status));
 		goto BailOut;
 	}
 
 	RemoteDllBase = NULL;
 	RemoteDllSize = 0;
 	Status = NtMapViewOfSection(
-		SectionHandle,
+		PropagationSection->SectionHandle,
 		*ProcessHandle,
 		&RemoteDllBase,
 		4,
@@ -529,73 +706,28 @@ STATIC NTSTATUS NTAPI KexpNtCreateUserProcessHook(
 		RemoteDllBase,
 		RemoteDllSize);
 
+	RemoteNtOpenKeyHook = (ULONG_PTR) RVA_TO_VA(RemoteDllBase, PropagationSection->NtOpenKeyHookRva);
+	RemoteNtOpenKeyExHook = (ULONG_PTR) RVA_TO_VA(RemoteDllBase, PropagationSection->NtOpenKeyExHookRva);
+	RemoteSyscallNumbers = (ULONG_PTR) RVA_TO_VA(RemoteDllBase, PropagationSection->SyscallNumbersRva);
+
 	//
-	// Find the addresses of the native-bitness hook procedures in the temporary
-	// KexDll mapping into the child process.
+	// The hook functions in the temporary KexDll use the unhooked system
+	// call stubs before that KexDll has had a chance to discover the system
+	// call numbers by itself, so give it ours. KexpGetNativeSyscallNumbers
+	// returns the table which applies to the native-bitness KexDll, even if
+	// we are running under WOW64.
 	//
 
-	if (KexRtlCurrentProcessBitness() == KexRtlOperatingSystemBitness()) {
-		RemoteNtOpenKeyHook = (ULONG_PTR) VA_TO_RVA(KexData->KexDllBase, KexpNtOpenKeyHook);
-		RemoteNtOpenKeyExHook = (ULONG_PTR) VA_TO_RVA(KexData->KexDllBase, KexpNtOpenKeyExHook);
-	} else {
-		PVOID TemporaryMapping;
-		SIZE_T TemporaryMappingSize;
-
-		Status = NtMapViewOfSection(
-			SectionHandle,
-			NtCurrentProcess(),
-			&TemporaryMapping,
-			0,
-			0,
-			NULL,
-			&TemporaryMappingSize,
-			ViewUnmap,
-			0,
-			PAGE_READWRITE);
-
-		if (!NT_SUCCESS(Status)) {
-			KexLogWarningEvent(
-				L"Failed to map temporary KexDll section into current process.\r\n\r\n"
-				L"NTSTATUS error code: %s",
-				KexRtlNtStatusToString(Status));
-			goto BailOut;
-		}
-
-		Status = KexLdrMiniGetProcedureAddress(
-			TemporaryMapping,
-			"KexpNtOpenKeyHook",
-			(PPVOID) &RemoteNtOpenKeyHook);
-
-		if (!NT_SUCCESS(Status)) {
-			KexLogWarningEvent(
-				L"Failed to find the procedure address of KexpNtOpenKeyHook.\r\n\r\n"
-				L"NTSTATUS error code: %s",
-				KexRtlNtStatusToString(Status));
-			goto BailOut;
-		}
-
-		Status = KexLdrMiniGetProcedureAddress(
-			TemporaryMapping,
-			"KexpNtOpenKeyExHook",
-			(PPVOID) &RemoteNtOpenKeyExHook);
-
-		if (!NT_SUCCESS(Status)) {
-			KexLogWarningEvent(
-				L"Failed to find the procedure address of KexpNtOpenKeyExHook.\r\n\r\n"
-				L"NTSTATUS error code: %s",
-				KexRtlNtStatusToString(Status));
-			goto BailOut;
-		}
-
-		NtUnmapViewOfSection(NtCurrentProcess(), TemporaryMapping);
+	Status = KexRtlWriteProcessMemory(
+		*ProcessHandle,
+		RemoteSyscallNumbers,
+		KexpGetNativeSyscallNumbers(),
+		KexSyscallMaximum * sizeof(ULONG));
 
-		RemoteNtOpenKeyHook = (ULONG_PTR) VA_TO_RVA(TemporaryMapping, RemoteNtOpenKeyHook);
-		RemoteNtOpenKeyExHook = (ULONG_PTR) VA_TO_RVA(TemporaryMapping, RemoteNtOpenKeyExHook);
+	if (!NT_SUCCESS(Status)) {
+		goto WriteProcessMemoryFailure;
 	}
 
-	RemoteNtOpenKeyHook = (ULONG_PTR) RVA_TO_VA(RemoteDllBase, RemoteNtOpenKeyHook);
-	RemoteNtOpenKeyExHook = (ULONG_PTR) RVA_TO_VA(RemoteDllBase, RemoteNtOpenKeyExHook);
-
 	//
 	// Create hook templates and write them into the target process.
 	//
@@ -636,7 +768,7 @@ STATIC NTSTATUS NTAPI KexpNtCreateUserProcessHook(
 			*ProcessHandle,
 			(ULONG_PTR) NativeNtOpenKey,
 			HookTemplate,
-			14);
+			6);
 
 		if (!NT_SUCCESS(Status)) {
 			goto WriteProcessMemoryFailure;
@@ -663,8 +795,6 @@ WriteProcessMemoryFailure:
 BailOut:
 	Status = STATUS_SUCCESS;
 
-	SafeClose(SectionHandle);
-
 	//
 	// Finally, resume the initial thread (unless the original caller
 	// wanted the thread to remain suspended).
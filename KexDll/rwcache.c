@@ -0,0 +1,238 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     rwcache.c
+//
+// Abstract:
+//
+//     Contains routines for the DLL rewrite cache.
+//
+//     The DLL rewrite cache remembers, for each image file, which imported
+//     DLL names were rewritten to what - or that there was nothing to
+//     rewrite at all. This allows KexRewriteImageImportDirectory to skip
+//     string mapper lookups (and, for images which need no rewriting, the
+//     page protection changes as well) when the same program is launched
+//     again.
+//
+//     The cache is stored in the registry under the key
+//     HKCU\Software\VXsoft\VxKex\DllRewriteCache. Each value name is the full
+//     path of an image file, and the value data is a REG_BINARY containing a
+//     KEX_DLL_REWRITE_CACHE_DATA structure (truncated to the number of valid
+//     entries).
+//
+//     A cache entry is only used if the SizeOfImage, TimeDateStamp and
+//     CheckSum fields from the NT headers of the loaded image match the ones
+//     recorded in the cache entry, and if the contents of the DllRewrite key
+//     have not changed since the cache entry was written.
+//
+// Environment:
+//
+//     Early process initialization and DLL load notifications.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "buildcfg.h"
+#include "kexdllp.h"
+
+STATIC HANDLE DllRewriteCacheKeyHandle = NULL;
+STATIC ULONG DllRewriteConfigurationSignature = 0;
+
+//
+// Open (or create) the DLL rewrite cache key.
+//
+//   ConfigurationSignature
+//     A value that identifies the current contents of the DllRewrite
+//     registry key. Cache entries that were written with a different
+//     configuration signature are ignored.
+//
+// If this function fails, the DLL rewrite cache is simply not used.
+//
+NTSTATUS KexInitializeDllRewriteCache(
+	IN	ULONG	ConfigurationSignature) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+	HANDLE CurrentUserKeyHandle;
+	UNICODE_STRING KeyName;
+	OBJECT_ATTRIBUTES ObjectAttributes;
+
+	DllRewriteConfigurationSignature = ConfigurationSignature;
+
+	Status = RtlOpenCurrentUser(KEY_CREATE_SUB_KEY, &CurrentUserKeyHandle);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	RtlInitConstantUnicodeString(&KeyName, L"Software\\VXsoft\\VxKex\\DllRewriteCache");
+
+	InitializeObjectAttributes(
+		&ObjectAttributes,
+		&KeyName,
+		OBJ_CASE_INSENSITIVE,
+		CurrentUserKeyHandle,
+		NULL);
+
+	Status = NtCreateKey(
+		&DllRewriteCacheKeyHandle,
+		KEY_QUERY_VALUE | KEY_SET_VALUE,
+		&ObjectAttributes,
+		0,
+		NULL,
+		0,
+		NULL);
+
+	NtClose(CurrentUserKeyHandle);
+
+	if (!NT_SUCCESS(Status)) {
+		DllRewriteCacheKeyHandle = NULL;
+	}
+
+	return Status;
+} PROTECTED_FUNCTION_END
+
+//
+// Look up the cached rewrite information for an image.
+//
+//   FullImageName
+//     Full path to the image file.
+//
+//   NtHeaders
+//     NT headers of the loaded image. These are used to check whether
+//     the image file has changed since the cache entry was written.
+//
+//   CacheData
+//     Receives the cached rewrite information.
+//
+// Returns STATUS_SUCCESS if a valid cache entry was found, or
+// STATUS_NOT_FOUND if there is no usable cache entry.
+//
+NTSTATUS KexLookupDllRewriteCache(
+	IN	PCUNICODE_STRING				FullImageName,
+	IN	PIMAGE_NT_HEADERS				NtHeaders,
+	OUT	PKEX_DLL_REWRITE_CACHE_DATA		CacheData) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+	ULONG CacheDataCb;
+	ULONG Index;
+
+	ASSERT (FullImageName != NULL);
+	ASSERT (NtHeaders != NULL);
+	ASSERT (CacheData != NULL);
+
+	if (!DllRewriteCacheKeyHandle) {
+		return STATUS_NOT_FOUND;
+	}
+
+	CacheDataCb = sizeof(*CacheData);
+
+	Status = KexRtlQueryKeyValueData(
+		DllRewriteCacheKeyHandle,
+		FullImageName,
+		&CacheDataCb,
+		CacheData,
+		REG_RESTRICT_BINARY,
+		NULL);
+
+	if (!NT_SUCCESS(Status)) {
+		return STATUS_NOT_FOUND;
+	}
+
+	//
+	// Validate the data we got back. Anyone can write to HKCU, so don't
+	// trust anything in here. The entries are checked against the image
+	// itself before they are used - see KexRewriteImageImportDirectory.
+	//
+
+	if (CacheDataCb < FIELD_OFFSET(KEX_DLL_REWRITE_CACHE_DATA, Entries) ||
+		CacheData->Version != KEX_DLL_REWRITE_CACHE_VERSION ||
+		CacheData->NumberOfEntries > KEX_DLL_REWRITE_CACHE_MAX_ENTRIES ||
+		CacheDataCb != FIELD_OFFSET(KEX_DLL_REWRITE_CACHE_DATA, Entries[CacheData->NumberOfEntries])) {
+
+		return STATUS_NOT_FOUND;
+	}
+
+	//
+	// Check that the image file and the rewrite configuration are still
+	// the same as when the cache entry was written.
+	//
+
+	if (CacheData->ConfigurationSignature != DllRewriteConfigurationSignature ||
+		CacheData->SizeOfImage != NtHeaders->OptionalHeader.SizeOfImage ||
+		CacheData->TimeDateStamp != NtHeaders->FileHeader.TimeDateStamp ||
+		CacheData->CheckSum != NtHeaders->OptionalHeader.CheckSum) {
+
+		KexLogDebugEvent(L"Stale DLL rewrite cache entry for %wZ", FullImageName);
+		return STATUS_NOT_FOUND;
+	}
+
+	for (Index = 0; Index < CacheData->NumberOfEntries; ++Index) {
+		PKEX_LDR_IMPORT_REWRITE Entry;
+
+		Entry = &CacheData->Entries[Index];
+
+		if (Entry->NameRva == 0 || Entry->NameRva >= CacheData->SizeOfImage) {
+			return STATUS_NOT_FOUND;
+		}
+
+		if (FAILED(StringCchLengthA(Entry->RewrittenName, ARRAYSIZE(Entry->RewrittenName), NULL))) {
+			return STATUS_NOT_FOUND;
+		}
+	}
+
+	return STATUS_SUCCESS;
+} PROTECTED_FUNCTION_END
+
+//
+// Write rewrite information for an image into the cache.
+//
+//   FullImageName
+//     Full path to the image file.
+//
+//   NtHeaders
+//     NT headers of the loaded image.
+//
+//   CacheData
+//     Contains the rewrite information. Only the NumberOfEntries and
+//     Entries members need to be filled out by the caller - all other
+//     members are filled out by this function.
+//
+NTSTATUS KexUpdateDllRewriteCache(
+	IN		PCUNICODE_STRING				FullImageName,
+	IN		PIMAGE_NT_HEADERS				NtHeaders,
+	IN OUT	PKEX_DLL_REWRITE_CACHE_DATA		CacheData) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+
+	ASSERT (FullImageName != NULL);
+	ASSERT (NtHeaders != NULL);
+	ASSERT (CacheData != NULL);
+	ASSERT (CacheData->NumberOfEntries <= KEX_DLL_REWRITE_CACHE_MAX_ENTRIES);
+
+	if (!DllRewriteCacheKeyHandle) {
+		return STATUS_PORT_DISCONNECTED;
+	}
+
+	CacheData->Version = KEX_DLL_REWRITE_CACHE_VERSION;
+	CacheData->ConfigurationSignature = DllRewriteConfigurationSignature;
+	CacheData->SizeOfImage = NtHeaders->OptionalHeader.SizeOfImage;
+	CacheData->TimeDateStamp = NtHeaders->FileHeader.TimeDateStamp;
+	CacheData->CheckSum = NtHeaders->OptionalHeader.CheckSum;
+
+	Status = NtSetValueKey(
+		DllRewriteCacheKeyHandle,
+		(PUNICODE_STRING) FullImageName,
+		0,
+		REG_BINARY,
+		CacheData,
+		FIELD_OFFSET(KEX_DLL_REWRITE_CACHE_DATA, Entries[CacheData->NumberOfEntries]));
+
+	if (!NT_SUCCESS(Status)) {
+		KexLogWarningEvent(
+			L"Failed to update the DLL rewrite cache for %wZ\r\n\r\n"
+			L"NTSTATUS error code: %s",
+			FullImageName,
+			KexRtlNtStatusToString(Status));
+	}
+
+	return Status;
+} PROTECTED_FUNCTION_END
\ No newline at end of file
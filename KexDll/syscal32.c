@@ -32,119 +32,30 @@
 #define KEXNTSYSCALLAPI __declspec(naked)
 #pragma warning(disable:4414) // shut the fuck up i dont care
 
-#define GENERATE_SYSCALL(SyscallName, SyscallNumber32, SyscallNumber64, EcxValue, Retn, ...) \
+//
+// The service numbers are loaded from the tables in sysctab.c, which are
+// filled in at run time by KexInitializeSyscallTable.
+//
+
+#define KEX_SYSCALL(SyscallName, Number32, Number64, Wow64EcxValue, Retn, ...) \
 KEXNTSYSCALLAPI NTSTATUS NTAPI Kex##SyscallName##(__VA_ARGS__) { asm { \
-	asm mov eax, SyscallNumber32 \
 	asm mov edx, 0x7FFE0300 \
 	asm cmp dword ptr [edx], 0 /* If [0x7ffe0300] is zero, that means we are running as a Wow64 program on a 64 bit OS. */ \
 	asm je Kex##SyscallName##_Wow64 \
+	asm mov eax, KexpSyscallNumbers32[KexSyscall##SyscallName * 4] \
 	asm call [edx] /* Native 32 bit call */ \
 	asm ret Retn \
 	asm Kex##SyscallName##_Wow64: /* Wow64 call */ \
-	asm mov eax, SyscallNumber64 \
-	asm mov ecx, EcxValue \
+	asm mov eax, KexpSyscallNumbers64[KexSyscall##SyscallName * 4] \
+	asm mov ecx, KexpSyscallWow64EcxValues[KexSyscall##SyscallName * 4] \
 	asm lea edx, [esp+4] \
 	asm call fs:0xC0 \
 	asm add esp, 4 \
 	asm ret Retn \
 }}
 
-GENERATE_SYSCALL(NtQuerySystemTime,					0x0107, 0x0057, 0x18, 0x04,
-	OUT		PLONGLONG	CurrentTime);
-
-GENERATE_SYSCALL(NtCreateUserProcess,				0x005D, 0x00AA, 0x00, 0x2C,
-	OUT		PHANDLE							ProcessHandle,
-	OUT		PHANDLE							ThreadHandle,
-	IN		ACCESS_MASK						ProcessDesiredAccess,
-	IN		ACCESS_MASK						ThreadDesiredAccess,
-	IN		POBJECT_ATTRIBUTES				ProcessObjectAttributes OPTIONAL,
-	IN		POBJECT_ATTRIBUTES				ThreadObjectAttributes OPTIONAL,
-	IN		ULONG							ProcessFlags,
-	IN		ULONG							ThreadFlags,
-	IN		PRTL_USER_PROCESS_PARAMETERS	ProcessParameters,
-	IN OUT	PPS_CREATE_INFO					CreateInfo,
-	IN		PPS_ATTRIBUTE_LIST				AttributeList OPTIONAL);
-
-GENERATE_SYSCALL(NtProtectVirtualMemory,			0x00D7, 0x004D, 0x00, 0x14,
-	IN		HANDLE		ProcessHandle,
-	IN OUT	PPVOID		BaseAddress,
-	IN OUT	PSIZE_T		RegionSize,
-	IN		ULONG		NewProtect,
-	OUT		PULONG		OldProtect);
-
-GENERATE_SYSCALL(NtAllocateVirtualMemory,			0x0013, 0x0015, 0x00, 0x18,
-	IN		HANDLE		ProcessHandle,
-	IN OUT	PVOID		*BaseAddress,
-	IN		ULONG_PTR	ZeroBits,
-	IN OUT	PSIZE_T		RegionSize,
-	IN		ULONG		AllocationType,
-	IN		ULONG		Protect);
-
-GENERATE_SYSCALL(NtQueryVirtualMemory,				0x010B, 0x0020, 0x00, 0x18,
-	IN		HANDLE			ProcessHandle,
-	IN		PVOID			BaseAddress OPTIONAL,
-	IN		MEMINFOCLASS	MemoryInformationClass,
-	OUT		PVOID			MemoryInformation,
-	IN		SIZE_T			MemoryInformationLength,
-	OUT		PSIZE_T			ReturnLength OPTIONAL);
-
-GENERATE_SYSCALL(NtFreeVirtualMemory,				0x0083, 0x001B, 0x00, 0x10,
-	IN		HANDLE		ProcessHandle,
-	IN OUT	PVOID		*BaseAddress,
-	IN OUT	PSIZE_T		RegionSize,
-	IN		ULONG		FreeType);
-
-GENERATE_SYSCALL(NtOpenKeyEx,						0x00B7, 0x00F2, 0x00, 0x10,
-	OUT		PHANDLE						KeyHandle,
-	IN		ACCESS_MASK					DesiredAccess,
-	IN		POBJECT_ATTRIBUTES			ObjectAttributes,
-	IN		ULONG						OpenOptions);
-
-GENERATE_SYSCALL(NtQueryObject,						0x00F8, 0x000D, 0x00, 0x14,
-	IN		HANDLE						ObjectHandle,
-	IN		OBJECT_INFORMATION_CLASS	ObjectInformationClass,
-	OUT		PVOID						ObjectInformation,
-	IN		ULONG						Length,
-	OUT		PULONG						ReturnLength OPTIONAL);
-
-GENERATE_SYSCALL(NtOpenFile,						0x00B3, 0x0030, 0x00, 0x18,
-	OUT		PHANDLE				FileHandle,
-	IN		ACCESS_MASK			DesiredAccess,
-	IN		POBJECT_ATTRIBUTES	ObjectAttributes,
-	OUT		PIO_STATUS_BLOCK	IoStatusBlock,
-	IN		ULONG				ShareAccess,
-	IN		ULONG				OpenOptions);
-
-GENERATE_SYSCALL(NtWriteFile,						0x018C, 0x0005, 0x1A, 0x24,
-	IN		HANDLE				FileHandle,
-	IN		HANDLE				Event OPTIONAL,
-	IN		PIO_APC_ROUTINE		ApcRoutine OPTIONAL,
-	IN		PVOID				ApcContext OPTIONAL,
-	OUT		PIO_STATUS_BLOCK	IoStatusBlock,
-	IN		PVOID				Buffer,
-	IN		ULONG				Length,
-	IN		PLARGE_INTEGER		ByteOffset OPTIONAL,
-	IN		PULONG				Key OPTIONAL);
-
-GENERATE_SYSCALL(NtRaiseHardError,					0x0110, 0x0130, 0x00, 0x18,
-	IN	NTSTATUS	ErrorStatus,
-	IN	ULONG		NumberOfParameters,
-	IN	ULONG		UnicodeStringParameterMask,
-	IN	PULONG_PTR	Parameters,
-	IN	ULONG		ValidResponseOptions,
-	OUT	PULONG		Response);
-
-GENERATE_SYSCALL(NtQueryInformationThread,			0x00EC, 0x0022, 0x00, 0x14,
-	IN	HANDLE				ThreadHandle,
-	IN	THREADINFOCLASS		ThreadInformationClass,
-	OUT	PVOID				ThreadInformation,
-	IN	ULONG				ThreadInformationLength,
-	OUT	PULONG				ReturnLength OPTIONAL);
+#include "syscalls.h"
 
-GENERATE_SYSCALL(NtSetInformationThread,			0x014F, 0x000A, 0x00, 0x10,
-	IN	HANDLE				ThreadHandle,
-	IN	THREADINFOCLASS		ThreadInformationClass,
-	IN	PVOID				ThreadInformation,
-	IN	ULONG				ThreadInformationLength);
+#undef KEX_SYSCALL
 
 #endif
\ No newline at end of file
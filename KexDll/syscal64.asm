@@ -1,31 +1,37 @@
+; Generated by gensysc.py from syscalls.h. Do not edit.
+
 IFDEF RAX
 
+EXTERN KexpSyscallNumbers64:DWORD
+
 _TEXT SEGMENT
 
-GENERATE_SYSCALL MACRO SyscallName, SyscallNumber64
+GENERATE_SYSCALL MACRO SyscallName, SyscallIndex
 PUBLIC SyscallName
 ALIGN 16
 SyscallName PROC
 	mov			r10, rcx
-	mov			eax, SyscallNumber64
+	mov			eax, DWORD PTR KexpSyscallNumbers64[SyscallIndex * 4]
 	syscall
 	ret
 SyscallName ENDP
 ENDM
 
-GENERATE_SYSCALL KexNtQuerySystemTime,							0057h
-GENERATE_SYSCALL KexNtCreateUserProcess,						00AAh
-GENERATE_SYSCALL KexNtProtectVirtualMemory,						004Dh
-GENERATE_SYSCALL KexNtAllocateVirtualMemory,					0015h
-GENERATE_SYSCALL KexNtQueryVirtualMemory,						0020h
-GENERATE_SYSCALL KexNtFreeVirtualMemory,						001Bh
-GENERATE_SYSCALL KexNtOpenKeyEx,								00F2h
-GENERATE_SYSCALL KexNtQueryObject,								000Dh
-GENERATE_SYSCALL KexNtOpenFile,									0030h
-GENERATE_SYSCALL KexNtWriteFile,								0005h
-GENERATE_SYSCALL KexNtRaiseHardError,							0130h
-GENERATE_SYSCALL KexNtQueryInformationThread,					0022h
-GENERATE_SYSCALL KexNtSetInformationThread,                     000Ah
+GENERATE_SYSCALL KexNtQuerySystemTime,							0
+GENERATE_SYSCALL KexNtCreateUserProcess,						1
+GENERATE_SYSCALL KexNtProtectVirtualMemory,						2
+GENERATE_SYSCALL KexNtAllocateVirtualMemory,					3
+GENERATE_SYSCALL KexNtQueryVirtualMemory,						4
+GENERATE_SYSCALL KexNtFreeVirtualMemory,						5
+GENERATE_SYSCALL KexNtOpenKey,									6
+GENERATE_SYSCALL KexNtOpenKeyEx,								7
+GENERATE_SYSCALL KexNtQueryObject,								8
+GENERATE_SYSCALL KexNtOpenFile,									9
+GENERATE_SYSCALL KexNtWriteFile,								10
+GENERATE_SYSCALL KexNtRaiseHardError,							11
+GENERATE_SYSCALL KexNtQueryInformationThread,					12
+GENERATE_SYSCALL KexNtSetInformationThread,						13
+GENERATE_SYSCALL KexNtFlushInstructionCache,					14
 
 _TEXT ENDS
 
@@ -0,0 +1,136 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     syscalls.h
+//
+// Abstract:
+//
+//     List of the unhooked system call stubs (KexNt*) provided by KexDll.
+//
+//     This file is included several times with different definitions of
+//     KEX_SYSCALL, in order to generate the stubs in syscal32.c, the index
+//     enumeration in kexdllp.h and the tables in sysctab.c. The x64 stubs in
+//     syscal64.asm are generated from this file by gensysc.py, so run that
+//     script after changing this list.
+//
+//     KEX_SYSCALL(Name, Number32, Number64, Wow64EcxValue, ParameterBytes, ...)
+//
+//       Number32, Number64 and Wow64EcxValue are the values for Windows 7
+//       SP1. They are only used if the real values cannot be discovered from
+//       the NTDLL stubs at run time (see sysctab.c).
+//
+//       ParameterBytes is the number of bytes of parameters which the 32-bit
+//       stub pops off the stack.
+//
+//       The remaining arguments are the parameters of the system call.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+KEX_SYSCALL(NtQuerySystemTime,					0x0107, 0x0057, 0x18, 0x04,
+	OUT		PLONGLONG	CurrentTime)
+
+KEX_SYSCALL(NtCreateUserProcess,				0x005D, 0x00AA, 0x00, 0x2C,
+	OUT		PHANDLE							ProcessHandle,
+	OUT		PHANDLE							ThreadHandle,
+	IN		ACCESS_MASK						ProcessDesiredAccess,
+	IN		ACCESS_MASK						ThreadDesiredAccess,
+	IN		POBJECT_ATTRIBUTES				ProcessObjectAttributes OPTIONAL,
+	IN		POBJECT_ATTRIBUTES				ThreadObjectAttributes OPTIONAL,
+	IN		ULONG							ProcessFlags,
+	IN		ULONG							ThreadFlags,
+	IN		PRTL_USER_PROCESS_PARAMETERS	ProcessParameters,
+	IN OUT	PPS_CREATE_INFO					CreateInfo,
+	IN		PPS_ATTRIBUTE_LIST				AttributeList OPTIONAL)
+
+KEX_SYSCALL(NtProtectVirtualMemory,				0x00D7, 0x004D, 0x00, 0x14,
+	IN		HANDLE		ProcessHandle,
+	IN OUT	PPVOID		BaseAddress,
+	IN OUT	PSIZE_T		RegionSize,
+	IN		ULONG		NewProtect,
+	OUT		PULONG		OldProtect)
+
+KEX_SYSCALL(NtAllocateVirtualMemory,			0x0013, 0x0015, 0x00, 0x18,
+	IN		HANDLE		ProcessHandle,
+	IN OUT	PVOID		*BaseAddress,
+	IN		ULONG_PTR	ZeroBits,
+	IN OUT	PSIZE_T		RegionSize,
+	IN		ULONG		AllocationType,
+	IN		ULONG		Protect)
+
+KEX_SYSCALL(NtQueryVirtualMemory,				0x010B, 0x0020, 0x00, 0x18,
+	IN		HANDLE			ProcessHandle,
+	IN		PVOID			BaseAddress OPTIONAL,
+	IN		MEMINFOCLASS	MemoryInformationClass,
+	OUT		PVOID			MemoryInformation,
+	IN		SIZE_T			MemoryInformationLength,
+	OUT		PSIZE_T			ReturnLength OPTIONAL)
+
+KEX_SYSCALL(NtFreeVirtualMemory,				0x0083, 0x001B, 0x00, 0x10,
+	IN		HANDLE		ProcessHandle,
+	IN OUT	PVOID		*BaseAddress,
+	IN OUT	PSIZE_T		RegionSize,
+	IN		ULONG		FreeType)
+
+KEX_SYSCALL(NtOpenKey,							0x00B6, 0x000F, 0x00, 0x0C,
+	OUT		PHANDLE						KeyHandle,
+	IN		ACCESS_MASK					DesiredAccess,
+	IN		POBJECT_ATTRIBUTES			ObjectAttributes)
+
+KEX_SYSCALL(NtOpenKeyEx,						0x00B7, 0x00F2, 0x00, 0x10,
+	OUT		PHANDLE						KeyHandle,
+	IN		ACCESS_MASK					DesiredAccess,
+	IN		POBJECT_ATTRIBUTES			ObjectAttributes,
+	IN		ULONG						OpenOptions)
+
+KEX_SYSCALL(NtQueryObject,						0x00F8, 0x000D, 0x00, 0x14,
+	IN		HANDLE						ObjectHandle,
+	IN		OBJECT_INFORMATION_CLASS	ObjectInformationClass,
+	OUT		PVOID						ObjectInformation,
+	IN		ULONG						Length,
+	OUT		PULONG						ReturnLength OPTIONAL)
+
+KEX_SYSCALL(NtOpenFile,							0x00B3, 0x0030, 0x00, 0x18,
+	OUT		PHANDLE				FileHandle,
+	IN		ACCESS_MASK			DesiredAccess,
+	IN		POBJECT_ATTRIBUTES	ObjectAttributes,
+	OUT		PIO_STATUS_BLOCK	IoStatusBlock,
+	IN		ULONG				ShareAccess,
+	IN		ULONG				OpenOptions)
+
+KEX_SYSCALL(NtWriteFile,						0x018C, 0x0005, 0x1A, 0x24,
+	IN		HANDLE				FileHandle,
+	IN		HANDLE				Event OPTIONAL,
+	IN		PIO_APC_ROUTINE		ApcRoutine OPTIONAL,
+	IN		PVOID				ApcContext OPTIONAL,
+	OUT		PIO_STATUS_BLOCK	IoStatusBlock,
+	IN		PVOID				Buffer,
+	IN		ULONG				Length,
+	IN		PLARGE_INTEGER		ByteOffset OPTIONAL,
+	IN		PULONG				Key OPTIONAL)
+
+KEX_SYSCALL(NtRaiseHardError,					0x0110, 0x0130, 0x00, 0x18,
+	IN		NTSTATUS	ErrorStatus,
+	IN		ULONG		NumberOfParameters,
+	IN		ULONG		UnicodeStringParameterMask,
+	IN		PULONG_PTR	Parameters,
+	IN		ULONG		ValidResponseOptions,
+	OUT		PULONG		Response)
+
+KEX_SYSCALL(NtQueryInformationThread,			0x00EC, 0x0022, 0x00, 0x14,
+	IN		HANDLE				ThreadHandle,
+	IN		THREADINFOCLASS		ThreadInformationClass,
+	OUT		PVOID				ThreadInformation,
+	IN		ULONG				ThreadInformationLength,
+	OUT		PULONG				ReturnLength OPTIONAL)
+
+KEX_SYSCALL(NtSetInformationThread,				0x014F, 0x000A, 0x00, 0x10,
+	IN		HANDLE				ThreadHandle,
+	IN		THREADINFOCLASS		ThreadInformationClass,
+	IN		PVOID				ThreadInformation,
+	IN		ULONG				ThreadInformationLength)
+
+KEX_SYSCALL(NtFlushInstructionCache,			0x007D, 0x00C2, 0x00, 0x0C,
+	IN		HANDLE		ProcessHandle,
+	IN		PVOID		BaseAddress OPTIONAL,
+	IN		SIZE_T		Length)
\ No newline at end of file
@@ -0,0 +1,231 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     sysctab.c
+//
+// Abstract:
+//
+//     Service number tables for the unhooked system call stubs.
+//
+//     System call numbers change between builds of Windows, so instead of
+//     hard-coding them into the stubs, we read them out of the NTDLL stubs
+//     during process initialization. The values from syscalls.h (which are
+//     correct for Windows 7 SP1) are kept for any stub that we can't
+//     recognize, for example because it has already been hooked by someone
+//     else.
+//
+//     In a child process that KexDll propagates into, the NtOpenKey* hooks
+//     run before KexDll can initialize itself, so the parent process writes
+//     its own tables into the child (see propagte.c).
+//
+// Environment:
+//
+//     KexInitializeSyscallTable must be called before any other thread is
+//     created. After that, the tables are read-only.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "buildcfg.h"
+#include "kexdllp.h"
+
+//
+// Service numbers for a 64-bit kernel. These are used by the x64 stubs and
+// by the WOW64 path of the x86 stubs.
+//
+
+ULONG KexpSyscallNumbers64[KexSyscallMaximum] = {
+#define KEX_SYSCALL(Name, Number32, Number64, ...) Number64,
+#include "syscalls.h"
+#undef KEX_SYSCALL
+};
+
+#ifdef KEX_ARCH_X86
+//
+// Service numbers for a 32-bit kernel.
+//
+
+ULONG KexpSyscallNumbers32[KexSyscallMaximum] = {
+#define KEX_SYSCALL(Name, Number32, ...) Number32,
+#include "syscalls.h"
+#undef KEX_SYSCALL
+};
+
+//
+// Values that the WOW64 stubs pass to wow64cpu in ECX.
+//
+
+ULONG KexpSyscallWow64EcxValues[KexSyscallMaximum] = {
+#define KEX_SYSCALL(Name, Number32, Number64, Wow64EcxValue, ...) Wow64EcxValue,
+#include "syscalls.h"
+#undef KEX_SYSCALL
+};
+#endif
+
+CONST USHORT KexpSyscallParameterBytes[KexSyscallMaximum] = {
+#define KEX_SYSCALL(Name, Number32, Number64, Wow64EcxValue, ParameterBytes, ...) ParameterBytes,
+#include "syscalls.h"
+#undef KEX_SYSCALL
+};
+
+STATIC PCSTR KexpSyscallNames[KexSyscallMaximum] = {
+#define KEX_SYSCALL(Name, ...) #Name,
+#include "syscalls.h"
+#undef KEX_SYSCALL
+};
+
+//
+// Read the service number (and on WOW64, the ECX value) out of an NTDLL
+// system call stub. Returns FALSE if the stub does not look like one we
+// know about.
+//
+STATIC BOOLEAN KexpParseSyscallStub(
+	IN	PBYTE	Stub,
+	OUT	PULONG	SyscallNumber,
+	OUT	PULONG	EcxValue)
+{
+	*EcxValue = 0;
+
+#ifdef KEX_ARCH_X64
+	//
+	// mov r10, rcx
+	// mov eax, <syscallnumber>
+	//
+
+	if (Stub[0] == 0x4C && Stub[1] == 0x8B && Stub[2] == 0xD1 && Stub[3] == 0xB8) {
+		*SyscallNumber = *(PULONG) &Stub[4];
+		return TRUE;
+	}
+
+	return FALSE;
+#else
+	PBYTE Next;
+
+	//
+	// mov eax, <syscallnumber>
+	//
+
+	if (Stub[0] != 0xB8) {
+		return FALSE;
+	}
+
+	*SyscallNumber = *(PULONG) &Stub[1];
+	Next = &Stub[5];
+
+	if (KexRtlOperatingSystemBitness() == 32) {
+		//
+		// mov edx, 0x7ffe0300
+		//
+
+		return (Next[0] == 0xBA && *(PULONG) &Next[1] == 0x7FFE0300);
+	}
+
+	//
+	// xor ecx, ecx -or- mov ecx, <ecxvalue>
+	// lea edx, [esp+4]
+	// call fs:[0xC0]
+	//
+
+	if (Next[0] == 0x33 && Next[1] == 0xC9) {
+		Next += 2;
+	} else if (Next[0] == 0xB9) {
+		*EcxValue = *(PULONG) &Next[1];
+		Next += 5;
+	} else {
+		return FALSE;
+	}
+
+	return (Next[0] == 0x8D && Next[1] == 0x54 && Next[2] == 0x24 && Next[3] == 0x04 &&
+			Next[4] == 0x64 && Next[5] == 0xFF && Next[6] == 0x15 && *(PULONG) &Next[7] == 0xC0);
+#endif
+}
+
+//
+// Returns the service number table which applies to the native NTDLL,
+// i.e. the one which is used by the native-bitness KexDll.
+//
+PULONG KexpGetNativeSyscallNumbers(
+	VOID)
+{
+#ifdef KEX_ARCH_X86
+	if (KexRtlOperatingSystemBitness() == 32) {
+		return KexpSyscallNumbers32;
+	}
+#endif
+
+	return KexpSyscallNumbers64;
+}
+
+//
+// Fill in the service number tables from the NTDLL which is loaded into the
+// current process.
+//
+NTSTATUS KexInitializeSyscallTable(
+	VOID) PROTECTED_FUNCTION
+{
+	NTSTATUS Status;
+	UNICODE_STRING NtdllName;
+	PVOID NtdllBase;
+	PVOID Stubs[KexSyscallMaximum];
+	PULONG SyscallNumbers;
+	ULONG Index;
+	ULONG NumberOfUnknownStubs;
+
+	RtlInitConstantUnicodeString(&NtdllName, L"ntdll.dll");
+	Status = LdrGetDllHandleByName(&NtdllName, NULL, &NtdllBase);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	//
+	// Failure to find some of the procedures is not fatal, we just keep the
+	// default service numbers for them.
+	//
+
+	KexLdrMiniGetProcedureAddresses(
+		NtdllBase,
+		KexSyscallMaximum,
+		KexpSyscallNames,
+		Stubs);
+
+#ifdef KEX_ARCH_X86
+	if (KexRtlOperatingSystemBitness() == 32) {
+		SyscallNumbers = KexpSyscallNumbers32;
+	} else {
+		SyscallNumbers = KexpSyscallNumbers64;
+	}
+#else
+	SyscallNumbers = KexpSyscallNumbers64;
+#endif
+
+	NumberOfUnknownStubs = 0;
+
+	for (Index = 0; Index < KexSyscallMaximum; ++Index) {
+		ULONG SyscallNumber;
+		ULONG EcxValue;
+
+		if (Stubs[Index] && KexpParseSyscallStub((PBYTE) Stubs[Index], &SyscallNumber, &EcxValue)) {
+			SyscallNumbers[Index] = SyscallNumber;
+
+#ifdef KEX_ARCH_X86
+			if (SyscallNumbers == KexpSyscallNumbers64) {
+				KexpSyscallWow64EcxValues[Index] = EcxValue;
+			}
+#endif
+		} else {
+			KexLogDebugEvent(
+				L"Could not discover the service number of %hs. "
+				L"Using default value 0x%04lx.",
+				KexpSyscallNames[Index],
+				SyscallNumbers[Index]);
+
+			++NumberOfUnknownStubs;
+		}
+	}
+
+	if (NumberOfUnknownStubs == KexSyscallMaximum) {
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	return STATUS_SUCCESS;
+} PROTECTED_FUNCTION_END
\ No newline at end of file
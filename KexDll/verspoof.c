@@ -95,6 +95,7 @@ VOID KexApplyVersionSpoof(
 	ULONG MinorVersion;
 	USHORT BuildNumber;
 	USHORT CSDVersion;
+	KEX_HOOK_TRANSACTION HookTransaction;
 
 	if (KexData->IfeoParameters.WinVerSpoof == WinVerSpoofNone) {
 		KexLogDebugEvent(L"Not spoofing Windows version since it is not requested.");
@@ -162,7 +163,8 @@ VOID KexApplyVersionSpoof(
 	// replace it with a custom function.
 	//
 
-	KexHkInstallBasicHook(RtlGetNtVersionNumbers, KexpRtlGetNtVersionNumbersHook, NULL);
+	KexHkBeginTransaction(&HookTransaction);
+	KexHkAddBasicHookToTransaction(&HookTransaction, RtlGetNtVersionNumbers, KexpRtlGetNtVersionNumbersHook, NULL);
 
 	//
 	// Strong version spoofing is anything that involves runtime performance
@@ -218,7 +220,7 @@ VOID KexApplyVersionSpoof(
 			// The NtQuerySystemTime stub actually reads from SharedUserData,
 			// which is why we need to redirect it to the custom syscall stub.
 			//
-			KexHkInstallBasicHook(NtQuerySystemTime, KexNtQuerySystemTime, NULL);
+			KexHkAddBasicHookToTransaction(&HookTransaction, NtQuerySystemTime, KexNtQuerySystemTime, NULL);
 		} else {
 			KexLogWarningEvent(
 				L"Failed to make SharedUserData read-write.\r\n\r\n"
@@ -226,5 +228,6 @@ VOID KexApplyVersionSpoof(
 				KexRtlNtStatusToString(Status));
 		}
 	}
-	
+
+	KexHkCommitTransaction(&HookTransaction);
 } PROTECTED_FUNCTION_END_VOID
\ No newline at end of file
@@ -122,110 +122,93 @@ NTSTATUS VxlpBuildIndex(
 	return STATUS_SUCCESS;
 } PROTECTED_FUNCTION_END
 
-NTSTATUS VxlpFindOrCreateSourceComponentIndex(
-	IN	VXLHANDLE			LogHandle,
-	IN	PCWSTR				SourceComponent,
-	OUT	PUCHAR				SourceComponentIndex) PROTECTED_FUNCTION
+//
+// Find a string in one of the string tables of the log file header, or add
+// it to the first free entry if it is not there yet. The string does not
+// need to be null-terminated.
+//
+STATIC NTSTATUS VxlpFindOrCreateStringIndex(
+	IN	PWCHAR				Table,
+	IN	ULONG				NumberOfEntries,
+	IN	ULONG				EntryCch,
+	IN	PCUNICODE_STRING	String,
+	OUT	PUCHAR				StringIndex)
 {
 	ULONG Index;
+	ULONG StringCch;
+	PWCHAR Entry;
 
-	ASSERT (LogHandle != NULL);
-	ASSERT (SourceComponent != NULL);
-	ASSERT (SourceComponentIndex != NULL);
-	ASSERT (wcslen(SourceComponent) < ARRAYSIZE(LogHandle->Header->SourceComponents[0]));
+	StringCch = KexRtlUnicodeStringCch(String);
 
-	for (Index = 0; Index < ARRAYSIZE(LogHandle->Header->SourceComponents); ++Index) {
-		if (StringEqual(LogHandle->Header->SourceComponents[Index], SourceComponent)) {
-			*SourceComponentIndex = Index;
-			return STATUS_SUCCESS;
-		} else if (LogHandle->Header->SourceComponents[Index][0] == '\0') {
-			HRESULT Result;
+	if (StringCch >= EntryCch) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
 
-			Result = StringCchCopy(
-				LogHandle->Header->SourceComponents[Index],
-				ARRAYSIZE(LogHandle->Header->SourceComponents[Index]),
-				SourceComponent);
+	for (Index = 0; Index < NumberOfEntries; ++Index) {
+		Entry = Table + (Index * EntryCch);
 
-			if (FAILED(Result)) {
-				return STATUS_BUFFER_TOO_SMALL;
-			}
+		if (Entry[0] == '\0') {
+			RtlCopyMemory(Entry, String->Buffer, String->Length);
+			Entry[StringCch] = '\0';
 
-			*SourceComponentIndex = Index;
+			*StringIndex = Index;
+			return STATUS_SUCCESS;
+		} else if (Entry[StringCch] == '\0' && RtlEqualMemory(Entry, String->Buffer, String->Length)) {
+			*StringIndex = Index;
 			return STATUS_SUCCESS;
 		}
 	}
 
 	return STATUS_TOO_MANY_INDICES;
+}
+
+NTSTATUS VxlpFindOrCreateSourceComponentIndex(
+	IN	VXLHANDLE			LogHandle,
+	IN	PCUNICODE_STRING	SourceComponent,
+	OUT	PUCHAR				SourceComponentIndex) PROTECTED_FUNCTION
+{
+	ASSERT (LogHandle != NULL);
+	ASSERT (SourceComponent != NULL);
+	ASSERT (SourceComponentIndex != NULL);
+
+	return VxlpFindOrCreateStringIndex(
+		LogHandle->Header->SourceComponents[0],
+		ARRAYSIZE(LogHandle->Header->SourceComponents),
+		ARRAYSIZE(LogHandle->Header->SourceComponents[0]),
+		SourceComponent,
+		SourceComponentIndex);
 } PROTECTED_FUNCTION_END
 
 NTSTATUS VxlpFindOrCreateSourceFileIndex(
 	IN	VXLHANDLE			LogHandle,
-	IN	PCWSTR				SourceFile,
+	IN	PCUNICODE_STRING	SourceFile,
 	OUT	PUCHAR				SourceFileIndex) PROTECTED_FUNCTION
 {
-	ULONG Index;
-
 	ASSERT (LogHandle != NULL);
 	ASSERT (SourceFile != NULL);
 	ASSERT (SourceFileIndex != NULL);
-	ASSERT (wcslen(SourceFile) < ARRAYSIZE(LogHandle->Header->SourceFiles[0]));
-
-	for (Index = 0; Index < ARRAYSIZE(LogHandle->Header->SourceFiles); ++Index) {
-		if (StringEqual(LogHandle->Header->SourceFiles[Index], SourceFile)) {
-			*SourceFileIndex = Index;
-			return STATUS_SUCCESS;
-		} else if (LogHandle->Header->SourceFiles[Index][0] == '\0') {
-			HRESULT Result;
 
-			Result = StringCchCopy(
-				LogHandle->Header->SourceFiles[Index],
-				ARRAYSIZE(LogHandle->Header->SourceFiles[Index]),
-				SourceFile);
-
-			if (FAILED(Result)) {
-				return STATUS_BUFFER_TOO_SMALL;
-			}
-
-			*SourceFileIndex = Index;
-			return STATUS_SUCCESS;
-		}
-	}
-
-	return STATUS_TOO_MANY_INDICES;
+	return VxlpFindOrCreateStringIndex(
+		LogHandle->Header->SourceFiles[0],
+		ARRAYSIZE(LogHandle->Header->SourceFiles),
+		ARRAYSIZE(LogHandle->Header->SourceFiles[0]),
+		SourceFile,
+		SourceFileIndex);
 } PROTECTED_FUNCTION_END
 
 NTSTATUS VxlpFindOrCreateSourceFunctionIndex(
 	IN	VXLHANDLE			LogHandle,
-	IN	PCWSTR				SourceFunction,
+	IN	PCUNICODE_STRING	SourceFunction,
 	OUT	PUCHAR				SourceFunctionIndex) PROTECTED_FUNCTION
 {
-	ULONG Index;
-
 	ASSERT (LogHandle != NULL);
 	ASSERT (SourceFunction != NULL);
 	ASSERT (SourceFunctionIndex != NULL);
-	ASSERT (wcslen(SourceFunction) < ARRAYSIZE(LogHandle->Header->SourceFunctions[0]));
-
-	for (Index = 0; Index < ARRAYSIZE(LogHandle->Header->SourceFunctions); ++Index) {
-		if (StringEqual(LogHandle->Header->SourceFunctions[Index], SourceFunction)) {
-			*SourceFunctionIndex = Index;
-			return STATUS_SUCCESS;
-		} else if (LogHandle->Header->SourceFunctions[Index][0] == '\0') {
-			HRESULT Result;
-
-			Result = StringCchCopy(
-				LogHandle->Header->SourceFunctions[Index],
-				ARRAYSIZE(LogHandle->Header->SourceFunctions[Index]),
-				SourceFunction);
-
-			if (FAILED(Result)) {
-				return STATUS_BUFFER_TOO_SMALL;
-			}
 
-			*SourceFunctionIndex = Index;
-			return STATUS_SUCCESS;
-		}
-	}
-
-	return STATUS_TOO_MANY_INDICES;
+	return VxlpFindOrCreateStringIndex(
+		LogHandle->Header->SourceFunctions[0],
+		ARRAYSIZE(LogHandle->Header->SourceFunctions),
+		ARRAYSIZE(LogHandle->Header->SourceFunctions[0]),
+		SourceFunction,
+		SourceFunctionIndex);
 } PROTECTED_FUNCTION_END
\ No newline at end of file
@@ -4,6 +4,91 @@
 #pragma warning(disable:4244)	// conversion from ULONG to USHORT
 #pragma warning(disable:4018)	// signed/unsigned mismatch
 
+//
+// Fill out the rest of a log file entry and append it to the log file. The
+// caller fills out the text, TextHeaderCch, TextCch, SourceLine, Time,
+// ProcessId and ThreadId members.
+//
+STATIC NTSTATUS VxlpWriteLogFileEntry(
+	IN		VXLHANDLE			LogHandle,
+	IN		PCUNICODE_STRING	SourceComponent,
+	IN		PCUNICODE_STRING	SourceFile,
+	IN		PCUNICODE_STRING	SourceFunction,
+	IN		VXLSEVERITY			Severity,
+	IN OUT	PVXLLOGFILEENTRY	FileEntry,
+	IN		ULONG				FileEntryCb)
+{
+	NTSTATUS Status;
+	IO_STATUS_BLOCK IoStatusBlock;
+	LONGLONG EndOfFileOffset;
+
+	FileEntry->Severity = Severity;
+
+	RtlAcquireSRWLockExclusive(&LogHandle->Lock);
+
+	try {
+		//
+		// fill out source component, file, and function indices
+		//
+
+		Status = VxlpFindOrCreateSourceComponentIndex(
+			LogHandle,
+			SourceComponent,
+			&FileEntry->SourceComponentIndex);
+
+		if (!NT_SUCCESS(Status)) {
+			leave;
+		}
+
+		Status = VxlpFindOrCreateSourceFileIndex(
+			LogHandle,
+			SourceFile,
+			&FileEntry->SourceFileIndex);
+
+		if (!NT_SUCCESS(Status)) {
+			leave;
+		}
+
+		Status = VxlpFindOrCreateSourceFunctionIndex(
+			LogHandle,
+			SourceFunction,
+			&FileEntry->SourceFunctionIndex);
+
+		if (!NT_SUCCESS(Status)) {
+			leave;
+		}
+
+		//
+		// update severity count
+		//
+
+		++LogHandle->Header->EventSeverityTypeCount[Severity];
+
+		//
+		// write the actual log entry to the file
+		//
+
+		// Passing -1 causes the write to occur at the end of the file.
+		EndOfFileOffset = -1;
+
+		Status = NtWriteFile(
+			LogHandle->FileHandle,
+			NULL,
+			NULL,
+			NULL,
+			&IoStatusBlock,
+			FileEntry,
+			FileEntryCb,
+			&EndOfFileOffset,
+			NULL);
+	} except (EXCEPTION_EXECUTE_HANDLER) {
+		Status = GetExceptionCode();
+	}
+
+	RtlReleaseSRWLockExclusive(&LogHandle->Lock);
+	return Status;
+}
+
 NTSTATUS CDECL VxlWriteLogEx(
 	IN		VXLHANDLE		LogHandle,
 	IN		PCWSTR			SourceComponent OPTIONAL,
@@ -19,8 +104,9 @@ NTSTATUS CDECL VxlWriteLogEx(
 	PVXLLOGFILEENTRY FileEntry;
 	ULONG FileEntryCb;
 	PTEB Teb;
-	IO_STATUS_BLOCK IoStatusBlock;
-	LONGLONG EndOfFileOffset;
+	UNICODE_STRING SourceComponentString;
+	UNICODE_STRING SourceFileString;
+	UNICODE_STRING SourceFunctionString;
 
 	//
 	// param validation
@@ -149,7 +235,6 @@ NTSTATUS CDECL VxlWriteLogEx(
 		KexNtQuerySystemTime((PLONGLONG) &FileEntry->Time64);
 		FileEntry->ProcessId = (ULONG) Teb->ClientId.UniqueProcess;
 		FileEntry->ThreadId = (ULONG) Teb->ClientId.UniqueThread;
-		FileEntry->Severity = Severity;
 		FileEntry->SourceLine = SourceLine;
 
 		Status = STATUS_SUCCESS;
@@ -163,67 +248,138 @@ NTSTATUS CDECL VxlWriteLogEx(
 		return Status;
 	}
 
-	RtlAcquireSRWLockExclusive(&LogHandle->Lock);
+	RtlInitUnicodeString(&SourceComponentString, SourceComponent);
+	RtlInitUnicodeString(&SourceFileString, SourceFile);
+	RtlInitUnicodeString(&SourceFunctionString, SourceFunction);
+
+	return VxlpWriteLogFileEntry(
+		LogHandle,
+		&SourceComponentString,
+		&SourceFileString,
+		&SourceFunctionString,
+		Severity,
+		FileEntry,
+		FileEntryCb);
+} PROTECTED_FUNCTION_END
+
+//
+// Write a log entry whose text has already been formatted. None of the
+// strings need to be null-terminated, and they are not interpreted in any
+// way - in particular, Text is not a format string. This is meant for
+// writing log events which were received from another process.
+//
+// As with VxlWriteLogEx, a double newline (\r\n\r\n) in Text separates the
+// header of the log entry from the rest of its text.
+//
+// If Time is not specified, the current time is used. If ProcessId or
+// ThreadId are zero, the ID of the calling process or thread is used.
+//
+KEXAPI NTSTATUS NTAPI VxlWriteLogPreformatted(
+	IN		VXLHANDLE			LogHandle,
+	IN		PCUNICODE_STRING	SourceComponent,
+	IN		PCUNICODE_STRING	SourceFile,
+	IN		ULONG				SourceLine,
+	IN		PCUNICODE_STRING	SourceFunction,
+	IN		VXLSEVERITY			Severity,
+	IN		PCUNICODE_STRING	Text,
+	IN		PLONGLONG			Time OPTIONAL,
+	IN		ULONG				ProcessId OPTIONAL,
+	IN		ULONG				ThreadId OPTIONAL) PROTECTED_FUNCTION
+{
+	PVXLLOGFILEENTRY FileEntry;
+	ULONG FileEntryCb;
+	ULONG TextCch;
+	ULONG TextHeaderCch;
+	ULONG Index;
 
-	try {
-		//
-		// fill out source component, file, and function indices
-		//
+	if (!LogHandle || !SourceComponent || !SourceFile || !SourceFunction || !Text) {
+		return STATUS_INVALID_PARAMETER;
+	}
 
-		Status = VxlpFindOrCreateSourceComponentIndex(
-			LogHandle,
-			SourceComponent,
-			&FileEntry->SourceComponentIndex);
+	if (Severity < 0 || Severity >= LogSeverityMaximumValue) {
+		return STATUS_INVALID_PARAMETER;
+	}
 
-		if (!NT_SUCCESS(Status)) {
-			leave;
-		}
+	TextCch = KexRtlUnicodeStringCch(Text);
 
-		Status = VxlpFindOrCreateSourceFileIndex(
-			LogHandle,
-			SourceFile,
-			&FileEntry->SourceFileIndex);
+	//
+	// Find the first double newline which is not at the end of the text.
+	//
 
-		if (!NT_SUCCESS(Status)) {
-			leave;
-		}
+	TextHeaderCch = TextCch;
 
-		Status = VxlpFindOrCreateSourceFunctionIndex(
-			LogHandle,
-			SourceFunction,
-			&FileEntry->SourceFunctionIndex);
+	for (Index = 0; Index + 4 < TextCch; ++Index) {
+		if (Text->Buffer[Index] == '\r' && Text->Buffer[Index + 1] == '\n' &&
+			Text->Buffer[Index + 2] == '\r' && Text->Buffer[Index + 3] == '\n') {
 
-		if (!NT_SUCCESS(Status)) {
-			leave;
+			TextHeaderCch = Index;
+			break;
 		}
+	}
 
-		//
-		// update severity count
-		//
+	//
+	// Both parts of the text are stored with a null terminator. The double
+	// newline itself is not stored.
+	//
 
-		++LogHandle->Header->EventSeverityTypeCount[Severity];
+	if (TextHeaderCch == TextCch) {
+		FileEntryCb = sizeof(VXLLOGFILEENTRY) + (TextCch + 1) * sizeof(WCHAR);
+	} else {
+		FileEntryCb = sizeof(VXLLOGFILEENTRY) + (TextCch - 4 + 2) * sizeof(WCHAR);
+	}
 
-		//
-		// write the actual log entry to the file
-		//
+	if (FileEntryCb > 0xFFFF) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
 
-		// Passing -1 causes the write to occur at the end of the file.
-		EndOfFileOffset = -1;
+	// See the comment in VxlWriteLogEx about avoiding heap allocations.
+	FileEntry = (PVXLLOGFILEENTRY) StackAlloc(BYTE, FileEntryCb);
+	RtlZeroMemory(FileEntry, sizeof(VXLLOGFILEENTRY));
 
-		Status = NtWriteFile(
-			LogHandle->FileHandle,
-			NULL,
-			NULL,
-			NULL,
-			&IoStatusBlock,
-			FileEntry,
-			FileEntryCb,
-			&EndOfFileOffset,
-			NULL);
-	} except (EXCEPTION_EXECUTE_HANDLER) {
-		Status = GetExceptionCode();
+	RtlCopyMemory(FileEntry->Text, Text->Buffer, TextHeaderCch * sizeof(WCHAR));
+	FileEntry->Text[TextHeaderCch] = '\0';
+	FileEntry->TextHeaderCch = (USHORT) (TextHeaderCch + 1);
+	FileEntry->TextCch = 0;
+
+	if (TextHeaderCch != TextCch) {
+		RtlCopyMemory(
+			&FileEntry->Text[TextHeaderCch + 1],
+			&Text->Buffer[TextHeaderCch + 4],
+			(TextCch - TextHeaderCch - 4) * sizeof(WCHAR));
+
+		FileEntry->TextCch = (USHORT) (TextCch - TextHeaderCch - 4 + 1);
+		FileEntry->Text[FileEntry->TextHeaderCch + FileEntry->TextCch - 1] = '\0';
 	}
 
-	RtlReleaseSRWLockExclusive(&LogHandle->Lock);
-	return Status;
+	FileEntry->SourceLine = SourceLine;
+
+	if (Time) {
+		FileEntry->Time64 = *Time;
+	} else {
+		KexNtQuerySystemTime((PLONGLONG) &FileEntry->Time64);
+	}
+
+	if (!ProcessId) {
+		ProcessId = HandleToUlong(NtCurrentTeb()->ClientId.UniqueProcess);
+	}
+
+	if (!ThreadId) {
+		ThreadId = HandleToUlong(NtCurrentTeb()->ClientId.UniqueThread);
+	}
+
+	FileEntry->ProcessId = ProcessId;
+	FileEntry->ThreadId = ThreadId;
+
+	if (KexIsDebugBuild) {
+		DbgPrint("VXL (%wZ): %wZ\r\n", SourceComponent, Text);
+	}
+
+	return VxlpWriteLogFileEntry(
+		LogHandle,
+		SourceComponent,
+		SourceFile,
+		SourceFunction,
+		Severity,
+		FileEntry,
+		FileEntryCb);
 } PROTECTED_FUNCTION_END
\ No newline at end of file
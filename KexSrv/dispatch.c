@@ -19,186 +19,297 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include "buildcfg.h"
-#include <KexComm.h>
 #include "kexsrvp.h"
 
-NTSTATUS KexSrvDispatchMessage(
-	IN OUT	PKEXSRV_PER_CLIENT_INFO	ClientInfo)
+STATIC NTSTATUS DispatchProcessStart(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process,
+	IN	PKEX_IPC_MESSAGE				Message)
 {
-	PKEX_IPC_MESSAGE Message;
-
-	ASSERT (ClientInfo != NULL);
-
-	Message = &ClientInfo->Message;
-
-#ifdef _DEBUG
-	KexSrvDumpMessageToLog(ClientInfo);
-#endif
-
-	if (Message->MessageId == KexIpcKexProcessStart) {
-		PKEX_IPC_MESSAGE_DATA_PROCESS_STARTED ProcessStartedInfo;
-		PNZWCH ApplicationName;
-
-		//
-		// Can't send this message twice - if we have already stored a
-		// client name, something is wrong.
-		//
-		if (ClientInfo->ApplicationName[0] != '\0' || ClientInfo->LogHandle != NULL) {
-			KexSrvGlobalLog(
-				LogSeverityWarning,
-				L"Client (PID %lu) has sent a duplicate KexIpcKexProcessStart message",
-				ClientInfo->ProcessId);
-			return STATUS_ACCESS_DENIED;
-		}
+	NTSTATUS Status;
+	PKEX_IPC_MESSAGE_DATA_PROCESS_STARTED ProcessStartedInfo;
+
+	ProcessStartedInfo = &Message->ProcessStartedInformation;
+
+	//
+	// Can't send this message twice - if we have already opened a log
+	// file for this client, something is wrong.
+	//
+
+	if (Process->LogHandle != NULL || Process->JournalStreamId != 0) {
+		KexLogWarningEvent(
+			L"Client (PID %lu) has sent a duplicate KexIpcKexProcessStart message",
+			Process->ProcessId);
+		return STATUS_ACCESS_DENIED;
+	}
+
+	StringCchCopyN(
+		Process->ApplicationName,
+		ARRAYSIZE(Process->ApplicationName),
+		(PCNZWCH) Message->AuxiliaryDataBlock,
+		ProcessStartedInfo->ApplicationNameLength);
+
+	Status = OpenClientLogFile(Process);
+	if (!NT_SUCCESS(Status)) {
+		KexLogErrorEvent(
+			L"Failed to open the log file for client %s (PID %lu)\r\n\r\n"
+			L"NTSTATUS error code: %s",
+			Process->ApplicationName,
+			Process->ProcessId,
+			KexRtlNtStatusToString(Status));
+		return Status;
+	}
+
+	//
+	// If the client has set up a log ring, start listening to it. Failure
+	// is not fatal - the client only writes into the ring once we have
+	// marked it as attached, and keeps using the pipe until then.
+	//
 
-		ProcessStartedInfo = &Message->ProcessStartedInformation;
-
-		//
-		// Store the client-provided client name into the client info structure.
-		//
-		ApplicationName = (PNZWCH) Message->AuxiliaryDataBlock;
-		
-		StringCchCopyN(
-			ClientInfo->ApplicationName,
-			ARRAYSIZE(ClientInfo->ApplicationName),
-			ApplicationName,
-			ProcessStartedInfo->ApplicationNameLength);
-
-		//
-		// Open the log file and place the handle in the ClientInfo structure.
-		//		
-		ClientInfo->LogHandle = KexSrvOpenLogFile(
-			ClientInfo->ApplicationName,
-			ARRAYSIZE(ClientInfo->LogFilePath),
-			ClientInfo->LogFilePath);
-
-	} else if (Message->MessageId == KexIpcHardError) {
-		ULONG StringParameter1Length;
-		ULONG StringParameter2Length;
-		PWSTR StringParameter1;
-		PWSTR StringParameter2;
-
-		// Include space for null terminators
-		StringParameter1Length = Message->HardErrorInformation.StringParameter1Length + 1;
-		StringParameter2Length = Message->HardErrorInformation.StringParameter2Length + 1;
-
-		if (StringParameter1Length > 1) {
-			StringParameter1 = StackAlloc(WCHAR, StringParameter1Length);
-
-			StringCchCopyN(
-				StringParameter1,
-				StringParameter1Length,
-				(PCWSTR) &Message->AuxiliaryDataBlock[0],
-				StringParameter1Length - 1);
-		} else {
-			StringParameter1 = L"";
+	if (ProcessStartedInfo->LogRingSectionHandle != 0 &&
+		ProcessStartedInfo->LogRingDoorbellEventHandle != 0) {
+
+		Status = AttachLogRing(
+			Process,
+			ProcessStartedInfo->LogRingSectionHandle,
+			ProcessStartedInfo->LogRingDoorbellEventHandle);
+
+		if (!NT_SUCCESS(Status)) {
+			KexLogWarningEvent(
+				L"Failed to attach to the log ring of client %s (PID %lu)\r\n\r\n"
+				L"NTSTATUS error code: %s",
+				Process->ApplicationName,
+				Process->ProcessId,
+				KexRtlNtStatusToString(Status));
 		}
+	}
+
+	KexLogInformationEvent(
+		L"Client (PID %lu) identified itself as %s",
+		Process->ProcessId,
+		Process->ApplicationName);
+
+	return STATUS_SUCCESS;
+}
+
+STATIC NTSTATUS DispatchHardError(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process,
+	IN	PKEX_IPC_MESSAGE				Message)
+{
+	PKEX_IPC_MESSAGE_DATA_HARD_ERROR HardErrorInfo;
+	PCNZWCH StringParameter1;
+	PCNZWCH StringParameter2;
+
+	HardErrorInfo = &Message->HardErrorInformation;
+
+	StringParameter1 = (PCNZWCH) Message->AuxiliaryDataBlock;
+	StringParameter2 = StringParameter1 + HardErrorInfo->StringParameter1Length;
+
+	KexLogErrorEvent(
+		L"Client %s (PID %lu) has encountered a hard error.\r\n\r\n"
+		L"NTSTATUS: 0x%08lx\r\n"
+		L"UlongParameter: 0x%08lx\r\n"
+		L"StringParameter1: %.*s\r\n"
+		L"StringParameter2: %.*s",
+		Process->ApplicationName,
+		Process->ProcessId,
+		HardErrorInfo->Status,
+		HardErrorInfo->UlongParameter,
+		HardErrorInfo->StringParameter1Length,
+		StringParameter1,
+		HardErrorInfo->StringParameter2Length,
+		StringParameter2);
+
+	return STATUS_SUCCESS;
+}
+
+//
+// Write a log event sent by a client into the client's log file. This is
+// called both for KexIpcLogEvent messages that arrive through the pipe and
+// for the contents of the client's log ring.
+//
+// The caller must pass a copy of the log event information which the
+// client cannot modify anymore. The auxiliary data, on the other hand, may
+// still be in memory that is shared with the client.
+//
+NTSTATUS DispatchLogEvent(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA		Process,
+	IN	PCKEX_IPC_MESSAGE_DATA_LOG_EVENT	LogEventInfo,
+	IN	PCNZWCH								AuxiliaryData,
+	IN	USHORT								AuxiliaryDataBlockSize)
+{
+	NTSTATUS Status;
+	UNICODE_STRING SourceComponent;
+	UNICODE_STRING SourceFile;
+	UNICODE_STRING SourceFunction;
+	UNICODE_STRING Text;
+
+	ASSERT (Process != NULL);
+	ASSERT (LogEventInfo != NULL);
+	ASSERT (AuxiliaryData != NULL);
+
+	if (Process->LogHandle == NULL && Process->JournalStreamId == 0) {
+		KexLogWarningEvent(
+			L"Client (PID %lu) has sent a log event before KexIpcKexProcessStart",
+			Process->ProcessId);
+		return STATUS_ACCESS_DENIED;
+	}
+
+	if ((ULONG) (LogEventInfo->SourceComponentLength + LogEventInfo->SourceFileLength +
+				 LogEventInfo->SourceFunctionLength + LogEventInfo->TextLength) * sizeof(WCHAR) >
+		AuxiliaryDataBlockSize) {
+
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (LogEventInfo->Severity >= LogSeverityMaximumValue) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	//
+	// In journal mode, the log event is copied into the journal buffer and
+	// written out later by the journal writer thread.
+	//
+
+	if (Process->JournalStreamId != 0) {
+		AppendJournalLogEvent(Process, LogEventInfo, AuxiliaryData);
+		return STATUS_SUCCESS;
+	}
+
+	//
+	// The strings are written into the log file straight out of the receive
+	// buffer (or the log ring). They don't need to be null-terminated.
+	//
+
+	SourceComponent.Buffer = (PWCHAR) AuxiliaryData;
+	SourceComponent.Length = LogEventInfo->SourceComponentLength * sizeof(WCHAR);
+	SourceComponent.MaximumLength = SourceComponent.Length;
+
+	SourceFile.Buffer = SourceComponent.Buffer + LogEventInfo->SourceComponentLength;
+	SourceFile.Length = LogEventInfo->SourceFileLength * sizeof(WCHAR);
+	SourceFile.MaximumLength = SourceFile.Length;
+
+	SourceFunction.Buffer = SourceFile.Buffer + LogEventInfo->SourceFileLength;
+	SourceFunction.Length = LogEventInfo->SourceFunctionLength * sizeof(WCHAR);
+	SourceFunction.MaximumLength = SourceFunction.Length;
+
+	Text.Buffer = SourceFunction.Buffer + LogEventInfo->SourceFunctionLength;
+	Text.Length = LogEventInfo->TextLength * sizeof(WCHAR);
+	Text.MaximumLength = Text.Length;
+
+	Status = VxlWriteLogPreformatted(
+		Process->LogHandle,
+		&SourceComponent,
+		&SourceFile,
+		LogEventInfo->SourceLine,
+		&SourceFunction,
+		(VXLSEVERITY) LogEventInfo->Severity,
+		&Text,
+		NULL,
+		Process->ProcessId,
+		0);
+
+	if (!NT_SUCCESS(Status)) {
+		KexLogErrorEvent(
+			L"Failed to process a log event request from client (PID %lu)\r\n\r\n"
+			L"NTSTATUS error code: %s",
+			Process->ProcessId,
+			KexRtlNtStatusToString(Status));
+	}
+
+	// A log event that we failed to write is not the client's fault.
+	return STATUS_SUCCESS;
+}
+
+//
+// Unpack a KexIpcLogEventBatch message and write each log event it contains
+// into the client's log file. Each entry is checked just before it is
+// written, so if the batch turns out to be malformed, the events in front
+// of the bad entry have already been written.
+//
+STATIC NTSTATUS DispatchLogEventBatch(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process,
+	IN	PKEX_IPC_MESSAGE				Message)
+{
+	NTSTATUS Status;
+	ULONG Index;
+	ULONG Offset;
+	PCKEX_IPC_LOG_EVENT_BATCH_ENTRY Entry;
+	USHORT EntryDataCb;
 
-		if (StringParameter2Length > 1) {
-			StringParameter2 = StackAlloc(WCHAR, StringParameter2Length);
+	Offset = 0;
 
-			StringCchCopyN(
-				StringParameter2,
-				StringParameter2Length,
-				&((PCWSTR) (Message->AuxiliaryDataBlock))[StringParameter1Length - 1],
-				StringParameter2Length - 1);
-		} else {
-			StringParameter2 = L"";
+	for (Index = 0; Index < Message->LogEventBatchInformation.NumberOfEvents; ++Index) {
+		Status = GetLogEventBatchEntry(Message, &Offset, &Entry, &EntryDataCb);
+
+		if (!NT_SUCCESS(Status)) {
+			KexLogWarningEvent(
+				L"Client (PID %lu) has sent an invalid message\r\n\r\n"
+				L"Message ID: %d, entry %lu",
+				Process->ProcessId,
+				Message->MessageId,
+				Index);
+
+			return Status;
 		}
 
-		//
-		// Display the custom Hard Error task dialog.
-		// KexSrvpHardErrorDialog will perform all user input processing.
-		//
-
-		KexSrvpHardError(
-			ClientInfo,
-			Message->HardErrorInformation.Status,
-			Message->HardErrorInformation.UlongParameter,
-			StringParameter1,
-			StringParameter2);
-
-	} else if (Message->MessageId == KexIpcLogEvent) {
-		PKEX_IPC_MESSAGE_DATA_LOG_EVENT LogEventInfo;
-		PNZWCH SourceComponent;
-		PNZWCH SourceFile;
-		PNZWCH SourceFunction;
-		PNZWCH Text;
-		PWSTR SourceComponentZ;
-		PWSTR SourceFileZ;
-		PWSTR SourceFunctionZ;
-		VXLSTATUS Status;
-
-		ASSERT (ClientInfo->LogHandle != NULL);
-
-		LogEventInfo = &Message->LogEventInformation;
-		SourceComponent = (PNZWCH) Message->AuxiliaryDataBlock;
-		SourceFile = SourceComponent + LogEventInfo->SourceComponentLength;
-		SourceFunction = SourceFile + LogEventInfo->SourceFileLength;
-		Text = SourceFunction + LogEventInfo->SourceFunctionLength;
-
-		//
-		// allocate memory for null-terminated versions of source parameters.
-		// We don't need this for the log text itself because we can use the
-		// printf specifier %.*s to limit the length.
-		//
-		SourceComponentZ = StackAlloc(WCHAR, LogEventInfo->SourceComponentLength + 1);
-		SourceFileZ = StackAlloc(WCHAR, LogEventInfo->SourceFileLength + 1);
-		SourceFunctionZ = StackAlloc(WCHAR, LogEventInfo->SourceFunctionLength + 1);
-
-		StringCchCopyN(
-			SourceComponentZ,
-			LogEventInfo->SourceComponentLength + 1,
-			SourceComponent,
-			LogEventInfo->SourceComponentLength);
-
-		StringCchCopyN(
-			SourceFileZ,
-			LogEventInfo->SourceFileLength + 1,
-			SourceFile,
-			LogEventInfo->SourceFileLength);
-
-		StringCchCopyN(
-			SourceFunctionZ,
-			LogEventInfo->SourceFunctionLength + 1,
-			SourceFunction,
-			LogEventInfo->SourceFunctionLength);
-
-		ASSERT (wcslen(SourceComponentZ) == LogEventInfo->SourceComponentLength);
-		ASSERT (wcslen(SourceFileZ) == LogEventInfo->SourceFileLength);
-		ASSERT (wcslen(SourceFunctionZ) == LogEventInfo->SourceFunctionLength);
-
-		Status = VxlLogEx(
-			ClientInfo->LogHandle,
-			SourceComponentZ,
-			SourceFileZ,
-			LogEventInfo->SourceLine,
-			SourceFunctionZ,
-			(VXLSEVERITY) LogEventInfo->Severity,
-			L"%.*s",
-			LogEventInfo->TextLength,
-			Text);
-
-		ASSERT (VXL_SUCCEEDED(Status));
-		if (VXL_FAILED(Status)) {
-			KexSrvGlobalLog(
-				LogSeverityError,
-				L"Failed to process a log event request from client (PID %lu)\r\n\r\n"
-				L"VXLSTATUS error code: %d (%s)",
-				ClientInfo->ProcessId,
-				Status,
-				VxlErrorLookup(Status));
+		Status = DispatchLogEvent(
+			Process,
+			&Entry->LogEventInformation,
+			Entry->Data,
+			EntryDataCb);
+
+		if (!NT_SUCCESS(Status)) {
+			return Status;
 		}
-	} else {
-		KexSrvGlobalLog(
-			LogSeverityWarning,
-			L"Client (PID %lu) has sent a message with an invalid message ID\r\n\r\n"
+	}
+
+	return STATUS_SUCCESS;
+}
+
+//
+// Handle a message that has arrived through the pipe. The size of the
+// message has already been checked by the caller, and the rest of the
+// message is checked by ValidateMessage before it is dispatched.
+//
+// If this function returns a failure code, the client is disconnected.
+//
+NTSTATUS DispatchMessage(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process,
+	IN	PKEX_IPC_MESSAGE				Message)
+{
+	NTSTATUS Status;
+
+	ASSERT (Process != NULL);
+	ASSERT (Message != NULL);
+
+	Status = ValidateMessage(Message);
+
+	if (!NT_SUCCESS(Status)) {
+		KexLogWarningEvent(
+			L"Client (PID %lu) has sent an invalid message\r\n\r\n"
 			L"Message ID: %d",
-			ClientInfo->ProcessId,
-			ClientInfo->Message.MessageId);
+			Process->ProcessId,
+			Message->MessageId);
 
-		return STATUS_INVALID_PARAMETER;
+		return Status;
 	}
 
-	return STATUS_SUCCESS;
+	switch (Message->MessageId) {
+	case KexIpcKexProcessStart:
+		return DispatchProcessStart(Process, Message);
+	case KexIpcHardError:
+		return DispatchHardError(Process, Message);
+	case KexIpcLogEvent:
+		return DispatchLogEvent(
+			Process,
+			&Message->LogEventInformation,
+			(PCNZWCH) Message->AuxiliaryDataBlock,
+			Message->AuxiliaryDataBlockSize);
+	case KexIpcLogEventBatch:
+		return DispatchLogEventBatch(Process, Message);
+	default:
+		// ValidateMessage has already rejected unknown message IDs.
+		NOT_REACHED;
+		return STATUS_INVALID_PARAMETER;
+	}
 }
\ No newline at end of file
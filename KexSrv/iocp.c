@@ -0,0 +1,383 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     iocp.c
+//
+// Abstract:
+//
+//     Contains the server's I/O completion port and the worker threads which
+//     process completed reads on the server named pipe.
+//
+//     Each connected client has exactly one outstanding read at any time. The
+//     next read is only issued once the previous message has been completely
+//     processed, so messages from a single client are always handled in the
+//     order in which they were sent, even though any worker thread may pick
+//     up the completion for any client.
+//
+//     Worker threads never modify the process/thread table. When a client
+//     disconnects, the worker pushes its per-process data onto an interlocked
+//     list and wakes up the main thread, which owns the table and performs
+//     the actual removal.
+//
+//     The completion port also carries requests to drain a client's log ring
+//     (see logring.c). These are told apart from completed reads by their
+//     APC context, which points to the LogRing member instead of to the
+//     per-process data itself.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "buildcfg.h"
+#include "kexsrvp.h"
+
+HANDLE CompletionPortHandle = NULL;
+HANDLE DisconnectEventHandle = NULL;
+SLIST_HEADER DisconnectedProcessList;
+
+//
+// Give a disconnected client back to the main thread. The main thread is
+// only woken up when the list goes from empty to non-empty, since it always
+// takes the entire list at once.
+//
+STATIC VOID HandOffDisconnectedProcess(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process)
+{
+	PSLIST_ENTRY PreviousListHead;
+
+	ASSERT (Process != NULL);
+
+	PreviousListHead = RtlInterlockedPushEntrySList(
+		&DisconnectedProcessList,
+		&Process->DisconnectListEntry);
+
+	if (PreviousListHead == NULL) {
+		NtSetEvent(DisconnectEventHandle, NULL);
+	}
+}
+
+//
+// Called when no further reads will be issued on a client's pipe, because
+// the client has disconnected or misbehaved.
+//
+STATIC VOID EndReadChain(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process)
+{
+	StopLogRingDoorbell(Process);
+	ReleaseProcess(Process);
+}
+
+//
+// Called by a worker thread when a read on a client's pipe has completed.
+//
+STATIC VOID CompletedRead(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process,
+	IN	PIO_STATUS_BLOCK				IoStatusBlock)
+{
+	NTSTATUS Status;
+	ULONG_PTR ExpectedBytes;
+
+	ASSERT (Process != NULL);
+	ASSERT (IoStatusBlock != NULL);
+
+	if (!NT_SUCCESS(IoStatusBlock->Status)) {
+		if (IoStatusBlock->Status != STATUS_PIPE_BROKEN) {
+			KexLogErrorEvent(
+				L"I/O error on a completed read from pipe for PID %lu (%s)",
+				Process->ProcessId,
+				KexRtlNtStatusToString(IoStatusBlock->Status));
+		}
+
+		EndReadChain(Process);
+		return;
+	}
+
+	//
+	// Verify that the length of the received message matches what the
+	// client said it sent.
+	//
+
+	if (IoStatusBlock->Information < sizeof(KEX_IPC_MESSAGE)) {
+		ExpectedBytes = sizeof(KEX_IPC_MESSAGE);
+	} else {
+		ExpectedBytes = sizeof(KEX_IPC_MESSAGE) + Process->IncomingMessage.AuxiliaryDataBlockSize;
+	}
+
+	if (IoStatusBlock->Information != ExpectedBytes) {
+		KexLogWarningEvent(
+			L"Client (PID %lu) has sent an invalid message\r\n\r\n"
+			L"Expected %Iu bytes, received %Iu",
+			Process->ProcessId,
+			ExpectedBytes,
+			IoStatusBlock->Information);
+
+		EndReadChain(Process);
+		return;
+	}
+
+	Status = DispatchMessage(Process, &Process->IncomingMessage);
+	if (!NT_SUCCESS(Status)) {
+		EndReadChain(Process);
+		return;
+	}
+
+	//
+	// Only start the next read once we are completely finished with the
+	// contents of IncomingMessage.
+	//
+
+	Status = BeginReadProcess(Process);
+	if (!NT_SUCCESS(Status)) {
+		EndReadChain(Process);
+	}
+}
+
+//
+// Called by a worker thread to service one or more log ring drain requests.
+// Only one drain per client is ever queued or in progress at a time - any
+// doorbell rings which arrive in the meantime are counted, and result in
+// another pass over the ring here.
+//
+STATIC VOID CompletedLogRingDrainRequest(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process)
+{
+	ASSERT (Process != NULL);
+
+	do {
+		DrainLogRing(Process);
+	} until (InterlockedDecrement(&Process->LogRingDrainRequests) == 0);
+
+	ReleaseProcess(Process);
+}
+
+STATIC NTSTATUS NTAPI WorkerThreadProc(
+	IN	PVOID	Parameter)
+{
+	NTSTATUS Status;
+	PVOID KeyContext;
+	PVOID ApcContext;
+	IO_STATUS_BLOCK IoStatusBlock;
+	PKEXSRV_PER_CLIENT_PROCESS_DATA Process;
+
+	while (TRUE) {
+		Status = NtRemoveIoCompletion(
+			CompletionPortHandle,
+			&KeyContext,
+			&ApcContext,
+			&IoStatusBlock,
+			NULL);
+
+		if (Status != STATUS_SUCCESS) {
+			KexLogErrorEvent(
+				L"Failed to dequeue a completion packet. The worker thread will exit.\r\n\r\n"
+				L"NTSTATUS error code: %s",
+				KexRtlNtStatusToString(Status));
+			break;
+		}
+
+		//
+		// The key context is always the per-process data of the client whose
+		// pipe the completed operation was issued on.
+		//
+
+		ASSERT (KeyContext != NULL);
+
+		Process = (PKEXSRV_PER_CLIENT_PROCESS_DATA) KeyContext;
+
+		if (ApcContext == &Process->LogRing) {
+			CompletedLogRingDrainRequest(Process);
+		} else {
+			ASSERT (ApcContext == Process);
+			CompletedRead(Process, &IoStatusBlock);
+		}
+	}
+
+	return Status;
+}
+
+//
+// Create the I/O completion port and start one worker thread for each
+// processor in the system.
+//
+NTSTATUS CreateWorkerThreads(
+	VOID)
+{
+	NTSTATUS Status;
+	ULONG NumberOfWorkerThreads;
+	ULONG Index;
+
+	NumberOfWorkerThreads = NtCurrentPeb()->NumberOfProcessors;
+	NumberOfWorkerThreads = max(NumberOfWorkerThreads, 1);
+	NumberOfWorkerThreads = min(NumberOfWorkerThreads, KEXSRV_MAXIMUM_NUMBER_OF_WORKER_THREADS);
+
+	RtlInitializeSListHead(&DisconnectedProcessList);
+
+	Status = NtCreateEvent(
+		&DisconnectEventHandle,
+		EVENT_ALL_ACCESS,
+		NULL,
+		SynchronizationEvent,
+		FALSE);
+
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	Status = NtCreateIoCompletion(
+		&CompletionPortHandle,
+		IO_COMPLETION_ALL_ACCESS,
+		NULL,
+		NumberOfWorkerThreads);
+
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	for (Index = 0; Index < NumberOfWorkerThreads; ++Index) {
+		HANDLE ThreadHandle;
+
+		Status = RtlCreateUserThread(
+			NtCurrentProcess(),
+			NULL,
+			FALSE,
+			0,
+			0,
+			0,
+			WorkerThreadProc,
+			NULL,
+			&ThreadHandle,
+			NULL);
+
+		if (!NT_SUCCESS(Status)) {
+			KexLogWarningEvent(
+				L"Failed to create worker thread #%lu.\r\n\r\n"
+				L"NTSTATUS error code: %s",
+				Index,
+				KexRtlNtStatusToString(Status));
+
+			break;
+		}
+
+		NtClose(ThreadHandle);
+	}
+
+	if (Index == 0) {
+		// we can't do anything without at least one worker
+		return Status;
+	}
+
+	KexLogInformationEvent(L"Started %lu worker threads.", Index);
+	return STATUS_SUCCESS;
+}
+
+//
+// Associate a newly connected client's pipe with the completion port. All
+// completion packets for this pipe will carry the per-process data as the
+// key context.
+//
+NTSTATUS AssociateProcessWithCompletionPort(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process)
+{
+	IO_STATUS_BLOCK IoStatusBlock;
+	FILE_COMPLETION_INFORMATION CompletionInformation;
+
+	ASSERT (Process != NULL);
+	ASSERT (VALID_HANDLE(CompletionPortHandle));
+
+	CompletionInformation.Port = CompletionPortHandle;
+	CompletionInformation.Key = Process;
+
+	return NtSetInformationFile(
+		Process->PipeHandle,
+		&IoStatusBlock,
+		&CompletionInformation,
+		sizeof(CompletionInformation),
+		FileCompletionInformation);
+}
+
+//
+// Start an asynchronous read of the next message from a client. The
+// completion is picked up by one of the worker threads.
+//
+NTSTATUS BeginReadProcess(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process)
+{
+	NTSTATUS Status;
+
+	ASSERT (Process != NULL);
+
+	Status = NtReadFile(
+		Process->PipeHandle,
+		NULL,
+		NULL,
+		Process,
+		&Process->IoStatusBlock,
+		Process->IncomingMessageBuffer,
+		ARRAYSIZE(Process->IncomingMessageBuffer),
+		NULL,
+		NULL);
+
+	if (Status != STATUS_PENDING && !NT_SUCCESS(Status)) {
+		if (Status != STATUS_PIPE_BROKEN) {
+			KexLogErrorEvent(
+				L"NtReadFile error on pipe for PID %lu (%s)",
+				Process->ProcessId,
+				KexRtlNtStatusToString(Status));
+		}
+
+		return Status;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+//
+// Ask the worker threads to drain a client's log ring. This is called from
+// the doorbell wait callback.
+//
+VOID QueueLogRingDrain(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process)
+{
+	NTSTATUS Status;
+
+	ASSERT (Process != NULL);
+
+	if (InterlockedIncrement(&Process->LogRingDrainRequests) != 1) {
+		// A drain is already queued or in progress, and it will pick up
+		// this request as well.
+		return;
+	}
+
+	InterlockedIncrement(&Process->ReferenceCount);
+
+	Status = NtSetIoCompletion(
+		CompletionPortHandle,
+		Process,
+		&Process->LogRing,
+		STATUS_SUCCESS,
+		0);
+
+	if (!NT_SUCCESS(Status)) {
+		InterlockedExchange(&Process->LogRingDrainRequests, 0);
+		ReleaseProcess(Process);
+	}
+}
+
+//
+// Drop a reference to a client. When the read chain and any log ring drain
+// are both finished, the client is handed back to the main thread to be
+// removed from the process/thread table and freed.
+//
+// The doorbell wait must already be gone by the time the read chain drops
+// its reference, since otherwise a new drain could be queued for a client
+// that is about to be freed.
+//
+VOID ReleaseProcess(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process)
+{
+	ASSERT (Process != NULL);
+	ASSERT (Process->ReferenceCount > 0);
+
+	if (InterlockedDecrement(&Process->ReferenceCount) == 0) {
+		HandOffDisconnectedProcess(Process);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,1092 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     journal.c
+//
+// Abstract:
+//
+//     Contains the multiplexed log journal which is used in journal mode.
+//
+//     Normally each client gets a log file of its own, and the worker threads
+//     write a client's log events straight into that file. With many busy
+//     clients, this means many small writes scattered over many files. In
+//     journal mode, the log events of all clients are instead appended to
+//     one journal file (KexSrv.vxj in the log directory). Each client is
+//     given a stream ID, which is used to tag all of its records.
+//
+//     The worker threads only copy records into the active one of two
+//     journal buffers. A dedicated writer thread swaps the buffers when the
+//     active one fills up, or when it has been waiting for
+//     KEXSRV_JOURNAL_FLUSH_INTERVAL, and appends the contents of the full
+//     buffer to the journal in a single sequential write.
+//
+//     Once the journal has grown past KEXSRV_JOURNAL_SEGMENT_SIZE, the writer
+//     thread renames it to KexSrv-1.vxj and starts a new segment. The new
+//     segment begins with a copy of the StreamOpen record of every stream
+//     which is still open, so each segment can be read on its own. An export
+//     thread then splits the previous segment up into the usual
+//     per-application log files in one pass, and deletes it. Any segments
+//     left behind by the previous server process are split up in the same
+//     way when the server starts (see ExportJournal).
+//
+//     The journal is not readable by VxlView. The log events of a client
+//     only show up in its own log file once the segment which holds them
+//     has been exported.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "buildcfg.h"
+#include "kexsrvp.h"
+
+#define JOURNAL_SEGMENT_NAME L"KexSrv.vxj"
+#define PREVIOUS_JOURNAL_SEGMENT_NAME L"KexSrv-1.vxj"
+
+BOOLEAN JournalEnabled = FALSE;
+
+STATIC HANDLE JournalFileHandle = NULL;
+STATIC VOLATILE LONG LastJournalStreamId = 0;
+
+//
+// JournalLock protects the two buffers, as well as ActiveBufferIndex,
+// ActiveBufferUsed, JournalReservedSize and FlushRequested. The writer thread
+// waits on JournalWriterCondition, and threads which are waiting for space in
+// the active buffer wait on JournalSpaceCondition.
+//
+// Room for the StreamClose record of every open stream is always kept free
+// in the active buffer, so that CloseJournalStream, which is called by the
+// main thread, never has to wait for the writer thread.
+//
+
+#define JOURNAL_CLOSE_RECORD_SIZE KEXSRV_JOURNAL_RECORD_SIZE(0)
+
+STATIC RTL_SRWLOCK JournalLock = RTL_SRWLOCK_INIT;
+STATIC RTL_CONDITION_VARIABLE JournalWriterCondition = RTL_CONDITION_VARIABLE_INIT;
+STATIC RTL_CONDITION_VARIABLE JournalSpaceCondition = RTL_CONDITION_VARIABLE_INIT;
+STATIC PBYTE JournalBuffers[2] = {NULL, NULL};
+STATIC ULONG ActiveBufferIndex = 0;
+STATIC ULONG ActiveBufferUsed = 0;
+STATIC ULONG JournalReservedSize = 0;
+STATIC BOOLEAN FlushRequested = FALSE;
+
+//
+// Only used by the writer thread.
+//
+
+STATIC LONGLONG JournalFileOffset = 0;
+STATIC PKEXSRV_JOURNAL_STREAM OpenStreams = NULL;
+
+//
+// PreviousSegmentPending is set by the writer thread when it has renamed a
+// segment to KexSrv-1.vxj, and cleared by the export thread once it has
+// exported and deleted that segment. The writer thread doesn't start another
+// segment until then. JournalExportLock protects PreviousSegmentPending, and
+// the export thread waits on JournalExportCondition.
+//
+
+STATIC RTL_SRWLOCK JournalExportLock = RTL_SRWLOCK_INIT;
+STATIC RTL_CONDITION_VARIABLE JournalExportCondition = RTL_CONDITION_VARIABLE_INIT;
+STATIC BOOLEAN PreviousSegmentPending = FALSE;
+
+//
+// Called by the writer thread once it has written a buffer to the journal
+// file. Keep a copy of the StreamOpen record of each stream which is still
+// open, so that it can be written again at the start of the next segment.
+//
+STATIC VOID TrackJournalStreams(
+	IN	PBYTE	Buffer,
+	IN	ULONG	BufferUsed)
+{
+	ULONG Position;
+	PCKEXSRV_JOURNAL_RECORD Record;
+	PKEXSRV_JOURNAL_STREAM Stream;
+	PPKEXSRV_JOURNAL_STREAM Link;
+
+	for (Position = 0; Position < BufferUsed; Position += Record->RecordSize) {
+		Record = (PCKEXSRV_JOURNAL_RECORD) &Buffer[Position];
+
+		if (Record->RecordType == KexSrvJournalStreamOpen) {
+			Stream = (PKEXSRV_JOURNAL_STREAM) SafeAlloc(BYTE, sizeof(KEXSRV_JOURNAL_STREAM) + Record->RecordSize);
+
+			if (!Stream) {
+				// The rest of this stream can't be exported from later
+				// segments, but the part in this segment still can.
+				continue;
+			}
+
+			Stream->OpenRecord = (PKEXSRV_JOURNAL_RECORD) (Stream + 1);
+			RtlCopyMemory(Stream->OpenRecord, Record, Record->RecordSize);
+
+			Stream->Next = OpenStreams;
+			OpenStreams = Stream;
+		} else if (Record->RecordType == KexSrvJournalStreamClose) {
+			for (Link = &OpenStreams; *Link != NULL; Link = &(*Link)->Next) {
+				if ((*Link)->OpenRecord->StreamId == Record->StreamId) {
+					break;
+				}
+			}
+
+			Stream = *Link;
+
+			if (Stream) {
+				*Link = Stream->Next;
+				SafeFree(Stream);
+			}
+		}
+	}
+}
+
+//
+// Create a new journal segment, write its header, and copy the StreamOpen
+// record of every open stream into it. On success, the writer thread goes
+// on writing into the new segment.
+//
+STATIC NTSTATUS CreateJournalSegment(
+	VOID)
+{
+	NTSTATUS Status;
+	HANDLE DirectoryHandle;
+	HANDLE FileHandle;
+	UNICODE_STRING FileName;
+	OBJECT_ATTRIBUTES ObjectAttributes;
+	IO_STATUS_BLOCK IoStatusBlock;
+	KEXSRV_JOURNAL_HEADER Header;
+	LONGLONG Offset;
+	PKEXSRV_JOURNAL_STREAM Stream;
+
+	Status = OpenLogDirectory(&DirectoryHandle);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	RtlInitConstantUnicodeString(&FileName, JOURNAL_SEGMENT_NAME);
+
+	InitializeObjectAttributes(
+		&ObjectAttributes,
+		&FileName,
+		OBJ_CASE_INSENSITIVE,
+		DirectoryHandle,
+		NULL);
+
+	//
+	// DELETE access is needed to rename the segment later on.
+	//
+
+	Status = NtCreateFile(
+		&FileHandle,
+		GENERIC_WRITE | DELETE | SYNCHRONIZE,
+		&ObjectAttributes,
+		&IoStatusBlock,
+		NULL,
+		FILE_ATTRIBUTE_NORMAL,
+		FILE_SHARE_READ,
+		FILE_OVERWRITE_IF,
+		FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_SEQUENTIAL_ONLY,
+		NULL,
+		0);
+
+	NtClose(DirectoryHandle);
+
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	Header.Signature = KEXSRV_JOURNAL_SIGNATURE;
+	Header.Version = KEXSRV_JOURNAL_VERSION;
+	Offset = 0;
+
+	Status = NtWriteFile(
+		FileHandle,
+		NULL,
+		NULL,
+		NULL,
+		&IoStatusBlock,
+		&Header,
+		sizeof(Header),
+		&Offset,
+		NULL);
+
+	Offset = sizeof(Header);
+
+	for (Stream = OpenStreams; Stream != NULL && NT_SUCCESS(Status); Stream = Stream->Next) {
+		Status = NtWriteFile(
+			FileHandle,
+			NULL,
+			NULL,
+			NULL,
+			&IoStatusBlock,
+			Stream->OpenRecord,
+			Stream->OpenRecord->RecordSize,
+			&Offset,
+			NULL);
+
+		Offset += Stream->OpenRecord->RecordSize;
+	}
+
+	if (!NT_SUCCESS(Status)) {
+		NtClose(FileHandle);
+		return Status;
+	}
+
+	JournalFileHandle = FileHandle;
+	JournalFileOffset = Offset;
+
+	return STATUS_SUCCESS;
+}
+
+//
+// Called by the writer thread once the current segment has grown past
+// KEXSRV_JOURNAL_SEGMENT_SIZE. The current segment is renamed to
+// KexSrv-1.vxj and handed to the export thread, and a new segment is
+// started. If the export thread is still busy with the previous segment,
+// the current segment just keeps growing for now.
+//
+STATIC VOID RotateJournal(
+	VOID)
+{
+	NTSTATUS Status;
+	BOOLEAN ExportPending;
+	HANDLE OldFileHandle;
+	LONGLONG OldFileOffset;
+	IO_STATUS_BLOCK IoStatusBlock;
+	PFILE_RENAME_INFORMATION RenameInformation;
+	ULONG RenameInformationCb;
+
+	RtlAcquireSRWLockShared(&JournalExportLock);
+	ExportPending = PreviousSegmentPending;
+	RtlReleaseSRWLockShared(&JournalExportLock);
+
+	if (ExportPending) {
+		return;
+	}
+
+	RenameInformationCb = FIELD_OFFSET(FILE_RENAME_INFORMATION, FileName) +
+						  sizeof(PREVIOUS_JOURNAL_SEGMENT_NAME) - sizeof(WCHAR);
+
+	RenameInformation = (PFILE_RENAME_INFORMATION) SafeAlloc(BYTE, RenameInformationCb);
+	if (!RenameInformation) {
+		return;
+	}
+
+	//
+	// A file name without a path renames the file within its directory.
+	//
+
+	RenameInformation->ReplaceIfExists = TRUE;
+	RenameInformation->RootDirectory = NULL;
+	RenameInformation->FileNameLength = sizeof(PREVIOUS_JOURNAL_SEGMENT_NAME) - sizeof(WCHAR);
+
+	RtlCopyMemory(
+		RenameInformation->FileName,
+		PREVIOUS_JOURNAL_SEGMENT_NAME,
+		RenameInformation->FileNameLength);
+
+	Status = NtSetInformationFile(
+		JournalFileHandle,
+		&IoStatusBlock,
+		RenameInformation,
+		RenameInformationCb,
+		FileRenameInformation);
+
+	SafeFree(RenameInformation);
+
+	if (!NT_SUCCESS(Status)) {
+		KexLogWarningEvent(
+			L"Failed to rename the journal.\r\n\r\n"
+			L"NTSTATUS error code: %s",
+			KexRtlNtStatusToString(Status));
+
+		return;
+	}
+
+	OldFileHandle = JournalFileHandle;
+	OldFileOffset = JournalFileOffset;
+
+	Status = CreateJournalSegment();
+
+	if (!NT_SUCCESS(Status)) {
+		//
+		// Keep writing into the renamed segment. It is exported along with
+		// the next one, or when the server next starts.
+		//
+
+		KexLogWarningEvent(
+			L"Failed to start a new journal segment.\r\n\r\n"
+			L"NTSTATUS error code: %s",
+			KexRtlNtStatusToString(Status));
+
+		JournalFileHandle = OldFileHandle;
+		JournalFileOffset = OldFileOffset;
+		return;
+	}
+
+	NtClose(OldFileHandle);
+
+	RtlAcquireSRWLockExclusive(&JournalExportLock);
+	PreviousSegmentPending = TRUE;
+	RtlReleaseSRWLockExclusive(&JournalExportLock);
+
+	RtlWakeConditionVariable(&JournalExportCondition);
+}
+
+STATIC NTSTATUS NTAPI JournalWriterThreadProc(
+	IN	PVOID	Parameter)
+{
+	NTSTATUS Status;
+	IO_STATUS_BLOCK IoStatusBlock;
+	LONGLONG Timeout;
+	PBYTE Buffer;
+	ULONG BufferUsed;
+
+	while (TRUE) {
+		RtlAcquireSRWLockExclusive(&JournalLock);
+
+		while (ActiveBufferUsed == 0) {
+			RtlSleepConditionVariableSRW(&JournalWriterCondition, &JournalLock, NULL, 0);
+		}
+
+		//
+		// Give the buffer some time to fill up, unless somebody is already
+		// waiting for space.
+		//
+
+		unless (FlushRequested) {
+			Timeout = -KEXSRV_JOURNAL_FLUSH_INTERVAL;
+			RtlSleepConditionVariableSRW(&JournalWriterCondition, &JournalLock, &Timeout, 0);
+		}
+
+		Buffer = JournalBuffers[ActiveBufferIndex];
+		BufferUsed = ActiveBufferUsed;
+
+		ActiveBufferIndex ^= 1;
+		ActiveBufferUsed = 0;
+		FlushRequested = FALSE;
+
+		RtlReleaseSRWLockExclusive(&JournalLock);
+		RtlWakeAllConditionVariable(&JournalSpaceCondition);
+
+		//
+		// The buffer we took can't be touched by anyone else until we swap
+		// buffers again, which only happens once this write is finished.
+		//
+
+		Status = NtWriteFile(
+			JournalFileHandle,
+			NULL,
+			NULL,
+			NULL,
+			&IoStatusBlock,
+			Buffer,
+			BufferUsed,
+			&JournalFileOffset,
+			NULL);
+
+		if (NT_SUCCESS(Status)) {
+			TrackJournalStreams(Buffer, BufferUsed);
+			JournalFileOffset += BufferUsed;
+
+			if (JournalFileOffset >= KEXSRV_JOURNAL_SEGMENT_SIZE) {
+				RotateJournal();
+			}
+		} else {
+			KexLogErrorEvent(
+				L"Failed to write %lu bytes to the journal.\r\n\r\n"
+				L"NTSTATUS error code: %s",
+				BufferUsed,
+				KexRtlNtStatusToString(Status));
+		}
+	}
+}
+
+//
+// Append a record to the journal. The record consists of a header, which
+// must already have its RecordSize filled out, followed by DataCb bytes of
+// data which are copied from Data. Any padding at the end of the record is
+// zeroed.
+//
+// If the active buffer doesn't have enough space for the record, this
+// function waits until the writer thread has swapped buffers. StreamClose
+// records are the exception, since space for them is set aside when the
+// stream is opened.
+//
+STATIC VOID AppendJournalRecord(
+	IN	PCKEXSRV_JOURNAL_RECORD	RecordHeader,
+	IN	PCVOID					Data OPTIONAL,
+	IN	ULONG					DataCb)
+{
+	PBYTE Record;
+	BOOLEAN BufferWasEmpty;
+	ULONG RequiredSize;
+
+	ASSERT (JournalEnabled);
+	ASSERT (RecordHeader != NULL);
+	ASSERT (RecordHeader->RecordSize <= KEXSRV_JOURNAL_BUFFER_SIZE);
+	ASSERT (FIELD_OFFSET(KEXSRV_JOURNAL_RECORD, Data) + DataCb <= RecordHeader->RecordSize);
+
+	RtlAcquireSRWLockExclusive(&JournalLock);
+
+	if (RecordHeader->RecordType == KexSrvJournalStreamClose) {
+		ASSERT (RecordHeader->RecordSize == JOURNAL_CLOSE_RECORD_SIZE);
+		ASSERT (JournalReservedSize >= JOURNAL_CLOSE_RECORD_SIZE);
+		ASSERT (ActiveBufferUsed + JOURNAL_CLOSE_RECORD_SIZE <= KEXSRV_JOURNAL_BUFFER_SIZE);
+
+		JournalReservedSize -= JOURNAL_CLOSE_RECORD_SIZE;
+	} else {
+		while (TRUE) {
+			RequiredSize = RecordHeader->RecordSize + JournalReservedSize;
+
+			if (RecordHeader->RecordType == KexSrvJournalStreamOpen) {
+				RequiredSize += JOURNAL_CLOSE_RECORD_SIZE;
+			}
+
+			if (ActiveBufferUsed + RequiredSize <= KEXSRV_JOURNAL_BUFFER_SIZE) {
+				break;
+			}
+
+			FlushRequested = TRUE;
+			RtlWakeConditionVariable(&JournalWriterCondition);
+			RtlSleepConditionVariableSRW(&JournalSpaceCondition, &JournalLock, NULL, 0);
+		}
+
+		if (RecordHeader->RecordType == KexSrvJournalStreamOpen) {
+			JournalReservedSize += JOURNAL_CLOSE_RECORD_SIZE;
+		}
+	}
+
+	BufferWasEmpty = (ActiveBufferUsed == 0);
+	Record = JournalBuffers[ActiveBufferIndex] + ActiveBufferUsed;
+
+	RtlCopyMemory(Record, RecordHeader, FIELD_OFFSET(KEXSRV_JOURNAL_RECORD, Data));
+
+	if (DataCb != 0) {
+		RtlCopyMemory(Record + FIELD_OFFSET(KEXSRV_JOURNAL_RECORD, Data), Data, DataCb);
+	}
+
+	RtlZeroMemory(
+		Record + FIELD_OFFSET(KEXSRV_JOURNAL_RECORD, Data) + DataCb,
+		RecordHeader->RecordSize - FIELD_OFFSET(KEXSRV_JOURNAL_RECORD, Data) - DataCb);
+
+	ActiveBufferUsed += RecordHeader->RecordSize;
+
+	RtlReleaseSRWLockExclusive(&JournalLock);
+
+	if (BufferWasEmpty) {
+		RtlWakeConditionVariable(&JournalWriterCondition);
+	}
+}
+
+//
+// Write one log event record from the journal into the log file of its
+// stream. Everything in the record is checked, since the journal may have
+// been cut short or damaged.
+//
+STATIC NTSTATUS ExportJournalLogEvent(
+	IN	VXLHANDLE				LogHandle,
+	IN	PCKEXSRV_JOURNAL_RECORD	Record)
+{
+	PCKEX_IPC_MESSAGE_DATA_LOG_EVENT LogEventInfo;
+	UNICODE_STRING SourceComponent;
+	UNICODE_STRING SourceFile;
+	UNICODE_STRING SourceFunction;
+	UNICODE_STRING Text;
+	LONGLONG Time;
+
+	LogEventInfo = &Record->LogEventInformation;
+
+	if (KEXSRV_JOURNAL_RECORD_SIZE(
+			LogEventInfo->SourceComponentLength + LogEventInfo->SourceFileLength +
+			LogEventInfo->SourceFunctionLength + LogEventInfo->TextLength) > Record->RecordSize) {
+
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (LogEventInfo->Severity >= LogSeverityMaximumValue) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	SourceComponent.Buffer = (PWCHAR) Record->Data;
+	SourceComponent.Length = LogEventInfo->SourceComponentLength * sizeof(WCHAR);
+	SourceComponent.MaximumLength = SourceComponent.Length;
+
+	SourceFile.Buffer = SourceComponent.Buffer + LogEventInfo->SourceComponentLength;
+	SourceFile.Length = LogEventInfo->SourceFileLength * sizeof(WCHAR);
+	SourceFile.MaximumLength = SourceFile.Length;
+
+	SourceFunction.Buffer = SourceFile.Buffer + LogEventInfo->SourceFileLength;
+	SourceFunction.Length = LogEventInfo->SourceFunctionLength * sizeof(WCHAR);
+	SourceFunction.MaximumLength = SourceFunction.Length;
+
+	Text.Buffer = SourceFunction.Buffer + LogEventInfo->SourceFunctionLength;
+	Text.Length = LogEventInfo->TextLength * sizeof(WCHAR);
+	Text.MaximumLength = Text.Length;
+
+	Time = Record->Time;
+
+	return VxlWriteLogPreformatted(
+		LogHandle,
+		&SourceComponent,
+		&SourceFile,
+		LogEventInfo->SourceLine,
+		&SourceFunction,
+		(VXLSEVERITY) LogEventInfo->Severity,
+		&Text,
+		&Time,
+		Record->ProcessId,
+		0);
+}
+
+//
+// Write one record of a stream into the log file of the stream. The log
+// file is opened at the StreamOpen record, which comes first in every
+// segment that holds records of the stream, and closed at the StreamClose
+// record.
+//
+STATIC NTSTATUS ExportJournalRecord(
+	IN OUT	PVXLHANDLE				LogHandle,
+	IN		PCKEXSRV_JOURNAL_RECORD	Record)
+{
+	NTSTATUS Status;
+
+	ASSERT (LogHandle != NULL);
+	ASSERT (Record != NULL);
+
+	switch (Record->RecordType) {
+	case KexSrvJournalStreamOpen:
+		{
+			WCHAR ApplicationName[RTL_FIELD_SIZE(KEXSRV_PER_CLIENT_PROCESS_DATA, ApplicationName) / sizeof(WCHAR)];
+
+			if (*LogHandle != NULL ||
+				KEXSRV_JOURNAL_RECORD_SIZE(Record->ApplicationNameLength) > Record->RecordSize) {
+
+				return STATUS_INVALID_PARAMETER;
+			}
+
+			StringCchCopyN(
+				ApplicationName,
+				ARRAYSIZE(ApplicationName),
+				Record->Data,
+				Record->ApplicationNameLength);
+
+			//
+			// If an earlier segment held the start of this stream, the log
+			// file already exists and we append to it.
+			//
+
+			Status = OpenApplicationLogFile(
+				LogHandle,
+				ApplicationName,
+				Record->ProcessId);
+
+			if (!NT_SUCCESS(Status)) {
+				*LogHandle = NULL;
+			}
+
+			return Status;
+		}
+	case KexSrvJournalLogEvent:
+		if (*LogHandle == NULL) {
+			return STATUS_INVALID_HANDLE;
+		}
+
+		return ExportJournalLogEvent(*LogHandle, Record);
+	case KexSrvJournalStreamClose:
+		VxlCloseLog(LogHandle);
+		return STATUS_SUCCESS;
+	default:
+		return STATUS_INVALID_PARAMETER;
+	}
+}
+
+//
+// Return the record at *Offset in a mapped journal and advance *Offset past
+// it, or return NULL if there are no more records. The view is rounded up
+// to a whole number of pages, and the part past the end of the file reads
+// as zeroes. So the records end at the first record with a RecordSize of
+// zero, or at the end of the view.
+//
+STATIC PCKEXSRV_JOURNAL_RECORD GetNextJournalRecord(
+	IN		PBYTE	Journal,
+	IN		SIZE_T	JournalSize,
+	IN OUT	PSIZE_T	Offset)
+{
+	PCKEXSRV_JOURNAL_RECORD Record;
+
+	if (*Offset + FIELD_OFFSET(KEXSRV_JOURNAL_RECORD, Data) > JournalSize) {
+		return NULL;
+	}
+
+	Record = (PCKEXSRV_JOURNAL_RECORD) &Journal[*Offset];
+
+	if (Record->RecordSize < FIELD_OFFSET(KEXSRV_JOURNAL_RECORD, Data) ||
+		Record->RecordSize > JournalSize - *Offset) {
+
+		return NULL;
+	}
+
+	*Offset += Record->RecordSize;
+	return Record;
+}
+
+//
+// Find the export slot of a stream in a hash table of NumberOfSlots slots,
+// which must be a power of two. Free slots have a StreamId of zero. A free
+// slot is only claimed for a StreamOpen record, so that a damaged segment
+// can't fill up the table with bogus stream IDs.
+//
+// Returns NULL if the stream has no slot.
+//
+STATIC PKEXSRV_JOURNAL_EXPORT_SLOT LookupJournalExportSlot(
+	IN	PKEXSRV_JOURNAL_EXPORT_SLOT	Slots,
+	IN	ULONG						NumberOfSlots,
+	IN	PCKEXSRV_JOURNAL_RECORD		Record)
+{
+	ULONG Index;
+
+	if (Record->StreamId == 0) {
+		return NULL;
+	}
+
+	Index = Record->StreamId & (NumberOfSlots - 1);
+
+	until (Slots[Index].StreamId == Record->StreamId) {
+		if (Slots[Index].StreamId == 0) {
+			if (Record->RecordType != KexSrvJournalStreamOpen) {
+				return NULL;
+			}
+
+			Slots[Index].StreamId = Record->StreamId;
+			break;
+		}
+
+		Index = (Index + 1) & (NumberOfSlots - 1);
+	}
+
+	return &Slots[Index];
+}
+
+//
+// Split up one journal segment into the usual per-application log files,
+// and then delete it. The log events keep their original timestamps. The
+// segment is read through a mapped view, and each record is only looked at
+// a few times no matter how many streams are interleaved in the segment.
+//
+// Returns STATUS_OBJECT_NAME_NOT_FOUND if there is no such segment.
+//
+STATIC NTSTATUS ExportJournalSegment(
+	IN	PCWSTR	SegmentName)
+{
+	NTSTATUS Status;
+	HANDLE DirectoryHandle;
+	HANDLE FileHandle;
+	HANDLE SectionHandle;
+	UNICODE_STRING FileName;
+	OBJECT_ATTRIBUTES ObjectAttributes;
+	IO_STATUS_BLOCK IoStatusBlock;
+	PBYTE Journal;
+	SIZE_T JournalSize;
+	SIZE_T Offset;
+	PCKEXSRV_JOURNAL_RECORD Record;
+	PKEXSRV_JOURNAL_EXPORT_SLOT Slots;
+	PKEXSRV_JOURNAL_EXPORT_SLOT Slot;
+	ULONG NumberOfStreams;
+	ULONG NumberOfSlots;
+	ULONG NumberOfRecords;
+	ULONG NumberOfFailedRecords;
+	ULONG Index;
+
+	ASSERT (SegmentName != NULL);
+
+	Status = OpenLogDirectory(&DirectoryHandle);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	RtlInitUnicodeString(&FileName, SegmentName);
+
+	InitializeObjectAttributes(
+		&ObjectAttributes,
+		&FileName,
+		OBJ_CASE_INSENSITIVE,
+		DirectoryHandle,
+		NULL);
+
+	//
+	// The segment is deleted as soon as we close it, whether or not the
+	// export succeeds. Otherwise, a damaged segment would be exported again
+	// every time the server starts.
+	//
+
+	Status = NtOpenFile(
+		&FileHandle,
+		GENERIC_READ | DELETE | SYNCHRONIZE,
+		&ObjectAttributes,
+		&IoStatusBlock,
+		FILE_SHARE_READ | FILE_SHARE_DELETE,
+		FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_DELETE_ON_CLOSE);
+
+	NtClose(DirectoryHandle);
+
+	if (!NT_SUCCESS(Status)) {
+		if (Status != STATUS_OBJECT_NAME_NOT_FOUND) {
+			KexLogWarningEvent(
+				L"Failed to open %s for export.\r\n\r\n"
+				L"NTSTATUS error code: %s",
+				SegmentName,
+				KexRtlNtStatusToString(Status));
+		}
+
+		return Status;
+	}
+
+	SectionHandle = NULL;
+	Journal = NULL;
+	Slots = NULL;
+	NumberOfSlots = 0;
+	NumberOfRecords = 0;
+	NumberOfFailedRecords = 0;
+
+	try {
+		Status = NtCreateSection(
+			&SectionHandle,
+			SECTION_MAP_READ,
+			NULL,
+			NULL,
+			PAGE_READONLY,
+			SEC_COMMIT,
+			FileHandle);
+
+		if (!NT_SUCCESS(Status)) {
+			// An empty segment can't be mapped.
+			SectionHandle = NULL;
+			leave;
+		}
+
+		JournalSize = 0;
+
+		Status = NtMapViewOfSection(
+			SectionHandle,
+			NtCurrentProcess(),
+			(PPVOID) &Journal,
+			0,
+			0,
+			NULL,
+			&JournalSize,
+			ViewUnmap,
+			0,
+			PAGE_READONLY);
+
+		if (!NT_SUCCESS(Status)) {
+			Journal = NULL;
+			leave;
+		}
+
+		if (JournalSize < sizeof(KEXSRV_JOURNAL_HEADER) ||
+			((PKEXSRV_JOURNAL_HEADER) Journal)->Signature != KEXSRV_JOURNAL_SIGNATURE ||
+			((PKEXSRV_JOURNAL_HEADER) Journal)->Version != KEXSRV_JOURNAL_VERSION) {
+
+			Status = STATUS_FILE_CORRUPT_ERROR;
+			leave;
+		}
+
+		//
+		// Every stream in a segment starts with a StreamOpen record, so the
+		// first pass finds out how many streams there are.
+		//
+
+		NumberOfStreams = 0;
+		Offset = sizeof(KEXSRV_JOURNAL_HEADER);
+
+		while ((Record = GetNextJournalRecord(Journal, JournalSize, &Offset)) != NULL) {
+			if (Record->RecordType == KexSrvJournalStreamOpen) {
+				++NumberOfStreams;
+			}
+		}
+
+		if (NumberOfStreams == 0) {
+			Status = STATUS_SUCCESS;
+			leave;
+		}
+
+		// Keep the table at most half full.
+		NumberOfSlots = 1;
+
+		while (NumberOfSlots < NumberOfStreams * 2) {
+			NumberOfSlots *= 2;
+		}
+
+		Slots = SafeAlloc(KEXSRV_JOURNAL_EXPORT_SLOT, NumberOfSlots);
+		if (!Slots) {
+			Status = STATUS_NO_MEMORY;
+			leave;
+		}
+
+		RtlZeroMemory(Slots, NumberOfSlots * sizeof(KEXSRV_JOURNAL_EXPORT_SLOT));
+
+		//
+		// Second pass - write each record into the log file of its stream.
+		//
+
+		Offset = sizeof(KEXSRV_JOURNAL_HEADER);
+
+		while ((Record = GetNextJournalRecord(Journal, JournalSize, &Offset)) != NULL) {
+			++NumberOfRecords;
+
+			Slot = LookupJournalExportSlot(Slots, NumberOfSlots, Record);
+
+			if (!Slot) {
+				++NumberOfFailedRecords;
+				continue;
+			}
+
+			Status = ExportJournalRecord(&Slot->LogHandle, Record);
+
+			if (!NT_SUCCESS(Status)) {
+				++NumberOfFailedRecords;
+			}
+		}
+
+		Status = STATUS_SUCCESS;
+	} finally {
+		if (Slots) {
+			// Streams which are continued in the next segment, or whose
+			// clients were still connected when the previous server process
+			// exited, are not closed in this segment.
+			for (Index = 0; Index < NumberOfSlots; ++Index) {
+				VxlCloseLog(&Slots[Index].LogHandle);
+			}
+
+			SafeFree(Slots);
+		}
+
+		if (Journal) {
+			NtUnmapViewOfSection(NtCurrentProcess(), Journal);
+		}
+
+		SafeClose(SectionHandle);
+		NtClose(FileHandle);
+	}
+
+	if (NT_SUCCESS(Status)) {
+		KexLogInformationEvent(
+			L"Exported %lu records from %s (%lu failed).",
+			NumberOfRecords,
+			SegmentName,
+			NumberOfFailedRecords);
+	} else {
+		KexLogWarningEvent(
+			L"Failed to export %s.\r\n\r\n"
+			L"NTSTATUS error code: %s",
+			SegmentName,
+			KexRtlNtStatusToString(Status));
+	}
+
+	return Status;
+}
+
+STATIC NTSTATUS NTAPI JournalExportThreadProc(
+	IN	PVOID	Parameter)
+{
+	while (TRUE) {
+		RtlAcquireSRWLockExclusive(&JournalExportLock);
+
+		until (PreviousSegmentPending) {
+			RtlSleepConditionVariableSRW(&JournalExportCondition, &JournalExportLock, NULL, 0);
+		}
+
+		RtlReleaseSRWLockExclusive(&JournalExportLock);
+
+		ExportJournalSegment(PREVIOUS_JOURNAL_SEGMENT_NAME);
+
+		RtlAcquireSRWLockExclusive(&JournalExportLock);
+		PreviousSegmentPending = FALSE;
+		RtlReleaseSRWLockExclusive(&JournalExportLock);
+	}
+}
+
+//
+// Create a new, empty journal and start the writer and export threads.
+// After this function succeeds, the log events of new clients go into the
+// journal.
+//
+NTSTATUS InitializeJournal(
+	VOID)
+{
+	NTSTATUS Status;
+	HANDLE ThreadHandle;
+
+	ASSERT (!JournalEnabled);
+	ASSERT (JournalFileHandle == NULL);
+
+	JournalBuffers[0] = SafeAlloc(BYTE, KEXSRV_JOURNAL_BUFFER_SIZE);
+	JournalBuffers[1] = SafeAlloc(BYTE, KEXSRV_JOURNAL_BUFFER_SIZE);
+
+	try {
+		if (!JournalBuffers[0] || !JournalBuffers[1]) {
+			Status = STATUS_NO_MEMORY;
+			leave;
+		}
+
+		Status = CreateJournalSegment();
+		if (!NT_SUCCESS(Status)) {
+			leave;
+		}
+
+		Status = RtlCreateUserThread(
+			NtCurrentProcess(),
+			NULL,
+			FALSE,
+			0,
+			0,
+			0,
+			JournalExportThreadProc,
+			NULL,
+			&ThreadHandle,
+			NULL);
+
+		if (!NT_SUCCESS(Status)) {
+			leave;
+		}
+
+		NtClose(ThreadHandle);
+
+		Status = RtlCreateUserThread(
+			NtCurrentProcess(),
+			NULL,
+			FALSE,
+			0,
+			0,
+			0,
+			JournalWriterThreadProc,
+			NULL,
+			&ThreadHandle,
+			NULL);
+
+		if (!NT_SUCCESS(Status)) {
+			leave;
+		}
+
+		NtClose(ThreadHandle);
+	} finally {
+		if (!NT_SUCCESS(Status)) {
+			SafeClose(JournalFileHandle);
+			SafeFree(JournalBuffers[0]);
+			SafeFree(JournalBuffers[1]);
+		}
+	}
+
+	if (NT_SUCCESS(Status)) {
+		JournalEnabled = TRUE;
+		KexLogInformationEvent(L"Client log events will be written into the journal.");
+	}
+
+	return Status;
+}
+
+//
+// Give a client a new stream ID, and record its application name and
+// process ID in the journal. This is called instead of opening a log file
+// when the client sends KexIpcKexProcessStart.
+//
+NTSTATUS OpenJournalStream(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process)
+{
+	KEXSRV_JOURNAL_RECORD RecordHeader;
+	ULONG ApplicationNameCch;
+
+	ASSERT (JournalEnabled);
+	ASSERT (Process != NULL);
+	ASSERT (Process->JournalStreamId == 0);
+
+	ApplicationNameCch = (ULONG) wcslen(Process->ApplicationName);
+
+	RecordHeader.RecordSize = KEXSRV_JOURNAL_RECORD_SIZE(ApplicationNameCch);
+	RecordHeader.RecordType = KexSrvJournalStreamOpen;
+	RecordHeader.StreamId = InterlockedIncrement(&LastJournalStreamId);
+	RecordHeader.ProcessId = Process->ProcessId;
+	RecordHeader.ApplicationNameLength = (USHORT) ApplicationNameCch;
+	KexNtQuerySystemTime(&RecordHeader.Time);
+
+	AppendJournalRecord(
+		&RecordHeader,
+		Process->ApplicationName,
+		ApplicationNameCch * sizeof(WCHAR));
+
+	Process->JournalStreamId = RecordHeader.StreamId;
+	return STATUS_SUCCESS;
+}
+
+//
+// Append a log event to a client's journal stream. The log event has
+// already been validated by DispatchLogEvent.
+//
+VOID AppendJournalLogEvent(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA		Process,
+	IN	PCKEX_IPC_MESSAGE_DATA_LOG_EVENT	LogEventInfo,
+	IN	PCNZWCH								AuxiliaryData)
+{
+	KEXSRV_JOURNAL_RECORD RecordHeader;
+	ULONG DataCch;
+
+	ASSERT (Process != NULL);
+	ASSERT (Process->JournalStreamId != 0);
+	ASSERT (LogEventInfo != NULL);
+	ASSERT (AuxiliaryData != NULL);
+
+	DataCch = LogEventInfo->SourceComponentLength + LogEventInfo->SourceFileLength +
+			  LogEventInfo->SourceFunctionLength + LogEventInfo->TextLength;
+
+	RecordHeader.RecordSize = KEXSRV_JOURNAL_RECORD_SIZE(DataCch);
+	RecordHeader.RecordType = KexSrvJournalLogEvent;
+	RecordHeader.StreamId = Process->JournalStreamId;
+	RecordHeader.ProcessId = Process->ProcessId;
+	RecordHeader.LogEventInformation = *LogEventInfo;
+	KexNtQuerySystemTime(&RecordHeader.Time);
+
+	AppendJournalRecord(&RecordHeader, AuxiliaryData, DataCch * sizeof(WCHAR));
+}
+
+//
+// Mark the end of a client's journal stream. This is called by the main
+// thread when the client is being destroyed, and never waits for the writer
+// thread. The stream is exported along with the rest of its segment.
+//
+VOID CloseJournalStream(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process)
+{
+	KEXSRV_JOURNAL_RECORD RecordHeader;
+
+	ASSERT (Process != NULL);
+
+	if (Process->JournalStreamId == 0) {
+		return;
+	}
+
+	RecordHeader.RecordSize = KEXSRV_JOURNAL_RECORD_SIZE(0);
+	RecordHeader.RecordType = KexSrvJournalStreamClose;
+	RecordHeader.StreamId = Process->JournalStreamId;
+	RecordHeader.ProcessId = Process->ProcessId;
+	KexNtQuerySystemTime(&RecordHeader.Time);
+
+	AppendJournalRecord(&RecordHeader, NULL, 0);
+	Process->JournalStreamId = 0;
+}
+
+//
+// Split up the journal segments left behind by a previous server process
+// into the usual per-application log files, and then delete them. This
+// must be called before InitializeJournal.
+//
+VOID ExportJournal(
+	VOID)
+{
+	ASSERT (!JournalEnabled);
+
+	//
+	// The previous segment holds the older records, so it has to go first.
+	// The records of a stream in the current segment are then appended to
+	// the same log file.
+	//
+
+	ExportJournalSegment(PREVIOUS_JOURNAL_SEGMENT_NAME);
+	ExportJournalSegment(JOURNAL_SEGMENT_NAME);
+}
\ No newline at end of file
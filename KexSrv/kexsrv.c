@@ -25,11 +25,119 @@ PKEX_PROCESS_DATA KexData = NULL;
 RTL_DYNAMIC_HASH_TABLE _ProcessThreadTable;
 PRTL_DYNAMIC_HASH_TABLE ProcessThreadTable = &_ProcessThreadTable;
 
+STATIC KEXSRV_LISTENING_PIPE_INSTANCE PipeInstances[KEXSRV_MAXIMUM_NUMBER_OF_PIPE_INSTANCES];
+
+//
+// Read a DWORD setting of the server from HKCU\Software\VXsoft\VxKex. If
+// the value does not exist or cannot be read, DefaultValue is returned.
+//
+ULONG QueryServerSettingDword(
+	IN	PCWSTR	ValueName,
+	IN	ULONG	DefaultValue)
+{
+	NTSTATUS Status;
+	HANDLE CurrentUserKeyHandle;
+	HANDLE KeyHandle;
+	UNICODE_STRING KeyName;
+	UNICODE_STRING ValueNameString;
+	OBJECT_ATTRIBUTES ObjectAttributes;
+	ULONG ValueData;
+	ULONG ValueDataCb;
+
+	ASSERT (ValueName != NULL);
+
+	Status = RtlOpenCurrentUser(KEY_ENUMERATE_SUB_KEYS, &CurrentUserKeyHandle);
+	if (!NT_SUCCESS(Status)) {
+		return DefaultValue;
+	}
+
+	RtlInitConstantUnicodeString(&KeyName, L"Software\\VXsoft\\VxKex");
+
+	InitializeObjectAttributes(
+		&ObjectAttributes,
+		&KeyName,
+		OBJ_CASE_INSENSITIVE,
+		CurrentUserKeyHandle,
+		NULL);
+
+	Status = NtOpenKey(
+		&KeyHandle,
+		KEY_QUERY_VALUE,
+		&ObjectAttributes);
+
+	NtClose(CurrentUserKeyHandle);
+
+	if (!NT_SUCCESS(Status)) {
+		return DefaultValue;
+	}
+
+	RtlInitUnicodeString(&ValueNameString, ValueName);
+	ValueDataCb = sizeof(ValueData);
+
+	Status = KexRtlQueryKeyValueData(
+		KeyHandle,
+		&ValueNameString,
+		&ValueDataCb,
+		&ValueData,
+		REG_RESTRICT_DWORD,
+		NULL);
+
+	NtClose(KeyHandle);
+
+	if (!NT_SUCCESS(Status)) {
+		return DefaultValue;
+	}
+
+	return ValueData;
+}
+
+//
+// Put instances back into the pool of listening pipe instances, after they
+// were taken out because they could not be replaced when a client connected
+// to them. The taken-out instances are kept after the last listening one,
+// and still have their connect events.
+//
+STATIC VOID RefillPipeInstances(
+	IN		POBJECT_ATTRIBUTES	ObjectAttributes,
+	IN		ULONG				MaximumNumberOfPipeInstances,
+	IN OUT	PULONG				NumberOfPipeInstances,
+	IN OUT	PHANDLE				WaitHandles)
+{
+	NTSTATUS Status;
+
+	while (*NumberOfPipeInstances < MaximumNumberOfPipeInstances) {
+		PKEXSRV_LISTENING_PIPE_INSTANCE PipeInstance;
+
+		PipeInstance = &PipeInstances[*NumberOfPipeInstances];
+
+		Status = CreateConnectPipeInstance(
+			&PipeInstance->PipeHandle,
+			PipeInstance->ConnectEventHandle,
+			ObjectAttributes,
+			&PipeInstance->IoStatusBlock);
+
+		if (Status != STATUS_PENDING && !NT_SUCCESS(Status)) {
+			// try again when the next client disconnects
+			break;
+		}
+
+		WaitHandles[*NumberOfPipeInstances + 1] = PipeInstance->ConnectEventHandle;
+		++*NumberOfPipeInstances;
+
+		KexLogInformationEvent(
+			L"Pipe instance restored. Listening on %lu pipe instances.",
+			*NumberOfPipeInstances);
+	}
+}
+
 NORETURN VOID NTAPI EntryPoint(
 	IN	PVOID	Parameter)
 {
 	NTSTATUS Status;
-	HANDLE ConnectEventHandle;
+	HANDLE WaitHandles[KEXSRV_MAXIMUM_NUMBER_OF_PIPE_INSTANCES + 1];
+	ULONG NumberOfPipeInstances;
+	ULONG MaximumNumberOfPipeInstances;
+	ULONG Index;
 	HANDLE PipeHandle;
 	UNICODE_STRING PipeName;
 	OBJECT_ATTRIBUTES ObjectAttributes;
@@ -73,6 +181,12 @@ NORETURN VOID NTAPI EntryPoint(
 
 	RtlCreateHashTable(&ProcessThreadTable, 0, 0);
 
+	Status = InitializeProcessDataSlab();
+	if (!NT_SUCCESS(Status)) {
+		DbgPrint("Failed to reserve memory for per-process data (%ws)\r\n", KexRtlNtStatusToString(Status));
+		NtTerminateProcess(NtCurrentProcess(), Status);
+	}
+
 	//
 	// Open the server's log file. If this fails, we will not be able to
 	// log anything, but it's otherwise a non-critical error.
@@ -82,106 +196,231 @@ NORETURN VOID NTAPI EntryPoint(
 	KexLogInformationEvent(L"Server process started.");
 
 	//
-	// Create an event. This event will be signaled when a client is attempting to
-	// connect to the server.
+	// If the previous server process left a journal behind, split it up into
+	// per-application log files before it is overwritten.
 	//
 
-	Status = NtCreateEvent(
-		&ConnectEventHandle,
-		EVENT_ALL_ACCESS,
-		NULL,
-		NotificationEvent,
-		TRUE);
+	ExportJournal();
 
+	//
+	// In journal mode, the log events of all clients are written into a
+	// single file by one writer thread, instead of into a separate log file
+	// for each client. If the journal can't be set up, we just fall back to
+	// separate log files.
+	//
+
+	if (QueryServerSettingDword(L"KexSrvJournal", FALSE)) {
+		Status = InitializeJournal();
+
+		if (!NT_SUCCESS(Status)) {
+			KexLogWarningEvent(
+				L"Failed to initialize the journal.\r\n\r\n"
+				L"NTSTATUS error code: %s",
+				KexRtlNtStatusToString(Status));
+		}
+	}
+
+	//
+	// Create the I/O completion port and the worker threads. All reads from
+	// connected clients are processed by the worker threads - the main thread
+	// only accepts new connections and removes disconnected clients from the
+	// process/thread table.
+	//
+
+	Status = CreateWorkerThreads();
 	if (!NT_SUCCESS(Status)) {
 		KexLogErrorEvent(
-			L"Failed to create the pipe-connect event.\r\n\r\n"
+			L"Failed to create the worker threads.\r\n\r\n"
 			L"NTSTATUS error code: %s",
 			KexRtlNtStatusToString(Status));
 		NtTerminateProcess(NtCurrentProcess(), Status);
 	}
 
 	//
-	// Create and connect the first instance of the pipe.
+	// Create the pool of listening pipe instances. Each instance has its own
+	// event, which will be signaled when a client has connected to it.
 	//
 
-	Status = CreateConnectPipeInstance(
-			&PipeHandle,
-			ConnectEventHandle,
-			&ObjectAttributes, 
-			&IoStatusBlock);
+	NumberOfPipeInstances = QueryNumberOfPipeInstances();
 
-	if (Status != STATUS_PENDING && !NT_SUCCESS(Status)) {
-		KexLogErrorEvent(
-			L"Failed to create and connect the first instance of the server pipe.\r\n\r\n"
-			L"NTSTATUS error code: %s",
-			KexRtlNtStatusToString(Status));
-		NtTerminateProcess(NtCurrentProcess(), Status);
+	for (Index = 0; Index < NumberOfPipeInstances; ++Index) {
+		PKEXSRV_LISTENING_PIPE_INSTANCE PipeInstance;
+
+		PipeInstance = &PipeInstances[Index];
+
+		Status = NtCreateEvent(
+			&PipeInstance->ConnectEventHandle,
+			EVENT_ALL_ACCESS,
+			NULL,
+			NotificationEvent,
+			FALSE);
+
+		if (NT_SUCCESS(Status)) {
+			Status = CreateConnectPipeInstance(
+				&PipeInstance->PipeHandle,
+				PipeInstance->ConnectEventHandle,
+				&ObjectAttributes,
+				&PipeInstance->IoStatusBlock);
+
+			if (Status != STATUS_PENDING && !NT_SUCCESS(Status)) {
+				NtClose(PipeInstance->ConnectEventHandle);
+			}
+		}
+
+		if (Status != STATUS_PENDING && !NT_SUCCESS(Status)) {
+			if (Index == 0) {
+				KexLogErrorEvent(
+					L"Failed to create and connect the first instance of the server pipe.\r\n\r\n"
+					L"NTSTATUS error code: %s",
+					KexRtlNtStatusToString(Status));
+				NtTerminateProcess(NtCurrentProcess(), Status);
+			}
+
+			KexLogWarningEvent(
+				L"Failed to create pipe instance #%lu.\r\n\r\n"
+				L"NTSTATUS error code: %s",
+				Index,
+				KexRtlNtStatusToString(Status));
+
+			break;
+		}
+
+		WaitHandles[Index + 1] = PipeInstance->ConnectEventHandle;
 	}
 
+	NumberOfPipeInstances = Index;
+	MaximumNumberOfPipeInstances = Index;
+	KexLogInformationEvent(L"Listening on %lu pipe instances.", NumberOfPipeInstances);
+
 	//
 	// Main loop
 	//
 
+	WaitHandles[0] = DisconnectEventHandle;
+
 	while (TRUE) {
-		Status = NtWaitForSingleObject(
-			ConnectEventHandle,
-			TRUE,
+		Status = NtWaitForMultipleObjects(
+			NumberOfPipeInstances + 1,
+			WaitHandles,
+			WaitAnyObject,
+			FALSE,
 			NULL);
 
-		if (Status == STATUS_SUCCESS) {
+		if (Status > STATUS_WAIT_0 && Status <= STATUS_WAIT_0 + NumberOfPipeInstances) {
+			PKEXSRV_LISTENING_PIPE_INSTANCE PipeInstance;
 			PKEXSRV_PER_CLIENT_PROCESS_DATA PerProcessData;
 
 			//
-			// This means that a client is connected.
+			// This means that a client is connected to one of the pipe
+			// instances. Put a new instance in its place straight away, so
+			// that other clients can connect while we deal with this one.
+			//
+
+			Index = Status - STATUS_WAIT_0 - 1;
+			PipeInstance = &PipeInstances[Index];
+			PipeHandle = PipeInstance->PipeHandle;
+
+			Status = CreateConnectPipeInstance(
+				&PipeInstance->PipeHandle,
+				PipeInstance->ConnectEventHandle,
+				&ObjectAttributes,
+				&PipeInstance->IoStatusBlock);
+
+			if (Status != STATUS_PENDING && !NT_SUCCESS(Status)) {
+				KEXSRV_LISTENING_PIPE_INSTANCE FailedPipeInstance;
+
+				//
+				// This usually means that the pipe has as many instances as
+				// it is allowed to have. Stop waiting on this instance, whose
+				// event is still signaled, by swapping it with the last
+				// listening instance. It is put back by RefillPipeInstances
+				// once a client has disconnected.
+				//
+
+				KexLogWarningEvent(
+					L"Failed to replace a pipe instance. Listening on %lu pipe instances.\r\n\r\n"
+					L"NTSTATUS error code: %s",
+					NumberOfPipeInstances - 1,
+					KexRtlNtStatusToString(Status));
+
+				--NumberOfPipeInstances;
+
+				FailedPipeInstance = PipeInstances[Index];
+				PipeInstances[Index] = PipeInstances[NumberOfPipeInstances];
+				PipeInstances[NumberOfPipeInstances] = FailedPipeInstance;
+
+				WaitHandles[Index + 1] = PipeInstances[Index].ConnectEventHandle;
+			}
+
+			//
 			// Invoke a subroutine to allocate and register data structures, etc.
 			//
 
 			Status = AcceptConnectProcess(&PerProcessData, PipeHandle);
 			if (NT_SUCCESS(Status)) {
 				//
-				// Initiate an asynchronous read of the new pipe.
-				// This call will return immediately.
+				// Hand the new pipe over to the worker threads and initiate
+				// an asynchronous read. This call will return immediately.
 				//
 
-				CompletedWriteApc(NULL, &PerProcessData->IoStatusBlock, 0);
+				Status = AssociateProcessWithCompletionPort(PerProcessData);
 
-				KexLogInformationEvent(
-					L"New client process (PID %lu) has successfully connected.",
-					PerProcessData->ProcessId);
+				if (NT_SUCCESS(Status)) {
+					Status = BeginReadProcess(PerProcessData);
+				}
+
+				if (NT_SUCCESS(Status)) {
+					KexLogInformationEvent(
+						L"New client process (PID %lu) has successfully connected.",
+						PerProcessData->ProcessId);
+				} else {
+					KexLogErrorEvent(
+						L"Failed to start reading from client process (PID %lu). (%s)",
+						PerProcessData->ProcessId,
+						KexRtlNtStatusToString(Status));
+					DisconnectProcess(PerProcessData);
+				}
 			} else {
 				KexLogErrorEvent(
 					L"Failed to accept a connection from a client process. (%s)",
 					KexRtlNtStatusToString(Status));
 				NtClose(PipeHandle);
 			}
+		} else if (Status == STATUS_WAIT_0) {
+			PSLIST_ENTRY ListEntry;
 
 			//
-			// Create and connect another instance.
+			// One or more clients have disconnected. The worker threads can't
+			// touch the process/thread table, so they have handed the clients
+			// back to us. See iocp.c
 			//
 
-			Status = CreateConnectPipeInstance(
-				&PipeHandle,
-				ConnectEventHandle,
-				&ObjectAttributes,
-				&IoStatusBlock);
+			ListEntry = RtlInterlockedFlushSList(&DisconnectedProcessList);
 
-			if (Status != STATUS_PENDING && !NT_SUCCESS(Status)) {
-				NtTerminateProcess(NtCurrentProcess(), Status);
+			while (ListEntry) {
+				PKEXSRV_PER_CLIENT_PROCESS_DATA PerProcessData;
+
+				PerProcessData = CONTAINING_RECORD(
+					ListEntry,
+					KEXSRV_PER_CLIENT_PROCESS_DATA,
+					DisconnectListEntry);
+
+				ListEntry = ListEntry->Next;
+
+				KexLogInformationEvent(
+					L"Client process (PID %lu) has disconnected.",
+					PerProcessData->ProcessId);
+
+				DisconnectProcess(PerProcessData);
 			}
-		} else if (!NT_SUCCESS(Status)) {
-			NtTerminateProcess(NtCurrentProcess(), Status);
-		} else {
-			//
-			// - Thread was alerted (somehow)
-			// - User APC was delivered (somehow)
-			// - I/O APC was delivered
-			//
-			// In these cases we don't need to take any action here.
-			// See functions in apc.c
-			//
 
-			NOTHING;
+			RefillPipeInstances(
+				&ObjectAttributes,
+				MaximumNumberOfPipeInstances,
+				&NumberOfPipeInstances,
+				WaitHandles);
+		} else {
+			NtTerminateProcess(NtCurrentProcess(), Status);
 		}
 	}
 
@@ -26,6 +26,67 @@
 
 extern PKEX_PROCESS_DATA KexData;
 extern PRTL_DYNAMIC_HASH_TABLE ProcessThreadTable;
+extern HANDLE CompletionPortHandle;
+extern HANDLE DisconnectEventHandle;
+extern SLIST_HEADER DisconnectedProcessList;
+extern BOOLEAN JournalEnabled;
+
+//
+// The number of worker threads is equal to the number of processors, up to
+// this limit.
+//
+
+#define KEXSRV_MAXIMUM_NUMBER_OF_WORKER_THREADS 64
+
+//
+// Several instances of the server pipe are kept listening at all times, so
+// that many processes which start at the same time don't have to wait for
+// each other to connect. The main thread waits on one connect event for each
+// instance, plus the disconnect event.
+//
+
+#define KEXSRV_DEFAULT_NUMBER_OF_PIPE_INSTANCES 8
+#define KEXSRV_MAXIMUM_NUMBER_OF_PIPE_INSTANCES (MAXIMUM_WAIT_OBJECTS - 1)
+
+//
+// Buffer quotas of each pipe instance. The inbound quota is large enough to
+// hold a full-size message, so that a client can usually write without
+// waiting for the server to read.
+//
+
+#define KEXSRV_PIPE_INBOUND_QUOTA 0x10000
+#define KEXSRV_PIPE_OUTBOUND_QUOTA 0x1000
+
+//
+// Maximum number of instances of the server pipe, and therefore the maximum
+// number of clients which can be connected at the same time.
+//
+
+#define KEXSRV_MAXIMUM_NUMBER_OF_CLIENTS 256
+
+//
+// Number of freed per-process data slots which are kept committed for reuse
+// by new clients. See slab.c
+//
+
+#define KEXSRV_NUMBER_OF_WARM_PROCESS_DATA_SLOTS 8
+
+//
+// In journal mode, the log events of all clients are appended to a single
+// journal file by a dedicated writer thread. Records are collected in one
+// of two buffers of this size while the writer thread writes out the other.
+// The writer thread waits this long (in 100ns units) for a buffer to fill
+// up before writing it out anyway. Once the journal has grown past the
+// segment size, the writer thread starts a new segment and the old one is
+// exported. See journal.c
+//
+
+#define KEXSRV_JOURNAL_BUFFER_SIZE (256 * 1024)
+#define KEXSRV_JOURNAL_FLUSH_INTERVAL (50 * 10000)
+#define KEXSRV_JOURNAL_SEGMENT_SIZE (16 * 1024 * 1024)
+
+#define KEXSRV_JOURNAL_SIGNATURE 'JXEK'
+#define KEXSRV_JOURNAL_VERSION 1
 
 //
 // Data-Type Definitions
@@ -46,14 +107,35 @@ typedef struct _KEXSRV_PER_CLIENT_PROCESS_DATA {
 	HANDLE							PipeHandle;
 	IO_STATUS_BLOCK					IoStatusBlock;
 
-	union {
-		KEX_IPC_MESSAGE				IncomingMessage;
-		BYTE						IncomingMessageBuffer[0xFFFF];
-	};
+	// Used by the worker threads to hand a disconnected client back to the
+	// main thread, which owns the process/thread table.
+	SLIST_ENTRY						DisconnectListEntry;
+
+	// One reference is held by the chain of reads on the pipe, and one more
+	// while a log ring drain is queued or in progress. When the count drops
+	// to zero, the client is handed back to the main thread.
+	VOLATILE LONG					ReferenceCount;
+
+	// Filled out when the client sends KexIpcKexProcessStart. In journal
+	// mode, LogHandle stays NULL and the client's log events are written
+	// into the journal with a JournalStreamId that is unique to this
+	// client. Otherwise, JournalStreamId is zero.
+	WCHAR							ApplicationName[64];
+	VXLHANDLE						LogHandle;
+	ULONG							JournalStreamId;
+
+	// Log ring shared with the client (see KexSrv.h). LogRing is NULL if
+	// the client did not set one up.
+	PKEX_IPC_LOG_RING				LogRing;
+	HANDLE							LogRingDoorbellEventHandle;
+	HANDLE							LogRingWaitHandle;
+	ULONG							LogRingReadOffset;
+	BOOLEAN							LogRingCorrupt;
+	VOLATILE LONG					LogRingDrainRequests;
 
 	union {
-		KEX_IPC_MESSAGE				OutgoingMessage;
-		BYTE						OutgoingMessageBuffer[0xFFFF];
+		KEX_IPC_MESSAGE				IncomingMessage;
+		BYTE						IncomingMessageBuffer[KEX_IPC_MESSAGE_MAXIMUM_SIZE];
 	};
 } TYPEDEF_TYPE_NAME(KEXSRV_PER_CLIENT_PROCESS_DATA);
 
@@ -72,27 +154,185 @@ typedef struct _KEXSRV_PER_CLIENT_THREAD_DATA {
 	UNICODE_STRING					ThreadDescription;
 } TYPEDEF_TYPE_NAME(KEXSRV_PER_CLIENT_THREAD_DATA);
 
+typedef struct _KEXSRV_LISTENING_PIPE_INSTANCE {
+	HANDLE							PipeHandle;
+	HANDLE							ConnectEventHandle;
+	IO_STATUS_BLOCK					IoStatusBlock;
+} TYPEDEF_TYPE_NAME(KEXSRV_LISTENING_PIPE_INSTANCE);
+
 //
-// apc.c
+// The journal file consists of a KEXSRV_JOURNAL_HEADER followed by any
+// number of records. Each record belongs to the stream of one client, and
+// the records of different clients are interleaved in the order in which
+// they were appended.
 //
 
-VOID NTAPI CompletedReadApc(
-	IN	PVOID				ApcContext,
-	IN	PIO_STATUS_BLOCK	IoStatusBlock,
-	IN	ULONG				Reserved);
+typedef struct _KEXSRV_JOURNAL_HEADER {
+	ULONG							Signature;
+	ULONG							Version;
+} TYPEDEF_TYPE_NAME(KEXSRV_JOURNAL_HEADER);
+
+typedef enum _KEXSRV_JOURNAL_RECORD_TYPE {
+	KexSrvJournalStreamOpen,		// Data contains the application name
+	KexSrvJournalLogEvent,			// Data is laid out as in KexIpcLogEvent
+	KexSrvJournalStreamClose,		// Data is empty
+	KexSrvJournalMaximumRecordType
+} KEXSRV_JOURNAL_RECORD_TYPE;
+
+typedef struct _KEXSRV_JOURNAL_RECORD {
+	// Size of the entire record, including this header. Always a multiple
+	// of 8 bytes.
+	ULONG							RecordSize;
+	KEXSRV_JOURNAL_RECORD_TYPE		RecordType;
+	ULONG							StreamId;
+	ULONG							ProcessId;
+	LONGLONG						Time;
+
+	union {
+		USHORT						ApplicationNameLength;
+		KEX_IPC_MESSAGE_DATA_LOG_EVENT LogEventInformation;
+	};
+
+	WCHAR							Data[];
+} TYPEDEF_TYPE_NAME(KEXSRV_JOURNAL_RECORD);
+
+#define KEXSRV_JOURNAL_RECORD_SIZE(DataCch) \
+	((FIELD_OFFSET(KEXSRV_JOURNAL_RECORD, Data) + ((DataCch) * sizeof(WCHAR)) + 7) & ~7)
 
-VOID NTAPI CompletedWriteApc(
-	IN	PVOID				ApcContext,
-	IN	PIO_STATUS_BLOCK	IoStatusBlock,
-	IN	ULONG				Reserved);
+//
+// The journal writer thread keeps one of these for each stream whose
+// StreamOpen record has been written to the journal file, but whose
+// StreamClose record hasn't. OpenRecord points to a copy of the StreamOpen
+// record, which follows the structure and is written again at the start of
+// each new journal segment.
+//
+
+typedef struct _KEXSRV_JOURNAL_STREAM {
+	struct _KEXSRV_JOURNAL_STREAM *	Next;
+	PKEXSRV_JOURNAL_RECORD			OpenRecord;
+} TYPEDEF_TYPE_NAME(KEXSRV_JOURNAL_STREAM);
+
+//
+// Used while a journal segment is being exported, to find the log file of
+// the stream that a record belongs to.
+//
+
+typedef struct _KEXSRV_JOURNAL_EXPORT_SLOT {
+	ULONG							StreamId;
+	VXLHANDLE						LogHandle;
+} TYPEDEF_TYPE_NAME(KEXSRV_JOURNAL_EXPORT_SLOT);
+
+//
+// iocp.c
+//
+
+NTSTATUS CreateWorkerThreads(
+	VOID);
+
+NTSTATUS AssociateProcessWithCompletionPort(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process);
+
+NTSTATUS BeginReadProcess(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process);
+
+VOID QueueLogRingDrain(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process);
+
+VOID ReleaseProcess(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process);
+
+//
+// dispatch.c
+//
+
+NTSTATUS DispatchMessage(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process,
+	IN	PKEX_IPC_MESSAGE				Message);
+
+NTSTATUS DispatchLogEvent(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA		Process,
+	IN	PCKEX_IPC_MESSAGE_DATA_LOG_EVENT	LogEventInfo,
+	IN	PCNZWCH								AuxiliaryData,
+	IN	USHORT								AuxiliaryDataBlockSize);
+
+//
+// msgcheck.c
+//
+
+NTSTATUS GetLogEventBatchEntry(
+	IN		PCKEX_IPC_MESSAGE					Message,
+	IN OUT	PULONG								Offset,
+	OUT		PPCKEX_IPC_LOG_EVENT_BATCH_ENTRY	Entry,
+	OUT		PUSHORT								EntryDataCb);
+
+NTSTATUS ValidateMessage(
+	IN	PCKEX_IPC_MESSAGE	Message);
+
+//
+// journal.c
+//
+
+VOID ExportJournal(
+	VOID);
+
+NTSTATUS InitializeJournal(
+	VOID);
+
+NTSTATUS OpenJournalStream(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process);
+
+VOID AppendJournalLogEvent(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA		Process,
+	IN	PCKEX_IPC_MESSAGE_DATA_LOG_EVENT	LogEventInfo,
+	IN	PCNZWCH								AuxiliaryData);
+
+VOID CloseJournalStream(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process);
+
+//
+// kexsrv.c
+//
+
+ULONG QueryServerSettingDword(
+	IN	PCWSTR	ValueName,
+	IN	ULONG	DefaultValue);
 
 //
 // logging.c
 //
 
+NTSTATUS OpenLogDirectory(
+	OUT	PHANDLE	DirectoryHandle);
+
 NTSTATUS OpenServerLogFile(
 	OUT	PVXLHANDLE	LogHandle);
 
+NTSTATUS OpenApplicationLogFile(
+	OUT	PVXLHANDLE	LogHandle,
+	IN	PCWSTR		ApplicationName,
+	IN	ULONG		ProcessId);
+
+NTSTATUS OpenClientLogFile(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process);
+
+//
+// logring.c
+//
+
+NTSTATUS AttachLogRing(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process,
+	IN	ULONG							ClientSectionHandle,
+	IN	ULONG							ClientDoorbellEventHandle);
+
+VOID StopLogRingDoorbell(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process);
+
+VOID DrainLogRing(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process);
+
+VOID CloseLogRing(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process);
+
 //
 // pipe.c
 //
@@ -103,6 +343,22 @@ NTSTATUS CreateConnectPipeInstance(
 	IN	POBJECT_ATTRIBUTES	ObjectAttributes,
 	OUT	PIO_STATUS_BLOCK	IoStatusBlock);
 
+ULONG QueryNumberOfPipeInstances(
+	VOID);
+
+//
+// slab.c
+//
+
+NTSTATUS InitializeProcessDataSlab(
+	VOID);
+
+PKEXSRV_PER_CLIENT_PROCESS_DATA AllocateProcessData(
+	VOID);
+
+VOID FreeProcessData(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process);
+
 //
 // procthrd.c
 //
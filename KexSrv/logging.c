@@ -22,23 +22,18 @@
 #include "kexsrvp.h"
 
 //
-// Open KexSrv's log file. This log file is located in the standard
-// directory for VxKex logs, and is simply named KexSrv.vxl
+// Open (or create) the standard directory for VxKex logs. The directory
+// handle is opened with FILE_TRAVERSE access, so that files can be opened
+// relative to it.
 //
-NTSTATUS OpenServerLogFile(
-	OUT	PVXLHANDLE	LogHandle)
+NTSTATUS OpenLogDirectory(
+	OUT	PHANDLE	DirectoryHandle)
 {
 	NTSTATUS Status;
-	HANDLE DirectoryHandle;
 	UNICODE_STRING FileName;
-	UNICODE_STRING SourceApplication;
 	OBJECT_ATTRIBUTES ObjectAttributes;
 
-	ASSERT (LogHandle != NULL);
-
-	//
-	// 1. Open the log directory.
-	//
+	ASSERT (DirectoryHandle != NULL);
 
 	Status = RtlDosPathNameToNtPathName_U_WithStatus(
 		KexData->LogDir.Buffer,
@@ -58,27 +53,40 @@ NTSTATUS OpenServerLogFile(
 		NULL);
 
 	Status = KexRtlCreateDirectoryRecursive(
-		&DirectoryHandle,
+		DirectoryHandle,
 		FILE_TRAVERSE,
 		&ObjectAttributes,
 		FILE_SHARE_READ | FILE_SHARE_WRITE);
 
 	RtlFreeUnicodeString(&FileName);
+	return Status;
+}
 
+//
+// Open (or create) a log file in the standard directory for VxKex logs.
+//
+STATIC NTSTATUS OpenLogFileInLogDirectory(
+	OUT	PVXLHANDLE			LogHandle,
+	IN	PCUNICODE_STRING	LogFileName)
+{
+	NTSTATUS Status;
+	HANDLE DirectoryHandle;
+	UNICODE_STRING SourceApplication;
+	OBJECT_ATTRIBUTES ObjectAttributes;
+
+	ASSERT (LogHandle != NULL);
+	ASSERT (LogFileName != NULL);
+
+	Status = OpenLogDirectory(&DirectoryHandle);
 	if (!NT_SUCCESS(Status)) {
 		return Status;
 	}
 
-	//
-	// 2. Open the log file "KexSrv.vxl" under that directory.
-	//
-
 	RtlInitConstantUnicodeString(&SourceApplication, L"VxKex");
-	RtlInitConstantUnicodeString(&FileName, L"KexSrv.vxl");
 
 	InitializeObjectAttributes(
 		&ObjectAttributes,
-		&FileName,
+		(PUNICODE_STRING) LogFileName,
 		OBJ_CASE_INSENSITIVE,
 		DirectoryHandle,
 		NULL);
@@ -92,4 +100,73 @@ NTSTATUS OpenServerLogFile(
 
 	NtClose(DirectoryHandle);
 	return Status;
+}
+
+//
+// Open KexSrv's log file. This log file is located in the standard
+// directory for VxKex logs, and is simply named KexSrv.vxl
+//
+NTSTATUS OpenServerLogFile(
+	OUT	PVXLHANDLE	LogHandle)
+{
+	UNICODE_STRING FileName;
+
+	RtlInitConstantUnicodeString(&FileName, L"KexSrv.vxl");
+	return OpenLogFileInLogDirectory(LogHandle, &FileName);
+}
+
+//
+// Open the log file for a particular run of a client application. The file
+// is named after the application and its process ID, e.g. program-1234.vxl
+//
+NTSTATUS OpenApplicationLogFile(
+	OUT	PVXLHANDLE	LogHandle,
+	IN	PCWSTR		ApplicationName,
+	IN	ULONG		ProcessId)
+{
+	HRESULT Result;
+	WCHAR FileNameBuffer[MAX_PATH];
+	UNICODE_STRING FileName;
+
+	ASSERT (LogHandle != NULL);
+	ASSERT (ApplicationName != NULL);
+
+	Result = StringCchPrintf(
+		FileNameBuffer,
+		ARRAYSIZE(FileNameBuffer),
+		L"%s-%lu.vxl",
+		ApplicationName,
+		ProcessId);
+
+	if (FAILED(Result)) {
+		return STATUS_NAME_TOO_LONG;
+	}
+
+	RtlInitUnicodeString(&FileName, FileNameBuffer);
+	KexRtlPathReplaceIllegalCharacters(&FileName, &FileName, 0, FALSE);
+
+	return OpenLogFileInLogDirectory(LogHandle, &FileName);
+}
+
+//
+// Start receiving the log events sent by a client. Normally these go into
+// a log file of their own (see OpenApplicationLogFile), but if journal mode
+// is enabled, they are written into the server's journal instead, and only
+// split out into per-application log files later on.
+//
+NTSTATUS OpenClientLogFile(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process)
+{
+	ASSERT (Process != NULL);
+	ASSERT (Process->LogHandle == NULL);
+	ASSERT (Process->JournalStreamId == 0);
+
+	if (JournalEnabled) {
+		return OpenJournalStream(Process);
+	}
+
+	return OpenApplicationLogFile(
+		&Process->LogHandle,
+		Process->ApplicationName,
+		Process->ProcessId);
 }
\ No newline at end of file
@@ -0,0 +1,302 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     logring.c
+//
+// Abstract:
+//
+//     Contains the server side of the shared-memory log ring (see KexSrv.h).
+//
+//     A client which sets up a log ring passes the handles to the ring's
+//     section and doorbell event in its KexIpcKexProcessStart message. We
+//     duplicate both handles out of the client process, map the ring, and
+//     register a wait on the doorbell event. When the doorbell rings, a
+//     drain request is queued to the completion port, and one of the worker
+//     threads writes the contents of the ring into the client's log file.
+//
+//     The client can write to the ring at any time, so nothing that is read
+//     from the ring is trusted. Each message header is copied out of the ring
+//     before it is validated.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "buildcfg.h"
+#include "kexsrvp.h"
+
+STATIC VOID NTAPI LogRingDoorbellCallback(
+	IN	PVOID	Context,
+	IN	BOOLEAN	TimedOut)
+{
+	ASSERT (Context != NULL);
+	ASSERT (!TimedOut);
+
+	QueueLogRingDrain((PKEXSRV_PER_CLIENT_PROCESS_DATA) Context);
+}
+
+//
+// Map a client's log ring and start waiting on its doorbell. This is called
+// while processing the client's KexIpcKexProcessStart message.
+//
+NTSTATUS AttachLogRing(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process,
+	IN	ULONG							ClientSectionHandle,
+	IN	ULONG							ClientDoorbellEventHandle)
+{
+	NTSTATUS Status;
+	HANDLE ClientProcessHandle;
+	HANDLE SectionHandle;
+	CLIENT_ID ClientId;
+	OBJECT_ATTRIBUTES ObjectAttributes;
+	PVOID BaseAddress;
+	SIZE_T ViewSize;
+
+	ASSERT (Process != NULL);
+	ASSERT (Process->LogRing == NULL);
+
+	ClientId.UniqueProcess = UlongToHandle(Process->ProcessId);
+	ClientId.UniqueThread = NULL;
+
+	InitializeObjectAttributes(&ObjectAttributes, NULL, 0, NULL, NULL);
+
+	Status = NtOpenProcess(
+		&ClientProcessHandle,
+		PROCESS_DUP_HANDLE,
+		&ObjectAttributes,
+		&ClientId);
+
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	SectionHandle = NULL;
+
+	try {
+		Status = NtDuplicateObject(
+			ClientProcessHandle,
+			UlongToHandle(ClientSectionHandle),
+			NtCurrentProcess(),
+			&SectionHandle,
+			0,
+			0,
+			DUPLICATE_SAME_ACCESS);
+
+		if (!NT_SUCCESS(Status)) {
+			leave;
+		}
+
+		Status = NtDuplicateObject(
+			ClientProcessHandle,
+			UlongToHandle(ClientDoorbellEventHandle),
+			NtCurrentProcess(),
+			&Process->LogRingDoorbellEventHandle,
+			SYNCHRONIZE,
+			0,
+			0);
+
+		if (!NT_SUCCESS(Status)) {
+			Process->LogRingDoorbellEventHandle = NULL;
+			leave;
+		}
+
+		//
+		// If the section is smaller than a log ring, the mapping will fail
+		// since we ask for an explicit view size.
+		//
+
+		BaseAddress = NULL;
+		ViewSize = sizeof(KEX_IPC_LOG_RING);
+
+		Status = NtMapViewOfSection(
+			SectionHandle,
+			NtCurrentProcess(),
+			&BaseAddress,
+			0,
+			0,
+			NULL,
+			&ViewSize,
+			ViewUnmap,
+			0,
+			PAGE_READWRITE);
+
+		if (!NT_SUCCESS(Status)) {
+			leave;
+		}
+
+		Process->LogRing = (PKEX_IPC_LOG_RING) BaseAddress;
+		Process->LogRingReadOffset = Process->LogRing->ReadOffset;
+
+		//
+		// The callback only queues a completion packet, so it can run in the
+		// wait thread itself.
+		//
+
+		Status = RtlRegisterWait(
+			&Process->LogRingWaitHandle,
+			Process->LogRingDoorbellEventHandle,
+			LogRingDoorbellCallback,
+			Process,
+			INFINITE,
+			WT_EXECUTEINWAITTHREAD);
+
+		if (!NT_SUCCESS(Status)) {
+			Process->LogRingWaitHandle = NULL;
+			leave;
+		}
+
+		//
+		// We are now listening to the doorbell, so the client can start
+		// writing log events into the ring.
+		//
+
+		Process->LogRing->ServerAttached = TRUE;
+	} finally {
+		SafeClose(SectionHandle);
+		NtClose(ClientProcessHandle);
+
+		if (!NT_SUCCESS(Status)) {
+			CloseLogRing(Process);
+		}
+	}
+
+	return Status;
+}
+
+//
+// Stop listening to a client's doorbell. When this function returns, the
+// doorbell callback is not running and will never be called again, so no
+// more drain requests can be queued for this client.
+//
+VOID StopLogRingDoorbell(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process)
+{
+	ASSERT (Process != NULL);
+
+	if (Process->LogRingWaitHandle) {
+		RtlDeregisterWaitEx(Process->LogRingWaitHandle, INVALID_HANDLE_VALUE);
+		Process->LogRingWaitHandle = NULL;
+	}
+}
+
+//
+// Write everything that is currently in a client's log ring into the
+// client's log file. Only one thread may drain a particular ring at a time.
+//
+VOID DrainLogRing(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process)
+{
+	PKEX_IPC_LOG_RING LogRing;
+	ULONG ReadOffset;
+	ULONG WriteOffset;
+	ULONG Available;
+	ULONG Position;
+	ULONG Contiguous;
+	ULONG RecordSize;
+	KEX_IPC_MESSAGE Header;
+
+	ASSERT (Process != NULL);
+
+	LogRing = Process->LogRing;
+
+	if (!LogRing || Process->LogRingCorrupt) {
+		return;
+	}
+
+	ReadOffset = Process->LogRingReadOffset;
+
+	try {
+		while (TRUE) {
+			WriteOffset = LogRing->WriteOffset;
+
+			if (WriteOffset == ReadOffset) {
+				//
+				// The ring is empty. Tell the client how far we've got and
+				// then check again, since the client only rings the doorbell
+				// if it sees that we have consumed everything.
+				//
+
+				LogRing->ReadOffset = ReadOffset;
+				MemoryBarrier();
+
+				if (LogRing->WriteOffset == ReadOffset) {
+					break;
+				}
+
+				continue;
+			}
+
+			Available = WriteOffset - ReadOffset;
+			Position = ReadOffset % KEX_IPC_LOG_RING_DATA_SIZE;
+			Contiguous = KEX_IPC_LOG_RING_DATA_SIZE - Position;
+
+			if (Available > KEX_IPC_LOG_RING_DATA_SIZE || Available < sizeof(KEX_IPC_MESSAGE_ID)) {
+				Process->LogRingCorrupt = TRUE;
+				break;
+			}
+
+			if (*(KEX_IPC_MESSAGE_ID *) &LogRing->Data[Position] == KEX_IPC_LOG_RING_WRAP) {
+				if (Contiguous > Available) {
+					Process->LogRingCorrupt = TRUE;
+					break;
+				}
+
+				ReadOffset += Contiguous;
+				continue;
+			}
+
+			if (Contiguous < sizeof(KEX_IPC_MESSAGE) || Available < sizeof(KEX_IPC_MESSAGE)) {
+				Process->LogRingCorrupt = TRUE;
+				break;
+			}
+
+			RtlCopyMemory(&Header, &LogRing->Data[Position], sizeof(KEX_IPC_MESSAGE));
+			RecordSize = KEX_IPC_LOG_RING_RECORD_SIZE(sizeof(KEX_IPC_MESSAGE) + Header.AuxiliaryDataBlockSize);
+
+			if (Header.MessageId != KexIpcLogEvent || RecordSize > Contiguous || RecordSize > Available) {
+				Process->LogRingCorrupt = TRUE;
+				break;
+			}
+
+			DispatchLogEvent(
+				Process,
+				&Header.LogEventInformation,
+				(PCNZWCH) &LogRing->Data[Position + sizeof(KEX_IPC_MESSAGE)],
+				Header.AuxiliaryDataBlockSize);
+
+			ReadOffset += RecordSize;
+			LogRing->ReadOffset = ReadOffset;
+		}
+	} except (EXCEPTION_EXECUTE_HANDLER) {
+		Process->LogRingCorrupt = TRUE;
+	}
+
+	Process->LogRingReadOffset = ReadOffset;
+
+	if (Process->LogRingCorrupt) {
+		KexLogWarningEvent(
+			L"The log ring of client %s (PID %lu) is corrupt and will no longer be read.",
+			Process->ApplicationName,
+			Process->ProcessId);
+	}
+}
+
+//
+// Write out whatever is left in a client's log ring, then unmap the ring
+// and close the doorbell. This is called by the main thread when the client
+// is being destroyed, or when AttachLogRing fails.
+//
+VOID CloseLogRing(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process)
+{
+	ASSERT (Process != NULL);
+
+	StopLogRingDoorbell(Process);
+
+	if (Process->LogRing) {
+		DrainLogRing(Process);
+		NtUnmapViewOfSection(NtCurrentProcess(), Process->LogRing);
+		Process->LogRing = NULL;
+	}
+
+	SafeClose(Process->LogRingDoorbellEventHandle);
+}
\ No newline at end of file
@@ -0,0 +1,112 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     msgcheck.c
+//
+// Abstract:
+//
+//     Checks that messages arriving from clients are well-formed, before
+//     they are dispatched.
+//
+//     Nothing in this file depends on the state of the server or calls any
+//     system functions, and it does not include kexsrvp.h. This is because
+//     it is also compiled into the SrvSend load generator test (see
+//     01-Tests\srvsendtest), which checks that the messages generated by
+//     SrvSend would be accepted by the server.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "buildcfg.h"
+#include <KexComm.h>
+
+//
+// Find the log event batch entry which starts at *Offset in the auxiliary
+// data block of a KexIpcLogEventBatch message, and advance *Offset to the
+// next entry. EntryDataCb receives the number of bytes which follow the
+// log event information of the entry.
+//
+NTSTATUS GetLogEventBatchEntry(
+	IN		PCKEX_IPC_MESSAGE					Message,
+	IN OUT	PULONG								Offset,
+	OUT		PPCKEX_IPC_LOG_EVENT_BATCH_ENTRY	Entry,
+	OUT		PUSHORT								EntryDataCb)
+{
+	PCKEX_IPC_LOG_EVENT_BATCH_ENTRY BatchEntry;
+	PCKEX_IPC_MESSAGE_DATA_LOG_EVENT LogEventInfo;
+	ULONG EntrySize;
+
+	ASSERT (Message != NULL);
+	ASSERT (Message->MessageId == KexIpcLogEventBatch);
+	ASSERT (Offset != NULL);
+	ASSERT (Entry != NULL);
+	ASSERT (EntryDataCb != NULL);
+
+	if (*Offset + FIELD_OFFSET(KEX_IPC_LOG_EVENT_BATCH_ENTRY, Data) > Message->AuxiliaryDataBlockSize) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	BatchEntry = (PCKEX_IPC_LOG_EVENT_BATCH_ENTRY) &Message->AuxiliaryDataBlock[*Offset];
+	LogEventInfo = &BatchEntry->LogEventInformation;
+
+	EntrySize = KEX_IPC_LOG_EVENT_BATCH_ENTRY_SIZE(
+		LogEventInfo->SourceComponentLength + LogEventInfo->SourceFileLength +
+		LogEventInfo->SourceFunctionLength + LogEventInfo->TextLength);
+
+	if (*Offset + EntrySize > Message->AuxiliaryDataBlockSize) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	*Entry = BatchEntry;
+	*EntryDataCb = (USHORT) (EntrySize - FIELD_OFFSET(KEX_IPC_LOG_EVENT_BATCH_ENTRY, Data));
+	*Offset += EntrySize;
+
+	return STATUS_SUCCESS;
+}
+
+//
+// Check that the message ID of a message is valid, and that all of the
+// lengths in the message fit inside its auxiliary data block. The caller
+// has already checked that the size of the message matches its
+// AuxiliaryDataBlockSize.
+//
+// The entries of a KexIpcLogEventBatch message are not checked here. Each
+// entry must be fetched with GetLogEventBatchEntry, which fails if the
+// entry does not fit inside the message.
+//
+NTSTATUS ValidateMessage(
+	IN	PCKEX_IPC_MESSAGE	Message)
+{
+	ULONG DataCch;
+
+	ASSERT (Message != NULL);
+
+	switch (Message->MessageId) {
+	case KexIpcKexProcessStart:
+		DataCch = Message->ProcessStartedInformation.ApplicationNameLength;
+		break;
+	case KexIpcHardError:
+		DataCch = Message->HardErrorInformation.StringParameter1Length +
+				  Message->HardErrorInformation.StringParameter2Length;
+		break;
+	case KexIpcLogEvent:
+		DataCch = Message->LogEventInformation.SourceComponentLength +
+				  Message->LogEventInformation.SourceFileLength +
+				  Message->LogEventInformation.SourceFunctionLength +
+				  Message->LogEventInformation.TextLength;
+		break;
+	case KexIpcLogEventBatch:
+		// The entries are checked one at a time by GetLogEventBatchEntry,
+		// while the batch is being dispatched.
+		DataCch = 0;
+		break;
+	default:
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (DataCch * sizeof(WCHAR) > Message->AuxiliaryDataBlockSize) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	return STATUS_SUCCESS;
+}
\ No newline at end of file
@@ -56,9 +56,9 @@ NTSTATUS CreateConnectPipeInstance(
 		FILE_PIPE_MESSAGE_TYPE,
 		FILE_PIPE_MESSAGE_MODE,
 		FILE_PIPE_QUEUE_OPERATION,
-		256,
-		1024,
-		1024,
+		KEXSRV_MAXIMUM_NUMBER_OF_CLIENTS,
+		KEXSRV_PIPE_INBOUND_QUOTA,
+		KEXSRV_PIPE_OUTBOUND_QUOTA,
 		&DefaultTimeout);
 
 	if (!NT_SUCCESS(Status)) {
@@ -83,12 +83,38 @@ NTSTATUS CreateConnectPipeInstance(
 
 	if (Status == STATUS_PIPE_CONNECTED) {
 		Status = NtSetEvent(ConnectEventHandle, NULL);
-		if (!NT_SUCCESS(Status)) {
-			return Status;
-		}
+	}
+
+	if (Status != STATUS_PENDING && !NT_SUCCESS(Status)) {
+		NtClose(*PipeHandle);
+		*PipeHandle = NULL;
+		return Status;
+	}
 
+	if (Status != STATUS_PENDING) {
 		Status = STATUS_SUCCESS;
 	}
 
 	return Status;
+}
+
+//
+// Find out how many instances of the server pipe should be kept listening
+// for new clients at any time. This can be set with the KexSrvPipeInstances
+// setting, and is clamped to the range from 1 to
+// KEXSRV_MAXIMUM_NUMBER_OF_PIPE_INSTANCES.
+//
+ULONG QueryNumberOfPipeInstances(
+	VOID)
+{
+	ULONG NumberOfPipeInstances;
+
+	NumberOfPipeInstances = QueryServerSettingDword(
+		L"KexSrvPipeInstances",
+		KEXSRV_DEFAULT_NUMBER_OF_PIPE_INSTANCES);
+
+	NumberOfPipeInstances = max(NumberOfPipeInstances, 1);
+	NumberOfPipeInstances = min(NumberOfPipeInstances, KEXSRV_MAXIMUM_NUMBER_OF_PIPE_INSTANCES);
+
+	return NumberOfPipeInstances;
 }
\ No newline at end of file
@@ -46,7 +46,7 @@ NTSTATUS AcceptConnectProcess(
 	// Allocate memory for the per-process data structure.
 	//
 
-	Process = SafeAlloc(KEXSRV_PER_CLIENT_PROCESS_DATA, 1);
+	Process = AllocateProcessData();
 	if (!Process) {
 		return STATUS_NO_MEMORY;
 	}
@@ -81,6 +81,16 @@ NTSTATUS AcceptConnectProcess(
 	Process->PipeHandle = PipeHandle;
 	Process->NumberOfThreads = 0;
 	Process->Threads = NULL;
+	Process->ReferenceCount = 1;
+	Process->ApplicationName[0] = '\0';
+	Process->LogHandle = NULL;
+	Process->JournalStreamId = 0;
+	Process->LogRing = NULL;
+	Process->LogRingDoorbellEventHandle = NULL;
+	Process->LogRingWaitHandle = NULL;
+	Process->LogRingReadOffset = 0;
+	Process->LogRingCorrupt = FALSE;
+	Process->LogRingDrainRequests = 0;
 
 	RtlInsertEntryHashTable(
 		ProcessThreadTable,
@@ -94,7 +104,7 @@ Finished:
 			*ProcessDataOut = Process;
 		}
 	} else {
-		SafeFree(Process);
+		FreeProcessData(Process);
 	}
 
 	return Status;
@@ -267,9 +277,19 @@ NTSTATUS DisconnectProcess(
 	ULONG Index;
 
 	ASSERT (Process != NULL);
+	ASSERT (Process->LogRingWaitHandle == NULL);
 	
 	NtClose(Process->PipeHandle);
 
+	//
+	// Anything that is still in the log ring was written before the client
+	// disconnected, so write it out before closing the client's log.
+	//
+
+	CloseLogRing(Process);
+	CloseJournalStream(Process);
+	VxlCloseLog(&Process->LogHandle);
+
 	for (Index = 0; Index < Process->NumberOfThreads; ++Index) {
 		Status = UnregisterThread(Process->Threads[Index], TRUE);
 		ASSERT (NT_SUCCESS(Status));
@@ -278,7 +298,7 @@ NTSTATUS DisconnectProcess(
 	RtlRemoveEntryHashTable(ProcessThreadTable, &Process->HashTableEntry, NULL);
 
 	SafeFree(Process->Threads);
-	SafeFree(Process);
+	FreeProcessData(Process);
 
 	return STATUS_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,186 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Module Name:
+//
+//     slab.c
+//
+// Abstract:
+//
+//     Contains the allocator for per-process client data.
+//
+//     Each KEXSRV_PER_CLIENT_PROCESS_DATA structure is large (it contains
+//     a full-size message buffer), and clients often connect and
+//     disconnect in quick succession. Instead of going through the heap,
+//     the structures are carved out of a single reserved region of address
+//     space which has one page-aligned slot per client.
+//
+//     A slot is only committed when it is handed out. When a client is freed,
+//     its slot stays committed so that the next client can reuse it straight
+//     away, but only the most recently freed
+//     KEXSRV_NUMBER_OF_WARM_PROCESS_DATA_SLOTS slots are kept like this.
+//     Older free slots are decommitted.
+//
+//     Slots are only allocated and freed by the main thread, so no locking
+//     is needed.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "buildcfg.h"
+#include "kexsrvp.h"
+
+#define PROCESS_DATA_SLOT_SIZE (ROUND_TO_PAGES(sizeof(KEXSRV_PER_CLIENT_PROCESS_DATA)))
+
+STATIC PBYTE ProcessDataSlab = NULL;
+
+//
+// Number of slots which have been handed out at least once. Slots above this
+// index have never been committed.
+//
+STATIC ULONG NumberOfUsedSlots = 0;
+
+//
+// Stack of free slot indexes. The topmost NumberOfWarmSlots entries refer to
+// slots which are still committed.
+//
+STATIC ULONG FreeSlots[KEXSRV_MAXIMUM_NUMBER_OF_CLIENTS];
+STATIC ULONG NumberOfFreeSlots = 0;
+STATIC ULONG NumberOfWarmSlots = 0;
+
+STATIC NTSTATUS CommitProcessDataSlot(
+	IN	ULONG	SlotIndex)
+{
+	PVOID BaseAddress;
+	SIZE_T RegionSize;
+
+	ASSERT (SlotIndex < KEXSRV_MAXIMUM_NUMBER_OF_CLIENTS);
+
+	BaseAddress = ProcessDataSlab + (SlotIndex * PROCESS_DATA_SLOT_SIZE);
+	RegionSize = sizeof(KEXSRV_PER_CLIENT_PROCESS_DATA);
+
+	return NtAllocateVirtualMemory(
+		NtCurrentProcess(),
+		&BaseAddress,
+		0,
+		&RegionSize,
+		MEM_COMMIT,
+		PAGE_READWRITE);
+}
+
+STATIC VOID DecommitProcessDataSlot(
+	IN	ULONG	SlotIndex)
+{
+	NTSTATUS Status;
+	PVOID BaseAddress;
+	SIZE_T RegionSize;
+
+	ASSERT (SlotIndex < KEXSRV_MAXIMUM_NUMBER_OF_CLIENTS);
+
+	BaseAddress = ProcessDataSlab + (SlotIndex * PROCESS_DATA_SLOT_SIZE);
+	RegionSize = PROCESS_DATA_SLOT_SIZE;
+
+	Status = NtFreeVirtualMemory(
+		NtCurrentProcess(),
+		&BaseAddress,
+		&RegionSize,
+		MEM_DECOMMIT);
+
+	ASSERT (NT_SUCCESS(Status));
+}
+
+//
+// Reserve the address space for all slots. This must be called before any
+// clients are accepted.
+//
+NTSTATUS InitializeProcessDataSlab(
+	VOID)
+{
+	NTSTATUS Status;
+	PVOID BaseAddress;
+	SIZE_T RegionSize;
+
+	ASSERT (ProcessDataSlab == NULL);
+
+	BaseAddress = NULL;
+	RegionSize = KEXSRV_MAXIMUM_NUMBER_OF_CLIENTS * PROCESS_DATA_SLOT_SIZE;
+
+	Status = NtAllocateVirtualMemory(
+		NtCurrentProcess(),
+		&BaseAddress,
+		0,
+		&RegionSize,
+		MEM_RESERVE,
+		PAGE_READWRITE);
+
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	ProcessDataSlab = (PBYTE) BaseAddress;
+	return STATUS_SUCCESS;
+}
+
+//
+// Hand out a slot for a new client. Like SafeAlloc, the contents of the
+// returned structure are not initialized.
+//
+PKEXSRV_PER_CLIENT_PROCESS_DATA AllocateProcessData(
+	VOID)
+{
+	NTSTATUS Status;
+	ULONG SlotIndex;
+
+	ASSERT (ProcessDataSlab != NULL);
+
+	if (NumberOfFreeSlots != 0) {
+		SlotIndex = FreeSlots[--NumberOfFreeSlots];
+
+		if (NumberOfWarmSlots != 0) {
+			--NumberOfWarmSlots;
+			return (PKEXSRV_PER_CLIENT_PROCESS_DATA) (ProcessDataSlab + (SlotIndex * PROCESS_DATA_SLOT_SIZE));
+		}
+	} else if (NumberOfUsedSlots < KEXSRV_MAXIMUM_NUMBER_OF_CLIENTS) {
+		SlotIndex = NumberOfUsedSlots++;
+	} else {
+		return NULL;
+	}
+
+	Status = CommitProcessDataSlot(SlotIndex);
+
+	if (!NT_SUCCESS(Status)) {
+		// Put the slot back where it came from.
+		FreeSlots[NumberOfFreeSlots++] = SlotIndex;
+		return NULL;
+	}
+
+	return (PKEXSRV_PER_CLIENT_PROCESS_DATA) (ProcessDataSlab + (SlotIndex * PROCESS_DATA_SLOT_SIZE));
+}
+
+//
+// Give a client's slot back. The slot stays committed for a while in case
+// another client connects soon.
+//
+VOID FreeProcessData(
+	IN	PKEXSRV_PER_CLIENT_PROCESS_DATA	Process)
+{
+	ULONG SlotIndex;
+
+	ASSERT (Process != NULL);
+	ASSERT ((PBYTE) Process >= ProcessDataSlab);
+
+	SlotIndex = (ULONG) (((PBYTE) Process - ProcessDataSlab) / PROCESS_DATA_SLOT_SIZE);
+
+	ASSERT (SlotIndex < NumberOfUsedSlots);
+	ASSERT (NumberOfFreeSlots < KEXSRV_MAXIMUM_NUMBER_OF_CLIENTS);
+
+	FreeSlots[NumberOfFreeSlots++] = SlotIndex;
+	++NumberOfWarmSlots;
+
+	if (NumberOfWarmSlots > KEXSRV_NUMBER_OF_WARM_PROCESS_DATA_SLOTS) {
+		//
+		// Decommit the least recently freed of the warm slots.
+		//
+
+		DecommitProcessDataSlot(FreeSlots[NumberOfFreeSlots - NumberOfWarmSlots]);
+		--NumberOfWarmSlots;
+	}
+}
\ No newline at end of file